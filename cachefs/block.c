@@ -0,0 +1,223 @@
+#include "block.h"
+#include "compress.h"
+#include "hash.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Compressed payload has to save at least this much to be kept */
+#define MIN_GAIN (INODE_BLOCK_SIZE / 16)
+
+/*
+ * After BYPASS_THRESHOLD incompressible blocks in a row, thread stores
+ * next BYPASS_BLOCKS blocks without trying, then probes again.
+ */
+#define BYPASS_THRESHOLD 8
+#define BYPASS_BLOCKS 256
+
+#define REPORT_INTERVAL 10 // Seconds between messages about corrupted blocks
+
+static bool compression;
+static int verify_retries = 1;
+static corruption_policy_t corruption_policy = CORRUPTION_EIO;
+static uint64_t checksum_failures;
+static time_t last_report;
+static __thread unsigned int failures;
+static __thread unsigned int bypass;
+
+void block_set_compression(bool enabled)
+{
+    compression = enabled;
+}
+
+void block_set_verification(int retries, corruption_policy_t policy)
+{
+    verify_retries = retries;
+    corruption_policy = policy;
+}
+
+uint64_t block_checksum_failures()
+{
+    return __atomic_load_n(&checksum_failures, __ATOMIC_RELAXED);
+}
+
+static uint32_t checksum(const struct block_header* header, const char* payload)
+{
+    uint32_t crc = crc32c(0, header, offsetof(struct block_header, checksum));
+    return crc32c(crc, payload, header->size);
+}
+
+size_t block_encode(const char* block, char* value)
+{
+    struct block_header header = { .flags = 0, .size = INODE_BLOCK_SIZE };
+    char* payload = value + sizeof(header);
+
+    if (compression && bypass > 0) {
+        bypass--;
+    } else if (compression) {
+        size_t size = compress_block(block, INODE_BLOCK_SIZE, payload, INODE_BLOCK_SIZE - MIN_GAIN);
+        if (size > 0) {
+            header.flags |= BLOCK_COMPRESSED;
+            header.size = size;
+            failures = 0;
+        } else if (++failures == BYPASS_THRESHOLD) {
+            failures = 0;
+            bypass = BYPASS_BLOCKS;
+        }
+    }
+
+    if (!(header.flags & BLOCK_COMPRESSED))
+        memcpy(payload, block, INODE_BLOCK_SIZE);
+    header.checksum = checksum(&header, payload);
+    memcpy(value, &header, sizeof(header));
+    return sizeof(header) + header.size;
+}
+
+bool block_decode(const char* value, size_t size, char* block)
+{
+    struct block_header header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, value, sizeof(header));
+    if (header.size != size - sizeof(header))
+        return false;
+
+    const char* payload = value + sizeof(header);
+    if (header.checksum != checksum(&header, payload))
+        return false;
+    if (header.flags & BLOCK_COMPRESSED)
+        return decompress_block(payload, header.size, block, INODE_BLOCK_SIZE);
+    if (header.size != INODE_BLOCK_SIZE)
+        return false;
+    memcpy(block, payload, INODE_BLOCK_SIZE);
+    return true;
+}
+
+/* Counts failed verification, at most one message is printed per REPORT_INTERVAL */
+static void report_failure(const char* key)
+{
+    uint64_t total = __atomic_add_fetch(&checksum_failures, 1, __ATOMIC_RELAXED);
+    time_t now = time(NULL);
+    time_t last = __atomic_load_n(&last_report, __ATOMIC_RELAXED);
+    if (now - last < REPORT_INTERVAL
+        || !__atomic_compare_exchange_n(&last_report, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    fprintf(stderr, "cachefs: block %s failed verification, %" PRIu64 " failures so far\n", key, total);
+}
+
+/* Fetches and verifies blocks, with UNIQUES their cas is kept in items */
+static bool fetch(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char** dst, bool uniques)
+{
+    if (cnt == 0)
+        return true;
+    char* encoded = malloc(cnt * BLOCK_VALUE_MAX);
+    size_t* pending = malloc(cnt * sizeof(size_t));
+    if (encoded == NULL || pending == NULL) {
+        free(encoded);
+        free(pending);
+        return false;
+    }
+
+    size_t pending_cnt = cnt;
+    for (size_t i = 0; i < cnt; i++)
+        pending[i] = i;
+
+    bool res = true;
+    for (int attempt = 0; res && pending_cnt > 0; attempt++) {
+        for (size_t i = 0; i < pending_cnt; i++) {
+            items[pending[i]].buff = encoded + pending[i] * BLOCK_VALUE_MAX;
+            items[pending[i]].size = BLOCK_VALUE_MAX;
+        }
+        /* Corrupted blocks are refetched in place, others are done */
+        bool (*get)(struct memcache_t*, struct memcache_item*, size_t)
+            = uniques ? memcache_gets_multi : memcache_get_multi;
+        if (attempt == 0) {
+            res = get(memcache, items, cnt);
+        } else {
+            for (size_t i = 0; res && i < pending_cnt; i++)
+                res = get(memcache, &items[pending[i]], 1);
+        }
+        if (!res)
+            break;
+
+        size_t corrupted = 0;
+        for (size_t i = 0; i < pending_cnt; i++) {
+            struct memcache_item* item = &items[pending[i]];
+            if (!item->found) {
+                item->cas = 0;
+                memset(dst[pending[i]], 0, INODE_BLOCK_SIZE);
+            } else if (!block_decode(item->buff, item->size, dst[pending[i]])) {
+                report_failure(item->key);
+                pending[corrupted++] = pending[i];
+            }
+        }
+        pending_cnt = corrupted;
+
+        if (pending_cnt > 0 && attempt == verify_retries) {
+            if (corruption_policy == CORRUPTION_ZERO) {
+                for (size_t i = 0; i < pending_cnt; i++)
+                    memset(dst[pending[i]], 0, INODE_BLOCK_SIZE);
+            } else {
+                errno = EIO;
+                res = false;
+            }
+            break;
+        }
+    }
+
+    free(pending);
+    free(encoded);
+    return res;
+}
+
+bool block_get_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char** dst)
+{
+    return fetch(memcache, items, cnt, dst, false);
+}
+
+bool block_gets_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char** dst)
+{
+    return fetch(memcache, items, cnt, dst, true);
+}
+
+static bool store(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src, bool (*add)(struct memcache_t*, struct memcache_item*, size_t))
+{
+    if (cnt == 0)
+        return true;
+    char* encoded = malloc(cnt * BLOCK_VALUE_MAX);
+    if (encoded == NULL)
+        return false;
+    for (size_t i = 0; i < cnt; i++) {
+        items[i].buff = encoded + i * BLOCK_VALUE_MAX;
+        items[i].size = block_encode(src[i], items[i].buff);
+        items[i].exptime = 0;
+    }
+    bool res = add(memcache, items, cnt);
+    free(encoded);
+    return res;
+}
+
+bool block_set_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src)
+{
+    return store(memcache, items, cnt, src, memcache_set_multi);
+}
+
+bool block_add_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src)
+{
+    return store(memcache, items, cnt, src, memcache_add_multi);
+}
+
+bool block_cas_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src)
+{
+    return store(memcache, items, cnt, src, memcache_cas_multi);
+}
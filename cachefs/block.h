@@ -0,0 +1,158 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "inode.h"
+#include "memcache.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCK_COMPRESSED 0x1 // Payload is LZ4 compressed
+
+/**
+ * Header stored in front of every data block value
+ */
+struct block_header {
+    uint16_t flags;
+    uint16_t size; // Size of payload following the header
+    uint32_t checksum; // CRC-32C of flags, size and payload
+};
+
+/**
+ * What reads do with blocks which fail verification after all retries
+ */
+typedef enum {
+    CORRUPTION_EIO = 0, // Read fails
+    CORRUPTION_ZERO = 1 // Block is read as a hole
+} corruption_policy_t;
+
+#define BLOCK_VALUE_MAX (sizeof(struct block_header) + INODE_BLOCK_SIZE)
+
+/**
+ * Function : block_set_compression
+ * ----------------------------------------
+ * Enables or disables compression of encoded blocks
+ * 
+ * enabled  : true if blocks should be compressed
+ */
+void block_set_compression(bool enabled);
+
+/**
+ * Function : block_set_verification
+ * ----------------------------------------
+ * Configures handling of blocks with wrong checksum
+ * 
+ * retries  : how many times block is fetched again before giving up
+ * policy   : what to do with block which is still corrupted
+ */
+void block_set_verification(int retries, corruption_policy_t policy);
+
+/**
+ * Function : block_checksum_failures
+ * ----------------------------------------
+ * Returns  : number of fetched values which failed verification
+ */
+uint64_t block_checksum_failures();
+
+/**
+ * Function : block_encode
+ * ----------------------------------------
+ * Converts block to the value stored in Memcached. Block is 
+ * compressed only if compression is enabled and it pays off
+ * 
+ * block    : INODE_BLOCK_SIZE bytes of data
+ * value    : buffer of BLOCK_VALUE_MAX bytes
+ * 
+ * Returns  : size of value
+ */
+size_t block_encode(const char* block, char* value);
+
+/**
+ * Function : block_decode
+ * ----------------------------------------
+ * Converts value stored in Memcached back to block
+ * 
+ * value    : stored value
+ * size     : size of value
+ * block    : buffer of INODE_BLOCK_SIZE bytes
+ * 
+ * Returns  : true if value was valid block
+ */
+bool block_decode(const char* value, size_t size, char* block);
+
+/**
+ * Function : block_get_multi
+ * ----------------------------------------
+ * Fetches and verifies blocks with pipelined requests. Missing 
+ * blocks are holes and are read as zeros
+ * 
+ * memcache : memcache object
+ * items    : requests with filled keys, other fields are used internally
+ * cnt      : number of blocks
+ * dst      : INODE_BLOCK_SIZE buffer for each block
+ * 
+ * Returns  : true if every block was read successfully
+ */
+bool block_get_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char** dst);
+
+/**
+ * Function : block_gets_multi
+ * ----------------------------------------
+ * Same as block_get_multi but keeps cas unique of every fetched 
+ * block in its item, missing blocks get zero cas
+ * memcache : memcache object
+ * items    : requests with filled keys, other fields are used internally
+ * cnt      : number of blocks
+ * dst      : INODE_BLOCK_SIZE buffer for each block
+ * Returns  : true if every block was read successfully
+ */
+bool block_gets_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char** dst);
+
+/**
+ * Function : block_set_multi
+ * ----------------------------------------
+ * Encodes and stores blocks with pipelined requests
+ * 
+ * memcache : memcache object
+ * items    : requests with filled keys, found flag reports stored blocks
+ * cnt      : number of blocks
+ * src      : INODE_BLOCK_SIZE of data for each block
+ * 
+ * Returns  : true if all requests were answered
+ */
+bool block_set_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src);
+
+/**
+ * Function : block_add_multi
+ * ----------------------------------------
+ * Encodes and stores blocks which aren't stored yet
+ * 
+ * memcache : memcache object
+ * items    : requests with filled keys, found flag reports created blocks
+ * cnt      : number of blocks
+ * src      : INODE_BLOCK_SIZE of data for each block
+ * 
+ * Returns  : true if all requests were answered
+ */
+bool block_add_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src);
+
+/**
+ * Function : block_cas_multi
+ * ----------------------------------------
+ * Encodes and stores blocks only if they weren't changed since
+ * block_gets_multi, blocks which were missing must still be missing
+ * memcache : memcache object
+ * items    : requests with keys and cas from block_gets_multi, 
+ *            found flag reports stored blocks
+ * cnt      : number of blocks
+ * src      : INODE_BLOCK_SIZE of data for each block
+ * Returns  : true if all requests were answered
+ */
+bool block_cas_multi(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, char* const* src);
+
+#endif
@@ -0,0 +1,254 @@
+#include "changelog.h"
+
+#include "directory.h"
+#include "inode.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define POLL_BATCH 256
+#define STALL_POLLS 5 // Polls to wait for change whose number is taken but which isn't stored yet
+
+static struct memcache_t* memcache;
+static struct fuse* fuse;
+static uint64_t origin;
+static int interval;
+
+static uint64_t last_seq; // Last applied change
+static int stalls;
+static bool seq_lost; // Counter was created again, poller drops everything cached
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool poller_started;
+
+static void get_key(char* key, uint64_t seq)
+{
+    sprintf(key, "CHANGES#%lu", (unsigned long)(seq % CHANGELOG_SIZE));
+}
+
+static size_t change_size(const struct change* change)
+{
+    return offsetof(struct change, path) + strlen(change->path) + 1;
+}
+
+/* Creates counter of changes, add fails if it already exists */
+static void add_seq(struct memcache_t* mem)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", CHANGELOG_SEQ_KEY);
+    item.buff = "0";
+    item.size = 1;
+    item.exptime = 0;
+    memcache_add_multi(mem, &item, 1);
+}
+
+/*
+ * Reads number of last announced change into SEQ. Counter evicted by
+ * Memcached is created again, changes numbered before it are lost
+ */
+static bool current_seq(uint64_t* seq)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", CHANGELOG_SEQ_KEY);
+    item.number = 0;
+    if (!memcache_incr_multi(memcache, &item, 1))
+        return false;
+    if (!item.found) {
+        add_seq(memcache);
+        __atomic_store_n(&seq_lost, true, __ATOMIC_RELAXED);
+        item.number = 0;
+    }
+    *seq = item.number;
+    return true;
+}
+
+/* Drops kernel caches of PATH, there are none without fuse */
+static void invalidate(const char* path)
+{
+    if (fuse != NULL)
+        fuse_invalidate_path(fuse, path);
+}
+
+/* Drops everything which may be cached */
+static void invalidate_all()
+{
+    dir_forget_cached();
+    invalidate("/");
+}
+
+static void apply(const struct change* change)
+{
+    if (change->flags & CHANGE_ALL) {
+        invalidate_all();
+        return;
+    }
+    if (change->flags & CHANGE_ENTRY)
+        dir_forget_cached();
+
+    /* Open inode keeps metadata in memory, it has to be read again */
+    struct inode* inode = inode_from_path(change->path);
+    inode_refresh(inode);
+    inode_close(inode);
+    invalidate(change->path);
+
+    if (change->flags & CHANGE_ENTRY) {
+        char parent[CHANGE_PATH_MAX];
+        snprintf(parent, sizeof(parent), "%s", change->path);
+        char* slash = strrchr(parent, '/');
+        if (slash != NULL) {
+            slash[slash == parent] = '\0';
+            invalidate(parent);
+        }
+    }
+}
+
+static void* poll_loop(void* aux)
+{
+    (void)aux;
+    while (true) {
+        sleep(interval);
+        changelog_poll();
+    }
+    return NULL;
+}
+
+bool init_changelog(struct memcache_t* mem, struct fuse* f, int poll_interval)
+{
+    pthread_mutex_lock(&poll_lock);
+    __atomic_store_n(&memcache, poll_interval > 0 ? mem : NULL, __ATOMIC_RELEASE);
+    fuse = f;
+    interval = poll_interval;
+    if (memcache == NULL) {
+        pthread_mutex_unlock(&poll_lock);
+        return true;
+    }
+
+    random_bytes(&origin, sizeof(origin));
+
+    /* Counter exists from the first mount on, add fails for later ones */
+    add_seq(memcache);
+    last_seq = 0;
+    current_seq(&last_seq);
+    __atomic_store_n(&seq_lost, false, __ATOMIC_RELAXED);
+    stalls = 0;
+    pthread_mutex_unlock(&poll_lock);
+
+    if (!poller_started) {
+        pthread_t poller;
+        if (pthread_create(&poller, NULL, poll_loop, NULL) != 0)
+            return false;
+        pthread_detach(poller);
+        poller_started = true;
+    }
+    return true;
+}
+
+void changelog_append(const char* path, uint32_t flags)
+{
+    struct memcache_t* mem = __atomic_load_n(&memcache, __ATOMIC_ACQUIRE);
+    if (mem == NULL)
+        return;
+
+    struct change change;
+    change.origin = origin;
+    change.flags = flags;
+    if (strlen(path) >= CHANGE_PATH_MAX) {
+        change.flags |= CHANGE_ALL;
+        change.path[0] = '\0';
+    } else {
+        strcpy(change.path, path);
+    }
+
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", CHANGELOG_SEQ_KEY);
+    item.number = 1;
+    if (!memcache_incr_multi(mem, &item, 1))
+        return;
+    if (!item.found) {
+        /* Handlers may hold locks invalidation needs, poller drops caches */
+        add_seq(mem);
+        __atomic_store_n(&seq_lost, true, __ATOMIC_RELAXED);
+        item.number = 1;
+        if (!memcache_incr_multi(mem, &item, 1) || !item.found)
+            return;
+    }
+    change.seq = item.number;
+    get_key(item.key, change.seq);
+    item.buff = &change;
+    item.size = change_size(&change);
+    item.exptime = 0;
+    memcache_set_multi(mem, &item, 1);
+}
+
+size_t changelog_poll()
+{
+    size_t applied = 0;
+    pthread_mutex_lock(&poll_lock);
+    uint64_t seq = last_seq;
+    if (memcache != NULL && current_seq(&seq) && seq < last_seq)
+        __atomic_store_n(&seq_lost, true, __ATOMIC_RELAXED);
+    if (__atomic_exchange_n(&seq_lost, false, __ATOMIC_RELAXED)) {
+        /* Counter was created again, numbers of lost changes are reused */
+        invalidate_all();
+        last_seq = seq;
+    }
+    if (seq > last_seq + CHANGELOG_SIZE) {
+        /* Changes were overwritten before we read them */
+        invalidate_all();
+        last_seq = seq;
+    }
+
+    struct change* changes = malloc(POLL_BATCH * sizeof(struct change));
+    struct memcache_item* items = malloc(POLL_BATCH * sizeof(struct memcache_item));
+    bool done = changes == NULL || items == NULL;
+    while (!done && last_seq < seq) {
+        size_t cnt = seq - last_seq < POLL_BATCH ? seq - last_seq : POLL_BATCH;
+        for (size_t i = 0; i < cnt; i++) {
+            get_key(items[i].key, last_seq + 1 + i);
+            items[i].buff = &changes[i];
+            items[i].size = sizeof(struct change);
+        }
+        if (!memcache_get_multi(memcache, items, cnt))
+            break;
+
+        for (size_t i = 0; i < cnt && !done; i++) {
+            uint64_t expected = last_seq + 1;
+            bool stored = items[i].found && items[i].size > offsetof(struct change, path);
+            if (stored && changes[i].seq > expected) {
+                invalidate_all();
+                last_seq = seq;
+                done = true;
+            } else if (!stored || changes[i].seq < expected) {
+                /* Number was taken but change isn't stored yet */
+                if (++stalls < STALL_POLLS) {
+                    done = true;
+                } else {
+                    invalidate_all();
+                    stalls = 0;
+                    last_seq = expected;
+                }
+            } else {
+                ((char*)items[i].buff)[items[i].size - 1] = '\0';
+                if (changes[i].origin != origin) {
+                    apply(&changes[i]);
+                    applied++;
+                }
+                stalls = 0;
+                last_seq = expected;
+            }
+        }
+    }
+    free(items);
+    free(changes);
+    pthread_mutex_unlock(&poll_lock);
+    return applied;
+}
+
+void close_changelog()
+{
+    pthread_mutex_lock(&poll_lock);
+    __atomic_store_n(&memcache, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&poll_lock);
+}
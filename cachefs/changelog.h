@@ -0,0 +1,69 @@
+#ifndef CHANGELOG_H
+#define CHANGELOG_H
+
+#define FUSE_USE_VERSION 31
+
+#include "memcache.h"
+#include <fuse.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHANGELOG_SIZE 4096 // Changes kept in memcached, older ones are overwritten
+#define CHANGE_PATH_MAX 1024
+#define CHANGELOG_SEQ_KEY "CHANGES#SEQ" // Number of the last appended change
+
+#define CHANGE_ENTRY 0x1 // Name was added or removed, parent directory changed too
+#define CHANGE_ALL 0x2 // Path didn't fit, everything has to be invalidated
+
+/**
+ * One change made by a mount, other mounts drop their caches of the path
+ */
+struct change {
+    uint64_t seq;
+    uint64_t origin; // Mount which made the change
+    uint32_t flags;
+    char path[CHANGE_PATH_MAX];
+};
+
+/**
+ * Function : init_changelog
+ * ----------------------------------------
+ * Starts announcing changes of this mount and polling changes
+ * of other mounts which share memcached
+ * 
+ * mem      : memcache data object 
+ * fuse     : fuse object whose kernel caches are invalidated, may be NULL
+ * interval : seconds between polls, 0 disables change log
+ * 
+ * Returns  : true if change log is running or disabled
+ */
+bool init_changelog(struct memcache_t* mem, struct fuse* fuse, int interval);
+
+/**
+ * Function : changelog_append
+ * ----------------------------------------
+ * Announces that file or directory at PATH changed
+ * 
+ * path     : path of changed file
+ * flags    : CHANGE_* flags
+ */
+void changelog_append(const char* path, uint32_t flags);
+
+/**
+ * Function : changelog_poll
+ * ----------------------------------------
+ * Applies changes of other mounts made since last poll, this also
+ * happens in background
+ * 
+ * Returns  : number of applied changes
+ */
+size_t changelog_poll();
+
+/**
+ * Function : close_changelog
+ * ----------------------------------------
+ * Stops announcing and polling changes
+ */
+void close_changelog();
+
+#endif
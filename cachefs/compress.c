@@ -0,0 +1,186 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Limits of LZ4 block format */
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash32(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* Writes length which didn't fit in token as 255 byte run */
+static inline uint8_t* write_length(uint8_t* op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = length;
+    return op;
+}
+
+static uint8_t* write_literals(uint8_t* op, uint8_t* token, const uint8_t* anchor, size_t literals)
+{
+    if (literals >= 15) {
+        *token = 15 << 4;
+        op = write_length(op, literals - 15);
+    } else {
+        *token = literals << 4;
+    }
+    memcpy(op, anchor, literals);
+    return op + literals;
+}
+
+size_t compress_block(const void* src, size_t size, void* dst, size_t capacity)
+{
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + size;
+    uint8_t* op = dst;
+    uint8_t* out_end = op + capacity;
+    uint16_t table[1 << HASH_LOG];
+
+    if (size > MAX_OFFSET)
+        return 0;
+
+    if (size > MATCH_FIND_LIMIT) {
+        const uint8_t* match_limit = end - LAST_LITERALS;
+        const uint8_t* find_limit = end - MATCH_FIND_LIMIT;
+        memset(table, 0, sizeof(table));
+
+        for (ip++; ip < find_limit;) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash32(sequence);
+            const uint8_t* ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t* match_end = ip + MIN_MATCH;
+            const uint8_t* ref_end = ref + MIN_MATCH;
+            while (match_end + 8 <= match_limit) {
+                uint64_t diff = read64(match_end) ^ read64(ref_end);
+                if (diff != 0) {
+                    match_end += __builtin_ctzll(diff) / 8;
+                    goto match_found;
+                }
+                match_end += 8;
+                ref_end += 8;
+            }
+            while (match_end < match_limit && *match_end == *ref_end) {
+                match_end++;
+                ref_end++;
+            }
+        match_found:;
+
+            size_t literals = ip - anchor;
+            size_t match = match_end - ip - MIN_MATCH;
+            if (op + 1 + literals + literals / 255 + 1 + 2 + match / 255 + 1 > out_end)
+                return 0;
+
+            uint8_t* token = op++;
+            op = write_literals(op, token, anchor, literals);
+            uint16_t offset = ip - ref;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (match >= 15) {
+                *token |= 15;
+                op = write_length(op, match - 15);
+            } else {
+                *token |= match;
+            }
+            ip = anchor = match_end;
+        }
+    }
+
+    size_t literals = end - anchor;
+    if (op + 1 + literals + literals / 255 + 1 > out_end)
+        return 0;
+    uint8_t* token = op++;
+    op = write_literals(op, token, anchor, literals);
+    return op - (uint8_t*)dst;
+}
+
+/* Reads length continuation bytes, returns false on truncated input */
+static inline bool read_length(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= end)
+            return false;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool decompress_block(const void* src, size_t size, void* dst, size_t dst_size)
+{
+    const uint8_t* ip = src;
+    const uint8_t* end = ip + size;
+    uint8_t* op = dst;
+    uint8_t* out_end = op + dst_size;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(&ip, end, &literals))
+            return false;
+        if (literals > (size_t)(end - ip) || literals > (size_t)(out_end - op))
+            return false;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        /* Last sequence has only literals */
+        if (ip == end)
+            break;
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst))
+            return false;
+
+        size_t match = token & 15;
+        if (match == 15 && !read_length(&ip, end, &match))
+            return false;
+        match += MIN_MATCH;
+        if (match > (size_t)(out_end - op))
+            return false;
+
+        /* Overlapping match repeats its pattern, so it is copied byte by byte */
+        const uint8_t* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+        } else {
+            for (size_t i = 0; i < match; i++)
+                op[i] = ref[i];
+        }
+        op += match;
+    }
+
+    return op == out_end;
+}
@@ -0,0 +1,35 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Function : compress_block
+ * ----------------------------------------
+ * Compresses data into LZ4 block format
+ * 
+ * src      : data to compress
+ * size     : size of data, should be less than 64K
+ * dst      : buffer for compressed data
+ * capacity : size of dst
+ * 
+ * Returns  : size of compressed data or 0 if it doesn't fit in capacity
+ */
+size_t compress_block(const void* src, size_t size, void* dst, size_t capacity);
+
+/**
+ * Function : decompress_block
+ * ----------------------------------------
+ * Decompresses data compressed with compress_block
+ * 
+ * src      : compressed data
+ * size     : size of compressed data
+ * dst      : buffer for decompressed data
+ * dst_size : expected size of decompressed data
+ * 
+ * Returns  : true if data was valid and decompressed into exactly dst_size bytes
+ */
+bool decompress_block(const void* src, size_t size, void* dst, size_t dst_size);
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Measures block compression used for Memcached values: throughput of
+ * encoding and decoding 4K blocks and achieved compression ratio on 
+ * text, binary and random data.
+ *
+ * Usage : ./compress_bench [megabytes]
+ */
+
+#include "block.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_MB 64
+
+static const char* words[] = {
+    "the", "file", "system", "memcached", "block", "inode", "directory", "of",
+    "and", "to", "a", "in", "is", "that", "for", "it", "with", "as", "was", "on",
+    "cache", "server", "request", "value", "key", "stored", "read", "write"
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_text(char* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        const char* word = words[rand() % (sizeof(words) / sizeof(words[0]))];
+        for (size_t i = 0; word[i] != '\0' && pos < size; i++)
+            data[pos++] = word[i];
+        if (pos < size)
+            data[pos++] = rand() % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+/* Binary of the benchmark itself, repeated, or synthetic records if unavailable */
+static void fill_binary(char* data, size_t size)
+{
+    FILE* file = fopen("/proc/self/exe", "rb");
+    size_t pos = 0;
+    if (file != NULL) {
+        size_t read;
+        while (pos < size && (read = fread(data + pos, 1, size - pos, file)) > 0) {
+            pos += read;
+            if (pos < size)
+                rewind(file);
+        }
+        fclose(file);
+    }
+    for (int id = 0; pos < size; id++) {
+        struct {
+            int id;
+            double value;
+            short flags;
+            char tag[6];
+        } record = { id, id * 0.5, id % 4, "rec" };
+        size_t chunk = size - pos < sizeof(record) ? size - pos : sizeof(record);
+        memcpy(data + pos, &record, chunk);
+        pos += chunk;
+    }
+}
+
+static void fill_random(char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        data[i] = rand();
+}
+
+static bool run(const char* name, void (*fill)(char*, size_t), size_t size)
+{
+    size_t blocks = size / INODE_BLOCK_SIZE;
+    char* data = malloc(size);
+    char* values = malloc(blocks * BLOCK_VALUE_MAX);
+    size_t* sizes = malloc(blocks * sizeof(size_t));
+    char* decoded = malloc(size);
+    bool res = data != NULL && values != NULL && sizes != NULL && decoded != NULL;
+    if (!res) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        goto done;
+    }
+    fill(data, size);
+
+    size_t stored = 0;
+    size_t compressed = 0;
+    double start = now();
+    for (size_t i = 0; i < blocks; i++) {
+        sizes[i] = block_encode(data + i * INODE_BLOCK_SIZE, values + i * BLOCK_VALUE_MAX);
+        stored += sizes[i];
+        if (sizes[i] < BLOCK_VALUE_MAX)
+            compressed++;
+    }
+    double encode_time = now() - start;
+
+    size_t invalid = 0;
+    start = now();
+    for (size_t i = 0; i < blocks; i++) {
+        if (!block_decode(values + i * BLOCK_VALUE_MAX, sizes[i], decoded + i * INODE_BLOCK_SIZE))
+            invalid++;
+    }
+    double decode_time = now() - start;
+
+    /* Decoded data is compared after timing, so that check isn't measured */
+    if (invalid > 0 || memcmp(decoded, data, blocks * INODE_BLOCK_SIZE) != 0) {
+        fprintf(stderr, "%s: %zu blocks failed to decode, decoded data differs\n", name, invalid);
+        res = false;
+        goto done;
+    }
+
+    double mb = (double)blocks * INODE_BLOCK_SIZE / (1024 * 1024);
+    printf("%-8s ratio %5.2f  compressed blocks %5.1f%%  encode %8.1f MB/s  decode %8.1f MB/s\n",
+        name, (double)blocks * INODE_BLOCK_SIZE / stored, 100.0 * compressed / blocks,
+        mb / encode_time, mb / decode_time);
+
+done:
+    free(decoded);
+    free(sizes);
+    free(values);
+    free(data);
+    return res;
+}
+
+int main(int argc, char* argv[])
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : DEFAULT_MB;
+    size_t size = mb * 1024 * 1024;
+
+    block_set_compression(true);
+    printf("%zu MB of 4K blocks, stored size includes block headers\n", mb);
+    bool res = run("text", fill_text, size);
+    res = run("binary", fill_binary, size) && res;
+    res = run("random", fill_random, size) && res;
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
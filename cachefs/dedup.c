@@ -0,0 +1,550 @@
+#include "dedup.h"
+#include "block.h"
+#include "usage.h"
+#include "utils.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TOMBSTONE "-"
+#define TOMBSTONE_TTL 10
+#define ACQUIRE_DELAY 1000 // Microseconds between retries of blocks being collected
+#define ACQUIRE_RETRIES 100 // Live collector is done by then, tombstone of crashed one isn't waited out
+#define COUNTER_SIZE 24
+#define LIST_CHUNKS 64 // Block map chunks loaded at once while keys are listed
+#define CAS_RETRIES 16 // Attempts of read-modify-write before giving up
+
+static struct memcache_t* memcache;
+static size_t block_size;
+static size_t chunk_size;
+
+static void
+get_chunk_key(char* key, int inode_id, size_t chunk)
+{
+    sprintf(key, "%d#MAP%zu", inode_id, chunk);
+}
+
+static void
+get_block_key(char* key, const struct block_hash* hash)
+{
+    sprintf(key, "blk#%016llx%016llx", (unsigned long long)hash->h[0], (unsigned long long)hash->h[1]);
+}
+
+static void
+get_ref_key(char* key, const struct block_hash* hash)
+{
+    sprintf(key, "ref#%016llx%016llx", (unsigned long long)hash->h[0], (unsigned long long)hash->h[1]);
+}
+
+static bool is_hole(const struct block_hash* hash)
+{
+    return hash->h[0] == 0 && hash->h[1] == 0;
+}
+
+static bool is_zero(const char* value)
+{
+    for (size_t i = 0; i < block_size; i++) {
+        if (value[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+void init_dedup(struct memcache_t* mem, size_t size)
+{
+    memcache = mem;
+    block_size = size;
+    chunk_size = size / sizeof(struct block_hash);
+}
+
+bool block_map_load(struct block_map* map, int inode_id, size_t first, size_t cnt)
+{
+    assert(cnt > 0);
+    size_t first_chunk = first / chunk_size;
+    size_t chunks = (first + cnt - 1) / chunk_size - first_chunk + 1;
+
+    map->inode_id = inode_id;
+    map->first = first_chunk * chunk_size;
+    map->cnt = chunks * chunk_size;
+    map->hashes = calloc(map->cnt, sizeof(struct block_hash));
+    map->stored = malloc(map->cnt * sizeof(struct block_hash));
+    map->cas = malloc(chunks * sizeof(uint64_t));
+    struct memcache_item* items = malloc(chunks * sizeof(struct memcache_item));
+    if (map->hashes == NULL || map->stored == NULL || map->cas == NULL || items == NULL) {
+        free(items);
+        block_map_free(map);
+        return false;
+    }
+
+    for (size_t i = 0; i < chunks; i++) {
+        get_chunk_key(items[i].key, inode_id, first_chunk + i);
+        items[i].buff = map->hashes + i * chunk_size;
+        items[i].size = block_size;
+    }
+    bool res = memcache_gets_multi(memcache, items, chunks);
+    for (size_t i = 0; res && i < chunks; i++) {
+        if (!items[i].found)
+            memset(map->hashes + i * chunk_size, 0, block_size);
+        map->cas[i] = items[i].found ? items[i].cas : 0;
+    }
+    free(items);
+    if (res)
+        memcpy(map->stored, map->hashes, map->cnt * sizeof(struct block_hash));
+    else
+        block_map_free(map);
+    return res;
+}
+
+struct block_hash* block_map_at(struct block_map* map, size_t block)
+{
+    assert(block >= map->first && block < map->first + map->cnt);
+    return map->hashes + (block - map->first);
+}
+
+struct block_hash* block_map_replaced(struct block_map* map, size_t block)
+{
+    assert(block >= map->first && block < map->first + map->cnt);
+    return map->stored + (block - map->first);
+}
+
+/*
+ * Takes slots of chunk which other mount changed and this one didn't,
+ * for slots changed by both remembers hash which is replaced
+ */
+static void merge_chunk(struct block_map* map, size_t chunk, const bool* changed,
+    const struct block_hash* theirs)
+{
+    size_t first = chunk * chunk_size;
+    for (size_t i = 0; i < chunk_size; i++) {
+        if (changed[first + i])
+            map->stored[first + i] = theirs[i];
+        else
+            map->hashes[first + i] = theirs[i];
+    }
+}
+
+bool block_map_store(struct block_map* map)
+{
+    size_t chunks = map->cnt / chunk_size;
+    struct memcache_item* items = malloc(chunks * sizeof(struct memcache_item));
+    size_t* pending = malloc(chunks * sizeof(size_t));
+    bool* changed = malloc(map->cnt * sizeof(bool));
+    struct block_hash* theirs = malloc(block_size);
+    size_t pending_cnt = 0;
+    bool res = items != NULL && pending != NULL && changed != NULL && theirs != NULL;
+    for (size_t i = 0; res && i < map->cnt; i++)
+        changed[i] = memcmp(&map->hashes[i], &map->stored[i], sizeof(struct block_hash)) != 0;
+    for (size_t i = 0; res && i < map->cnt; i++) {
+        if (changed[i] && (pending_cnt == 0 || pending[pending_cnt - 1] != i / chunk_size))
+            pending[pending_cnt++] = i / chunk_size;
+    }
+
+    /* Chunks changed by other mounts are fetched again and merged slot by slot */
+    for (int attempt = 0; res && pending_cnt > 0 && attempt < CAS_RETRIES; attempt++) {
+        for (size_t k = 0; k < pending_cnt; k++) {
+            get_chunk_key(items[k].key, map->inode_id, map->first / chunk_size + pending[k]);
+            items[k].buff = map->hashes + pending[k] * chunk_size;
+            items[k].size = block_size;
+            items[k].exptime = 0;
+            items[k].cas = map->cas[pending[k]];
+        }
+        res = memcache_cas_multi(memcache, items, pending_cnt);
+
+        size_t left = 0;
+        for (size_t k = 0; res && k < pending_cnt; k++) {
+            if (items[k].found)
+                continue;
+            struct memcache_item item;
+            memcpy(item.key, items[k].key, sizeof item.key);
+            item.buff = theirs;
+            item.size = block_size;
+            res = memcache_gets_multi(memcache, &item, 1);
+            if (res && (!item.found || item.size != block_size))
+                memset(theirs, 0, block_size);
+            map->cas[pending[k]] = item.found ? item.cas : 0;
+            merge_chunk(map, pending[k], changed, theirs);
+            pending[left++] = pending[k];
+        }
+        pending_cnt = left;
+    }
+    res = res && pending_cnt == 0;
+
+    /* Caller gives back hashes it put, slots it didn't change keep loaded ones */
+    for (size_t i = 0; !res && changed != NULL && i < map->cnt; i++) {
+        if (!changed[i])
+            map->hashes[i] = map->stored[i];
+    }
+    free(theirs);
+    free(changed);
+    free(pending);
+    free(items);
+    return res;
+}
+
+void block_map_free(struct block_map* map)
+{
+    free(map->hashes);
+    free(map->stored);
+    free(map->cas);
+    map->hashes = NULL;
+    map->stored = NULL;
+    map->cas = NULL;
+}
+
+bool dedup_get_blocks(const struct block_hash* hashes, size_t cnt, char* values)
+{
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    char** dst = malloc(cnt * sizeof(char*));
+    if (items == NULL || dst == NULL) {
+        free(items);
+        free(dst);
+        return false;
+    }
+
+    size_t item_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        memset(values + i * block_size, 0, block_size);
+        if (is_hole(&hashes[i]))
+            continue;
+        get_block_key(items[item_cnt].key, &hashes[i]);
+        dst[item_cnt++] = values + i * block_size;
+    }
+    bool res = block_get_multi(memcache, items, item_cnt, dst);
+    /* Referenced block can't be missing, only a zero hash is a hole */
+    for (size_t i = 0; res && i < item_cnt; i++) {
+        if (!items[i].found) {
+            errno = EIO;
+            res = false;
+        }
+    }
+    free(dst);
+    free(items);
+    return res;
+}
+
+/* Drops references taken for blocks which aren't listed in PENDING */
+static void release_taken(const struct block_hash* hashes, size_t cnt,
+    const size_t* pending, size_t pending_cnt)
+{
+    struct block_hash* taken = malloc(cnt * sizeof(struct block_hash));
+    if (taken == NULL)
+        return;
+    memcpy(taken, hashes, cnt * sizeof(struct block_hash));
+    for (size_t i = 0; i < pending_cnt; i++)
+        memset(&taken[pending[i]], 0, sizeof(struct block_hash));
+    dedup_release(taken, cnt);
+    free(taken);
+}
+
+/*
+ * Increments reference counters of given blocks, PENDING is replaced 
+ * with indexes of blocks whose counters don't exist. Indexes of the
+ * others are written to TAKEN if it isn't NULL.
+ */
+static bool increment_refs(const struct block_hash* hashes, size_t* pending, size_t* cnt,
+    size_t* taken, size_t* taken_cnt)
+{
+    struct memcache_item* items = malloc(*cnt * sizeof(struct memcache_item));
+    if (items == NULL)
+        return false;
+    for (size_t i = 0; i < *cnt; i++) {
+        get_ref_key(items[i].key, &hashes[pending[i]]);
+        items[i].number = 1;
+    }
+    bool res = memcache_incr_multi(memcache, items, *cnt);
+    size_t left = 0;
+    for (size_t i = 0; res && i < *cnt; i++) {
+        if (!items[i].found)
+            pending[left++] = pending[i];
+        else if (taken != NULL)
+            taken[(*taken_cnt)++] = pending[i];
+    }
+    if (res)
+        *cnt = left;
+    free(items);
+    return res;
+}
+
+/*
+ * Compares blocks which references were taken for with stored data.
+ * Hash doesn't prove equality, block which only collides with stored
+ * one loses the reference and gets random hash nobody else writes,
+ * its index is added to PENDING so that it's stored as new block
+ */
+static bool verify_blocks(const char* values, struct block_hash* hashes,
+    const size_t* taken, size_t taken_cnt, size_t* pending, size_t* pending_cnt)
+{
+    struct memcache_item* items = malloc(taken_cnt * sizeof(struct memcache_item));
+    char** dst = malloc(taken_cnt * sizeof(char*));
+    char* stored = malloc(taken_cnt * block_size);
+    struct block_hash* collided = malloc(taken_cnt * sizeof(struct block_hash));
+    bool res = items != NULL && dst != NULL && stored != NULL && collided != NULL;
+    for (size_t i = 0; res && i < taken_cnt; i++) {
+        get_block_key(items[i].key, &hashes[taken[i]]);
+        dst[i] = stored + i * block_size;
+    }
+    res = res && block_get_multi(memcache, items, taken_cnt, dst);
+
+    size_t collided_cnt = 0;
+    for (size_t i = 0; res && i < taken_cnt; i++) {
+        size_t ind = taken[i];
+        if (items[i].found && memcmp(dst[i], values + ind * block_size, block_size) == 0)
+            continue;
+        collided[collided_cnt++] = hashes[ind];
+        do
+            random_bytes(&hashes[ind], sizeof(struct block_hash));
+        while (is_hole(&hashes[ind]));
+        pending[(*pending_cnt)++] = ind;
+    }
+    if (collided_cnt > 0)
+        dedup_release(collided, collided_cnt);
+    free(collided);
+    free(stored);
+    free(dst);
+    free(items);
+    return res;
+}
+
+static bool store_blocks(const char* values, const struct block_hash* hashes,
+    const size_t* indexes, size_t cnt, struct memcache_item* items)
+{
+    char** src = malloc(cnt * sizeof(char*));
+    if (src == NULL)
+        return false;
+    for (size_t i = 0; i < cnt; i++) {
+        get_block_key(items[i].key, &hashes[indexes[i]]);
+        src[i] = (char*)(values + indexes[i] * block_size);
+    }
+    bool res = block_set_multi(memcache, items, cnt, src);
+    for (size_t i = 0; res && i < cnt; i++)
+        res = items[i].found;
+    free(src);
+    return res;
+}
+
+bool dedup_put_blocks(const char* values, size_t cnt, struct block_hash* hashes)
+{
+    size_t* pending = malloc(cnt * sizeof(size_t));
+    size_t* created = malloc(cnt * sizeof(size_t));
+    size_t* taken = malloc(cnt * sizeof(size_t));
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    if (pending == NULL || created == NULL || taken == NULL || items == NULL) {
+        free(pending);
+        free(created);
+        free(taken);
+        free(items);
+        return false;
+    }
+
+    size_t pending_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        const char* value = values + i * block_size;
+        if (is_zero(value)) {
+            memset(&hashes[i], 0, sizeof(struct block_hash));
+            continue;
+        }
+        hash_block(value, block_size, &hashes[i]);
+        pending[pending_cnt++] = i;
+    }
+
+    /*
+     * Existing blocks only need their counter incremented once their
+     * data is checked to be the same. New ones are
+     * stored first and published by creating the counter, so counter 
+     * never exists without data. If block was being collected at the
+     * same time (its counter is a tombstone) we retry, and store data
+     * once more after our counter is created, since collector could 
+     * have deleted it. Tombstone left by crashed collector outlives
+     * the retries, then write fails with EAGAIN instead of blocking.
+     */
+    bool res = true;
+    bool raced = false;
+    for (int retry = 0; res && pending_cnt > 0; retry++) {
+        if (retry == ACQUIRE_RETRIES) {
+            errno = EAGAIN;
+            res = false;
+            break;
+        }
+        if (retry > 1)
+            usleep(ACQUIRE_DELAY);
+        size_t taken_cnt = 0;
+        res = increment_refs(hashes, pending, &pending_cnt, taken, &taken_cnt);
+        if (res && taken_cnt > 0)
+            res = verify_blocks(values, hashes, taken, taken_cnt, pending, &pending_cnt);
+        if (!res || pending_cnt == 0)
+            break;
+
+        res = store_blocks(values, hashes, pending, pending_cnt, items);
+        if (!res)
+            break;
+
+        for (size_t i = 0; i < pending_cnt; i++) {
+            get_ref_key(items[i].key, &hashes[pending[i]]);
+            items[i].buff = "1";
+            items[i].size = 1;
+            items[i].exptime = 0;
+        }
+        res = memcache_add_multi(memcache, items, pending_cnt);
+        if (!res)
+            break;
+
+        size_t left = 0;
+        size_t created_cnt = 0;
+        for (size_t i = 0; i < pending_cnt; i++) {
+            if (!items[i].found)
+                pending[left++] = pending[i];
+            else if (raced)
+                created[created_cnt++] = pending[i];
+        }
+        /* Shared block is counted once, by mount which created its counter */
+        usage_add((int64_t)(pending_cnt - left), 0);
+        if (created_cnt > 0)
+            res = store_blocks(values, hashes, created, created_cnt, items);
+        if (left > 0)
+            raced = true;
+        pending_cnt = left;
+    }
+    if (!res)
+        release_taken(hashes, cnt, pending, pending_cnt);
+
+    free(items);
+    free(taken);
+    free(created);
+    free(pending);
+    return res;
+}
+
+bool dedup_acquire(const struct block_hash* hashes, size_t cnt)
+{
+    size_t* pending = malloc(cnt * sizeof(size_t));
+    if (pending == NULL)
+        return false;
+
+    size_t pending_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (!is_hole(&hashes[i]))
+            pending[pending_cnt++] = i;
+    }
+    /* Caller already holds a reference, so every counter must exist */
+    bool res = increment_refs(hashes, pending, &pending_cnt, NULL, NULL) && pending_cnt == 0;
+    free(pending);
+    return res;
+}
+
+void dedup_release(const struct block_hash* hashes, size_t cnt)
+{
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    char(*counters)[COUNTER_SIZE] = malloc(cnt * COUNTER_SIZE);
+    if (items == NULL || counters == NULL) {
+        free(items);
+        free(counters);
+        return;
+    }
+
+    size_t item_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (is_hole(&hashes[i]))
+            continue;
+        get_ref_key(items[item_cnt].key, &hashes[i]);
+        items[item_cnt].number = 1;
+        item_cnt++;
+    }
+    if (!memcache_decr_multi(memcache, items, item_cnt))
+        goto done;
+
+    /* Unreferenced blocks are collected only if nobody revived them */
+    size_t dead = 0;
+    for (size_t i = 0; i < item_cnt; i++) {
+        if (items[i].found && items[i].number == 0) {
+            items[dead] = items[i];
+            items[dead].buff = counters[dead];
+            items[dead].size = COUNTER_SIZE - 1;
+            dead++;
+        }
+    }
+    if (!memcache_gets_multi(memcache, items, dead))
+        goto done;
+
+    size_t dying = 0;
+    for (size_t i = 0; i < dead; i++) {
+        /* Decremented counters may be padded with spaces */
+        counters[i][items[i].found ? items[i].size : 0] = '\0';
+        if (items[i].found && counters[i][0] == '0' && strspn(counters[i] + 1, " ") == items[i].size - 1) {
+            items[dying] = items[i];
+            items[dying].buff = TOMBSTONE;
+            items[dying].size = strlen(TOMBSTONE);
+            items[dying].exptime = TOMBSTONE_TTL;
+            dying++;
+        }
+    }
+    if (!memcache_cas_multi(memcache, items, dying))
+        goto done;
+
+    size_t buried = 0;
+    for (size_t i = 0; i < dying; i++) {
+        if (items[i].found)
+            items[buried++] = items[i];
+    }
+    usage_add(-(int64_t)buried, 0);
+    /* Data goes first, counter disappears only when data is gone */
+    for (size_t i = 0; i < buried; i++)
+        memcpy(items[i].key, "blk", 3);
+    memcache_delete_multi(memcache, items, buried);
+    for (size_t i = 0; i < buried; i++)
+        memcpy(items[i].key, "ref", 3);
+    memcache_delete_multi(memcache, items, buried);
+
+done:
+    free(counters);
+    free(items);
+}
+
+void dedup_remove_map(int inode_id, size_t blocks)
+{
+    if (blocks == 0)
+        return;
+
+    struct block_map map;
+    if (!block_map_load(&map, inode_id, 0, blocks))
+        return;
+    dedup_release(map.hashes, map.cnt);
+
+    size_t chunks = map.cnt / chunk_size;
+    struct memcache_item* items = malloc(chunks * sizeof(struct memcache_item));
+    if (items != NULL) {
+        for (size_t i = 0; i < chunks; i++)
+            get_chunk_key(items[i].key, inode_id, i);
+        memcache_delete_multi(memcache, items, chunks);
+        free(items);
+    }
+    block_map_free(&map);
+}
+
+bool dedup_list_keys(int inode_id, size_t blocks, key_visitor visit, void* aux)
+{
+    char key[MEMCACHE_KEY_MAX + 1];
+    size_t window = LIST_CHUNKS * chunk_size;
+    for (size_t first = 0; first < blocks; first += window) {
+        size_t cnt = blocks - first < window ? blocks - first : window;
+        struct block_map map;
+        if (!block_map_load(&map, inode_id, first, cnt))
+            return false;
+        for (size_t i = 0; i < map.cnt / chunk_size; i++) {
+            get_chunk_key(key, inode_id, map.first / chunk_size + i);
+            visit(key, false, aux);
+        }
+        for (size_t i = 0; i < cnt; i++) {
+            const struct block_hash* hash = block_map_at(&map, first + i);
+            if (is_hole(hash))
+                continue;
+            get_block_key(key, hash);
+            visit(key, true, aux);
+            get_ref_key(key, hash);
+            visit(key, true, aux);
+        }
+        block_map_free(&map);
+    }
+    return true;
+}
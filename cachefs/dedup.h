@@ -0,0 +1,173 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "hash.h"
+#include "keys.h"
+#include "memcache.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Loaded part of inode's block map. Map is stored in chunks of
+ * BLOCK_MAP_CHUNK hashes, an all zero hash marks a hole
+ */
+struct block_map {
+    int inode_id;
+    size_t first; // First block covered by loaded chunks
+    size_t cnt; // Number of covered blocks
+    struct block_hash* hashes;
+    struct block_hash* stored; // Hashes as loaded, replaced ones after store
+    uint64_t* cas; // Cas uniques of loaded chunks, 0 if chunk didn't exist
+};
+
+/**
+ * Function : init_dedup
+ * ----------------------------------------
+ * Initializes deduplication variables
+ * 
+ * mem        : memcache data object 
+ * block_size : size of data blocks
+ */
+void init_dedup(struct memcache_t* mem, size_t block_size);
+
+/**
+ * Function : block_map_load
+ * ----------------------------------------
+ * Loads chunks of inode's block map covering given blocks
+ * 
+ * map      : map to fill, should be freed with block_map_free
+ * inode_id : id of inode
+ * first    : first needed block
+ * cnt      : number of needed blocks
+ * 
+ * Returns  : true if map was loaded successfully
+ */
+bool block_map_load(struct block_map* map, int inode_id, size_t first, size_t cnt);
+
+/**
+ * Function : block_map_at
+ * ----------------------------------------
+ * Finds hash of loaded block, following blocks are stored
+ * right after it
+ * 
+ * map      : loaded map
+ * block    : index of block, should be covered by map
+ * 
+ * Returns  : pointer to the hash inside map
+ */
+struct block_hash* block_map_at(struct block_map* map, size_t block);
+
+/**
+ * Function : block_map_replaced
+ * ----------------------------------------
+ * Finds hash block had when map was loaded, after successful
+ * block_map_store hash which was really replaced, other mount
+ * could change it in between
+ * 
+ * map      : loaded map
+ * block    : index of block, should be covered by map
+ * 
+ * Returns  : pointer to the hash, following blocks are stored right after it
+ */
+struct block_hash* block_map_replaced(struct block_map* map, size_t block);
+
+/**
+ * Function : block_map_store
+ * ----------------------------------------
+ * Saves changed chunks of block map with gets/cas. Slots changed by
+ * other mounts since load are merged in, slots changed here win.
+ * On failure slots which weren't changed here hold loaded hashes
+ * 
+ * map      : loaded map
+ * 
+ * Returns  : true if all chunks were stored
+ */
+bool block_map_store(struct block_map* map);
+
+/**
+ * Function : block_map_free
+ * ----------------------------------------
+ * Frees memory used by loaded map
+ * 
+ * map      : loaded map
+ */
+void block_map_free(struct block_map* map);
+
+/**
+ * Function : dedup_get_blocks
+ * ----------------------------------------
+ * Reads contents of blocks with given hashes
+ * 
+ * hashes   : hashes of blocks, zero hashes are read as holes 
+ * cnt      : number of blocks
+ * values   : buffer of cnt blocks
+ * 
+ * Returns  : true if blocks were read successfully, false if any of them is missing
+ */
+bool dedup_get_blocks(const struct block_hash* hashes, size_t cnt, char* values);
+
+/**
+ * Function : dedup_put_blocks
+ * ----------------------------------------
+ * Hashes blocks and takes reference to each of them, blocks which 
+ * aren't stored yet are saved under their hash. Stored data is compared
+ * before it's shared, block which only collides with it gets random hash
+ * 
+ * values   : contents of cnt blocks
+ * cnt      : number of blocks
+ * hashes   : where hashes of blocks should be written
+ * 
+ * Returns  : true if every block was referenced, on failure no reference
+ *            is kept and errno is EAGAIN if block stayed under collection
+ */
+bool dedup_put_blocks(const char* values, size_t cnt, struct block_hash* hashes);
+
+/**
+ * Function : dedup_acquire
+ * ----------------------------------------
+ * Takes one more reference to already stored blocks
+ * 
+ * hashes   : hashes of blocks
+ * cnt      : number of blocks
+ * 
+ * Returns  : true if every block was referenced
+ */
+bool dedup_acquire(const struct block_hash* hashes, size_t cnt);
+
+/**
+ * Function : dedup_release
+ * ----------------------------------------
+ * Drops references to blocks, blocks which aren't referenced 
+ * anymore are deleted
+ * 
+ * hashes   : hashes of blocks
+ * cnt      : number of blocks
+ */
+void dedup_release(const struct block_hash* hashes, size_t cnt);
+
+/**
+ * Function : dedup_remove_map
+ * ----------------------------------------
+ * Releases all blocks of inode and deletes its block map
+ * 
+ * inode_id : id of inode
+ * blocks   : number of inode's blocks
+ */
+void dedup_remove_map(int inode_id, size_t blocks);
+
+/**
+ * Function : dedup_list_keys
+ * ----------------------------------------
+ * Reports keys of block map chunks and of blocks and reference
+ * counters map points to, later ones as shared
+ * 
+ * inode_id : id of inode
+ * blocks   : number of inode's blocks
+ * visit    : called for every key
+ * aux      : passed to visit
+ * 
+ * Returns  : false if block map couldn't be read
+ */
+bool dedup_list_keys(int inode_id, size_t blocks, key_visitor visit, void* aux);
+
+#endif
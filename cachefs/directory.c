@@ -1,48 +1,732 @@
 
 
 #include "directory.h"
+#include "hash.h"
+#include "lease.h"
 #include "list.h"
 #include "utils.h"
 #include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDEX_VALUE_MAX 4096
+#define DIR_READ_SIZE (16 * INODE_BLOCK_SIZE) // Scans fetch this many bytes at once
+#define DIR_LOCK_CNT 64
+#define MAX_FREE_SLOTS 4096 // Tombstones remembered for reuse per directory
+#define FREE_SLOTS_INIT 16 // Tombstone array starts this big and doubles up to MAX_FREE_SLOTS
+#define MAX_DIR_STATES 256 // Directories with remembered tombstones, least recently used are forgotten
+#define COMPACT_MIN_LENGTH (4 * INODE_BLOCK_SIZE) // Smaller directories are not compacted
+#define COMPACT_PERCENT 50 // Compact when tombstones take this part of directory
+#define COMPACT_BATCH 64
+#define COMPACT_RETRY_DELAY 1 // Seconds before busy directory is compacted again
+#define DENTRY_CACHE_SIZE 4096
+#define DENTRY_TTL 1 // Seconds cached name is trusted, other mounts may change it
+#define CHECK_BATCH 256 // Index buckets loaded with one pipelined request by check
+#define CAS_RETRIES 16 // Attempts of read-modify-write before giving up
+
+static struct memcache_t* memcache;
+static bool compaction; // Off when other mounts change directories without leases
+
+/* Lookup and update of index must be atomic, directories share locks by id */
+static pthread_mutex_t dir_locks[DIR_LOCK_CNT];
+
+/**
+ * Tombstone which can hold new entry
+ */
+struct free_slot {
+    size_t offset;
+    size_t rec_len;
+};
+
+/**
+ * Tombstones of directory known to this process, sorted by offset
+ */
+struct dir_state {
+    int dir_id;
+    struct free_slot* slots;
+    size_t slot_cnt;
+    size_t slot_capacity;
+    size_t dead; // Bytes taken by remembered tombstones
+    bool queued; // Waits for compaction
+    struct list_elem elem;
+    struct list_elem queue_elem;
+};
+
+/**
+ * Cached result of name lookup, slots are chosen by hash
+ * of directory and name
+ */
+struct dentry {
+    int dir_id;
+    int inode_id; // -1 if slot is empty
+    time_t expires;
+    char name[NAME_MAX + 1];
+};
+
+static struct dentry dentries[DENTRY_CACHE_SIZE];
+static pthread_mutex_t dentries_lock;
+
+static struct list dir_states; // Most recently used first
+static size_t state_cnt;
+static struct list compact_queue;
+static pthread_mutex_t states_lock;
+static pthread_cond_t compact_cond;
+static pthread_t compact_thread;
 
 struct dir {
     struct inode* inode;
     size_t pos;
+    char* buff; // Blocks of directory read by last scan
+    size_t buff_pos; // Offset of buff in directory
+    size_t buff_len;
 };
 
+#define ENTRY_DELETED 0x1
+
+/**
+ * Entry stored in directory, NAME_LEN bytes of name follow it. Entries
+ * never cross block boundary, rest of block starting with zero REC_LEN
+ * or too short for an entry is unused
+ */
 struct dir_entry {
-    int inode_id;
-    char name[NAME_MAX + 1];
-    bool is_deleted;
+    int32_t inode_id;
+    uint16_t rec_len; // Size of entry with name, padded to 4 bytes
+    uint8_t name_len;
+    uint8_t flags;
+    uint32_t hash; // Hash of name, names are compared only when hashes match
+} __attribute__((packed));
+
+#define ENTRY_SIZE(name_len) ((sizeof(struct dir_entry) + (name_len) + 3) & ~(size_t)3)
+
+/**
+ * Record of name index, name follows the record. Names of directory are
+ * indexed by hash, records of names with the same hash share one bucket
+ */
+struct index_record {
+    uint64_t offset; // Offset of dir_entry in directory
+    int32_t inode_id;
+    uint16_t name_len;
+} __attribute__((packed));
+
+struct index_bucket {
+    char key[MEMCACHE_KEY_MAX + 1];
+    char value[INDEX_VALUE_MAX];
+    size_t size;
+    uint64_t cas; // Unique of loaded bucket, 0 if it didn't exist
 };
 
-static bool lookup(const struct dir* dir, const char* name,
-    struct dir_entry* entry_pointer, size_t* offset_pointer)
+static pthread_mutex_t* dir_lock(int dir_id)
 {
-    struct dir_entry entry;
-    size_t ofs;
-    assert(dir != NULL);
+    return &dir_locks[(unsigned)dir_id % DIR_LOCK_CNT];
+}
+
+/* Names whose hashes share this value share index bucket */
+static uint64_t name_bucket(const char* name)
+{
+    struct block_hash hash;
+    hash_block(name, strlen(name), &hash);
+    return hash.h[0];
+}
+
+static void get_bucket_key(char* key, int dir_id, const char* name)
+{
+    sprintf(key, "%d#H%016" PRIx64, dir_id, name_bucket(name));
+}
+
+/*
+ * Reads index bucket of NAME in directory DIR_ID, bucket of
+ * missing name is empty
+ */
+static bool load_bucket(struct index_bucket* bucket, int dir_id, const char* name)
+{
+    get_bucket_key(bucket->key, dir_id, name);
+
+    struct memcache_item item = { 0 };
+    strcpy(item.key, bucket->key);
+    item.buff = bucket->value;
+    item.size = INDEX_VALUE_MAX;
+    if (!memcache_gets_multi(memcache, &item, 1))
+        return false;
+    bucket->size = item.found ? item.size : 0;
+    bucket->cas = item.found ? item.cas : 0;
+    return true;
+}
+
+/*
+ * Stores bucket only if nobody changed it since it was loaded. Emptied
+ * bucket is kept with empty value, deleting it could lose names which
+ * other mount adds meanwhile
+ */
+static bool store_bucket(struct index_bucket* bucket)
+{
+    if (bucket->size == 0 && bucket->cas == 0)
+        return true;
+    struct memcache_item item = { 0 };
+    strcpy(item.key, bucket->key);
+    item.buff = bucket->value;
+    item.size = bucket->size;
+    item.cas = bucket->cas;
+    return memcache_cas_multi(memcache, &item, 1) && item.found;
+}
+
+/*
+ * Finds record of NAME in bucket, returns its position
+ * in bucket value or -1 if name is not indexed
+ */
+static ssize_t find_record(const struct index_bucket* bucket, const char* name,
+    struct index_record* record)
+{
+    size_t name_len = strlen(name);
+    size_t pos = 0;
+    while (pos + sizeof(struct index_record) <= bucket->size) {
+        memcpy(record, bucket->value + pos, sizeof(struct index_record));
+        const char* record_name = bucket->value + pos + sizeof(struct index_record);
+        if (record->name_len == name_len && memcmp(record_name, name, name_len) == 0)
+            return pos;
+        pos += sizeof(struct index_record) + record->name_len;
+    }
+    return -1;
+}
+
+/*
+ * Adds record of NAME to bucket loaded by load_bucket, bucket is loaded
+ * again when other mount changed it. Returns false if name is already
+ * indexed or bucket can't be stored
+ */
+static bool index_insert(struct index_bucket* bucket, int dir_id, const char* name,
+    const struct index_record* record)
+{
+    size_t size = sizeof(struct index_record) + record->name_len;
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        struct index_record other;
+        if (find_record(bucket, name, &other) >= 0 || bucket->size + size > INDEX_VALUE_MAX)
+            return false;
+        memcpy(bucket->value + bucket->size, record, sizeof(struct index_record));
+        memcpy(bucket->value + bucket->size + sizeof(struct index_record), name, record->name_len);
+        bucket->size += size;
+        if (store_bucket(bucket))
+            return true;
+        if (!load_bucket(bucket, dir_id, name))
+            return false;
+    }
+    return false;
+}
+
+/*
+ * Changes record of NAME which points to entry at OFFSET, INODE_ID (unless
+ * negative) and NEW_OFFSET replace its fields. Bucket is loaded again when
+ * other mount changed it. Returns false if record doesn't point to OFFSET
+ */
+static bool index_update(struct index_bucket* bucket, int dir_id, const char* name,
+    uint64_t offset, int32_t inode_id, uint64_t new_offset)
+{
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        struct index_record record;
+        ssize_t pos = find_record(bucket, name, &record);
+        if (pos < 0 || record.offset != offset)
+            return false;
+        if (inode_id >= 0)
+            record.inode_id = inode_id;
+        record.offset = new_offset;
+        memcpy(bucket->value + pos, &record, sizeof record);
+        if (store_bucket(bucket))
+            return true;
+        if (!load_bucket(bucket, dir_id, name))
+            return false;
+    }
+    return false;
+}
+
+/*
+ * Drops record of NAME which points to entry at OFFSET, any record
+ * of NAME if OFFSET is UINT64_MAX. Missing record counts as removed
+ */
+static bool index_remove(struct index_bucket* bucket, int dir_id, const char* name, uint64_t offset)
+{
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        struct index_record record;
+        ssize_t pos = find_record(bucket, name, &record);
+        if (pos < 0 || (offset != UINT64_MAX && record.offset != offset))
+            return true;
+        size_t size = sizeof(struct index_record) + record.name_len;
+        memmove(bucket->value + pos, bucket->value + pos + size, bucket->size - pos - size);
+        bucket->size -= size;
+        if (store_bucket(bucket))
+            return true;
+        if (!load_bucket(bucket, dir_id, name))
+            return false;
+    }
+    return false;
+}
+
+/*
+ * Slot of dentry cache where lookup of NAME in directory DIR_ID
+ * is cached, names with the same slot replace each other
+ */
+static struct dentry* dentry_slot(int dir_id, const char* name)
+{
+    uint32_t hash = crc32c(crc32c(0, &dir_id, sizeof dir_id), name, strlen(name));
+    return &dentries[hash % DENTRY_CACHE_SIZE];
+}
+
+static bool dentry_get(int dir_id, const char* name, int* inode_id)
+{
+    pthread_mutex_lock(&dentries_lock);
+    struct dentry* dentry = dentry_slot(dir_id, name);
+    bool found = dentry->inode_id >= 0 && dentry->dir_id == dir_id
+        && dentry->expires > time(NULL) && strcmp(dentry->name, name) == 0;
+    if (found)
+        *inode_id = dentry->inode_id;
+    pthread_mutex_unlock(&dentries_lock);
+    return found;
+}
+
+static void dentry_put(int dir_id, const char* name, int inode_id, time_t expires)
+{
+    pthread_mutex_lock(&dentries_lock);
+    struct dentry* dentry = dentry_slot(dir_id, name);
+    dentry->dir_id = dir_id;
+    dentry->inode_id = inode_id;
+    dentry->expires = expires;
+    strcpy(dentry->name, name);
+    pthread_mutex_unlock(&dentries_lock);
+}
+
+static void dentry_drop(int dir_id, const char* name)
+{
+    pthread_mutex_lock(&dentries_lock);
+    struct dentry* dentry = dentry_slot(dir_id, name);
+    if (dentry->dir_id == dir_id && strcmp(dentry->name, name) == 0)
+        dentry->inode_id = -1;
+    pthread_mutex_unlock(&dentries_lock);
+}
+
+void dir_forget_cached()
+{
+    pthread_mutex_lock(&dentries_lock);
+    for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++)
+        dentries[i].inode_id = -1;
+    pthread_mutex_unlock(&dentries_lock);
+}
+
+/*
+ * Finds inode of NAME in directory DIR_ID, through dentry cache
+ * or in one request to the name index
+ */
+static bool lookup(int dir_id, const char* name, int* inode_id)
+{
+    struct index_bucket bucket;
+    struct index_record record;
     assert(name != NULL);
-    for (ofs = 0; inode_read_at(dir->inode, &entry, sizeof(struct dir_entry), ofs, false) == sizeof(struct dir_entry);
-         ofs += sizeof(struct dir_entry)) {
-        if (entry.is_deleted)
+    if (dentry_get(dir_id, name, inode_id))
+        return true;
+    /* Lease is taken before reading, so entry can't change while it's held */
+    time_t expires = time(NULL) + DENTRY_TTL;
+    if (lease_acquire(dir_id) && lease_valid(dir_id) / 1000 > expires)
+        expires = lease_valid(dir_id) / 1000;
+    if (!load_bucket(&bucket, dir_id, name) || find_record(&bucket, name, &record) < 0)
+        return false;
+    *inode_id = record.inode_id;
+    dentry_put(dir_id, name, record.inode_id, expires);
+    return true;
+}
+
+static uint32_t name_hash(const char* name, size_t name_len)
+{
+    return crc32c(0, name, name_len);
+}
+
+/*
+ * Drops index bucket of NAME in directory which is being removed
+ */
+static void unindex(int dir_id, const char* name)
+{
+    dentry_drop(dir_id, name);
+    struct index_bucket bucket;
+    if (load_bucket(&bucket, dir_id, name))
+        index_remove(&bucket, dir_id, name, UINT64_MAX);
+}
+
+static void drop_state(struct dir_state* state)
+{
+    list_remove(&state->elem);
+    if (state->queued)
+        list_remove(&state->queue_elem);
+    state_cnt--;
+    free(state->slots);
+    free(state);
+}
+
+/*
+ * Finds tombstones of directory, creates them if CREATE is set.
+ * Must be called with states_lock held
+ */
+static struct dir_state* get_state(int dir_id, bool create)
+{
+    struct list_elem* e;
+    for (e = list_begin(&dir_states); e != list_end(&dir_states); e = list_next(e)) {
+        struct dir_state* state = list_entry(e, struct dir_state, elem);
+        if (state->dir_id == dir_id) {
+            list_remove(&state->elem);
+            list_push_front(&dir_states, &state->elem);
+            return state;
+        }
+    }
+    if (!create)
+        return NULL;
+
+    /* Forgotten tombstones stay in directory, they just aren't reused */
+    if (state_cnt == MAX_DIR_STATES)
+        drop_state(list_entry(list_back(&dir_states), struct dir_state, elem));
+    struct dir_state* state = malloc(sizeof(struct dir_state));
+    if (state == NULL)
+        return NULL;
+    state->dir_id = dir_id;
+    state->slots = NULL;
+    state->slot_cnt = 0;
+    state->slot_capacity = 0;
+    state->dead = 0;
+    state->queued = false;
+    list_push_front(&dir_states, &state->elem);
+    state_cnt++;
+    return state;
+}
+
+/* Makes room for one more tombstone, returns false when it can't be remembered */
+static bool reserve_slot(struct dir_state* state)
+{
+    if (state->slot_cnt < state->slot_capacity)
+        return true;
+    if (state->slot_capacity == MAX_FREE_SLOTS)
+        return false;
+    size_t capacity = state->slot_capacity == 0 ? FREE_SLOTS_INIT : state->slot_capacity * 2;
+    struct free_slot* slots = realloc(state->slots, capacity * sizeof(struct free_slot));
+    if (slots == NULL)
+        return false;
+    state->slots = slots;
+    state->slot_capacity = capacity;
+    return true;
+}
+
+/* Index of first slot at OFFSET or after it */
+static size_t find_slot(const struct dir_state* state, size_t offset)
+{
+    size_t lo = 0;
+    size_t hi = state->slot_cnt;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (state->slots[mid].offset < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Remembers tombstone of directory and queues directory for
+ * compaction when tombstones take too much of it
+ */
+static void add_free_slot(int dir_id, size_t offset, size_t rec_len, size_t length)
+{
+    pthread_mutex_lock(&states_lock);
+    struct dir_state* state = get_state(dir_id, true);
+    if (state != NULL) {
+        /* Readdir finds tombstones in offset order, so they are mostly appended */
+        size_t pos = find_slot(state, offset);
+        bool known = pos < state->slot_cnt && state->slots[pos].offset == offset;
+        if (!known && reserve_slot(state)) {
+            memmove(state->slots + pos + 1, state->slots + pos,
+                (state->slot_cnt - pos) * sizeof(struct free_slot));
+            state->slots[pos].offset = offset;
+            state->slots[pos].rec_len = rec_len;
+            state->slot_cnt++;
+            state->dead += rec_len;
+        }
+        if (compaction && !state->queued && length >= COMPACT_MIN_LENGTH
+            && state->dead * 100 >= length * COMPACT_PERCENT) {
+            state->queued = true;
+            list_push_back(&compact_queue, &state->queue_elem);
+            pthread_cond_signal(&compact_cond);
+        }
+    }
+    pthread_mutex_unlock(&states_lock);
+}
+
+/*
+ * Takes remembered tombstone of at least REC_LEN bytes
+ */
+static bool take_free_slot(int dir_id, size_t rec_len, struct free_slot* slot)
+{
+    bool found = false;
+    pthread_mutex_lock(&states_lock);
+    struct dir_state* state = get_state(dir_id, false);
+    for (size_t i = 0; state != NULL && i < state->slot_cnt; i++) {
+        if (state->slots[i].rec_len >= rec_len) {
+            *slot = state->slots[i];
+            state->slot_cnt--;
+            memmove(state->slots + i, state->slots + i + 1,
+                (state->slot_cnt - i) * sizeof(struct free_slot));
+            state->dead -= slot->rec_len;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&states_lock);
+    return found;
+}
+
+static void forget_free_slots(int dir_id)
+{
+    pthread_mutex_lock(&states_lock);
+    struct dir_state* state = get_state(dir_id, false);
+    if (state != NULL)
+        drop_state(state);
+    pthread_mutex_unlock(&states_lock);
+}
+
+static bool valid_entry(const struct dir_entry* entry, size_t block_left)
+{
+    return entry->rec_len >= ENTRY_SIZE(entry->name_len) && entry->rec_len <= block_left;
+}
+
+/*
+ * Points index records of moved entries to their new offsets. Entries
+ * are given by their names, old and new offsets and count
+ */
+static bool move_index_records(int dir_id, char (*names)[NAME_MAX + 1],
+    const size_t* old_offsets, const size_t* offsets, size_t cnt)
+{
+    struct index_bucket* buckets = malloc(cnt * sizeof(struct index_bucket));
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    bool res = buckets != NULL && items != NULL;
+
+    /* Names with the same hash share bucket, each bucket is loaded once */
+    size_t bucket_cnt = 0;
+    for (size_t i = 0; res && i < cnt; i++) {
+        memset(&items[bucket_cnt], 0, sizeof(struct memcache_item));
+        get_bucket_key(items[bucket_cnt].key, dir_id, names[i]);
+        bool loaded = false;
+        for (size_t j = 0; j < bucket_cnt && !loaded; j++)
+            loaded = strcmp(items[j].key, items[bucket_cnt].key) == 0;
+        if (loaded)
             continue;
-        if (!strcmp(name, entry.name)) {
-            if (entry_pointer != NULL)
-                *entry_pointer = entry;
-            if (offset_pointer != NULL)
-                *offset_pointer = ofs;
-            return true;
+        strcpy(buckets[bucket_cnt].key, items[bucket_cnt].key);
+        items[bucket_cnt].buff = buckets[bucket_cnt].value;
+        items[bucket_cnt].size = INDEX_VALUE_MAX;
+        bucket_cnt++;
+    }
+    res = res && memcache_gets_multi(memcache, items, bucket_cnt);
+    for (size_t j = 0; res && j < bucket_cnt; j++) {
+        buckets[j].size = items[j].found ? items[j].size : 0;
+        buckets[j].cas = items[j].found ? items[j].cas : 0;
+    }
+
+    for (size_t i = 0; res && i < cnt; i++) {
+        struct index_bucket* bucket = NULL;
+        char key[MEMCACHE_KEY_MAX + 1];
+        get_bucket_key(key, dir_id, names[i]);
+        for (size_t j = 0; j < bucket_cnt && bucket == NULL; j++) {
+            if (strcmp(buckets[j].key, key) == 0)
+                bucket = &buckets[j];
+        }
+
+        struct index_record record;
+        ssize_t pos = find_record(bucket, names[i], &record);
+        if (pos >= 0 && record.offset == old_offsets[i]) {
+            record.offset = offsets[i];
+            memcpy(bucket->value + pos, &record, sizeof record);
         }
     }
-    return false;
+    for (size_t j = 0; res && j < bucket_cnt; j++) {
+        items[j].buff = buckets[j].value;
+        items[j].size = buckets[j].size;
+        items[j].cas = buckets[j].cas;
+        items[j].exptime = 0;
+    }
+    res = res && memcache_cas_multi(memcache, items, bucket_cnt);
+
+    /* Buckets changed by other mounts meanwhile are updated one by one */
+    for (size_t i = 0; res && i < cnt; i++) {
+        size_t j = 0;
+        char key[MEMCACHE_KEY_MAX + 1];
+        get_bucket_key(key, dir_id, names[i]);
+        while (strcmp(buckets[j].key, key) != 0)
+            j++;
+        if (items[j].found || (buckets[j].size == 0 && buckets[j].cas == 0))
+            continue;
+        struct index_bucket bucket;
+        if (load_bucket(&bucket, dir_id, names[i]))
+            index_update(&bucket, dir_id, names[i], old_offsets[i], -1, offsets[i]);
+        else
+            res = false;
+    }
+
+    free(items);
+    free(buckets);
+    return res;
+}
+
+/*
+ * Packs live entries of OLD into NEW and returns their length, index
+ * records of moved names are updated if MOVE is set
+ */
+static bool pack_entries(int dir_id, const char* old, size_t length, char* new, size_t* new_len,
+    bool move)
+{
+    char(*names)[NAME_MAX + 1] = malloc(COMPACT_BATCH * (NAME_MAX + 1));
+    size_t old_offsets[COMPACT_BATCH];
+    size_t offsets[COMPACT_BATCH];
+    size_t moved = 0;
+    bool res = names != NULL;
+
+    *new_len = 0;
+    size_t pos = 0;
+    while (res && pos < length) {
+        size_t block_left = INODE_BLOCK_SIZE - pos % INODE_BLOCK_SIZE;
+        struct dir_entry entry;
+        if (block_left < sizeof entry || pos + sizeof entry > length) {
+            pos += block_left;
+            continue;
+        }
+        memcpy(&entry, old + pos, sizeof entry);
+        if (!valid_entry(&entry, block_left)) {
+            pos += block_left;
+            continue;
+        }
+        size_t rec_len = entry.rec_len;
+        if (!(entry.flags & ENTRY_DELETED)) {
+            entry.rec_len = ENTRY_SIZE(entry.name_len);
+            if (INODE_BLOCK_SIZE - *new_len % INODE_BLOCK_SIZE < entry.rec_len)
+                *new_len += INODE_BLOCK_SIZE - *new_len % INODE_BLOCK_SIZE;
+            memcpy(new + *new_len, &entry, sizeof entry);
+            memcpy(new + *new_len + sizeof entry, old + pos + sizeof entry, entry.name_len);
+            if (move && *new_len != pos) {
+                memcpy(names[moved], old + pos + sizeof entry, entry.name_len);
+                names[moved][entry.name_len] = '\0';
+                old_offsets[moved] = pos;
+                offsets[moved++] = *new_len;
+                if (moved == COMPACT_BATCH) {
+                    res = move_index_records(dir_id, names, old_offsets, offsets, moved);
+                    moved = 0;
+                }
+            }
+            *new_len += entry.rec_len;
+        }
+        pos += rec_len;
+    }
+    res = res && move_index_records(dir_id, names, old_offsets, offsets, moved);
+    free(names);
+    return res;
 }
 
-static void inode_cut(struct inode* inode, size_t start, size_t end)
+/* Reads stored metadata of inode nobody else has open, false if it's open */
+static bool refresh_unshared(struct inode* inode, uint64_t* cas)
 {
+    pthread_mutex_lock(&inode->lock);
+    bool busy = inode->open_cnt > 1;
+    pthread_mutex_unlock(&inode->lock);
+    if (busy || !inode_refresh(inode))
+        return false;
+    pthread_mutex_lock(&inode->lock);
+    *cas = inode->cas;
+    pthread_mutex_unlock(&inode->lock);
+    return true;
+}
+
+/*
+ * Rewrites directory without tombstones. Returns false if directory
+ * is opened or changed by somebody else and should be compacted later
+ */
+static bool compact(int dir_id)
+{
+    struct inode* inode = inode_open(dir_id);
+    if (inode == NULL)
+        return true;
+    if (!inode_is_dir(inode)) {
+        inode_close(inode);
+        return true;
+    }
+
+    pthread_mutex_lock(dir_lock(dir_id));
+    /* Other mounts wait for lease before they change directory */
+    lease_break(dir_id);
+    uint64_t cas;
+    bool busy = !refresh_unshared(inode, &cas);
+    size_t length = inode_length(inode);
+    char* old = busy ? NULL : malloc(length);
+    char* new = busy ? NULL : calloc(length, 1);
+    size_t new_len = 0;
+    bool res = old != NULL && new != NULL && inode_read_at(inode, old, length, 0, false) == (ssize_t)length
+        && pack_entries(dir_id, old, length, new, &new_len, false);
+
+    /* Lease may run out while directory is read, index is changed only if nobody else did */
+    if (res) {
+        lease_break(dir_id);
+        uint64_t now_cas;
+        busy = !refresh_unshared(inode, &now_cas) || now_cas != cas;
+        res = !busy;
+    }
+    res = res && pack_entries(dir_id, old, length, new, &new_len, true);
+    res = res && inode_write_at(inode, new, new_len, 0, false) == new_len;
+    res = res && inode_truncate(inode, new_len);
+    if (res)
+        forget_free_slots(dir_id);
+    pthread_mutex_unlock(dir_lock(dir_id));
+
+    free(new);
+    free(old);
+    inode_close(inode);
+    return !busy;
+}
+
+static void* compact_loop(void* aux)
+{
+    (void)aux;
+    pthread_mutex_lock(&states_lock);
+    while (true) {
+        while (list_empty(&compact_queue))
+            pthread_cond_wait(&compact_cond, &states_lock);
+        struct dir_state* state = list_entry(list_pop_front(&compact_queue), struct dir_state, queue_elem);
+        state->queued = false;
+        int dir_id = state->dir_id;
+        pthread_mutex_unlock(&states_lock);
+        bool done = compact(dir_id);
+        pthread_mutex_lock(&states_lock);
+
+        /* Busy directory is retried after a while */
+        if (!done && (state = get_state(dir_id, false)) != NULL && !state->queued) {
+            state->queued = true;
+            list_push_back(&compact_queue, &state->queue_elem);
+            pthread_mutex_unlock(&states_lock);
+            sleep(COMPACT_RETRY_DELAY);
+            pthread_mutex_lock(&states_lock);
+        }
+    }
+    return NULL;
+}
+
+void init_directories(struct memcache_t* mem, bool compact)
+{
+    memcache = mem;
+    compaction = compact;
+    for (int i = 0; i < DIR_LOCK_CNT; i++)
+        pthread_mutex_init(&dir_locks[i], NULL);
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+        dentries[i].inode_id = -1;
+    pthread_mutex_init(&dentries_lock, NULL);
+    list_init(&dir_states);
+    list_init(&compact_queue);
+    pthread_mutex_init(&states_lock, NULL);
+    pthread_cond_init(&compact_cond, NULL);
+    pthread_create(&compact_thread, NULL, compact_loop, NULL);
+    pthread_detach(compact_thread);
 }
 
 bool dir_create(int inode_id, __gid_t gid, __uid_t uid, __mode_t mode)
@@ -58,6 +742,9 @@ struct dir* dir_open(struct inode* inode)
         assert(inode_is_dir(inode));
         dir->pos = 0;
         dir->inode = inode;
+        dir->buff = NULL;
+        dir->buff_pos = 0;
+        dir->buff_len = 0;
         return dir;
     } else {
         inode_close(inode);
@@ -81,10 +768,25 @@ void dir_close(struct dir* dir)
 {
     if (dir != NULL) {
         inode_close(dir->inode);
+        free(dir->buff);
         free(dir);
     }
 }
 
+struct inode* inode_from_path(const char* path)
+{
+    char part[NAME_MAX + 1];
+    int inode_id = ROOT_INODE_ID;
+    int res;
+
+    /* Each component is resolved in its parent, mostly from dentry cache */
+    while ((res = get_next_part(part, &path)) == 1) {
+        if (!lookup(inode_id, part, &inode_id))
+            return NULL;
+    }
+    return res == 0 ? inode_open(inode_id) : NULL;
+}
+
 struct inode* dir_get_inode(struct dir* dir)
 {
     return dir->inode;
@@ -92,79 +794,355 @@ struct inode* dir_get_inode(struct dir* dir)
 
 bool dir_lookup(const struct dir* dir, const char* name, struct inode** inode)
 {
-    struct dir_entry e;
+    int inode_id;
 
     assert(dir != NULL);
     assert(name != NULL);
 
-    if (lookup(dir, name, &e, NULL))
-        *inode = inode_open(e.inode_id);
+    if (lookup(dir->inode->id, name, &inode_id))
+        *inode = inode_open(inode_id);
     else
         *inode = NULL;
 
     return *inode != NULL;
 }
 
+bool dir_lookup_id(const struct dir* dir, const char* name, int* inode_id)
+{
+    assert(dir != NULL);
+    assert(name != NULL);
+    return lookup(dir->inode->id, name, inode_id);
+}
+
+/*
+ * Takes tombstone of at least REC_LEN bytes for new entry, its header
+ * is read into OLD. Tombstones are checked because other mounts could
+ * have reused them
+ */
+static bool reuse_slot(struct inode* inode, size_t rec_len, struct free_slot* slot,
+    struct dir_entry* old)
+{
+    while (take_free_slot(inode->id, rec_len, slot)) {
+        if (inode_read_at(inode, old, sizeof *old, slot->offset, false) == sizeof *old
+            && (old->flags & ENTRY_DELETED) && old->rec_len == slot->rec_len)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Writes entry E with NAME over tombstone, the rest of large tombstone
+ * stays free. Tombstone is taken only if no other mount took it first
+ */
+static bool fill_slot(struct dir* dir, struct dir_entry* e, const char* name,
+    const struct free_slot* slot, const struct dir_entry* old)
+{
+    char buff[2 * ENTRY_SIZE(NAME_MAX)];
+    size_t rest = slot->rec_len - e->rec_len;
+    if (rest < ENTRY_SIZE(1))
+        e->rec_len = slot->rec_len;
+    memset(buff, 0, sizeof buff);
+    memcpy(buff, e, sizeof *e);
+    memcpy(buff + sizeof *e, name, e->name_len);
+    size_t size = e->rec_len;
+    if (rest >= ENTRY_SIZE(1)) {
+        struct dir_entry tombstone = { 0 };
+        tombstone.rec_len = rest;
+        tombstone.flags = ENTRY_DELETED;
+        memcpy(buff + size, &tombstone, sizeof tombstone);
+        size += sizeof tombstone;
+    }
+    if (!inode_replace_at(dir->inode, buff, size, slot->offset, old, sizeof *old))
+        return false;
+    if (rest >= ENTRY_SIZE(1))
+        add_free_slot(dir->inode->id, slot->offset + e->rec_len, rest, inode_length(dir->inode));
+    return true;
+}
+
+/*
+ * Appends entry E with NAME to directory, its offset is written to OFS.
+ * Range is reserved by growing directory first, so that mounts which
+ * append at the same time get different ranges
+ */
+static bool append_entry(struct dir* dir, const struct dir_entry* e, const char* name, size_t* ofs)
+{
+    char buff[2 * ENTRY_SIZE(NAME_MAX)];
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        /* Entry which does not fit in last block starts the next one */
+        size_t length = inode_length(dir->inode);
+        size_t block_left = INODE_BLOCK_SIZE - length % INODE_BLOCK_SIZE;
+        size_t pad = e->rec_len > block_left ? block_left : 0;
+        size_t size = pad + e->rec_len;
+        if (!inode_grow(dir->inode, length, length + size))
+            continue;
+        memset(buff, 0, size);
+        memcpy(buff + pad, e, sizeof *e);
+        memcpy(buff + pad + sizeof *e, name, e->name_len);
+        *ofs = length + pad;
+        return inode_write_at(dir->inode, buff, size, length, false) == size;
+    }
+    return false;
+}
+
 bool dir_add(struct dir* dir, const char* name, int inode_id)
 {
     struct dir_entry e;
-    size_t ofs;
+    struct index_bucket bucket;
+    struct index_record record;
+    size_t name_len = strlen(name);
     bool success = false;
 
     assert(dir != NULL);
     assert(name != NULL);
-    if (*name == '\0' || strlen(name) > NAME_MAX) {
-        return false;
-    }
-    if (lookup(dir, name, NULL, NULL)) {
+    if (*name == '\0' || name_len > NAME_MAX) {
         return false;
     }
 
-    memcpy(e.name, name, strlen(name) + 1);
+    pthread_mutex_lock(dir_lock(dir->inode->id));
+    lease_break(dir->inode->id);
+    if (!load_bucket(&bucket, dir->inode->id, name) || find_record(&bucket, name, &record) >= 0)
+        goto done;
+
     e.inode_id = inode_id;
-    e.is_deleted = false;
-    return inode_write_at(dir->inode, &e, sizeof e, inode_length(dir->inode), false) == sizeof e;
+    e.rec_len = ENTRY_SIZE(name_len);
+    e.name_len = name_len;
+    e.flags = 0;
+    e.hash = name_hash(name, name_len);
+
+    size_t ofs;
+    struct free_slot slot;
+    struct dir_entry old;
+    bool reused = false;
+    while (!reused && reuse_slot(dir->inode, ENTRY_SIZE(name_len), &slot, &old)) {
+        e.rec_len = ENTRY_SIZE(name_len);
+        reused = fill_slot(dir, &e, name, &slot, &old);
+        ofs = slot.offset;
+    }
+    if (!reused) {
+        e.rec_len = ENTRY_SIZE(name_len);
+        if (!append_entry(dir, &e, name, &ofs))
+            goto done;
+    }
+
+    /* Index decides which mount added the name when more of them tried */
+    record.offset = ofs;
+    record.inode_id = inode_id;
+    record.name_len = name_len;
+    if (!index_insert(&bucket, dir->inode->id, name, &record)) {
+        struct dir_entry added = e;
+        e.flags = ENTRY_DELETED;
+        if (inode_replace_at(dir->inode, &e, sizeof e, record.offset, &added, sizeof added))
+            add_free_slot(dir->inode->id, record.offset, e.rec_len, inode_length(dir->inode));
+        goto done;
+    }
+    success = true;
+
+done:
+    pthread_mutex_unlock(dir_lock(dir->inode->id));
+    return success;
+}
+
+/*
+ * Finds live entry of NAME through the index, checks that index points
+ * to it. Must be called with directory lock held
+ */
+static bool find_entry(const struct dir* dir, const char* name, struct index_bucket* bucket,
+    struct index_record* record, ssize_t* pos, struct dir_entry* e)
+{
+    char buff[ENTRY_SIZE(NAME_MAX)];
+    if (!load_bucket(bucket, dir->inode->id, name) || (*pos = find_record(bucket, name, record)) < 0)
+        return false;
+
+    size_t size = sizeof(struct dir_entry) + record->name_len;
+    /* Entry may be added by other mount past the end known here */
+    if (record->offset + size > inode_length(dir->inode))
+        inode_refresh(dir->inode);
+    if (inode_read_at(dir->inode, buff, size, record->offset, false) != (ssize_t)size)
+        return false;
+    memcpy(e, buff, sizeof(struct dir_entry));
+    return !(e->flags & ENTRY_DELETED) && e->name_len == record->name_len
+        && e->hash == name_hash(name, record->name_len)
+        && memcmp(buff + sizeof(struct dir_entry), name, record->name_len) == 0;
+}
+
+/*
+ * Turns entry found by find_entry into tombstone and drops it from index
+ */
+static bool delete_entry(struct dir* dir, const char* name, struct index_bucket* bucket,
+    const struct index_record* record, struct dir_entry* e)
+{
+    dentry_drop(dir->inode->id, name);
+    /* Only one of mounts removing the name at once succeeds */
+    struct dir_entry live = *e;
+    e->flags |= ENTRY_DELETED;
+    if (!inode_replace_at(dir->inode, e, sizeof(struct dir_entry), record->offset, &live, sizeof live))
+        return false;
+    if (!index_remove(bucket, dir->inode->id, name, record->offset))
+        return false;
+    add_free_slot(dir->inode->id, record->offset, e->rec_len, inode_length(dir->inode));
+    return true;
 }
 
 bool dir_remove(struct dir* dir, const char* name)
 {
     struct dir_entry e;
+    struct index_bucket bucket;
+    struct index_record record;
     struct inode* inode = NULL;
     bool success = false;
-    size_t ofs;
+    ssize_t pos;
 
     assert(dir != NULL);
     assert(name != NULL);
 
-    if (!lookup(dir, name, &e, &ofs))
+    pthread_mutex_lock(dir_lock(dir->inode->id));
+    lease_break(dir->inode->id);
+    if (!find_entry(dir, name, &bucket, &record, &pos, &e))
         goto done;
 
-    inode = inode_open(e.inode_id);
+    inode = inode_open(record.inode_id);
     if (inode == NULL)
         goto done;
-    e.is_deleted = true;
-    if (inode_write_at(dir->inode, &e, sizeof e, ofs, false) != sizeof e)
+    if (!delete_entry(dir, name, &bucket, &record, &e))
         goto done;
 
-    inode_remove(inode);
+    dir_discard(inode);
     success = true;
 
 done:
+    pthread_mutex_unlock(dir_lock(dir->inode->id));
     inode_close(inode);
     return success;
 }
 
+void dir_discard(struct inode* inode)
+{
+    if (inode_is_dir(inode)) {
+        unindex(inode->id, ".");
+        unindex(inode->id, "..");
+        forget_free_slots(inode->id);
+    }
+    inode_remove(inode);
+}
+
+bool dir_unlink(struct dir* dir, const char* name)
+{
+    struct dir_entry e;
+    struct index_bucket bucket;
+    struct index_record record;
+    ssize_t pos;
+
+    assert(dir != NULL);
+    assert(name != NULL);
+
+    pthread_mutex_lock(dir_lock(dir->inode->id));
+    lease_break(dir->inode->id);
+    bool success = find_entry(dir, name, &bucket, &record, &pos, &e)
+        && delete_entry(dir, name, &bucket, &record, &e);
+    pthread_mutex_unlock(dir_lock(dir->inode->id));
+    return success;
+}
+
+bool dir_set(struct dir* dir, const char* name, int inode_id)
+{
+    struct dir_entry e;
+    struct index_bucket bucket;
+    struct index_record record;
+    ssize_t pos;
+    bool success = false;
+
+    assert(dir != NULL);
+    assert(name != NULL);
+
+    pthread_mutex_lock(dir_lock(dir->inode->id));
+    lease_break(dir->inode->id);
+    if (!find_entry(dir, name, &bucket, &record, &pos, &e))
+        goto done;
+
+    struct dir_entry live = e;
+    e.inode_id = inode_id;
+    if (!inode_replace_at(dir->inode, &e, sizeof e, record.offset, &live, sizeof live))
+        goto done;
+    dentry_drop(dir->inode->id, name);
+    success = index_update(&bucket, dir->inode->id, name, record.offset, inode_id, record.offset);
+
+done:
+    pthread_mutex_unlock(dir_lock(dir->inode->id));
+    return success;
+}
+
+/*
+ * Makes sure SIZE bytes at current position of DIR are buffered. Buffer
+ * is refilled with DIR_READ_SIZE bytes starting at block of position
+ */
+static bool fill_buffer(struct dir* dir, size_t size)
+{
+    if (dir->pos >= dir->buff_pos && dir->pos + size <= dir->buff_pos + dir->buff_len)
+        return true;
+    if (dir->buff == NULL && (dir->buff = malloc(DIR_READ_SIZE)) == NULL)
+        return false;
+    dir->buff_pos = dir->pos - dir->pos % INODE_BLOCK_SIZE;
+    ssize_t read = inode_read_at(dir->inode, dir->buff, DIR_READ_SIZE, dir->buff_pos, false);
+    dir->buff_len = read > 0 ? read : 0;
+    return dir->pos + size <= dir->buff_pos + dir->buff_len;
+}
+
+/*
+ * Reads entry at current position of DIR, including deleted ones,
+ * and moves position after it
+ */
+static bool read_entry(struct dir* dir, struct dir_entry* entry, char name[NAME_MAX + 1],
+    size_t* offset)
+{
+    while (true) {
+        size_t block_left = INODE_BLOCK_SIZE - dir->pos % INODE_BLOCK_SIZE;
+        if (block_left < sizeof(struct dir_entry)) {
+            dir->pos += block_left;
+            continue;
+        }
+        if (!fill_buffer(dir, sizeof(struct dir_entry)))
+            return false;
+        memcpy(entry, dir->buff + dir->pos - dir->buff_pos, sizeof(struct dir_entry));
+        if (!valid_entry(entry, block_left)) {
+            dir->pos += block_left;
+            continue;
+        }
+        if (!fill_buffer(dir, entry->rec_len))
+            return false;
+        memcpy(name, dir->buff + dir->pos - dir->buff_pos + sizeof(struct dir_entry), entry->name_len);
+        name[entry->name_len] = '\0';
+        *offset = dir->pos;
+        dir->pos += entry->rec_len;
+        return true;
+    }
+}
+
+size_t dir_tell(struct dir* dir)
+{
+    return dir->pos;
+}
+
+void dir_seek(struct dir* dir, size_t pos)
+{
+    dir->pos = pos;
+}
+
 bool dir_readdir(struct dir* dir, char name[NAME_MAX + 1])
 {
-    struct dir_entry entry;
+    int inode_id;
+    return dir_readdir_inode(dir, name, &inode_id);
+}
 
-    if (dir->pos < 2 * sizeof(struct dir_entry))
-        dir->pos = 2 * sizeof(struct dir_entry);
+bool dir_readdir_inode(struct dir* dir, char name[NAME_MAX + 1], int* inode_id)
+{
+    struct dir_entry entry;
+    size_t offset;
 
-    while (inode_read_at(dir->inode, &entry, sizeof entry, dir->pos, false) == sizeof entry) {
-        dir->pos += sizeof entry;
-        if (!entry.is_deleted) {
-            memcpy(name, entry.name, NAME_MAX + 1);
+    while (read_entry(dir, &entry, name, &offset)) {
+        if (entry.flags & ENTRY_DELETED) {
+            add_free_slot(dir->inode->id, offset, entry.rec_len, inode_length(dir->inode));
+        } else if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            *inode_id = entry.inode_id;
             return true;
         }
     }
@@ -181,3 +1159,253 @@ bool dir_is_empty(struct dir* dir)
     }
     return cnt == 0;
 }
+
+bool dir_list_keys(int dir_id, key_visitor visit, void* aux)
+{
+    struct inode* inode = inode_open(dir_id);
+    if (inode == NULL)
+        return true;
+    if (!inode_is_dir(inode)) {
+        /* Removed and id reused since caller looked at it */
+        inode_close(inode);
+        return true;
+    }
+    struct dir* dir = dir_open(inode);
+    if (dir == NULL)
+        return false;
+
+    struct dir_entry entry;
+    char name[NAME_MAX + 1];
+    char key[MEMCACHE_KEY_MAX + 1];
+    size_t offset;
+    while (read_entry(dir, &entry, name, &offset)) {
+        if (entry.flags & ENTRY_DELETED)
+            continue;
+        get_bucket_key(key, dir_id, name);
+        visit(key, true, aux);
+    }
+    bool res = dir->pos >= inode_length(inode);
+    dir_close(dir);
+    return res;
+}
+
+/**
+ * Live entry of directory read by check
+ */
+struct checked_entry {
+    uint64_t bucket;
+    uint64_t offset;
+    int32_t inode_id;
+    bool duplicate; // Other entry with the same name is the indexed one
+    char name[NAME_MAX + 1];
+};
+
+static int compare_checked(const void* a, const void* b)
+{
+    const struct checked_entry* x = a;
+    const struct checked_entry* y = b;
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket ? -1 : 1;
+    int res = strcmp(x->name, y->name);
+    if (res != 0)
+        return res;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Reads every live entry of directory, entries are sorted so that
+ * names of one bucket follow each other. Must be called with
+ * directory lock held
+ */
+static bool read_live_entries(struct dir* dir, struct checked_entry** entries, size_t* cnt)
+{
+    struct dir_entry entry;
+    char name[NAME_MAX + 1];
+    size_t offset;
+    size_t cap = 0;
+
+    *entries = NULL;
+    *cnt = 0;
+    dir->pos = 0;
+    while (read_entry(dir, &entry, name, &offset)) {
+        if (entry.flags & ENTRY_DELETED)
+            continue;
+        if (*cnt == cap) {
+            cap = cap == 0 ? 64 : 2 * cap;
+            struct checked_entry* grown = realloc(*entries, cap * sizeof(struct checked_entry));
+            if (grown == NULL)
+                return false;
+            *entries = grown;
+        }
+        struct checked_entry* checked = &(*entries)[(*cnt)++];
+        checked->bucket = name_bucket(name);
+        checked->offset = offset;
+        checked->inode_id = entry.inode_id;
+        checked->duplicate = false;
+        strcpy(checked->name, name);
+    }
+    if (dir->pos < inode_length(dir->inode))
+        return false;
+    qsort(*entries, *cnt, sizeof(struct checked_entry), compare_checked);
+    return true;
+}
+
+/*
+ * Compares records of bucket with CNT live entries which hash to it and
+ * marks duplicate names. With REPAIR value of bucket is rebuilt from
+ * entries when they don't match. Returns number of problems found
+ */
+static size_t check_bucket(struct index_bucket* bucket, struct checked_entry* entries,
+    size_t cnt, bool repair)
+{
+    size_t problems = 0;
+    struct index_record record;
+
+    /* Entry which index points to is kept, other entries of the name are duplicates */
+    for (size_t first = 0, end; first < cnt; first = end) {
+        for (end = first + 1; end < cnt && strcmp(entries[end].name, entries[first].name) == 0; end++)
+            ;
+        size_t kept = first;
+        bool indexed = find_record(bucket, entries[first].name, &record) >= 0;
+        for (size_t i = first; indexed && i < end; i++) {
+            if (entries[i].offset == record.offset)
+                kept = i;
+        }
+        if (!indexed || record.offset != entries[kept].offset || record.inode_id != entries[kept].inode_id)
+            problems++;
+        for (size_t i = first; i < end; i++) {
+            entries[i].duplicate = i != kept;
+            problems += entries[i].duplicate;
+        }
+    }
+
+    /* Records of names which have no live entry */
+    for (size_t pos = 0; pos + sizeof(struct index_record) <= bucket->size;) {
+        memcpy(&record, bucket->value + pos, sizeof record);
+        const char* name = bucket->value + pos + sizeof record;
+        bool live = false;
+        for (size_t i = 0; i < cnt && !live; i++) {
+            live = strlen(entries[i].name) == record.name_len
+                && memcmp(entries[i].name, name, record.name_len) == 0;
+        }
+        problems += !live;
+        pos += sizeof record + record.name_len;
+    }
+
+    if (!repair || problems == 0)
+        return problems;
+    size_t size = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        if (entries[i].duplicate)
+            continue;
+        record.offset = entries[i].offset;
+        record.inode_id = entries[i].inode_id;
+        record.name_len = strlen(entries[i].name);
+        if (size + sizeof record + record.name_len > INDEX_VALUE_MAX)
+            break;
+        memcpy(bucket->value + size, &record, sizeof record);
+        memcpy(bucket->value + size + sizeof record, entries[i].name, record.name_len);
+        size += sizeof record + record.name_len;
+    }
+    bucket->size = size;
+    return problems;
+}
+
+/*
+ * Turns live entry which index doesn't point to into tombstone
+ */
+static bool drop_duplicate(struct dir* dir, const struct checked_entry* checked)
+{
+    struct dir_entry e;
+    if (inode_read_at(dir->inode, &e, sizeof e, checked->offset, false) != sizeof e)
+        return false;
+    struct dir_entry live = e;
+    e.flags |= ENTRY_DELETED;
+    if (!inode_replace_at(dir->inode, &e, sizeof e, checked->offset, &live, sizeof live))
+        return false;
+    add_free_slot(dir->inode->id, checked->offset, e.rec_len, inode_length(dir->inode));
+    return true;
+}
+
+/*
+ * Checks index buckets of entries FIRST..END (whole buckets), they are
+ * loaded and stored with one pipelined request each
+ */
+static bool check_buckets(struct dir* dir, struct checked_entry* entries, size_t first,
+    size_t end, bool repair, size_t* problems)
+{
+    size_t bucket_cnt = 0;
+    for (size_t i = first; i < end; i++)
+        bucket_cnt += i == first || entries[i].bucket != entries[i - 1].bucket;
+    struct index_bucket* buckets = malloc(bucket_cnt * sizeof(struct index_bucket));
+    struct memcache_item* items = calloc(bucket_cnt, sizeof(struct memcache_item));
+    bool res = buckets != NULL && items != NULL;
+
+    for (size_t i = first, j = 0; res && i < end; i++) {
+        if (i != first && entries[i].bucket == entries[i - 1].bucket)
+            continue;
+        get_bucket_key(buckets[j].key, dir->inode->id, entries[i].name);
+        strcpy(items[j].key, buckets[j].key);
+        items[j].buff = buckets[j].value;
+        items[j].size = INDEX_VALUE_MAX;
+        j++;
+    }
+    res = res && memcache_gets_multi(memcache, items, bucket_cnt);
+
+    size_t changed = 0;
+    for (size_t i = first, j = 0, next; res && i < end; i = next, j++) {
+        for (next = i + 1; next < end && entries[next].bucket == entries[i].bucket; next++)
+            ;
+        buckets[j].size = items[j].found ? items[j].size : 0;
+        buckets[j].cas = items[j].found ? items[j].cas : 0;
+        size_t found = check_bucket(&buckets[j], entries + i, next - i, repair);
+        *problems += found;
+        if (!repair || found == 0 || (buckets[j].size == 0 && buckets[j].cas == 0))
+            continue;
+        strcpy(items[changed].key, buckets[j].key);
+        items[changed].buff = buckets[j].value;
+        items[changed].size = buckets[j].size;
+        items[changed].cas = buckets[j].cas;
+        items[changed].exptime = 0;
+        changed++;
+    }
+    res = res && memcache_cas_multi(memcache, items, changed);
+    for (size_t j = 0; res && j < changed; j++)
+        res = items[j].found;
+
+    for (size_t i = first; res && repair && i < end; i++) {
+        if (entries[i].duplicate)
+            res = drop_duplicate(dir, &entries[i]);
+    }
+    free(items);
+    free(buckets);
+    return res;
+}
+
+bool dir_check(struct dir* dir, bool repair, size_t* problems, dir_entry_visitor visit, void* aux)
+{
+    struct checked_entry* entries;
+    size_t cnt;
+
+    assert(dir != NULL);
+    *problems = 0;
+    pthread_mutex_lock(dir_lock(dir->inode->id));
+    bool res = read_live_entries(dir, &entries, &cnt);
+
+    /* Buckets go in batches, batch never splits one bucket */
+    for (size_t first = 0, end = 0, batch = 0; res && first < cnt; first = end, batch = 0) {
+        while (end < cnt && (batch < CHECK_BATCH || entries[end].bucket == entries[end - 1].bucket)) {
+            batch += end == first || entries[end].bucket != entries[end - 1].bucket;
+            end++;
+        }
+        res = check_buckets(dir, entries, first, end, repair, problems);
+    }
+    pthread_mutex_unlock(dir_lock(dir->inode->id));
+
+    for (size_t i = 0; res && i < cnt; i++) {
+        if (!entries[i].duplicate)
+            visit(entries[i].name, entries[i].inode_id, aux);
+    }
+    free(entries);
+    return res;
+}
@@ -6,12 +6,15 @@
 #define FUSE_USE_VERSION 31
 
 #include "inode.h"
+#include "keys.h"
 #include <stdbool.h>
 #include <stddef.h>
 
-#define NAME_MAX 23
+#define NAME_MAX 255
 #define ROOT_INODE_ID 0
 
+void init_directories(struct memcache_t* mem, bool compact);
+
 bool dir_create(int inode_id, __gid_t gid, __uid_t uid, __mode_t mode);
 
 struct dir* dir_open(struct inode* inode);
@@ -22,10 +25,27 @@ struct inode* dir_get_inode(struct dir* dir);
 struct inode* inode_from_path(const char* path);
 
 bool dir_lookup(const struct dir*, const char* name, struct inode**);
+bool dir_lookup_id(const struct dir*, const char* name, int* inode_id);
 bool dir_add(struct dir*, const char* name, int inode_id);
 bool dir_remove(struct dir*, const char* name);
+bool dir_unlink(struct dir*, const char* name);
+bool dir_set(struct dir*, const char* name, int inode_id);
+void dir_discard(struct inode* inode);
 bool dir_readdir(struct dir*, char name[NAME_MAX + 1]);
+bool dir_readdir_inode(struct dir*, char name[NAME_MAX + 1], int* inode_id);
 bool dir_is_empty(struct dir* dir);
+size_t dir_tell(struct dir* dir);
+void dir_seek(struct dir* dir, size_t pos);
+void dir_forget_cached();
+
+/* Reports index buckets of names in directory, missing directory has none */
+bool dir_list_keys(int dir_id, key_visitor visit, void* aux);
+
+/* Reports live entries including "." and "..", index records which don't match
+   entries are counted in PROBLEMS and rebuilt with REPAIR. Buckets of names
+   which have no entry left are not found */
+typedef void (*dir_entry_visitor)(const char* name, int inode_id, void* aux);
+bool dir_check(struct dir* dir, bool repair, size_t* problems, dir_entry_visitor visit, void* aux);
 
 void dir_close(struct dir* dir);
 
@@ -0,0 +1,40 @@
+/*
+ * Copies file system stored in Memcached to local file, it can be
+ * loaded back with cachefs-restore after Memcached restarts. File
+ * system may stay mounted, snapshot then holds state of the moment
+ * each record was read.
+ *
+ * Usage : ./cachefs-dump <file>
+ */
+
+#include "directory.h"
+#include "inode.h"
+#include "lease.h"
+#include "memcache.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct memcache_t* memcache = memcache_init();
+    if (memcache == NULL) {
+        fprintf(stderr, "cachefs-dump: can't connect to memcached\n");
+        return EXIT_FAILURE;
+    }
+    init_inodes(memcache, getgid(), getuid());
+    init_leases(memcache, 0);
+    init_directories(memcache, false);
+
+    bool res = snapshot_dump(memcache, argv[1]);
+    if (!res)
+        fprintf(stderr, "cachefs-dump: can't write snapshot %s\n", argv[1]);
+    memcache_close(memcache);
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
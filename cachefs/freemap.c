@@ -1,13 +1,67 @@
 #include "freemap.h"
 
+#include "super.h"
 #include "utils.h"
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#define FREEMAP_BLOCK_SIZE 1024
+#include <time.h>
+#include <unistd.h>
 
-struct memcache_t* memcache;
-int current_block;
-int number_of_blocks;
+#define FREEMAP_ITEM_BITS 8192 // Inodes covered by one stored item
+#define WORD_BITS 64
+#define ITEM_WORDS (FREEMAP_ITEM_BITS / WORD_BITS)
+#define FLUSH_INTERVAL 1 // Seconds between flushes of changed items
+#define POOL_SIZE 32 // Inode ids reserved by thread at once
+#define POOL_IDLE_TIMEOUT 5 // Seconds after which unused ids of thread are returned
+#define MAX_INODE_CNT ((size_t)INT32_MAX / FREEMAP_ITEM_BITS * FREEMAP_ITEM_BITS)
+#define TIME_MAX ((time_t)(~0ULL >> 1))
+#define CAS_RETRIES 16 // Attempts of read-modify-write before giving up
+
+static struct memcache_t* memcache;
+
+/* Bit of every inode is set while inode is in use */
+static uint64_t* bitmap;
+static size_t word_cnt;
+static size_t inode_cnt;
+static size_t next_word; // Search for free inode starts here
+static size_t used_cnt; // Inodes handed out, ids waiting in pools aren't counted
+
+/* Items changed since last flush */
+static bool* dirty;
+static size_t item_cnt;
+
+/* Items being stored, each item is stored by one thread at a time */
+static bool* syncing;
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+
+/* Map as last read from or written to memcache, and uniques of its items */
+static uint64_t* stored;
+static uint64_t* uniques;
+
+/**
+ * Inode ids reserved by one thread, they are marked used in bitmap
+ */
+struct inode_pool {
+    int ids[POOL_SIZE];
+    int pos; // Next id to hand out
+    int cnt;
+    time_t last_used;
+    pthread_mutex_t lock; // Taken by owner and by reclaim of idle pools
+    struct inode_pool* next;
+};
+
+static __thread struct inode_pool* thread_pool;
+static struct inode_pool* pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t freemap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool flusher_started;
 
 static void
 get_key(char* key, int ind)
@@ -15,68 +69,590 @@ get_key(char* key, int ind)
     sprintf(key, "FREEMAP#%d", ind);
 }
 
-bool init_freemap(struct memcache_t* mem, size_t inode_cnt)
+static size_t item_words(size_t item)
 {
-    assert(inode_cnt % FREEMAP_BLOCK_SIZE == 0);
-    number_of_blocks = inode_cnt / FREEMAP_BLOCK_SIZE;
-    bool success = true;
-    memcache = mem;
-    current_block = 0;
-    for (int i = 0; i < number_of_blocks; i++) {
-        char key[30];
-        get_key(key, i);
-        char value[FREEMAP_BLOCK_SIZE];
-        memset(value, 0, FREEMAP_BLOCK_SIZE);
-        if (!memcache_add(memcache, key, value, FREEMAP_BLOCK_SIZE))
-            success = false;
+    size_t rest = word_cnt - item * ITEM_WORDS;
+    return rest < ITEM_WORDS ? rest : ITEM_WORDS;
+}
+
+/*
+ * Marks up to CNT free inodes used and writes their ids to IDS.
+ * Returns number of found inodes, size of searched map is written to SEEN
+ */
+static int pick(int* ids, int cnt, size_t* seen)
+{
+    int found = 0;
+    pthread_mutex_lock(&freemap_lock);
+    *seen = inode_cnt;
+    for (size_t i = 0; i < word_cnt && found < cnt; i++) {
+        size_t word = (next_word + i) % word_cnt;
+        while (~bitmap[word] != 0 && found < cnt) {
+            int bit = __builtin_ctzll(~bitmap[word]);
+            bitmap[word] |= 1ULL << bit;
+            dirty[word / ITEM_WORDS] = true;
+            ids[found++] = word * WORD_BITS + bit;
+        }
+        next_word = word;
     }
-    if (success)
-        return true;
+    pthread_mutex_unlock(&freemap_lock);
+    return found;
+}
 
-    for (int i = 0; i < number_of_blocks; i++) {
-        char key[30];
-        get_key(key, i);
-        if (!memcache_delete(memcache, key))
-            break;
+static void release(const int* ids, int cnt)
+{
+    pthread_mutex_lock(&freemap_lock);
+    for (int i = 0; i < cnt; i++) {
+        size_t word = ids[i] / WORD_BITS;
+        bitmap[word] &= ~(1ULL << (ids[i] % WORD_BITS));
+        dirty[ids[i] / FREEMAP_ITEM_BITS] = true;
+        /* Freed ids are reused first so that used ids stay dense */
+        if (word < next_word)
+            next_word = word;
+    }
+    pthread_mutex_unlock(&freemap_lock);
+}
+
+/* Bits of word which belong to existing inodes */
+static uint64_t live_mask(size_t word)
+{
+    if (word == word_cnt - 1 && inode_cnt % WORD_BITS != 0)
+        return ~(~0ULL << (inode_cnt % WORD_BITS));
+    return ~0ULL;
+}
+
+/*
+ * Applies changes made since item was stored to version THEIRS which
+ * other mount stored meanwhile. Bits set here which the other mount set
+ * too are added to LOST. Must be called with freemap_lock held
+ */
+static void merge_item(size_t item, const uint64_t* theirs, uint64_t* lost)
+{
+    for (size_t w = 0; w < item_words(item); w++) {
+        size_t word = item * ITEM_WORDS + w;
+        uint64_t mask = live_mask(word);
+        uint64_t set = bitmap[word] & ~stored[word] & mask;
+        uint64_t cleared = stored[word] & ~bitmap[word] & mask;
+        if (lost != NULL)
+            lost[w] |= set & theirs[w];
+        bitmap[word] = (((theirs[w] & ~cleared) | set) & mask) | (bitmap[word] & ~mask);
+        stored[word] = theirs[w];
+    }
+}
+
+/* Must be called with freemap_lock held */
+static bool any_syncing(const size_t* indexes, size_t cnt)
+{
+    for (size_t j = 0; j < cnt; j++) {
+        if (syncing[indexes[j]])
+            return true;
     }
     return false;
 }
 
-int get_free_inode()
+/* Waits until no other thread stores given items and marks them taken */
+static void begin_sync(const size_t* indexes, size_t cnt)
 {
-    int start = current_block;
-    while (true) {
-        char key[30];
-        get_key(key, current_block);
-        char value[FREEMAP_BLOCK_SIZE];
-        if (!memcache_get(memcache, key, value))
-            return -1;
+    pthread_mutex_lock(&freemap_lock);
+    while (any_syncing(indexes, cnt))
+        pthread_cond_wait(&synced_cond, &freemap_lock);
+    for (size_t j = 0; j < cnt; j++)
+        syncing[indexes[j]] = true;
+    pthread_mutex_unlock(&freemap_lock);
+}
+
+static void end_sync(const size_t* indexes, size_t cnt)
+{
+    pthread_mutex_lock(&freemap_lock);
+    for (size_t j = 0; j < cnt; j++)
+        syncing[indexes[j]] = false;
+    pthread_cond_broadcast(&synced_cond);
+    pthread_mutex_unlock(&freemap_lock);
+}
+
+/*
+ * Stores items with gets/cas, items which other mounts changed meanwhile
+ * are merged with their version and stored again. With LOST (one ITEM_WORDS
+ * array per item) bits which other mounts took too are reported. Threads
+ * storing the same item wait for each other, others run in parallel
+ */
+static bool sync_items(const size_t* indexes, size_t cnt, uint64_t* lost)
+{
+    begin_sync(indexes, cnt);
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    uint64_t* values = malloc(cnt * ITEM_WORDS * sizeof(uint64_t));
+    size_t* pending = malloc(cnt * sizeof(size_t));
+    bool success = items != NULL && values != NULL && pending != NULL;
+    size_t pending_cnt = success ? cnt : 0;
+    for (size_t j = 0; j < pending_cnt; j++)
+        pending[j] = j;
+
+    for (int attempt = 0; success && pending_cnt > 0 && attempt < CAS_RETRIES; attempt++) {
+        /* Bits past the last inode are stored as they were read */
+        pthread_mutex_lock(&freemap_lock);
+        for (size_t k = 0; k < pending_cnt; k++) {
+            size_t j = pending[k], i = indexes[j];
+            uint64_t* value = values + j * ITEM_WORDS;
+            for (size_t w = 0; w < item_words(i); w++) {
+                size_t word = i * ITEM_WORDS + w;
+                value[w] = (bitmap[word] & live_mask(word)) | (stored[word] & ~live_mask(word));
+            }
+            get_key(items[k].key, i);
+            items[k].buff = value;
+            items[k].size = item_words(i) * sizeof(uint64_t);
+            items[k].exptime = 0;
+            items[k].cas = uniques[i];
+            dirty[i] = false;
+        }
+        pthread_mutex_unlock(&freemap_lock);
+        success = memcache_cas_gets_multi(memcache, items, pending_cnt);
+
+        size_t conflict_cnt = 0;
+        pthread_mutex_lock(&freemap_lock);
+        for (size_t k = 0; success && k < pending_cnt; k++) {
+            size_t j = pending[k], i = indexes[j];
+            if (items[k].found) {
+                memcpy(stored + i * ITEM_WORDS, values + j * ITEM_WORDS, items[k].size);
+                uniques[i] = items[k].cas;
+            } else {
+                items[conflict_cnt] = items[k];
+                items[conflict_cnt].size = item_words(i) * sizeof(uint64_t);
+                pending[conflict_cnt++] = j;
+            }
+        }
+        pthread_mutex_unlock(&freemap_lock);
+        pending_cnt = success ? conflict_cnt : pending_cnt;
 
-        for (int i = 0; i < FREEMAP_BLOCK_SIZE; i++) {
-            if (value[i] == 0) {
-                value[i] = 1;
-                if (!memcache_add(memcache, key, value, FREEMAP_BLOCK_SIZE))
-                    return -1;
-                return current_block * FREEMAP_BLOCK_SIZE + i;
+        /* Other mounts changed the rest, their versions are merged in */
+        success = success && memcache_gets_multi(memcache, items, pending_cnt);
+        pthread_mutex_lock(&freemap_lock);
+        for (size_t k = 0; success && k < pending_cnt; k++) {
+            size_t j = pending[k], i = indexes[j];
+            success = items[k].found && items[k].size == item_words(i) * sizeof(uint64_t);
+            if (success) {
+                merge_item(i, values + j * ITEM_WORDS, lost != NULL ? lost + j * ITEM_WORDS : NULL);
+                uniques[i] = items[k].cas;
             }
         }
+        pthread_mutex_unlock(&freemap_lock);
+    }
+
+    /* Items which weren't stored are retried by the next flush */
+    pthread_mutex_lock(&freemap_lock);
+    for (size_t k = 0; k < pending_cnt; k++)
+        dirty[indexes[pending[k]]] = true;
+    pthread_mutex_unlock(&freemap_lock);
+    end_sync(indexes, cnt);
+    free(pending);
+    free(values);
+    free(items);
+    return success && pending_cnt == 0;
+}
+
+/*
+ * Takes up to CNT free inodes, like pick, and claims them in memcache
+ * before they are used. Ids which other mounts claimed first aren't
+ * returned, then SEEN doesn't match size of map so that it isn't grown.
+ * Only items holding picked ids are stored, flushes aren't waited for
+ */
+static int allocate(int* ids, int cnt, size_t* seen)
+{
+    int found = pick(ids, cnt, seen);
+    int kept = 0;
+    uint64_t lost[ITEM_WORDS];
+    for (int pos = 0, end; pos < found; pos = end) {
+        size_t item = ids[pos] / FREEMAP_ITEM_BITS;
+        for (end = pos; end < found && (size_t)ids[end] / FREEMAP_ITEM_BITS == item; end++)
+            ;
+        memset(lost, 0, sizeof lost);
+        bool synced = memcache == NULL || sync_items(&item, 1, lost);
+        for (int k = pos; k < end; k++) {
+            size_t bit = ids[k] % FREEMAP_ITEM_BITS;
+            if (!synced)
+                release(&ids[k], 1);
+            else if (lost[bit / WORD_BITS] & (1ULL << (bit % WORD_BITS)))
+                *seen = SIZE_MAX;
+            else
+                ids[kept++] = ids[k];
+        }
+    }
+    return kept;
+}
+
+/*
+ * Extends inode space up to the end of next item, unless other thread
+ * already grew it past SEEN. New items are stored before superblock
+ * records new capacity, so that loading never misses a part of map.
+ * Items which other mount added already are merged with ours
+ */
+static bool grow(size_t seen)
+{
+    bool success = false;
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&freemap_lock);
+    size_t old_cnt = inode_cnt, old_words = word_cnt, old_items = item_cnt;
+    if (inode_cnt != seen) {
+        success = true;
+        goto done;
+    }
+    size_t cnt = (inode_cnt / FREEMAP_ITEM_BITS + 1) * FREEMAP_ITEM_BITS;
+    if (cnt > MAX_INODE_CNT)
+        cnt = MAX_INODE_CNT;
+    if (memcache == NULL || cnt <= inode_cnt)
+        goto done;
+
+    size_t words = (cnt + WORD_BITS - 1) / WORD_BITS;
+    size_t items = (words + ITEM_WORDS - 1) / ITEM_WORDS;
+    uint64_t* new_bitmap = realloc(bitmap, words * sizeof(uint64_t));
+    if (new_bitmap == NULL)
+        goto done;
+    bitmap = new_bitmap;
+    uint64_t* new_stored = realloc(stored, words * sizeof(uint64_t));
+    if (new_stored == NULL)
+        goto done;
+    stored = new_stored;
+    uint64_t* new_uniques = realloc(uniques, items * sizeof(uint64_t));
+    if (new_uniques == NULL)
+        goto done;
+    uniques = new_uniques;
+    bool* new_dirty = realloc(dirty, items * sizeof(bool));
+    if (new_dirty == NULL)
+        goto done;
+    dirty = new_dirty;
+    bool* new_syncing = realloc(syncing, items * sizeof(bool));
+    if (new_syncing == NULL)
+        goto done;
+    syncing = new_syncing;
+
+    uint64_t last = bitmap[old_words - 1];
+    memset(bitmap + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    memset(stored + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    memset(uniques + old_items, 0, (items - old_items) * sizeof(uint64_t));
+    memset(dirty + old_items, 0, (items - old_items) * sizeof(bool));
+    memset(syncing + old_items, 0, (items - old_items) * sizeof(bool));
+    if (old_cnt % WORD_BITS != 0)
+        bitmap[old_words - 1] &= ~(~0ULL << (old_cnt % WORD_BITS));
+    if (cnt % WORD_BITS != 0)
+        bitmap[words - 1] |= ~0ULL << (cnt % WORD_BITS);
+    inode_cnt = cnt;
+    word_cnt = words;
+    item_cnt = items;
+    pthread_mutex_unlock(&freemap_lock);
+
+    size_t* indexes = malloc((items - old_items + 1) * sizeof(size_t));
+    for (size_t i = old_items - 1; indexes != NULL && i < items; i++)
+        indexes[i - old_items + 1] = i;
+    success = indexes != NULL && sync_items(indexes, items - old_items + 1, NULL)
+        && super_set_inode_capacity(cnt);
+    free(indexes);
+
+    pthread_mutex_lock(&freemap_lock);
+    if (success) {
+        next_word = old_words - 1;
+    } else {
+        bitmap[old_words - 1] = last;
+        inode_cnt = old_cnt;
+        word_cnt = old_words;
+        item_cnt = old_items;
+        /* Stored copy of last item may be the grown one */
+        dirty[old_items - 1] = true;
+    }
+done:
+    pthread_mutex_unlock(&freemap_lock);
+    pthread_mutex_unlock(&flush_lock);
+    return success;
+}
+
+/*
+ * Returns ids which weren't handed out to the free map.
+ * Must be called with pool lock held
+ */
+static void empty_pool(struct inode_pool* pool)
+{
+    release(pool->ids + pool->pos, pool->cnt - pool->pos);
+    pool->pos = pool->cnt = 0;
+}
+
+/*
+ * Empties pools which weren't used since LIMIT
+ */
+static void reclaim_pools(time_t limit)
+{
+    pthread_mutex_lock(&pools_lock);
+    for (struct inode_pool* pool = pools; pool != NULL; pool = pool->next) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->last_used < limit)
+            empty_pool(pool);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+/* Forgets reserved ids, they aren't valid for newly set up map */
+static void drop_pools()
+{
+    pthread_mutex_lock(&pools_lock);
+    for (struct inode_pool* pool = pools; pool != NULL; pool = pool->next) {
+        pthread_mutex_lock(&pool->lock);
+        pool->pos = pool->cnt = 0;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+/* Called when thread which owns the pool exits */
+static void destroy_pool(void* aux)
+{
+    struct inode_pool* pool = aux;
+    pthread_mutex_lock(&pools_lock);
+    for (struct inode_pool** p = &pools; *p != NULL; p = &(*p)->next) {
+        if (*p == pool) {
+            *p = pool->next;
+            break;
+        }
+    }
+    pthread_mutex_lock(&pool->lock);
+    empty_pool(pool);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pools_lock);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+static void create_pool_key()
+{
+    pthread_key_create(&pool_key, destroy_pool);
+}
+
+static struct inode_pool* get_pool()
+{
+    if (thread_pool != NULL)
+        return thread_pool;
+    struct inode_pool* pool = malloc(sizeof(struct inode_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->pos = pool->cnt = 0;
+    pool->last_used = time(NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_once(&pool_key_once, create_pool_key);
+    pthread_setspecific(pool_key, pool);
+    pthread_mutex_lock(&pools_lock);
+    pool->next = pools;
+    pools = pool;
+    pthread_mutex_unlock(&pools_lock);
+    thread_pool = pool;
+    return pool;
+}
+
+static void* flush_loop(void* aux)
+{
+    (void)aux;
+    while (true) {
+        sleep(FLUSH_INTERVAL);
+        reclaim_pools(time(NULL) - POOL_IDLE_TIMEOUT);
+        freemap_flush();
+    }
+    return NULL;
+}
+
+/*
+ * Allocates bitmap for INODE_CNT inodes, inodes past the end
+ * of the last word are marked as used
+ */
+static bool setup(struct memcache_t* mem, size_t cnt)
+{
+    memcache = mem;
+    free(bitmap);
+    free(dirty);
+    free(syncing);
+    free(stored);
+    free(uniques);
+    inode_cnt = cnt;
+    word_cnt = (cnt + WORD_BITS - 1) / WORD_BITS;
+    item_cnt = (word_cnt + ITEM_WORDS - 1) / ITEM_WORDS;
+    next_word = 0;
+    bitmap = calloc(word_cnt, sizeof(uint64_t));
+    dirty = calloc(item_cnt, sizeof(bool));
+    syncing = calloc(item_cnt, sizeof(bool));
+    stored = calloc(word_cnt, sizeof(uint64_t));
+    uniques = calloc(item_cnt, sizeof(uint64_t));
+    if (bitmap == NULL || dirty == NULL || syncing == NULL || stored == NULL || uniques == NULL)
+        return false;
+    if (cnt % WORD_BITS != 0)
+        bitmap[word_cnt - 1] = stored[word_cnt - 1] = ~0ULL << (cnt % WORD_BITS);
+
+    if (!flusher_started) {
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0) {
+            pthread_detach(flusher);
+            flusher_started = true;
+        }
+    }
+    return true;
+}
+
+bool init_freemap(struct memcache_t* mem, size_t inode_cnt)
+{
+    drop_pools();
+    pthread_mutex_lock(&freemap_lock);
+    bool success = setup(mem, inode_cnt);
+    for (size_t i = 0; success && i < item_cnt; i++)
+        dirty[i] = true;
+    __atomic_store_n(&used_cnt, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&freemap_lock);
+    return success && freemap_flush();
+}
+
+bool load_freemap(struct memcache_t* mem, size_t inode_cnt)
+{
+    drop_pools();
+    pthread_mutex_lock(&freemap_lock);
+    bool success = setup(mem, inode_cnt);
+    struct memcache_item* items = success ? malloc(item_cnt * sizeof(struct memcache_item)) : NULL;
+    if (items != NULL) {
+        for (size_t i = 0; i < item_cnt; i++) {
+            get_key(items[i].key, i);
+            items[i].buff = bitmap + i * ITEM_WORDS;
+            items[i].size = item_words(i) * sizeof(uint64_t);
+        }
+        success = memcache_gets_multi(memcache, items, item_cnt);
+        for (size_t i = 0; success && i < item_cnt; i++) {
+            success = items[i].found;
+            uniques[i] = items[i].cas;
+        }
+        if (success)
+            memcpy(stored, bitmap, word_cnt * sizeof(uint64_t));
+    }
+    size_t used = 0;
+    for (size_t i = 0; success && i < word_cnt; i++)
+        used += __builtin_popcountll(bitmap[i]);
+    /* Bits past the last inode are always set */
+    if (success && inode_cnt % WORD_BITS != 0)
+        used -= WORD_BITS - inode_cnt % WORD_BITS;
+    __atomic_store_n(&used_cnt, used, __ATOMIC_RELAXED);
+    free(items);
+    pthread_mutex_unlock(&freemap_lock);
+    return success && items != NULL;
+}
+
+bool freemap_flush()
+{
+    /* Flushes are serialized so older copy never overwrites newer one */
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&freemap_lock);
+    size_t cnt = 0;
+    for (size_t i = 0; memcache != NULL && i < item_cnt; i++)
+        cnt += dirty[i];
+    size_t* indexes = cnt > 0 ? malloc(cnt * sizeof(size_t)) : NULL;
+    for (size_t i = 0, j = 0; indexes != NULL && i < item_cnt; i++) {
+        if (dirty[i])
+            indexes[j++] = i;
+    }
+    pthread_mutex_unlock(&freemap_lock);
+
+    bool success = cnt == 0 || (indexes != NULL && sync_items(indexes, cnt, NULL));
+    free(indexes);
+    pthread_mutex_unlock(&flush_lock);
+    return success;
+}
+
+void close_freemap()
+{
+    reclaim_pools(TIME_MAX);
+    freemap_flush();
+    pthread_mutex_lock(&flush_lock);
+    memcache = NULL;
+    pthread_mutex_unlock(&flush_lock);
+}
 
-        current_block = (current_block + 1) % number_of_blocks;
-        if (current_block == start)
+/* Takes one id from map, grows the map if it's full */
+static int allocate_one()
+{
+    int id;
+    size_t seen;
+    while (allocate(&id, 1, &seen) != 1) {
+        if (!grow(seen))
             return -1;
     }
+    __atomic_add_fetch(&used_cnt, 1, __ATOMIC_RELAXED);
+    return id;
+}
+
+int get_free_inode()
+{
+    int id;
+    struct inode_pool* pool = get_pool();
+    if (pool == NULL)
+        return allocate_one();
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->pos == pool->cnt) {
+        pool->pos = 0;
+        size_t seen;
+        pool->cnt = allocate(pool->ids, POOL_SIZE, &seen);
+    }
+    if (pool->pos == pool->cnt) {
+        /* Last free inodes may wait in pools of other threads */
+        pthread_mutex_unlock(&pool->lock);
+        reclaim_pools(TIME_MAX);
+        return allocate_one();
+    }
+    id = pool->ids[pool->pos++];
+    pool->last_used = time(NULL);
+    pthread_mutex_unlock(&pool->lock);
+    __atomic_add_fetch(&used_cnt, 1, __ATOMIC_RELAXED);
+    return id;
 }
 
 bool free_inode(int inode)
 {
-    char key[30];
-    get_key(key, inode / FREEMAP_BLOCK_SIZE);
-    char value[FREEMAP_BLOCK_SIZE];
+    if (inode < 0 || (size_t)inode >= inode_cnt)
+        return false;
+    release(&inode, 1);
+    __atomic_sub_fetch(&used_cnt, 1, __ATOMIC_RELAXED);
+    return true;
+}
 
-    if (!memcache_get(memcache, key, value))
+bool freemap_is_used(int inode)
+{
+    if (inode < 0 || (size_t)inode >= inode_cnt)
         return false;
+    pthread_mutex_lock(&freemap_lock);
+    bool used = bitmap[inode / WORD_BITS] & (1ULL << (inode % WORD_BITS));
+    pthread_mutex_unlock(&freemap_lock);
+    return used;
+}
 
-    value[inode % FREEMAP_BLOCK_SIZE] = 0;
+bool freemap_claim(int inode)
+{
+    if (inode < 0 || (size_t)inode >= inode_cnt)
+        return false;
+    pthread_mutex_lock(&freemap_lock);
+    uint64_t bit = 1ULL << (inode % WORD_BITS);
+    bool claimed = !(bitmap[inode / WORD_BITS] & bit);
+    bitmap[inode / WORD_BITS] |= bit;
+    dirty[inode / FREEMAP_ITEM_BITS] = true;
+    pthread_mutex_unlock(&freemap_lock);
+    if (claimed)
+        __atomic_add_fetch(&used_cnt, 1, __ATOMIC_RELAXED);
+    return true;
+}
 
-    return memcache_add(memcache, key, value, FREEMAP_BLOCK_SIZE);
+size_t freemap_used()
+{
+    return __atomic_load_n(&used_cnt, __ATOMIC_RELAXED);
+}
+
+size_t freemap_max()
+{
+    return MAX_INODE_CNT;
+}
+
+void freemap_list_keys(size_t inode_capacity, key_visitor visit, void* aux)
+{
+    char key[MEMCACHE_KEY_MAX + 1];
+    size_t items = (inode_capacity + FREEMAP_ITEM_BITS - 1) / FREEMAP_ITEM_BITS;
+    for (size_t i = 0; i < items; i++) {
+        get_key(key, i);
+        visit(key, false, aux);
+    }
 }
@@ -1,6 +1,7 @@
 #ifndef FREEMAP_H
 #define FREEMAP_H
 
+#include "keys.h"
 #include "memcache.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,19 +13,52 @@
  * This function being called when file system is newly formated 
  * 
  * mem      : memcache data object 
- * inode_cnt: maximum number of inodes possible
+ * inode_cnt: initial number of inodes
  * 
  * Returns  : true if successfully created
  */
 bool init_freemap(struct memcache_t* mem, size_t inode_cnt);
 
+/**
+ * Function : load_freemap
+ * ----------------------------------------
+ * Reads freemap of existing file system into memory
+ * 
+ * mem      : memcache data object 
+ * inode_cnt: number of inodes recorded in superblock
+ * 
+ * Returns  : true if successfully loaded
+ */
+bool load_freemap(struct memcache_t* mem, size_t inode_cnt);
+
+/**
+ * Function : freemap_flush
+ * ----------------------------------------
+ * Stores parts of freemap which changed since last flush, this
+ * also happens in background every second
+ * 
+ * Returns  : true if changes were stored
+ */
+bool freemap_flush();
+
+/**
+ * Function : close_freemap
+ * ----------------------------------------
+ * Returns ids reserved by threads, stores changes of freemap
+ * and stops background flushes
+ */
+void close_freemap();
+
 /**
  * Function : get_free_inode
  * ----------------------------------------
  * 
- * Finds free inode id
+ * Finds free inode id. Every thread takes ids from its own pool
+ * which is refilled from freemap in batches, unused ids are returned
+ * when thread exits or doesn't allocate for a while. When every
+ * inode is used, map grows and new capacity is stored in superblock
  * 
- * Returns  : id of free inode or -1 if there isn't any
+ * Returns  : id of free inode or -1 if map can't grow
  */
 int get_free_inode();
 
@@ -40,4 +74,55 @@ int get_free_inode();
  */
 bool free_inode(int inode);
 
+/**
+ * Function : freemap_is_used
+ * ----------------------------------------
+ * 
+ * inode    : id of inode
+ * 
+ * Returns  : true if id is marked used in map
+ */
+bool freemap_is_used(int inode);
+
+/**
+ * Function : freemap_claim
+ * ----------------------------------------
+ * 
+ * Marks given id used, for ids which are in use though map lost
+ * them. Change is stored by next flush
+ * 
+ * inode    : id of inode
+ * 
+ * Returns  : false if id is out of map
+ */
+bool freemap_claim(int inode);
+
+/**
+ * Function : freemap_used
+ * ----------------------------------------
+ * 
+ * Returns  : number of inodes in use
+ */
+size_t freemap_used();
+
+/**
+ * Function : freemap_max
+ * ----------------------------------------
+ * 
+ * Returns  : number of inodes which map can grow to
+ */
+size_t freemap_max();
+
+/**
+ * Function : freemap_list_keys
+ * ----------------------------------------
+ * 
+ * Reports keys of stored free map items
+ * 
+ * inode_capacity : number of inode ids covered by map
+ * visit          : called for every key
+ * aux            : passed to visit
+ */
+void freemap_list_keys(size_t inode_capacity, key_visitor visit, void* aux);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,633 @@
+/*
+ * Checks file system stored in Memcached and, with -r, repairs it.
+ * Crashed operations can leave inodes which no directory reaches,
+ * entries of removed inodes, wrong link counts, index records which
+ * don't match entries, ids marked used in free map and blocks past
+ * the end of inodes. Metadata is read and directories are walked by
+ * several threads with pipelined requests. File system must not be
+ * mounted while it is repaired, repair holds lock which new mounts
+ * respect and refuses to start if mounts using leases or announcing
+ * changes are active. Other mounts can't be detected. Shared blocks of deduplicated file
+ * systems and their reference counts aren't checked, such file
+ * systems aren't repaired.
+ *
+ * Usage : ./cachefs-fsck [-r] [-j threads]
+ */
+
+#include "changelog.h"
+#include "directory.h"
+#include "freemap.h"
+#include "inode.h"
+#include "lease.h"
+#include "memcache.h"
+#include "super.h"
+#include "usage.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_BATCH 1024 // Inodes handled with one pipelined request
+#define DEFAULT_THREADS 8
+#define MAX_THREADS 64
+#define ACTIVITY_WAIT 2 // Seconds changes of active mounts are waited for
+
+static struct memcache_t* memcache;
+static bool repair;
+static int thread_cnt = DEFAULT_THREADS;
+static size_t capacity;
+
+/* Stored metadata of every id, EXISTS is cleared for reclaimed inodes */
+static struct inode_disk_metadata* metadata;
+static bool* exists;
+static uint32_t* refs; // Entries of walked directories which point to inode
+static int* parents; // Directory which holds entry of directory, -1 until it's reached
+
+/* Directories waiting for walk, each one is queued once */
+static int* queue;
+static size_t queue_head;
+static size_t queue_tail;
+static int busy; // Threads walking a directory, they may queue more
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Unreachable inodes, reclaimed with -r */
+static int* lost;
+static size_t lost_cnt;
+
+static size_t next_batch; // First id of batch which next thread takes
+static size_t problem_cnt;
+static size_t stray_cnt;
+static size_t stored_cnt; // Blocks found inside lengths of inodes
+static bool deduplicated; // Some inode shares blocks, they can't be counted per inode
+static bool failed; // Some request failed, result is incomplete
+static bool locked; // Mounts are kept away while file system is repaired
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER; // Lock isn't renewed after it's dropped
+
+static void report(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    flockfile(stdout);
+    vprintf(format, args);
+    putchar('\n');
+    funlockfile(stdout);
+    va_end(args);
+    __atomic_add_fetch(&problem_cnt, 1, __ATOMIC_RELAXED);
+}
+
+static void fail(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    flockfile(stderr);
+    fputs("cachefs-fsck: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    va_end(args);
+    __atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+}
+
+/* Runs LOOP in every thread and waits for them, batch counter starts from zero */
+static void run_threads(void* (*loop)(void*))
+{
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    next_batch = 0;
+    while (started < thread_cnt && pthread_create(&threads[started], NULL, loop, NULL) == 0)
+        started++;
+    if (started == 0)
+        loop(NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/* Takes next batch of ids below END, returns false when none are left */
+static bool take_batch(size_t end, size_t* first, size_t* cnt)
+{
+    *first = __atomic_fetch_add(&next_batch, SCAN_BATCH, __ATOMIC_RELAXED);
+    if (*first >= end)
+        return false;
+    *cnt = end - *first < SCAN_BATCH ? end - *first : SCAN_BATCH;
+    return true;
+}
+
+static void* scan_loop(void* aux)
+{
+    (void)aux;
+    int ids[SCAN_BATCH];
+    size_t first, cnt;
+    while (take_batch(capacity, &first, &cnt)) {
+        for (size_t i = 0; i < cnt; i++)
+            ids[i] = first + i;
+        if (!inode_get_metadata_multi(ids, cnt, metadata + first, exists + first))
+            fail("can't read metadata of inodes %zu-%zu", first, first + cnt - 1);
+    }
+    return NULL;
+}
+
+static void enqueue(int dir_id)
+{
+    pthread_mutex_lock(&queue_lock);
+    queue[queue_tail++] = dir_id;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Findings of walk of one directory, fixed once its check is over
+ */
+struct walk {
+    int dir_id;
+    bool has_self;
+    bool has_parent;
+    bool bad_self;
+    bool bad_parent;
+    char (*removed)[NAME_MAX + 1]; // Entries which are dropped
+    size_t removed_cnt;
+    size_t removed_cap;
+};
+
+static void remove_entry(struct walk* walk, const char* name)
+{
+    if (walk->removed_cnt == walk->removed_cap) {
+        size_t cap = walk->removed_cap == 0 ? 16 : 2 * walk->removed_cap;
+        char(*grown)[NAME_MAX + 1] = realloc(walk->removed, cap * sizeof(*grown));
+        if (grown == NULL)
+            return;
+        walk->removed = grown;
+        walk->removed_cap = cap;
+    }
+    strcpy(walk->removed[walk->removed_cnt++], name);
+}
+
+static void visit_entry(const char* name, int inode_id, void* aux)
+{
+    struct walk* walk = aux;
+    int dir_id = walk->dir_id;
+
+    if (strcmp(name, ".") == 0) {
+        walk->has_self = true;
+        walk->bad_self = inode_id != dir_id;
+        if (walk->bad_self)
+            report("directory %d: \".\" points to %d", dir_id, inode_id);
+        return;
+    }
+    if (strcmp(name, "..") == 0) {
+        walk->has_parent = true;
+        walk->bad_parent = inode_id != parents[dir_id];
+        if (walk->bad_parent)
+            report("directory %d: \"..\" points to %d instead of %d", dir_id, inode_id, parents[dir_id]);
+        return;
+    }
+
+    if (inode_id < 0 || (size_t)inode_id >= capacity || !exists[inode_id]) {
+        report("directory %d: entry \"%s\" points to missing inode %d", dir_id, name, inode_id);
+        remove_entry(walk, name);
+        return;
+    }
+    if (metadata[inode_id].is_dir) {
+        /* Directory has one parent, entry which reaches it first wins */
+        int none = -1;
+        if (!__atomic_compare_exchange_n(&parents[inode_id], &none, dir_id, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            report("directory %d: entry \"%s\" links directory %d which has other parent",
+                dir_id, name, inode_id);
+            remove_entry(walk, name);
+            return;
+        }
+        enqueue(inode_id);
+    }
+    __atomic_add_fetch(&refs[inode_id], 1, __ATOMIC_RELAXED);
+}
+
+static void check_dir(int dir_id)
+{
+    struct walk walk = { 0 };
+    walk.dir_id = dir_id;
+    size_t index_problems;
+
+    struct dir* dir = dir_open(inode_open(dir_id));
+    if (dir == NULL) {
+        fail("can't open directory %d", dir_id);
+        return;
+    }
+    if (!dir_check(dir, repair, &index_problems, visit_entry, &walk)) {
+        fail("can't read directory %d", dir_id);
+        dir_close(dir);
+        return;
+    }
+    if (index_problems > 0)
+        report("directory %d: %zu index records don't match entries", dir_id, index_problems);
+
+    if (!walk.has_self)
+        report("directory %d: \".\" is missing", dir_id);
+    if (!walk.has_parent)
+        report("directory %d: \"..\" is missing", dir_id);
+    if (repair) {
+        for (size_t i = 0; i < walk.removed_cnt; i++)
+            dir_unlink(dir, walk.removed[i]);
+        if (walk.bad_self)
+            dir_set(dir, ".", dir_id);
+        else if (!walk.has_self)
+            dir_add(dir, ".", dir_id);
+        if (walk.bad_parent)
+            dir_set(dir, "..", parents[dir_id]);
+        else if (!walk.has_parent)
+            dir_add(dir, "..", parents[dir_id]);
+    }
+    free(walk.removed);
+    dir_close(dir);
+}
+
+static void* walk_loop(void* aux)
+{
+    (void)aux;
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+        while (queue_head == queue_tail && busy > 0)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (queue_head == queue_tail)
+            break;
+        int dir_id = queue[queue_head++];
+        busy++;
+        pthread_mutex_unlock(&queue_lock);
+        check_dir(dir_id);
+        pthread_mutex_lock(&queue_lock);
+        busy--;
+        /* Last busy thread which queued nothing ends the walk */
+        if (queue_head == queue_tail && busy == 0)
+            pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+/**
+ * Keys collected for one pipelined delete
+ */
+struct key_list {
+    struct memcache_item* items;
+    size_t cnt;
+    size_t cap;
+    bool full; // Some key didn't fit
+};
+
+static void add_key(const char* key, bool shared, void* aux)
+{
+    (void)shared;
+    struct key_list* list = aux;
+    if (list->cnt == list->cap) {
+        size_t cap = list->cap == 0 ? 64 : 2 * list->cap;
+        struct memcache_item* grown = realloc(list->items, cap * sizeof(struct memcache_item));
+        if (grown == NULL) {
+            list->full = true;
+            return;
+        }
+        list->items = grown;
+        list->cap = cap;
+    }
+    memset(&list->items[list->cnt], 0, sizeof(struct memcache_item));
+    strcpy(list->items[list->cnt++].key, key);
+}
+
+/* Deletes index buckets of unreachable directory, they aren't found through its id */
+static void reclaim_index(int dir_id)
+{
+    struct key_list list = { 0 };
+    if (!dir_list_keys(dir_id, add_key, &list) || list.full)
+        fail("can't list index of directory %d", dir_id);
+    if (list.cnt > 0 && !memcache_delete_multi(memcache, list.items, list.cnt))
+        fail("can't delete index of directory %d", dir_id);
+    free(list.items);
+}
+
+static void* reclaim_loop(void* aux)
+{
+    (void)aux;
+    int ids[SCAN_BATCH];
+    struct inode_disk_metadata batch[SCAN_BATCH];
+    size_t first, cnt;
+    while (take_batch(lost_cnt, &first, &cnt)) {
+        for (size_t i = 0; i < cnt; i++) {
+            ids[i] = lost[first + i];
+            batch[i] = metadata[ids[i]];
+            if (batch[i].is_dir)
+                reclaim_index(ids[i]);
+        }
+        inode_reclaim(ids, batch, cnt);
+        for (size_t i = 0; i < cnt; i++) {
+            exists[ids[i]] = false;
+            free_inode(ids[i]);
+        }
+    }
+    return NULL;
+}
+
+static void* stray_loop(void* aux)
+{
+    (void)aux;
+    int ids[SCAN_BATCH];
+    struct inode_disk_metadata batch[SCAN_BATCH];
+    size_t first, cnt;
+    while (take_batch(capacity, &first, &cnt)) {
+        /* Ids taken by create which crashed before metadata was stored may have blocks too */
+        size_t probed = 0;
+        for (size_t i = 0; i < cnt; i++) {
+            int id = first + i;
+            if (!exists[id] && !freemap_is_used(id))
+                continue;
+            ids[probed] = id;
+            if (exists[id])
+                batch[probed] = metadata[id];
+            else
+                memset(&batch[probed], 0, sizeof(struct inode_disk_metadata));
+            probed++;
+        }
+        size_t found = inode_find_stray(ids, batch, probed, repair);
+        __atomic_add_fetch(&stray_cnt, found, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void* count_loop(void* aux)
+{
+    (void)aux;
+    int ids[SCAN_BATCH];
+    struct inode_disk_metadata batch[SCAN_BATCH];
+    size_t first, cnt;
+    while (take_batch(capacity, &first, &cnt)) {
+        size_t probed = 0;
+        for (size_t i = 0; i < cnt; i++) {
+            if (!exists[first + i])
+                continue;
+            if (metadata[first + i].flags & INODE_DEDUP)
+                __atomic_store_n(&deduplicated, true, __ATOMIC_RELAXED);
+            ids[probed] = first + i;
+            batch[probed++] = metadata[first + i];
+        }
+        size_t found;
+        if (!inode_count_blocks(ids, batch, probed, &found))
+            fail("can't count blocks of inodes %zu-%zu", first, first + cnt - 1);
+        else
+            __atomic_add_fetch(&stored_cnt, found, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Inode has entry in walked directory, root is reached by definition */
+static bool reached(size_t id)
+{
+    return metadata[id].is_dir ? parents[id] >= 0 : refs[id] > 0;
+}
+
+static bool allocate_state()
+{
+    metadata = malloc(capacity * sizeof(struct inode_disk_metadata));
+    exists = calloc(capacity, sizeof(bool));
+    refs = calloc(capacity, sizeof(uint32_t));
+    parents = malloc(capacity * sizeof(int));
+    queue = malloc(capacity * sizeof(int));
+    lost = malloc(capacity * sizeof(int));
+    if (metadata == NULL || exists == NULL || refs == NULL || parents == NULL
+        || queue == NULL || lost == NULL)
+        return false;
+    for (size_t i = 0; i < capacity; i++)
+        parents[i] = -1;
+    return true;
+}
+
+/* Link count of directory is always 1, file has one link per entry */
+static void check_links()
+{
+    for (size_t id = 0; id < capacity; id++) {
+        if (!exists[id] || !reached(id))
+            continue;
+        size_t expected = metadata[id].is_dir ? 1 : refs[id];
+        if (metadata[id].link_cnt == expected)
+            continue;
+        report("inode %zu: link count %zu, found %zu links", id, metadata[id].link_cnt, expected);
+        if (!repair)
+            continue;
+        struct inode* inode = inode_open(id);
+        if (inode == NULL) {
+            fail("can't open inode %zu", id);
+            continue;
+        }
+        pthread_mutex_lock(&inode->lock);
+        inode->metadata.link_cnt = expected;
+        pthread_mutex_unlock(&inode->lock);
+        if (!inode_flush_metadata(inode))
+            fail("can't store metadata of inode %zu", id);
+        inode_close(inode);
+    }
+}
+
+static void check_freemap()
+{
+    for (size_t id = 0; id < capacity; id++) {
+        bool used = freemap_is_used(id);
+        if (used && !exists[id]) {
+            report("inode %zu: id is marked used but inode doesn't exist", id);
+            if (repair)
+                free_inode(id);
+        } else if (!used && exists[id]) {
+            report("inode %zu: inode exists but id is marked free", id);
+            if (repair)
+                freemap_claim(id);
+        }
+    }
+    if (repair && !freemap_flush())
+        fail("can't store free map");
+}
+
+static void check_usage()
+{
+    struct usage expected = { 0 };
+    for (size_t id = 0; id < capacity; id++) {
+        if (exists[id])
+            expected.bytes += metadata[id].length + metadata[id].xattrs_length;
+    }
+    run_threads(count_loop);
+    if (failed)
+        return;
+    expected.blocks = stored_cnt;
+    struct usage stored;
+    usage_get(&stored);
+    /* Shared blocks are counted once for all inodes, only lengths are checked then */
+    if (deduplicated)
+        expected.blocks = stored.blocks;
+    if (stored.blocks == expected.blocks && stored.bytes == expected.bytes)
+        return;
+    report("usage counts %" PRId64 " blocks and %" PRId64 " bytes, found %" PRId64 " and %" PRId64,
+        stored.blocks, stored.bytes, expected.blocks, expected.bytes);
+    if (repair) {
+        usage_add(expected.blocks - stored.blocks, expected.bytes - stored.bytes);
+        if (!usage_flush())
+            fail("can't store usage");
+    }
+}
+
+/* Number of the last change announced by mounts, 0 if none announced */
+static bool change_seq(uint64_t* seq)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", CHANGELOG_SEQ_KEY);
+    item.number = 0;
+    if (!memcache_incr_multi(memcache, &item, 1))
+        return false;
+    *seq = item.found ? item.number : 0;
+    return true;
+}
+
+/* Mounts with leases hold one on root while they resolve paths, polling mounts number changes */
+static bool mounted()
+{
+    bool taken = false;
+    uint64_t before = 0;
+    uint64_t after = 0;
+    if (!lease_taken(memcache, ROOT_INODE_ID, &taken) || taken || !change_seq(&before))
+        return true;
+    sleep(ACTIVITY_WAIT);
+    return !change_seq(&after) || after != before;
+}
+
+static void* renew_loop(void* aux)
+{
+    (void)aux;
+    while (true) {
+        sleep(SUPER_LOCK_TTL / 3);
+        pthread_mutex_lock(&lock_mutex);
+        if (locked && !super_take_lock(memcache, true))
+            fail("can't renew lock of file system");
+        pthread_mutex_unlock(&lock_mutex);
+    }
+    return NULL;
+}
+
+/* Takes lock before mounts are looked for, none can start after that */
+static bool lock_fs()
+{
+    if (!super_take_lock(memcache, false)) {
+        fprintf(stderr, "cachefs-fsck: file system is locked by other repair\n");
+        return false;
+    }
+    locked = true;
+    if (mounted()) {
+        fprintf(stderr, "cachefs-fsck: file system is mounted, unmount it before repair\n");
+        return false;
+    }
+    pthread_t renewer;
+    if (pthread_create(&renewer, NULL, renew_loop, NULL) != 0) {
+        fprintf(stderr, "cachefs-fsck: can't start thread\n");
+        return false;
+    }
+    pthread_detach(renewer);
+    return true;
+}
+
+/* Drops lock and connection, returns STATUS */
+static int finish(int status)
+{
+    pthread_mutex_lock(&lock_mutex);
+    if (locked)
+        super_drop_lock(memcache);
+    locked = false;
+    pthread_mutex_unlock(&lock_mutex);
+    memcache_close(memcache);
+    return status;
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            repair = true;
+        } else if (opt == 'j' && atoi(optarg) > 0) {
+            thread_cnt = atoi(optarg) < MAX_THREADS ? atoi(optarg) : MAX_THREADS;
+        } else {
+            fprintf(stderr, "usage: %s [-r] [-j threads]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    memcache = memcache_init();
+    if (memcache == NULL) {
+        fprintf(stderr, "cachefs-fsck: can't connect to memcached\n");
+        return EXIT_FAILURE;
+    }
+    init_inodes(memcache, getgid(), getuid());
+    init_leases(memcache, 0);
+    init_directories(memcache, false);
+    if (super_load(memcache) != SUPER_OK) {
+        fprintf(stderr, "cachefs-fsck: memcached holds no file system of supported format\n");
+        memcache_close(memcache);
+        return EXIT_FAILURE;
+    }
+    struct superblock sb;
+    super_get(&sb);
+    inode_set_features(sb.features);
+    if (sb.features & FEATURE_DEDUP) {
+        /* Repair would delete blocks without fixing their reference counts */
+        if (repair) {
+            fprintf(stderr, "cachefs-fsck: deduplicated file system can't be repaired, "
+                            "shared blocks (blk#) and their reference counts (ref#) aren't checked\n");
+            memcache_close(memcache);
+            return EXIT_FAILURE;
+        }
+        printf("cachefs-fsck: shared blocks (blk#) and their reference counts (ref#) aren't checked\n");
+    }
+    if (repair && !lock_fs())
+        return finish(EXIT_FAILURE);
+    capacity = sb.inode_capacity;
+    if (!load_freemap(memcache, capacity) || !allocate_state()) {
+        fprintf(stderr, "cachefs-fsck: can't load free map\n");
+        return finish(EXIT_FAILURE);
+    }
+    if (!load_usage(memcache))
+        report("usage counters are missing");
+
+    run_threads(scan_loop);
+    if (failed || !exists[ROOT_INODE_ID] || !metadata[ROOT_INODE_ID].is_dir) {
+        fprintf(stderr, "cachefs-fsck: root directory can't be read\n");
+        return finish(EXIT_FAILURE);
+    }
+
+    /* Root is its own parent, walk reaches the rest from it */
+    parents[ROOT_INODE_ID] = ROOT_INODE_ID;
+    refs[ROOT_INODE_ID] = 1;
+    enqueue(ROOT_INODE_ID);
+    run_threads(walk_loop);
+
+    for (size_t id = 0; id < capacity; id++) {
+        if (exists[id] && !reached(id)) {
+            report("inode %zu: not reachable from root", id);
+            lost[lost_cnt++] = id;
+        }
+    }
+    if (repair)
+        run_threads(reclaim_loop);
+    if (!failed) {
+        check_links();
+        /* Ids which free map holds for missing inodes are probed before they are freed */
+        run_threads(stray_loop);
+        if (stray_cnt > 0)
+            report("%zu blocks past the end of inodes", stray_cnt);
+        check_freemap();
+        check_usage();
+    }
+
+    size_t inode_cnt = 0;
+    for (size_t id = 0; id < capacity; id++)
+        inode_cnt += exists[id];
+    printf("cachefs-fsck: %zu inodes, %zu problems%s\n", inode_cnt, problem_cnt,
+        repair && problem_cnt > 0 ? " repaired" : "");
+    if (failed)
+        return finish(EXIT_FAILURE);
+    return finish(problem_cnt == 0 || repair ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,220 @@
+#include "hash.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#endif
+
+#define SEED 0x9747b28c
+#define CRC32C_POLY 0x82f63b78
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+void hash_block(const void* data, size_t size, struct block_hash* hash)
+{
+    const uint8_t* bytes = data;
+    size_t nblocks = size / 16;
+    uint64_t h1 = SEED;
+    uint64_t h2 = SEED;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    for (size_t i = 0; i < nblocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, bytes + i * 16, 8);
+        memcpy(&k2, bytes + i * 16 + 8, 8);
+
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t* tail = bytes + nblocks * 16;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch (size & 15) {
+    case 15:
+        k2 ^= ((uint64_t)tail[14]) << 48;
+        /* fallthrough */
+    case 14:
+        k2 ^= ((uint64_t)tail[13]) << 40;
+        /* fallthrough */
+    case 13:
+        k2 ^= ((uint64_t)tail[12]) << 32;
+        /* fallthrough */
+    case 12:
+        k2 ^= ((uint64_t)tail[11]) << 24;
+        /* fallthrough */
+    case 11:
+        k2 ^= ((uint64_t)tail[10]) << 16;
+        /* fallthrough */
+    case 10:
+        k2 ^= ((uint64_t)tail[9]) << 8;
+        /* fallthrough */
+    case 9:
+        k2 ^= ((uint64_t)tail[8]) << 0;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        /* fallthrough */
+    case 8:
+        k1 ^= ((uint64_t)tail[7]) << 56;
+        /* fallthrough */
+    case 7:
+        k1 ^= ((uint64_t)tail[6]) << 48;
+        /* fallthrough */
+    case 6:
+        k1 ^= ((uint64_t)tail[5]) << 40;
+        /* fallthrough */
+    case 5:
+        k1 ^= ((uint64_t)tail[4]) << 32;
+        /* fallthrough */
+    case 4:
+        k1 ^= ((uint64_t)tail[3]) << 24;
+        /* fallthrough */
+    case 3:
+        k1 ^= ((uint64_t)tail[2]) << 16;
+        /* fallthrough */
+    case 2:
+        k1 ^= ((uint64_t)tail[1]) << 8;
+        /* fallthrough */
+    case 1:
+        k1 ^= ((uint64_t)tail[0]) << 0;
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash->h[0] = h1;
+    hash->h[1] = h2;
+}
+
+static uint32_t crc_table[8][256];
+static bool hardware_crc;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32c()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int j = 1; j < 8; j++)
+            crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+    }
+#if defined(__x86_64__)
+    hardware_crc = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    hardware_crc = true;
+#endif
+}
+
+/* Slicing-by-8, processes 8 bytes per table round */
+static uint32_t crc32c_software(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff]
+            ^ crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff]
+            ^ crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff]
+            ^ crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *bytes++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while (size-- > 0)
+        crc = _mm_crc32_u8(crc, *bytes++);
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = __crc32cb(crc, *bytes++);
+    return crc;
+}
+#else
+static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+    return crc32c_software(crc, bytes, size);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size)
+{
+    pthread_once(&crc_once, init_crc32c);
+    crc = ~crc;
+    if (hardware_crc)
+        crc = crc32c_hardware(crc, data, size);
+    else
+        crc = crc32c_software(crc, data, size);
+    return ~crc;
+}
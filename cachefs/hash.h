@@ -0,0 +1,39 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * 128 bit digest of block contents
+ */
+struct block_hash {
+    uint64_t h[2];
+};
+
+/**
+ * Function : hash_block
+ * ----------------------------------------
+ * Computes 128 bit MurmurHash3 (x64 variant) of data
+ * 
+ * data     : data to hash
+ * size     : size of data in bytes
+ * hash     : where digest should be written
+ */
+void hash_block(const void* data, size_t size, struct block_hash* hash);
+
+/**
+ * Function : crc32c
+ * ----------------------------------------
+ * Computes CRC-32C (Castagnoli) checksum, uses CPU instructions 
+ * when they are available
+ * 
+ * crc      : checksum of preceding data or 0
+ * data     : data to checksum
+ * size     : size of data in bytes
+ * 
+ * Returns  : checksum of preceding data followed by given data
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+#endif
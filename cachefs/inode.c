@@ -1,16 +1,29 @@
 
 #include "inode.h"
+#include "block.h"
+#include "dedup.h"
 #include "freemap.h"
+#include "journal.h"
+#include "lease.h"
+#include "reaper.h"
+#include "usage.h"
 #include "utils.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#define INODE_BLOCK_SIZE 4096
 #define INODE_MAGIC 2341785
+#define COPY_CHUNK_SIZE (64 * INODE_BLOCK_SIZE)
+#define METADATA_CACHE_SIZE 4096 // Metadata of closed inodes kept while lease is held
+#define CAS_RETRIES 16 // Attempts of read-modify-write before giving up
+#define RECLAIM_BATCH 512 // Keys of removed inodes deleted with one pipelined request
+#define STRAY_WINDOW 8 // Keys probed at once past the end of inode by stray block search
+#define COUNT_BATCH 512 // Keys probed with one pipelined request while stored blocks are counted
 
 static void
 get_key(char* key, int inode_id, int ind)
@@ -30,11 +43,21 @@ get_xattrs(char* key, int inode_id, int ind)
 }
 
 static struct memcache_t* memcache;
+static int features;
 static struct list open_inodes;
 static pthread_mutex_t inodes_lock;
 __gid_t root_g_id;
 __uid_t root_u_id;
 
+struct cached_metadata {
+    int id;
+    int64_t until; // End of lease metadata was read under, later leases don't cover it
+    struct inode_disk_metadata metadata;
+};
+
+static struct cached_metadata cached[METADATA_CACHE_SIZE];
+static pthread_mutex_t cached_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void init_inodes(struct memcache_t* mem, __gid_t gid, __uid_t uid)
 {
     memcache = mem;
@@ -42,6 +65,155 @@ void init_inodes(struct memcache_t* mem, __gid_t gid, __uid_t uid)
     root_g_id = gid;
     root_u_id = uid;
     pthread_mutex_init(&inodes_lock, NULL);
+    init_dedup(mem, INODE_BLOCK_SIZE);
+    for (size_t i = 0; i < METADATA_CACHE_SIZE; i++)
+        cached[i].id = -1;
+}
+
+static void cache_metadata(int id, const struct inode_disk_metadata* metadata)
+{
+    int64_t until = lease_valid(id);
+    pthread_mutex_lock(&cached_lock);
+    struct cached_metadata* entry = &cached[(unsigned)id % METADATA_CACHE_SIZE];
+    if (until != 0 || entry->id == id) {
+        entry->id = until != 0 ? id : -1;
+        entry->until = until;
+        entry->metadata = *metadata;
+    }
+    pthread_mutex_unlock(&cached_lock);
+}
+
+static void uncache_metadata(int id)
+{
+    pthread_mutex_lock(&cached_lock);
+    if (cached[(unsigned)id % METADATA_CACHE_SIZE].id == id)
+        cached[(unsigned)id % METADATA_CACHE_SIZE].id = -1;
+    pthread_mutex_unlock(&cached_lock);
+}
+
+/* Cached metadata is used only while lease guarantees nobody else changed it */
+static bool get_cached_metadata(int id, struct inode_disk_metadata* metadata)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t now_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    pthread_mutex_lock(&cached_lock);
+    struct cached_metadata* entry = &cached[(unsigned)id % METADATA_CACHE_SIZE];
+    bool found = entry->id == id && entry->until > now_ms;
+    if (found)
+        *metadata = entry->metadata;
+    pthread_mutex_unlock(&cached_lock);
+    return found;
+}
+
+/* Counts change of data length in usage, blocks are counted when they are stored or deleted */
+static void count_length(size_t from, size_t to)
+{
+    usage_add(0, (int64_t)to - (int64_t)from);
+}
+
+static size_t merge_length(size_t ours, size_t base, size_t theirs)
+{
+    /* Shrinking is kept, growth never loses data appended by the other side */
+    if (ours == base || (ours > base && theirs > ours))
+        return theirs;
+    return ours;
+}
+
+/*
+ * Applies changes made since metadata was stored to metadata THEIRS
+ * which other mount stored meanwhile. Fields changed on one side only
+ * take that side, link count takes changes of both
+ */
+static void merge_metadata(struct inode* inode, const struct inode_disk_metadata* theirs)
+{
+    struct inode_disk_metadata* ours = &inode->metadata;
+    const struct inode_disk_metadata* base = &inode->stored;
+    struct inode_disk_metadata merged = *theirs;
+    if (ours->mode != base->mode)
+        merged.mode = ours->mode;
+    if (ours->uid != base->uid)
+        merged.uid = ours->uid;
+    if (ours->gid != base->gid)
+        merged.gid = ours->gid;
+    if (ours->flags != base->flags)
+        merged.flags = ours->flags;
+    merged.link_cnt = theirs->link_cnt + ours->link_cnt - base->link_cnt;
+    merged.length = merge_length(ours->length, base->length, theirs->length);
+    merged.xattrs_length = merge_length(ours->xattrs_length, base->xattrs_length, theirs->xattrs_length);
+
+    /* Usage counts growth of both sides, only the merged result must stay */
+    count_length(ours->length, merged.length);
+    count_length(theirs->length, base->length);
+    count_length(ours->xattrs_length, merged.xattrs_length);
+    count_length(theirs->xattrs_length, base->xattrs_length);
+    *ours = merged;
+}
+
+/*
+ * Stores metadata of inode with gets/cas, changes of other mounts are
+ * merged in. Other mounts' leases are waited out first. With KEEP_LENGTH
+ * nothing is stored if other mount changed length, its length is taken
+ */
+static bool update_metadata(struct inode* inode, bool keep_length)
+{
+    struct memcache_item item;
+    struct inode_disk_metadata theirs;
+    lease_break(inode->id);
+    get_metadata(item.key, inode->id);
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        if (inode->cas != 0) {
+            item.buff = &inode->metadata;
+            item.size = sizeof(struct inode_disk_metadata);
+            item.exptime = 0;
+            item.cas = inode->cas;
+            if (!memcache_cas_gets_multi(memcache, &item, 1))
+                return false;
+            if (item.found) {
+                inode->stored = inode->metadata;
+                inode->cas = item.cas;
+                cache_metadata(inode->id, &inode->metadata);
+                return true;
+            }
+        }
+
+        item.buff = &theirs;
+        item.size = sizeof(struct inode_disk_metadata);
+        if (!memcache_gets_multi(memcache, &item, 1) || !item.found
+            || item.size != sizeof(struct inode_disk_metadata))
+            return false;
+        bool conflict = keep_length && theirs.length != inode->stored.length;
+        if (conflict) {
+            count_length(inode->metadata.length, inode->stored.length);
+            inode->metadata.length = inode->stored.length;
+        }
+        merge_metadata(inode, &theirs);
+        inode->stored = theirs;
+        inode->cas = item.cas;
+        if (conflict)
+            return false;
+    }
+    return false;
+}
+
+static bool store_metadata(struct inode* inode)
+{
+    return update_metadata(inode, false);
+}
+
+void inode_set_features(int enabled)
+{
+    features = enabled;
+    block_set_compression(enabled & FEATURE_COMPRESS);
+}
+
+/* Changes length of data or extended attributes and counts change in usage */
+static void set_length(struct inode* inode, size_t length, bool xattrs)
+{
+    size_t* field = xattrs ? &inode->metadata.xattrs_length : &inode->metadata.length;
+    count_length(*field, length);
+    *field = length;
+    inode->changed = true;
 }
 
 bool inode_create(int inode_id, bool is_dir, __gid_t gid, __uid_t uid, __mode_t mode)
@@ -55,6 +227,9 @@ bool inode_create(int inode_id, bool is_dir, __gid_t gid, __uid_t uid, __mode_t
     disk_inode.uid = uid;
     disk_inode.mode = mode;
     disk_inode.xattrs_length = 0;
+    disk_inode.flags = 0;
+    if (!is_dir && (features & FEATURE_DEDUP))
+        disk_inode.flags |= INODE_DEDUP;
 
     char key[30];
     get_metadata(key, inode_id);
@@ -64,42 +239,110 @@ bool inode_create(int inode_id, bool is_dir, __gid_t gid, __uid_t uid, __mode_t
     return res;
 }
 
-struct inode* inode_open(int id)
+/* Open inode with given id, it is reopened. Called with inodes_lock held */
+static struct inode* find_open(int id)
 {
-
     struct list_elem* e;
-    struct inode* inode;
+    for (e = list_begin(&open_inodes); e != list_end(&open_inodes); e = list_next(e)) {
+        struct inode* inode = list_entry(e, struct inode, elem);
+        if (inode->id == id)
+            return inode_reopen(inode);
+    }
+    return NULL;
+}
 
+struct inode* inode_open(int id)
+{
     pthread_mutex_lock(&inodes_lock);
-    for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-         e = list_next(e)) {
-        inode = list_entry(e, struct inode, elem);
-        if (inode->id == id) {
-            inode_reopen(inode);
-            pthread_mutex_unlock(&inodes_lock);
-            return inode;
-        }
-    }
+    struct inode* inode = find_open(id);
+    pthread_mutex_unlock(&inodes_lock);
+    if (inode != NULL)
+        return inode;
 
     inode = malloc(sizeof(struct inode));
-    if (inode == NULL) {
-        pthread_mutex_unlock(&inodes_lock);
+    if (inode == NULL)
         return NULL;
-    }
-
-    list_push_back(&open_inodes, &inode->elem);
     inode->id = id;
     inode->open_cnt = 1;
     inode->is_deleted = false;
+    inode->changed = false;
     inode->magic = INODE_MAGIC;
     pthread_mutex_init(&inode->lock, NULL);
-    char key[30];
-    get_metadata(key, inode->id);
+    inode->cas = 0;
+    inode->intent = 0;
+
+    /* Inode becomes visible to others only with its metadata */
+    bool found = get_cached_metadata(id, &inode->metadata);
+    if (!found) {
+        bool leased = lease_acquire(id);
+        struct memcache_item item;
+        get_metadata(item.key, inode->id);
+        item.buff = &inode->metadata;
+        item.size = sizeof(struct inode_disk_metadata);
+        found = memcache_gets_multi(memcache, &item, 1) && item.found
+            && item.size == sizeof(struct inode_disk_metadata);
+        if (found) {
+            inode->cas = item.cas;
+            if (leased)
+                cache_metadata(id, &inode->metadata);
+        }
+    }
+    inode->stored = inode->metadata;
+
+    pthread_mutex_lock(&inodes_lock);
+    struct inode* other = found ? find_open(id) : NULL;
+    if (found && other == NULL)
+        list_push_back(&open_inodes, &inode->elem);
     pthread_mutex_unlock(&inodes_lock);
-    if (memcache_get(memcache, key, &inode->metadata))
-        return inode;
-    else
-        return NULL;
+    if (!found || other != NULL) {
+        pthread_mutex_destroy(&inode->lock);
+        free(inode);
+        return other;
+    }
+    return inode;
+}
+
+bool inode_get_metadata_multi(const int* ids, size_t cnt, struct inode_disk_metadata* metadata,
+    bool* found)
+{
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    if (items == NULL)
+        return false;
+
+    /* Open inodes may have newer metadata than the stored one */
+    size_t item_cnt = 0;
+    pthread_mutex_lock(&inodes_lock);
+    for (size_t i = 0; i < cnt; i++) {
+        struct list_elem* e;
+        found[i] = false;
+        for (e = list_begin(&open_inodes); e != list_end(&open_inodes) && !found[i];
+             e = list_next(e)) {
+            struct inode* inode = list_entry(e, struct inode, elem);
+            if (inode->id == ids[i]) {
+                metadata[i] = inode->metadata;
+                found[i] = true;
+            }
+        }
+        if (!found[i])
+            found[i] = get_cached_metadata(ids[i], &metadata[i]);
+        if (!found[i]) {
+            get_metadata(items[item_cnt].key, ids[i]);
+            items[item_cnt].buff = &metadata[i];
+            items[item_cnt].size = sizeof(struct inode_disk_metadata);
+            item_cnt++;
+        }
+    }
+    pthread_mutex_unlock(&inodes_lock);
+
+    bool res = memcache_get_multi(memcache, items, item_cnt);
+    for (size_t i = 0, j = 0; res && i < cnt; i++) {
+        if (!found[i]) {
+            found[i] = items[j].found && items[j].size == sizeof(struct inode_disk_metadata);
+            j++;
+        }
+    }
+    free(items);
+    return res;
 }
 
 struct inode* inode_reopen(struct inode* inode)
@@ -112,45 +355,257 @@ struct inode* inode_reopen(struct inode* inode)
     return inode;
 }
 
-size_t inode_read_at(struct inode* inode, void* buff, size_t size,
+static void
+get_block_key(char* key, struct inode* inode, size_t block, bool xattrs)
+{
+    if (!xattrs) {
+        get_key(key, inode->id, block);
+    } else {
+        get_xattrs(key, inode->id, block);
+    }
+}
+
+static bool is_dedup(struct inode* inode, bool xattrs)
+{
+    return !xattrs && (inode->metadata.flags & INODE_DEDUP);
+}
+
+/*
+ * Reads CNT blocks with given indexes (in ascending order) into 
+ * buffers from DST. Missing blocks are holes and are read as zeros.
+ */
+static bool load_blocks(struct inode* inode, const size_t* blocks, size_t cnt,
+    bool xattrs, char** dst)
+{
+    if (cnt == 0)
+        return true;
+
+    if (is_dedup(inode, xattrs)) {
+        struct block_map map;
+        if (!block_map_load(&map, inode->id, blocks[0], blocks[cnt - 1] - blocks[0] + 1))
+            return false;
+        struct block_hash* hashes = malloc(cnt * sizeof(struct block_hash));
+        char* values = malloc(cnt * INODE_BLOCK_SIZE);
+        bool res = hashes != NULL && values != NULL;
+        if (res) {
+            for (size_t i = 0; i < cnt; i++)
+                hashes[i] = *block_map_at(&map, blocks[i]);
+            res = dedup_get_blocks(hashes, cnt, values);
+        }
+        for (size_t i = 0; res && i < cnt; i++)
+            memcpy(dst[i], values + i * INODE_BLOCK_SIZE, INODE_BLOCK_SIZE);
+        free(values);
+        free(hashes);
+        block_map_free(&map);
+        return res;
+    }
+
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    if (items == NULL)
+        return false;
+    for (size_t i = 0; i < cnt; i++)
+        get_block_key(items[i].key, inode, blocks[i], xattrs);
+    bool res = block_get_multi(memcache, items, cnt, dst);
+    free(items);
+    return res;
+}
+
+/*
+ * Saves CNT consecutive blocks starting from FIRST. Returns number of 
+ * blocks which were stored before the first failure.
+ */
+static size_t store_blocks(struct inode* inode, size_t first, size_t cnt,
+    bool xattrs, char* values)
+{
+    if (is_dedup(inode, xattrs)) {
+        struct block_map map;
+        if (!block_map_load(&map, inode->id, first, cnt))
+            return 0;
+        struct block_hash* slots = block_map_at(&map, first);
+        size_t stored = 0;
+        if (dedup_put_blocks(values, cnt, slots)) {
+            if (block_map_store(&map)) {
+                dedup_release(block_map_replaced(&map, first), cnt);
+                stored = cnt;
+            } else {
+                dedup_release(slots, cnt);
+            }
+        }
+        block_map_free(&map);
+        return stored;
+    }
+
+    struct memcache_item* items = malloc(cnt * sizeof(struct memcache_item));
+    char** src = malloc(cnt * sizeof(char*));
+    size_t stored = 0;
+    if (items != NULL && src != NULL) {
+        for (size_t i = 0; i < cnt; i++) {
+            get_block_key(items[i].key, inode, first + i, xattrs);
+            src[i] = values + i * INODE_BLOCK_SIZE;
+        }
+        if (block_set_multi(memcache, items, cnt, src)) {
+            while (stored < cnt && items[stored].found)
+                stored++;
+        }
+    }
+    free(src);
+    free(items);
+    return stored;
+}
+
+/* Copies part of write of SIZE bytes at OFFSET which falls into BLOCK */
+static void apply_write(char* value, size_t block, const char* buff, size_t size, size_t offset)
+{
+    size_t start = block * INODE_BLOCK_SIZE > offset ? block * INODE_BLOCK_SIZE : offset;
+    size_t stop = (block + 1) * INODE_BLOCK_SIZE < offset + size ? (block + 1) * INODE_BLOCK_SIZE : offset + size;
+    memcpy(value + start - block * INODE_BLOCK_SIZE, buff + start - offset, stop - start);
+}
+
+/*
+ * Stores CNT blocks starting from FIRST for write of SIZE bytes at OFFSET.
+ * Partially written edge blocks are fetched and stored with gets/cas, so
+ * that other mounts' writes to the rest of them are kept. Edges past
+ * BLOCK_CNT are expected to be missing and aren't fetched. Returns number
+ * of blocks which were stored before the first failure.
+ */
+static size_t write_blocks(struct inode* inode, size_t first, size_t cnt, bool xattrs,
+    char* values, const char* buff, size_t size, size_t offset, size_t block_cnt)
+{
+    size_t end = offset + size;
+    struct memcache_item edge_items[2];
+    char* edge_values[2];
+    size_t edges[2];
+    size_t edge_cnt = 0;
+    size_t fetch_cnt = 0;
+    if (offset % INODE_BLOCK_SIZE != 0 || (cnt == 1 && end % INODE_BLOCK_SIZE != 0))
+        edges[edge_cnt++] = 0;
+    if (cnt > 1 && end % INODE_BLOCK_SIZE != 0)
+        edges[edge_cnt++] = cnt - 1;
+    for (size_t j = 0; j < edge_cnt; j++) {
+        get_block_key(edge_items[j].key, inode, first + edges[j], xattrs);
+        edge_values[j] = values + edges[j] * INODE_BLOCK_SIZE;
+        edge_items[j].cas = 0;
+        if (first + edges[j] < block_cnt)
+            fetch_cnt = j + 1;
+    }
+    /* Edges inside inode come first, only they can exist */
+    if (!block_gets_multi(memcache, edge_items, fetch_cnt, edge_values))
+        return 0;
+    memcpy(values + offset % INODE_BLOCK_SIZE, buff, size);
+
+    bool stored[2] = { false, false };
+    int64_t created = 0;
+    size_t full_cnt = cnt - edge_cnt;
+    struct memcache_item* items = malloc((full_cnt + 1) * sizeof(struct memcache_item));
+    char** src = malloc((full_cnt + 1) * sizeof(char*));
+    bool full_stored = items != NULL && src != NULL;
+    size_t full_first = edge_cnt > 0 && edges[0] == 0 ? 1 : 0;
+    for (size_t i = 0; full_stored && i < full_cnt; i++) {
+        get_block_key(items[i].key, inode, first + full_first + i, xattrs);
+        src[i] = values + (full_first + i) * INODE_BLOCK_SIZE;
+    }
+    /* Blocks are added first so that only blocks which were holes are counted */
+    full_stored = full_stored && block_add_multi(memcache, items, full_cnt, src);
+    size_t existing = 0;
+    for (size_t i = 0; full_stored && i < full_cnt; i++) {
+        if (items[i].found) {
+            created++;
+        } else {
+            items[existing] = items[i];
+            src[existing++] = src[i];
+        }
+    }
+    full_stored = full_stored && block_set_multi(memcache, items, existing, src);
+    for (size_t i = 0; full_stored && i < existing; i++)
+        full_stored = items[i].found;
+    free(src);
+    free(items);
+
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        struct memcache_item pending[2];
+        char* pending_values[2];
+        size_t pending_edges[2];
+        bool missing[2];
+        size_t pending_cnt = 0;
+        for (size_t j = 0; j < edge_cnt; j++) {
+            if (!stored[j]) {
+                missing[pending_cnt] = edge_items[j].cas == 0;
+                pending[pending_cnt] = edge_items[j];
+                pending_values[pending_cnt] = edge_values[j];
+                pending_edges[pending_cnt++] = j;
+            }
+        }
+        if (pending_cnt == 0 || !block_cas_multi(memcache, pending, pending_cnt, pending_values))
+            break;
+
+        /* Edges changed by other mounts are fetched again and written over */
+        for (size_t k = 0; k < pending_cnt; k++) {
+            size_t j = pending_edges[k];
+            if (pending[k].found) {
+                stored[j] = true;
+                created += missing[k];
+                continue;
+            }
+            if (!block_gets_multi(memcache, &edge_items[j], 1, &edge_values[j])) {
+                usage_add(created, 0);
+                return 0;
+            }
+            apply_write(edge_values[j], first + edges[j], buff, size, offset);
+        }
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        bool ok = full_stored;
+        for (size_t j = 0; j < edge_cnt; j++) {
+            if (edges[j] == i)
+                ok = stored[j];
+        }
+        if (!ok)
+            break;
+        done++;
+    }
+    usage_add(created, 0);
+    return done;
+}
+
+ssize_t inode_read_at(struct inode* inode, void* buff, size_t size,
     size_t offset, bool xattrs)
 {
     pthread_mutex_lock(&inode->lock);
-    char* buffer = buff;
-    size_t current = offset;
     size_t end = offset + size;
-    size_t read = 0;
+    ssize_t read = 0;
 
     size_t length = xattrs ? inode->metadata.xattrs_length : inode->metadata.length;
 
     if (end > length) {
         end = length;
     }
+    if (offset >= end)
+        goto inode_read_at_end;
 
-    while (current < end) {
-        size_t current_block = current / INODE_BLOCK_SIZE;
-        size_t next_offset = (current_block + 1) * INODE_BLOCK_SIZE;
-
-        size_t in_block_end
-            = next_offset <= end ? next_offset - 1 : end - 1;
-        in_block_end %= INODE_BLOCK_SIZE;
-        size_t in_block_start = current;
-        in_block_start %= INODE_BLOCK_SIZE;
-        char key[30];
-        if (!xattrs) {
-            get_key(key, inode->id, current_block);
+    size_t first = offset / INODE_BLOCK_SIZE;
+    size_t cnt = (end - 1) / INODE_BLOCK_SIZE - first + 1;
+    char* values = malloc(cnt * INODE_BLOCK_SIZE);
+    size_t* blocks = malloc(cnt * sizeof(size_t));
+    char** dst = malloc(cnt * sizeof(char*));
+    if (values == NULL || blocks == NULL || dst == NULL) {
+        read = -ENOMEM;
+    } else {
+        for (size_t i = 0; i < cnt; i++) {
+            blocks[i] = first + i;
+            dst[i] = values + i * INODE_BLOCK_SIZE;
+        }
+        if (load_blocks(inode, blocks, cnt, xattrs, dst)) {
+            read = end - offset;
+            memcpy(buff, values + offset % INODE_BLOCK_SIZE, read);
         } else {
-            get_xattrs(key, inode->id, current_block);
+            read = -EIO;
         }
-
-        char value[INODE_BLOCK_SIZE];
-        if (!memcache_get(memcache, key, value))
-            goto inode_read_at_end;
-
-        memcpy(buffer + read, value + in_block_start, in_block_end - in_block_start + 1);
-        read += in_block_end - in_block_start + 1;
-        current = next_offset;
     }
+    free(dst);
+    free(blocks);
+    free(values);
 
 inode_read_at_end:
     pthread_mutex_unlock(&inode->lock);
@@ -161,9 +616,6 @@ size_t inode_write_at(struct inode* inode, const void* buff, size_t size,
     size_t offset, bool xattrs)
 {
     pthread_mutex_lock(&inode->lock);
-    bool metadate_modified = false;
-    const char* buffer = buff;
-    size_t current = offset;
     size_t end = offset + size;
     size_t written = 0;
     size_t length = xattrs ? inode->metadata.xattrs_length : inode->metadata.length;
@@ -174,80 +626,303 @@ size_t inode_write_at(struct inode* inode, const void* buff, size_t size,
 
     /* printf("\n\nstarted writing in %d offset : %zu\n\n", inode->id, offset); */
 
-    while (current < end) {
-        size_t current_block = current / INODE_BLOCK_SIZE;
-        size_t current_start = current * INODE_BLOCK_SIZE;
-        size_t next_offset = (current_block + 1) * INODE_BLOCK_SIZE;
-
-        size_t in_block_end
-            = next_offset <= end ? next_offset - 1 : end - 1;
-        in_block_end %= INODE_BLOCK_SIZE;
-        size_t in_block_start = current;
-        in_block_start %= INODE_BLOCK_SIZE;
-
-        /* printf("copping in block %zu\n", current_block);
-        printf("from : %zu to : %zu \n\n", in_block_start, in_block_end); */
-        char key[30];
-        if (!xattrs) {
-            get_key(key, inode->id, current_block);
-        } else {
-            get_xattrs(key, inode->id, current_block);
+    if (size == 0)
+        goto inode_write_at_end;
+
+    size_t first = offset / INODE_BLOCK_SIZE;
+    size_t last = (end - 1) / INODE_BLOCK_SIZE;
+    size_t cnt = last - first + 1;
+    char* values = calloc(cnt, INODE_BLOCK_SIZE);
+    size_t stored = 0;
+    if (values == NULL)
+        goto inode_write_at_end;
+
+    if (is_dedup(inode, xattrs)) {
+        /* Only partially overwritten edge blocks have to be fetched */
+        size_t edges[2];
+        char* edge_values[2];
+        size_t edge_cnt = 0;
+        if (first < block_cnt && (offset % INODE_BLOCK_SIZE != 0 || (cnt == 1 && end % INODE_BLOCK_SIZE != 0))) {
+            edges[edge_cnt] = first;
+            edge_values[edge_cnt++] = values;
         }
-        char value[INODE_BLOCK_SIZE];
-        if (current_block < block_cnt && (in_block_end != INODE_BLOCK_SIZE - 1 || in_block_start != 0)) {
-            memcache_get(memcache, key, value);
+        if (last != first && last < block_cnt && end % INODE_BLOCK_SIZE != 0) {
+            edges[edge_cnt] = last;
+            edge_values[edge_cnt++] = values + (cnt - 1) * INODE_BLOCK_SIZE;
         }
-
-        memcpy(value + in_block_start, buffer + written, in_block_end - in_block_start + 1);
-        if (!memcache_add(memcache, key, value, INODE_BLOCK_SIZE))
-            goto inode_write_at_end;
-        written += in_block_end - in_block_start + 1;
-        current = next_offset;
+        if (load_blocks(inode, edges, edge_cnt, xattrs, edge_values)) {
+            memcpy(values + offset % INODE_BLOCK_SIZE, buff, size);
+            stored = store_blocks(inode, first, cnt, xattrs, values);
+        }
+    } else {
+        stored = write_blocks(inode, first, cnt, xattrs, values, buff, size, offset, block_cnt);
     }
+    /* Count bytes up to the first block which wasn't stored */
+    if (stored == cnt)
+        written = size;
+    else if (stored > 0)
+        written = (first + stored) * INODE_BLOCK_SIZE - offset;
+    free(values);
 
 inode_write_at_end:
+    if (written > 0)
+        inode->changed = true;
     if (written > 0 && length < offset + written) {
         length = offset + written;
-        if (xattrs)
-            inode->metadata.xattrs_length = length;
-        else
-            inode->metadata.length = length;
-        char key[30];
-        get_metadata(key, inode->id);
-        memcache_add(memcache, key, &inode->metadata, sizeof(inode->metadata));
+        set_length(inode, length, xattrs);
+        store_metadata(inode);
     }
     pthread_mutex_unlock(&inode->lock);
 
     return written;
 }
 
-void inode_close(struct inode* inode)
+bool inode_replace_at(struct inode* inode, const void* buff, size_t size,
+    size_t offset, const void* expected, size_t expected_size)
 {
-    if (inode == NULL)
-        return;
+    size_t block = offset / INODE_BLOCK_SIZE;
+    assert(!is_dedup(inode, false));
+    assert(size > 0 && (offset + size - 1) / INODE_BLOCK_SIZE == block && expected_size <= size);
+
+    char value[INODE_BLOCK_SIZE];
+    char* dst = value;
+    struct memcache_item item;
+    get_key(item.key, inode->id, block);
+    bool res = false;
     pthread_mutex_lock(&inode->lock);
-    inode->open_cnt--;
-    if (inode->open_cnt == 0) {
-        list_remove(&inode->elem);
-        if (inode->is_deleted) {
-            char key[30];
-            for (int i = 0; i <= inode->metadata.length / INODE_BLOCK_SIZE; i++) {
-                get_key(key, inode->id, i);
-                memcache_delete(memcache, key);
-            }
-            for (int i = 0; i <= inode->metadata.xattrs_length / INODE_BLOCK_SIZE; i++) {
-                get_xattrs(key, inode->id, i);
-                memcache_delete(memcache, key);
-            }
+    for (int attempt = 0; offset + size <= inode->metadata.length && attempt < CAS_RETRIES; attempt++) {
+        item.cas = 0;
+        if (!block_gets_multi(memcache, &item, 1, &dst)
+            || memcmp(value + offset % INODE_BLOCK_SIZE, expected, expected_size) != 0)
+            break;
+        memcpy(value + offset % INODE_BLOCK_SIZE, buff, size);
+        bool missing = item.cas == 0;
+        if (!block_cas_multi(memcache, &item, 1, &dst))
+            break;
+        if (item.found) {
+            if (missing)
+                usage_add(1, 0);
+            inode->changed = true;
+            res = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inode->lock);
+    return res;
+}
+
+/*
+ * Makes destination blocks reference the same stored blocks as source, 
+ * both inodes have to be deduplicated. Returns number of shared blocks.
+ */
+static size_t share_blocks(struct inode* from, size_t from_block,
+    struct inode* to, size_t to_block, size_t cnt)
+{
+    struct block_map map;
+    pthread_mutex_lock(&from->lock);
+    bool res = block_map_load(&map, from->id, from_block, cnt);
+    pthread_mutex_unlock(&from->lock);
+    if (!res)
+        return 0;
 
-            get_metadata(key, inode->id);
-            memcache_delete(memcache, key);
-            free_inode(inode->id);
+    struct block_hash* hashes = malloc(cnt * sizeof(struct block_hash));
+    if (hashes == NULL || !dedup_acquire(memcpy(hashes, block_map_at(&map, from_block), cnt * sizeof(struct block_hash)), cnt)) {
+        free(hashes);
+        block_map_free(&map);
+        return 0;
+    }
+    block_map_free(&map);
+
+    pthread_mutex_lock(&to->lock);
+    size_t shared = 0;
+    if (block_map_load(&map, to->id, to_block, cnt)) {
+        memcpy(block_map_at(&map, to_block), hashes, cnt * sizeof(struct block_hash));
+        if (block_map_store(&map)) {
+            dedup_release(block_map_replaced(&map, to_block), cnt);
+            shared = cnt;
         }
+        block_map_free(&map);
+    }
+    if (shared > 0 && to->metadata.length < (to_block + cnt) * INODE_BLOCK_SIZE) {
+        set_length(to, (to_block + cnt) * INODE_BLOCK_SIZE, false);
+        store_metadata(to);
+    }
+    pthread_mutex_unlock(&to->lock);
 
-        free(inode);
+    if (shared == 0)
+        dedup_release(hashes, cnt);
+    free(hashes);
+    return shared;
+}
+
+size_t inode_copy_range(struct inode* from, size_t from_offset,
+    struct inode* to, size_t to_offset, size_t size)
+{
+    char* buffer = malloc(COPY_CHUNK_SIZE);
+    if (buffer == NULL)
+        return 0;
+
+    size_t length = inode_length(from);
+    if (from_offset >= length)
+        size = 0;
+    else if (size > length - from_offset)
+        size = length - from_offset;
+
+    bool share = is_dedup(from, false) && is_dedup(to, false)
+        && from_offset % INODE_BLOCK_SIZE == 0 && to_offset % INODE_BLOCK_SIZE == 0;
+
+    size_t copied = 0;
+    while (copied < size) {
+        size_t chunk = size - copied < COPY_CHUNK_SIZE ? size - copied : COPY_CHUNK_SIZE;
+
+        /* Whole deduplicated blocks are shared instead of copied */
+        if (share && chunk >= INODE_BLOCK_SIZE) {
+            size_t blocks = chunk / INODE_BLOCK_SIZE;
+            size_t shared = share_blocks(from, (from_offset + copied) / INODE_BLOCK_SIZE,
+                to, (to_offset + copied) / INODE_BLOCK_SIZE, blocks);
+            copied += shared * INODE_BLOCK_SIZE;
+            if (shared == blocks)
+                continue;
+            share = false;
+        }
+
+        ssize_t read = inode_read_at(from, buffer, chunk, from_offset + copied, false);
+        if (read <= 0)
+            break;
+        size_t written = inode_write_at(to, buffer, read, to_offset + copied, false);
+        copied += written;
+        if (written < (size_t)read)
+            break;
+    }
+
+    free(buffer);
+    return copied;
+}
+
+static bool write_zeros(struct inode* inode, size_t offset, size_t end)
+{
+    char zeros[INODE_BLOCK_SIZE];
+    memset(zeros, 0, INODE_BLOCK_SIZE);
+    while (offset < end) {
+        size_t chunk = end - offset < INODE_BLOCK_SIZE ? end - offset : INODE_BLOCK_SIZE;
+        if (inode_write_at(inode, zeros, chunk, offset, false) != chunk)
+            return false;
+        offset += chunk;
+    }
+    return true;
+}
+
+bool inode_punch_hole(struct inode* inode, size_t offset, size_t size)
+{
+    size_t length = inode_length(inode);
+    size_t end = offset + size < length ? offset + size : length;
+    if (offset >= end)
+        return true;
+
+    /* Blocks fully inside the range are dropped, edges are zeroed */
+    size_t first = (offset + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+    size_t last = end == length ? (end + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE : end / INODE_BLOCK_SIZE;
+    if (first >= last)
+        return write_zeros(inode, offset, end);
+    if (!write_zeros(inode, offset, first * INODE_BLOCK_SIZE)
+        || !write_zeros(inode, last * INODE_BLOCK_SIZE, end))
+        return false;
+
+    bool res = false;
+    pthread_mutex_lock(&inode->lock);
+    if (is_dedup(inode, false)) {
+        struct block_map map;
+        if (block_map_load(&map, inode->id, first, last - first)) {
+            memset(block_map_at(&map, first), 0, (last - first) * sizeof(struct block_hash));
+            res = block_map_store(&map);
+            if (res)
+                dedup_release(block_map_replaced(&map, first), last - first);
+            block_map_free(&map);
+        }
+    } else {
+        struct memcache_item* items = malloc((last - first) * sizeof(struct memcache_item));
+        if (items != NULL) {
+            for (size_t i = first; i < last; i++)
+                get_key(items[i - first].key, inode->id, i);
+            res = memcache_delete_multi(memcache, items, last - first);
+            for (size_t i = 0; res && i < last - first; i++)
+                usage_add(-(int64_t)items[i].found, 0);
+        }
+        free(items);
+    }
+    if (res)
+        inode->changed = true;
+    pthread_mutex_unlock(&inode->lock);
+    return res;
+}
+
+bool inode_extend(struct inode* inode, size_t length)
+{
+    pthread_mutex_lock(&inode->lock);
+    bool res = true;
+    if (inode->metadata.length < length) {
+        set_length(inode, length, false);
+        res = store_metadata(inode);
     }
     pthread_mutex_unlock(&inode->lock);
+    return res;
+}
+
+bool inode_grow(struct inode* inode, size_t expected, size_t length)
+{
+    pthread_mutex_lock(&inode->lock);
+    bool res = inode->metadata.length == expected;
+    if (res) {
+        set_length(inode, length, false);
+        res = update_metadata(inode, true);
+        /* Length which couldn't be stored isn't kept */
+        if (!res && inode->metadata.length != inode->stored.length)
+            set_length(inode, inode->stored.length, false);
+    }
+    pthread_mutex_unlock(&inode->lock);
+    return res;
+}
+
+bool inode_truncate(struct inode* inode, size_t length)
+{
+    size_t old_length = inode_length(inode);
+    if (length >= old_length)
+        return inode_extend(inode, length);
+    if (!inode_punch_hole(inode, length, old_length - length))
+        return false;
+
+    pthread_mutex_lock(&inode->lock);
+    bool res = true;
+    if (inode->metadata.length > length) {
+        set_length(inode, length, false);
+        res = store_metadata(inode);
+    }
+    pthread_mutex_unlock(&inode->lock);
+    return res;
+}
+
+void inode_close(struct inode* inode)
+{
+    if (inode == NULL)
+        return;
+    /* Openers find inode under inodes_lock, it is unlisted before it's freed */
+    pthread_mutex_lock(&inodes_lock);
+    pthread_mutex_lock(&inode->lock);
+    bool last = --inode->open_cnt == 0;
+    if (last)
+        list_remove(&inode->elem);
+    pthread_mutex_unlock(&inode->lock);
+    pthread_mutex_unlock(&inodes_lock);
+    if (!last)
+        return;
+
+    /* Stored data goes in background, id is reused only after that */
+    if (inode->is_deleted)
+        reaper_queue(inode->id, &inode->metadata, inode->intent);
+    else
+        journal_end(inode->intent);
+    pthread_mutex_destroy(&inode->lock);
+    free(inode);
 }
 
 void inode_remove(struct inode* inode)
@@ -259,6 +934,16 @@ void inode_remove(struct inode* inode)
     pthread_mutex_unlock(&inode->lock);
 }
 
+void inode_set_intent(struct inode* inode, uint64_t seq)
+{
+    pthread_mutex_lock(&inode->lock);
+    uint64_t old = inode->intent;
+    inode->intent = seq;
+    pthread_mutex_unlock(&inode->lock);
+    /* Replay of newer intent removes inode too */
+    journal_end(old);
+}
+
 size_t inode_length(struct inode* inode)
 {
     if (inode == NULL)
@@ -272,34 +957,6 @@ bool inode_is_dir(struct inode* inode)
     return inode->metadata.is_dir;
 }
 
-bool inode_path_register(const char* path, int inode_id)
-{
-    char key[256];
-    sprintf(key, "ipth#%s", path);
-    return memcache_add(memcache, key, &inode_id, sizeof(int));
-}
-
-struct inode* inode_get_from_path(const char* path)
-{
-    /* printf("getting key : %s\n\n", path); */
-    char key[256];
-    sprintf(key, "ipth#%s", path);
-    int res = -1;
-
-    if (memcache_get(memcache, key, &res)) {
-        /*         printf("\n\n\n resssss :          %d\n", res); */
-        return inode_open(res);
-    }
-    return NULL;
-}
-
-bool inode_path_delete(const char* path)
-{
-    char key[256];
-    sprintf(key, "ipth#%s", path);
-    return memcache_delete(memcache, key);
-}
-
 bool is_inode(struct inode* inode)
 {
     return inode != NULL && inode->magic == INODE_MAGIC;
@@ -314,9 +971,37 @@ bool inode_flush_metadata(struct inode* inode)
 {
     if (inode == NULL)
         return false;
-    char key[30];
-    get_metadata(key, inode->id);
-    return memcache_add(memcache, key, &inode->metadata, sizeof(inode->metadata));
+    return store_metadata(inode);
+}
+
+bool inode_refresh(struct inode* inode)
+{
+    if (inode == NULL)
+        return false;
+    struct inode_disk_metadata metadata;
+    struct memcache_item item;
+    get_metadata(item.key, inode->id);
+    item.buff = &metadata;
+    item.size = sizeof(struct inode_disk_metadata);
+    if (!memcache_gets_multi(memcache, &item, 1) || !item.found
+        || item.size != sizeof(struct inode_disk_metadata))
+        return false;
+    pthread_mutex_lock(&inode->lock);
+    inode->metadata = metadata;
+    inode->stored = metadata;
+    inode->cas = item.cas;
+    pthread_mutex_unlock(&inode->lock);
+    uncache_metadata(inode->id);
+    return true;
+}
+
+bool inode_take_changed(struct inode* inode)
+{
+    pthread_mutex_lock(&inode->lock);
+    bool changed = inode->changed;
+    inode->changed = false;
+    pthread_mutex_unlock(&inode->lock);
+    return changed;
 }
 
 bool inode_check_permission(struct inode* inode, permission_t permission)
@@ -358,4 +1043,204 @@ bool inode_check_permission(struct inode* inode, permission_t permission)
         }
     }
     return false;
-}
\ No newline at end of file
+}
+/* Deletes keys, deleted blocks are taken out of usage */
+static void delete_reclaimed(struct memcache_item* items, size_t cnt, bool blocks)
+{
+    if (!memcache_delete_multi(memcache, items, cnt) || !blocks)
+        return;
+    for (size_t i = 0; i < cnt; i++)
+        usage_add(-(int64_t)items[i].found, 0);
+}
+
+/* Deletes key of ITEMS[*CNT] once batch is full */
+static void add_reclaimed(struct memcache_item* items, size_t* cnt, bool blocks)
+{
+    if (++*cnt == RECLAIM_BATCH) {
+        delete_reclaimed(items, *cnt, blocks);
+        *cnt = 0;
+    }
+}
+
+void inode_reclaim(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt)
+{
+    struct memcache_item* items = malloc(RECLAIM_BATCH * sizeof(struct memcache_item));
+    if (items == NULL)
+        return;
+
+    size_t item_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        /* Id may be reused, nobody can keep serving cached metadata */
+        lease_break(ids[i]);
+        uncache_metadata(ids[i]);
+        lease_forget(ids[i]);
+
+        size_t blocks = (metadata[i].length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+        if (metadata[i].flags & INODE_DEDUP) {
+            dedup_remove_map(ids[i], blocks);
+        } else {
+            for (size_t j = 0; j < blocks; j++) {
+                get_key(items[item_cnt].key, ids[i], j);
+                add_reclaimed(items, &item_cnt, true);
+            }
+        }
+        blocks = (metadata[i].xattrs_length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+        for (size_t j = 0; j < blocks; j++) {
+            get_xattrs(items[item_cnt].key, ids[i], j);
+            add_reclaimed(items, &item_cnt, true);
+        }
+        count_length(metadata[i].length, 0);
+        count_length(metadata[i].xattrs_length, 0);
+    }
+    delete_reclaimed(items, item_cnt, true);
+
+    /* Metadata goes last, inode cut by crash can still be found and removed again */
+    item_cnt = 0;
+    for (size_t i = 0; i < cnt; i++) {
+        get_metadata(items[item_cnt].key, ids[i]);
+        add_reclaimed(items, &item_cnt, false);
+    }
+    delete_reclaimed(items, item_cnt, false);
+    free(items);
+}
+
+/**
+ * Blocks of one inode past its length which are probed next
+ */
+struct stray_cursor {
+    int inode_id;
+    bool xattrs;
+    size_t block;
+};
+
+size_t inode_find_stray(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt,
+    bool remove)
+{
+    struct stray_cursor* cursors = malloc(2 * cnt * sizeof(struct stray_cursor));
+    struct memcache_item* items = malloc(2 * cnt * STRAY_WINDOW * sizeof(struct memcache_item));
+    char* value = malloc(BLOCK_VALUE_MAX);
+    size_t cursor_cnt = 0;
+    size_t found = 0;
+
+    /* Block map of deduplicated inode tells which blocks it has, only plain blocks are probed */
+    for (size_t i = 0; cursors != NULL && i < cnt; i++) {
+        if (!(metadata[i].flags & INODE_DEDUP)) {
+            cursors[cursor_cnt].inode_id = ids[i];
+            cursors[cursor_cnt].xattrs = false;
+            cursors[cursor_cnt++].block = (metadata[i].length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+        }
+        cursors[cursor_cnt].inode_id = ids[i];
+        cursors[cursor_cnt].xattrs = true;
+        cursors[cursor_cnt++].block = (metadata[i].xattrs_length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+    }
+
+    /* Probing goes on while window finds anything, values are read into one scratch buffer */
+    while (items != NULL && value != NULL && cursor_cnt > 0) {
+        size_t item_cnt = 0;
+        for (size_t c = 0; c < cursor_cnt; c++) {
+            for (size_t j = 0; j < STRAY_WINDOW; j++, item_cnt++) {
+                if (cursors[c].xattrs)
+                    get_xattrs(items[item_cnt].key, cursors[c].inode_id, cursors[c].block + j);
+                else
+                    get_key(items[item_cnt].key, cursors[c].inode_id, cursors[c].block + j);
+                items[item_cnt].buff = value;
+                items[item_cnt].size = BLOCK_VALUE_MAX;
+            }
+        }
+        if (!memcache_get_multi(memcache, items, item_cnt))
+            break;
+
+        size_t kept = 0, stray_cnt = 0;
+        for (size_t c = 0; c < cursor_cnt; c++) {
+            bool any = false;
+            for (size_t j = 0; j < STRAY_WINDOW; j++) {
+                struct memcache_item* item = &items[c * STRAY_WINDOW + j];
+                if (item->found) {
+                    items[stray_cnt++] = *item;
+                    any = true;
+                }
+            }
+            if (any) {
+                cursors[kept] = cursors[c];
+                cursors[kept++].block += STRAY_WINDOW;
+            }
+        }
+        found += stray_cnt;
+        if (remove && memcache_delete_multi(memcache, items, stray_cnt)) {
+            for (size_t i = 0; i < stray_cnt; i++)
+                usage_add(-(int64_t)items[i].found, 0);
+        }
+        cursor_cnt = kept;
+    }
+
+    free(value);
+    free(items);
+    free(cursors);
+    return found;
+}
+
+/* Probes keys of ITEMS and adds number of found ones to FOUND */
+static bool count_found(struct memcache_item* items, size_t cnt, size_t* found)
+{
+    if (!memcache_get_multi(memcache, items, cnt))
+        return false;
+    for (size_t i = 0; i < cnt; i++)
+        *found += items[i].found;
+    return true;
+}
+
+bool inode_count_blocks(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt,
+    size_t* blocks)
+{
+    struct memcache_item* items = malloc(COUNT_BATCH * sizeof(struct memcache_item));
+    char* value = malloc(BLOCK_VALUE_MAX);
+    bool res = items != NULL && value != NULL;
+    size_t item_cnt = 0;
+    *blocks = 0;
+
+    /* Holes are missing keys, values are read into one scratch buffer */
+    for (size_t i = 0; res && i < cnt; i++) {
+        size_t data = metadata[i].flags & INODE_DEDUP ? 0 : (metadata[i].length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+        size_t xattrs = (metadata[i].xattrs_length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+        for (size_t j = 0; res && j < data + xattrs; j++) {
+            if (j < data)
+                get_key(items[item_cnt].key, ids[i], j);
+            else
+                get_xattrs(items[item_cnt].key, ids[i], j - data);
+            items[item_cnt].buff = value;
+            items[item_cnt].size = BLOCK_VALUE_MAX;
+            if (++item_cnt == COUNT_BATCH) {
+                res = count_found(items, item_cnt, blocks);
+                item_cnt = 0;
+            }
+        }
+    }
+    res = res && count_found(items, item_cnt, blocks);
+
+    free(value);
+    free(items);
+    return res;
+}
+
+bool inode_list_keys(int inode_id, const struct inode_disk_metadata* metadata,
+    key_visitor visit, void* aux)
+{
+    char key[MEMCACHE_KEY_MAX + 1];
+    get_metadata(key, inode_id);
+    visit(key, false, aux);
+
+    size_t blocks = (metadata->xattrs_length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+    for (size_t i = 0; i < blocks; i++) {
+        get_xattrs(key, inode_id, i);
+        visit(key, false, aux);
+    }
+
+    blocks = (metadata->length + INODE_BLOCK_SIZE - 1) / INODE_BLOCK_SIZE;
+    if (metadata->flags & INODE_DEDUP)
+        return dedup_list_keys(inode_id, blocks, visit, aux);
+    for (size_t i = 0; i < blocks; i++) {
+        get_key(key, inode_id, i);
+        visit(key, false, aux);
+    }
+    return true;
+}
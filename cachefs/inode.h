@@ -5,12 +5,21 @@
 #define FUSE_USE_VERSION 31
 
 #include "list.h"
+#include "keys.h"
 #include "memcache.h"
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 
 #define DIR_MAGIC 123130234
+#define INODE_BLOCK_SIZE 4096
+
+/* Optional features, enabled for whole mount */
+#define FEATURE_DEDUP 0x1
+#define FEATURE_COMPRESS 0x2
+
+/* Flags of single inode, stored in its metadata */
+#define INODE_DEDUP 0x1 // Blocks are content addressed through block map
 
 typedef enum {
     READ = 0,
@@ -29,6 +38,7 @@ struct inode_disk_metadata {
     __gid_t gid;
     size_t link_cnt;
     size_t xattrs_length;
+    int flags;
 };
 
 /**
@@ -38,10 +48,14 @@ struct inode {
     int id;
     int open_cnt;
     bool is_deleted;
+    bool changed; // Data changed since it was last announced to other mounts
     struct list_elem elem;
     int magic;
     pthread_mutex_t lock;
     struct inode_disk_metadata metadata;
+    struct inode_disk_metadata stored; // Metadata as last read from or written to memcache
+    uint64_t cas; // Unique of stored metadata, 0 if it isn't known
+    uint64_t intent; // Journal record which ends when inode is closed for the last time
 };
 
 /**
@@ -54,6 +68,16 @@ struct inode {
  */
 void init_inodes(struct memcache_t* mem, __gid_t gid, __uid_t uid);
 
+/**
+ * Function : inode_set_features
+ * ----------------------------------------
+ * Sets optional features used for newly created inodes
+ * 
+ * enabled  : FEATURE_* flags
+ *
+ */
+void inode_set_features(int enabled);
+
 /**
  * Function : inode_create
  * ----------------------------------------
@@ -77,6 +101,22 @@ bool inode_create(int inode_id, bool is_dir, __gid_t gid, __uid_t uid, __mode_t
  */
 struct inode* inode_open(int id);
 
+/**
+ * Function : inode_get_metadata_multi
+ * ----------------------------------------
+ * Reads metadata of many inodes without opening them, stored 
+ * metadata is fetched with one multi-get
+ * 
+ * ids      : ids of inodes
+ * cnt      : number of inodes
+ * metadata : where metadata of inodes should be written
+ * found    : set for inodes which exist
+ * 
+ * Returns  : true if metadata was read and false on connection error
+ */
+bool inode_get_metadata_multi(const int* ids, size_t cnt, struct inode_disk_metadata* metadata,
+    bool* found);
+
 /**
  * Function : inode_reopen
  * ----------------------------------------
@@ -98,15 +138,18 @@ struct inode* inode_reopen(struct inode* inode);
  * size     : size of data to read
  * offset   : offset in inode from where read starts 
  * 
- * Returns  : number of read bytes
+ * Returns  : number of read bytes, -EIO if stored data couldn't be read
+ *            or -ENOMEM
  */
-size_t inode_read_at(struct inode* inode, void* buff, size_t size,
+ssize_t inode_read_at(struct inode* inode, void* buff, size_t size,
     size_t offset, bool xattrs);
 
 /**
  * Function : inode_write_at
  * ----------------------------------------
- * Writes data in inode 
+ * Writes data in inode. Blocks which are written only partially
+ * are updated atomically, so writes of other mounts to the rest
+ * of them are kept
  * 
  * inode    : inode to write
  * buff     : buffer from where data should be copied to inode
@@ -118,6 +161,95 @@ size_t inode_read_at(struct inode* inode, void* buff, size_t size,
 size_t inode_write_at(struct inode* inode, const void* buff, size_t size,
     size_t offset, bool xattrs);
 
+/**
+ * Function : inode_copy_range
+ * ----------------------------------------
+ * Copies data between inodes without passing it through the kernel,
+ * blocks are moved in pipelined batches
+ * 
+ * from        : inode to copy from
+ * from_offset : offset in source inode
+ * to          : inode to copy to
+ * to_offset   : offset in destination inode
+ * size        : size of data to copy
+ * 
+ * Returns  : number of copied bytes
+ */
+size_t inode_copy_range(struct inode* from, size_t from_offset,
+    struct inode* to, size_t to_offset, size_t size);
+
+/**
+ * Function : inode_punch_hole
+ * ----------------------------------------
+ * Zeroes range of inode, whole blocks inside the range are
+ * deleted and read back as zeros. Length is not changed
+ * 
+ * inode    : inode to modify
+ * offset   : start of the range
+ * size     : size of the range
+ * 
+ * Returns  : true if range was successfully zeroed
+ */
+bool inode_punch_hole(struct inode* inode, size_t offset, size_t size);
+
+/**
+ * Function : inode_replace_at
+ * ----------------------------------------
+ * Writes data inside one block of inode only if the block still 
+ * holds expected bytes at offset, check and write are atomic even 
+ * when other mounts write the same block
+ * 
+ * inode    : inode to write, not deduplicated
+ * buff     : data to write
+ * size     : size of data, range has to be inside inode and one block
+ * offset   : offset in inode from where write starts
+ * expected : bytes expected at offset
+ * expected_size : number of expected bytes
+ * 
+ * Returns  : true if data was written
+ */
+bool inode_replace_at(struct inode* inode, const void* buff, size_t size,
+    size_t offset, const void* expected, size_t expected_size);
+
+/**
+ * Function : inode_grow
+ * ----------------------------------------
+ * Changes length of inode only if nobody else changed it, 
+ * other mounts included. Grown range is a hole
+ * 
+ * inode    : inode to grow
+ * expected : length inode should have
+ * length   : new length
+ * 
+ * Returns  : true if length was changed and saved, on conflict 
+ *            length stored by other mount is taken
+ */
+bool inode_grow(struct inode* inode, size_t expected, size_t length);
+
+/**
+ * Function : inode_extend
+ * ----------------------------------------
+ * Grows inode to given length, new range is a hole
+ * 
+ * inode    : inode to grow
+ * length   : new length, nothing happens if inode is already longer
+ * 
+ * Returns  : true if metadata was successfully saved
+ */
+bool inode_extend(struct inode* inode, size_t length);
+
+/**
+ * Function : inode_truncate
+ * ----------------------------------------
+ * Changes length of inode, blocks past new length are deleted
+ * 
+ * inode    : inode to resize
+ * length   : new length
+ * 
+ * Returns  : true if inode was successfully resized
+ */
+bool inode_truncate(struct inode* inode, size_t length);
+
 /**
  * Function : inode_close
  * ----------------------------------------
@@ -160,45 +292,108 @@ size_t inode_length(struct inode* inode);
  */
 bool inode_is_dir(struct inode* inode);
 
+bool is_inode(struct inode* inode);
+
+size_t inode_xattrs_length(struct inode* inode);
+
+bool inode_flush_metadata(struct inode* inode);
+
 /**
- * Function : inode_path_register
+ * Function : inode_refresh
  * ----------------------------------------
- * Checks if inode is directory 
+ * Reads metadata again, after other mount changed the inode
  * 
  * inode    : inode 
  * 
- * Returns  : true if inode is directory
+ * Returns  : true if metadata was read
  */
-bool inode_path_register(const char* path, int inode_id);
+bool inode_refresh(struct inode* inode);
 
 /**
- * Function : inode_get_from_path
+ * Function : inode_take_changed
  * ----------------------------------------
- * Checks if inode is directory 
+ * Checks if data or length changed since last call
  * 
  * inode    : inode 
  * 
- * Returns  : true if inode is directory
+ * Returns  : true if inode changed
  */
-struct inode* inode_get_from_path(const char* path);
+bool inode_take_changed(struct inode* inode);
+
+bool inode_check_permission(struct inode* inode, permission_t permission);
 
 /**
- * Function : inode_path_delete
+ * Function : inode_set_intent
  * ----------------------------------------
- * Checks if inode is directory 
- * 
- * inode    : inode 
+ * Keeps journal record of operation which removed inode open until
+ * inode is closed for the last time and removed from memcached
  * 
- * Returns  : true if inode is directory
+ * inode    : inode
+ * seq      : number of journal record
  */
-bool inode_path_delete(const char* path);
+void inode_set_intent(struct inode* inode, uint64_t seq);
 
-bool is_inode(struct inode* inode);
+/**
+ * Function : inode_reclaim
+ * ----------------------------------------
+ * Deletes data blocks, extended attributes and metadata of removed
+ * inodes with pipelined requests, ids stay taken
+ * 
+ * ids      : ids of inodes
+ * metadata : last metadata of inodes
+ * cnt      : number of inodes
+ */
+void inode_reclaim(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt);
 
-size_t inode_xattrs_length(struct inode* inode);
+/**
+ * Function : inode_find_stray
+ * ----------------------------------------
+ * Finds data and extended attribute blocks stored past lengths of
+ * inodes, write cut by crash before its metadata was stored leaves
+ * them. Keys after the last block are probed in windows, probing
+ * stops at first window which finds nothing
+ * 
+ * ids      : ids of inodes
+ * metadata : metadata of inodes
+ * cnt      : number of inodes
+ * remove   : found blocks are deleted
+ * 
+ * Returns  : number of found blocks
+ */
+size_t inode_find_stray(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt,
+    bool remove);
 
-bool inode_flush_metadata(struct inode* inode);
+/**
+ * Function : inode_count_blocks
+ * ----------------------------------------
+ * Counts data and extended attribute blocks stored inside lengths
+ * of inodes, holes aren't counted. Data of deduplicated inodes is
+ * shared and isn't counted
+ * 
+ * ids      : ids of inodes
+ * metadata : metadata of inodes
+ * cnt      : number of inodes
+ * blocks   : where number of stored blocks is written
+ * 
+ * Returns  : true if every key was probed
+ */
+bool inode_count_blocks(const int* ids, const struct inode_disk_metadata* metadata, size_t cnt,
+    size_t* blocks);
 
-bool inode_check_permission(struct inode* inode, permission_t permission);
+/**
+ * Function : inode_list_keys
+ * ----------------------------------------
+ * Reports keys of metadata, data blocks (or block map and shared
+ * blocks) and extended attributes of inode, some may be holes
+ * 
+ * inode_id : id of inode
+ * metadata : metadata of inode
+ * visit    : called for every key
+ * aux      : passed to visit
+ * 
+ * Returns  : false if block map couldn't be read
+ */
+bool inode_list_keys(int inode_id, const struct inode_disk_metadata* metadata,
+    key_visitor visit, void* aux);
 
 #endif
\ No newline at end of file
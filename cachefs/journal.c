@@ -0,0 +1,271 @@
+#include "journal.h"
+#include "hash.h"
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_INTENT 1
+#define RECORD_END 2
+
+struct record_header {
+    uint32_t type;
+    uint32_t crc; // Of header with zero crc and intent which follows it
+    uint64_t seq;
+};
+
+struct pending {
+    uint64_t seq;
+    struct intent intent;
+};
+
+static const char* journal_path;
+static int fd = -1;
+static uint64_t last_seq;
+static uint64_t written; // Bytes appended since mount, never reset
+static uint64_t durable; // Appended bytes known to be on disk
+static size_t file_size;
+static bool syncing; // Some caller runs fdatasync for everybody
+static struct pending* pending; // Intents without end record, in order of seq
+static size_t pending_cnt;
+static size_t pending_cap;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t synced_cond = PTHREAD_COND_INITIALIZER;
+
+static size_t record_size(uint32_t type)
+{
+    return sizeof(struct record_header) + (type == RECORD_INTENT ? sizeof(struct intent) : 0);
+}
+
+static uint32_t record_crc(struct record_header header, const struct intent* intent)
+{
+    header.crc = 0;
+    uint32_t crc = crc32c(0, &header, sizeof(header));
+    return header.type == RECORD_INTENT ? crc32c(crc, intent, sizeof(struct intent)) : crc;
+}
+
+static bool write_record(int file, uint32_t type, uint64_t seq, const struct intent* intent)
+{
+    char buff[sizeof(struct record_header) + sizeof(struct intent)];
+    struct record_header header = { type, 0, seq };
+    header.crc = record_crc(header, intent);
+    memcpy(buff, &header, sizeof(header));
+    if (type == RECORD_INTENT)
+        memcpy(buff + sizeof(header), intent, sizeof(struct intent));
+
+    /* Record goes with one write, torn tail is found by checksum */
+    size_t size = record_size(type);
+    for (size_t done = 0; done < size;) {
+        ssize_t res = write(file, buff + done, size - done);
+        if (res <= 0)
+            return false;
+        done += res;
+    }
+    return true;
+}
+
+static bool append_record(uint32_t type, uint64_t seq, const struct intent* intent)
+{
+    if (!write_record(fd, type, seq, intent))
+        return false;
+    written += record_size(type);
+    file_size += record_size(type);
+    return true;
+}
+
+static void forget_pending(uint64_t seq)
+{
+    for (size_t i = 0; i < pending_cnt; i++) {
+        if (pending[i].seq == seq) {
+            memmove(&pending[i], &pending[i + 1], (pending_cnt - i - 1) * sizeof(struct pending));
+            pending_cnt--;
+            return;
+        }
+    }
+}
+
+static bool add_pending(uint64_t seq, const struct intent* intent)
+{
+    if (pending_cnt == pending_cap) {
+        size_t cap = pending_cap == 0 ? 64 : 2 * pending_cap;
+        struct pending* grown = realloc(pending, cap * sizeof(struct pending));
+        if (grown == NULL)
+            return false;
+        pending = grown;
+        pending_cap = cap;
+    }
+    pending[pending_cnt].seq = seq;
+    pending[pending_cnt].intent = *intent;
+    pending_cnt++;
+    return true;
+}
+
+/*
+ * Reads records of journal left by previous mount, intents which
+ * have end record are dropped. Reading stops at first damaged record
+ */
+static void read_journal(FILE* file)
+{
+    struct record_header header;
+    struct intent intent;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.type != RECORD_INTENT && header.type != RECORD_END)
+            break;
+        if (header.type == RECORD_INTENT && fread(&intent, sizeof(intent), 1, file) != 1)
+            break;
+        if (header.crc != record_crc(header, &intent))
+            break;
+        if (header.type == RECORD_INTENT)
+            add_pending(header.seq, &intent);
+        else
+            forget_pending(header.seq);
+        if (header.seq > last_seq)
+            last_seq = header.seq;
+    }
+}
+
+/* Makes creation or rename of journal durable */
+static bool sync_parent(const char* path)
+{
+    char copy[strlen(path) + 1];
+    strcpy(copy, path);
+    int dir = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    if (dir < 0)
+        return false;
+    bool res = fsync(dir) == 0;
+    close(dir);
+    return res;
+}
+
+/*
+ * Replaces journal with one holding only unfinished intents, nobody
+ * may be in fdatasync of old file
+ */
+static void compact()
+{
+    char tmp_path[strlen(journal_path) + 5];
+    sprintf(tmp_path, "%s.tmp", journal_path);
+    int file = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (file < 0)
+        return;
+    bool res = true;
+    for (size_t i = 0; res && i < pending_cnt; i++)
+        res = write_record(file, RECORD_INTENT, pending[i].seq, &pending[i].intent);
+    if (!res || fdatasync(file) != 0 || rename(tmp_path, journal_path) != 0) {
+        close(file);
+        unlink(tmp_path);
+        return;
+    }
+    close(fd);
+    fd = file;
+    file_size = pending_cnt * record_size(RECORD_INTENT);
+    if (!sync_parent(journal_path))
+        return;
+    /* Intents waiting for sync are in new file which is on disk */
+    durable = written;
+    pthread_cond_broadcast(&synced_cond);
+}
+
+bool init_journal(const char* path, intent_handler replay)
+{
+    if (path == NULL)
+        return true;
+
+    FILE* file = fopen(path, "r");
+    if (file != NULL) {
+        read_journal(file);
+        fclose(file);
+    }
+    /* Journal is kept until replay is over, crash during it replays again */
+    for (size_t i = 0; i < pending_cnt; i++)
+        replay(&pending[i].intent);
+
+    pthread_mutex_lock(&journal_lock);
+    journal_path = path;
+    pending_cnt = 0;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    bool res = fd >= 0 && fsync(fd) == 0 && sync_parent(path);
+    file_size = 0;
+    pthread_mutex_unlock(&journal_lock);
+    return res;
+}
+
+bool journal_begin(const struct intent* intent, uint64_t* seq)
+{
+    *seq = 0;
+    pthread_mutex_lock(&journal_lock);
+    if (fd < 0) {
+        pthread_mutex_unlock(&journal_lock);
+        return journal_path == NULL;
+    }
+
+    uint64_t s = ++last_seq;
+    bool res = add_pending(s, intent);
+    if (res && !append_record(RECORD_INTENT, s, intent)) {
+        forget_pending(s);
+        res = false;
+    }
+
+    /* First waiter syncs for everybody who appended meanwhile */
+    uint64_t target = written;
+    while (res && durable < target) {
+        if (syncing) {
+            pthread_cond_wait(&synced_cond, &journal_lock);
+            continue;
+        }
+        syncing = true;
+        uint64_t upto = written;
+        int file = fd;
+        pthread_mutex_unlock(&journal_lock);
+        bool synced = fdatasync(file) == 0;
+        pthread_mutex_lock(&journal_lock);
+        syncing = false;
+        if (synced && upto > durable)
+            durable = upto;
+        pthread_cond_broadcast(&synced_cond);
+        if (!synced) {
+            forget_pending(s);
+            res = false;
+        }
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    if (res)
+        *seq = s;
+    return res;
+}
+
+void journal_end(uint64_t seq)
+{
+    if (seq == 0)
+        return;
+    pthread_mutex_lock(&journal_lock);
+    if (fd >= 0) {
+        forget_pending(seq);
+        /* Lost end record only makes replay repeat finished operation */
+        append_record(RECORD_END, seq, NULL);
+        if (file_size > JOURNAL_COMPACT_SIZE && !syncing)
+            compact();
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void close_journal()
+{
+    pthread_mutex_lock(&journal_lock);
+    while (syncing)
+        pthread_cond_wait(&synced_cond, &journal_lock);
+    if (fd >= 0) {
+        fdatasync(fd);
+        close(fd);
+    }
+    fd = -1;
+    journal_path = NULL;
+    free(pending);
+    pending = NULL;
+    pending_cnt = pending_cap = 0;
+    pthread_mutex_unlock(&journal_lock);
+}
@@ -0,0 +1,85 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "directory.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_COMPACT_SIZE (1 << 20) // Journal is rewritten with unfinished intents past this size
+
+/**
+ * Operations which change several items and are journaled
+ */
+typedef enum {
+    INTENT_CREATE,
+    INTENT_MKDIR,
+    INTENT_SYMLINK,
+    INTENT_LINK,
+    INTENT_UNLINK,
+    INTENT_RMDIR,
+    INTENT_RENAME
+} intent_op_t;
+
+/**
+ * Operation recorded before its first change, replay at mount
+ * finishes or undoes operations which have no end record
+ */
+struct intent {
+    uint32_t op;
+    uint32_t flags; // RENAME_* flags
+    int32_t inode_id; // Created, linked, removed or moved inode
+    int32_t other_id; // Inode replaced or exchanged by rename, -1 if none
+    int32_t dir_id; // Directory whose entry changes
+    int32_t to_dir_id; // Target directory of rename
+    uint32_t mode; // Modes are compared before ids are trusted at replay
+    uint32_t other_mode;
+    uint64_t link_cnt; // Links of changed inode once operation is done
+    char name[NAME_MAX + 1];
+    char to_name[NAME_MAX + 1];
+};
+
+typedef void (*intent_handler)(const struct intent* intent);
+
+/**
+ * Function : init_journal
+ * ----------------------------------------
+ * Replays intents of journal left by previous mount which have no
+ * end record, in order they were made, and starts new journal
+ *
+ * path     : local journal file, NULL disables journal
+ * replay   : called for every unfinished intent
+ *
+ * Returns  : true if journal can be written
+ */
+bool init_journal(const char* path, intent_handler replay);
+
+/**
+ * Function : journal_begin
+ * ----------------------------------------
+ * Appends intent and waits until it reaches disk. Callers waiting
+ * at the same time share one fdatasync
+ *
+ * intent   : operation about to start
+ * seq      : where number of record is written, 0 if journal is disabled
+ *
+ * Returns  : false if intent couldn't be made durable
+ */
+bool journal_begin(const struct intent* intent, uint64_t* seq);
+
+/**
+ * Function : journal_end
+ * ----------------------------------------
+ * Records that operation finished, nothing is waited for
+ *
+ * seq      : number returned by journal_begin, 0 is ignored
+ */
+void journal_end(uint64_t seq);
+
+/**
+ * Function : close_journal
+ * ----------------------------------------
+ * Closes journal, unfinished intents stay for next mount
+ */
+void close_journal();
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef KEYS_H
+#define KEYS_H
+
+#include <stdbool.h>
+
+/**
+ * Called for every key found by walk of stored file system, shared
+ * keys (deduplicated blocks, index buckets) can be reported many times
+ */
+typedef void (*key_visitor)(const char* key, bool shared, void* aux);
+
+#endif
@@ -0,0 +1,166 @@
+#!/bin/bash
+
+# to run please change mode
+# chmod +x lease.bash
+# both directories must be mounts of the same memcached with --lease_time,
+# --attr_timeout=0 and --entry_timeout=0 so every stat reaches cachefs
+
+if [ "$#" -lt 3 ]; then
+    echo "Illegal number of parameters"
+    echo 'Call : ./lease.bash first_mounted_dir second_mounted_dir lease_time_ms [memcached_host] [memcached_port]'
+    exit 1
+fi
+
+FIRST_DIR=$1
+SECOND_DIR=$2
+LEASE=$(echo "scale=3; $3 / 1000" | bc)
+WAIT=$(echo "$3 / 1000 + 1" | bc)
+HOST=${4:-127.0.0.1}
+PORT=${5:-11211}
+
+CMD="#### Command : "
+FAILED=0
+
+check(){
+    if [ "$1" = "$2" ]; then
+        echo "PASS : $3"
+    else
+        echo "FAIL : $3 (expected $2, got $1)"
+        FAILED=$((FAILED + 1))
+    fi
+}
+
+# Number of keys memcached was asked for so far
+gets(){
+    exec 3<>/dev/tcp/$HOST/$PORT
+    printf 'stats\r\n' >&3
+    while read -r -u 3 STAT NAME VALUE; do
+        [ "$NAME" = "cmd_get" ] && echo ${VALUE%$'\r'}
+        [ "${STAT%$'\r'}" = "END" ] && break
+    done
+    exec 3<&-
+}
+
+test1(){
+    echo "Test 1 : metadata change on one mount is seen on the other"
+
+    FILE_NAME="test_lease_1.txt"
+
+    echo "$CMD touch $FIRST_DIR/$FILE_NAME"
+    touch $FIRST_DIR/$FILE_NAME
+    echo
+
+    echo "$CMD chmod 644 $FIRST_DIR/$FILE_NAME"
+    chmod 644 $FIRST_DIR/$FILE_NAME
+    sleep $WAIT
+    echo
+
+    echo "$CMD stat -c %a $SECOND_DIR/$FILE_NAME"
+    check "$(stat -c %a $SECOND_DIR/$FILE_NAME)" 644 "second mount sees mode"
+    echo
+
+    echo "$CMD chmod 600 $FIRST_DIR/$FILE_NAME"
+    chmod 600 $FIRST_DIR/$FILE_NAME
+    echo
+
+    sleep $WAIT
+    echo "$CMD stat -c %a $SECOND_DIR/$FILE_NAME"
+    check "$(stat -c %a $SECOND_DIR/$FILE_NAME)" 600 "second mount sees changed mode"
+    echo
+
+    rm $FIRST_DIR/$FILE_NAME
+}
+
+test2(){
+    echo "Test 2 : name removed on one mount disappears on the other"
+
+    FILE_NAME="test_lease_2.txt"
+
+    echo "$CMD echo data > $FIRST_DIR/$FILE_NAME"
+    echo data > $FIRST_DIR/$FILE_NAME
+    echo
+
+    echo "$CMD cat $SECOND_DIR/$FILE_NAME"
+    check "$(cat $SECOND_DIR/$FILE_NAME)" data "second mount reads file"
+    echo
+
+    echo "$CMD rm $FIRST_DIR/$FILE_NAME"
+    rm $FIRST_DIR/$FILE_NAME
+    echo
+
+    sleep $WAIT
+    echo "$CMD ls $SECOND_DIR/$FILE_NAME"
+    ls $SECOND_DIR/$FILE_NAME > /dev/null 2>&1
+    check $? 2 "second mount doesn't find removed name"
+    echo
+}
+
+test3(){
+    echo "Test 3 : mount holding lease serves metadata from memory"
+
+    FILE_NAME="test_lease_3.txt"
+
+    echo "$CMD touch $FIRST_DIR/$FILE_NAME"
+    touch $FIRST_DIR/$FILE_NAME
+    sleep $WAIT
+    echo
+
+    echo "$CMD stat $SECOND_DIR/$FILE_NAME"
+    stat $SECOND_DIR/$FILE_NAME > /dev/null
+    echo
+
+    BEFORE=$(gets)
+    echo "$CMD 10 x stat $SECOND_DIR/$FILE_NAME"
+    for i in $(seq 1 10);
+    do
+        stat $SECOND_DIR/$FILE_NAME > /dev/null
+    done
+    AFTER=$(gets)
+    echo "Keys asked from memcached : $((AFTER - BEFORE))"
+    check $((AFTER - BEFORE)) 0 "stats under lease don't reach memcached"
+    echo
+
+    rm $FIRST_DIR/$FILE_NAME
+}
+
+test4(){
+    echo "Test 4 : writer waits for lease of other mount"
+
+    FILE_NAME="test_lease_4.txt"
+
+    echo "$CMD touch $FIRST_DIR/$FILE_NAME"
+    touch $FIRST_DIR/$FILE_NAME
+    sleep $WAIT
+    echo
+
+    echo "$CMD stat $SECOND_DIR/$FILE_NAME"
+    stat $SECOND_DIR/$FILE_NAME > /dev/null
+    echo
+
+    echo "$CMD chmod 600 $FIRST_DIR/$FILE_NAME"
+    START=$(date +%s.%N)
+    chmod 600 $FIRST_DIR/$FILE_NAME
+    END=$(date +%s.%N)
+    DIFF=$(echo "$END - $START" | bc)
+    echo "Elapsed time : $DIFF seconds"
+    # Lease was taken just before, writer waits at least half of it
+    check $(echo "$DIFF >= $LEASE / 2" | bc) 1 "chmod waits for lease"
+    echo
+
+    rm $FIRST_DIR/$FILE_NAME
+}
+
+# chmod on first mount, stat on second
+test1
+
+# remove on first mount, lookup on second
+test2
+
+# repeated stat on second mount under lease
+test3
+
+# chmod on first mount while second holds lease
+test4
+
+echo "Failed checks : $FAILED"
+[ $FAILED -eq 0 ]
@@ -0,0 +1,193 @@
+#include "lease.h"
+
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CAS_RETRIES 5
+
+/**
+ * Lease this mount holds
+ */
+struct held {
+    int id;
+    int64_t until;
+    bool write;
+};
+
+static struct memcache_t* memcache;
+static int64_t duration;
+static uint64_t origin;
+static struct held held[LEASE_TABLE_SIZE];
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void get_key(char* key, int id)
+{
+    sprintf(key, "%d#LEASE", id);
+}
+
+static void remember(int id, int64_t until, bool write)
+{
+    pthread_mutex_lock(&held_lock);
+    struct held* h = &held[(unsigned)id % LEASE_TABLE_SIZE];
+    h->id = id;
+    /* Lease is trusted a bit less than it lasts, clocks may differ */
+    h->until = until - LEASE_SKEW_MS;
+    h->write = write;
+    pthread_mutex_unlock(&held_lock);
+}
+
+/* Reads record, returns false if memcached can't be reached */
+static bool load(int id, struct memcache_item* item, struct lease_record* record)
+{
+    get_key(item->key, id);
+    item->buff = record;
+    item->size = sizeof(struct lease_record);
+    if (!memcache_gets_multi(memcache, item, 1))
+        return false;
+    /* Unknown value is replaced as expired lease */
+    if (item->found && item->size != sizeof(struct lease_record))
+        memset(record, 0, sizeof(struct lease_record));
+    return true;
+}
+
+/* Replaces record read by load, adds it if there was none */
+static bool replace(int id, struct memcache_item* item, struct lease_record* record)
+{
+    bool existed = item->found;
+    get_key(item->key, id);
+    item->buff = record;
+    item->size = sizeof(struct lease_record);
+    item->exptime = (record->expires - now_ms()) / 1000 + 2;
+    bool sent = existed ? memcache_cas_multi(memcache, item, 1) : memcache_add_multi(memcache, item, 1);
+    return sent && item->found;
+}
+
+void init_leases(struct memcache_t* mem, int64_t lease_duration)
+{
+    pthread_mutex_lock(&held_lock);
+    memcache = lease_duration > 0 ? mem : NULL;
+    duration = lease_duration;
+    random_bytes(&origin, sizeof(origin));
+    for (size_t i = 0; i < LEASE_TABLE_SIZE; i++)
+        held[i].id = -1;
+    pthread_mutex_unlock(&held_lock);
+}
+
+int64_t lease_valid(int id)
+{
+    pthread_mutex_lock(&held_lock);
+    struct held* h = &held[(unsigned)id % LEASE_TABLE_SIZE];
+    int64_t until = h->id == id && h->until > now_ms() ? h->until : 0;
+    pthread_mutex_unlock(&held_lock);
+    return until;
+}
+
+bool lease_acquire(int id)
+{
+    if (memcache == NULL)
+        return false;
+    if (lease_valid(id) > now_ms() + duration / 2)
+        return true;
+
+    for (int i = 0; i < CAS_RETRIES; i++) {
+        struct memcache_item item;
+        struct lease_record record;
+        if (!load(id, &item, &record))
+            return false;
+        int64_t now = now_ms();
+        bool alive = item.found && record.expires > now;
+        bool foreign = alive && record.origin != origin;
+        if (alive && (record.flags & LEASE_WAITING))
+            return false;
+        if (foreign && (record.flags & LEASE_WRITE))
+            return false;
+        if (alive && record.origin == origin && (record.flags & LEASE_WRITE)) {
+            /* Own writes keep cached data up to date */
+            remember(id, record.expires, true);
+            return true;
+        }
+
+        struct lease_record next;
+        next.expires = alive && record.expires > now + duration ? record.expires : now + duration;
+        next.origin = origin;
+        next.flags = foreign || (alive && (record.flags & LEASE_SHARED)) ? LEASE_SHARED : 0;
+        if (replace(id, &item, &next)) {
+            remember(id, next.expires, false);
+            return true;
+        }
+    }
+    return false;
+}
+
+void lease_break(int id)
+{
+    if (memcache == NULL)
+        return;
+    pthread_mutex_lock(&held_lock);
+    struct held* h = &held[(unsigned)id % LEASE_TABLE_SIZE];
+    bool writing = h->id == id && h->write && h->until > now_ms() + duration / 2;
+    pthread_mutex_unlock(&held_lock);
+    if (writing)
+        return;
+
+    while (true) {
+        struct memcache_item item;
+        struct lease_record record;
+        if (!load(id, &item, &record))
+            return;
+        int64_t now = now_ms();
+        bool alive = item.found && record.expires + LEASE_SKEW_MS > now;
+        bool own = record.origin == origin && !(record.flags & (LEASE_SHARED | LEASE_WAITING));
+        if (!alive || own) {
+            struct lease_record next = { now + duration, origin, LEASE_WRITE };
+            if (replace(id, &item, &next)) {
+                remember(id, next.expires, true);
+                return;
+            }
+            continue;
+        }
+
+        /* New readers are turned away, current ones keep lease until it expires */
+        if (!(record.flags & LEASE_WAITING)) {
+            record.flags |= LEASE_WAITING;
+            if (!replace(id, &item, &record))
+                continue;
+        }
+        int64_t wait = record.expires + LEASE_SKEW_MS - now;
+        usleep((wait > 0 ? wait : 1) * 1000);
+    }
+}
+
+void lease_forget(int id)
+{
+    pthread_mutex_lock(&held_lock);
+    struct held* h = &held[(unsigned)id % LEASE_TABLE_SIZE];
+    if (h->id == id)
+        h->id = -1;
+    pthread_mutex_unlock(&held_lock);
+}
+
+bool lease_taken(struct memcache_t* mem, int id, bool* taken)
+{
+    struct memcache_item item;
+    struct lease_record record;
+    get_key(item.key, id);
+    item.buff = &record;
+    item.size = sizeof(struct lease_record);
+    if (!memcache_get_multi(mem, &item, 1))
+        return false;
+    *taken = item.found && item.size == sizeof(struct lease_record)
+        && record.expires + LEASE_SKEW_MS > now_ms();
+    return true;
+}
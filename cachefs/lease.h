@@ -0,0 +1,94 @@
+#ifndef LEASE_H
+#define LEASE_H
+
+#include "memcache.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LEASE_TABLE_SIZE 4096 // Leases this mount remembers
+#define LEASE_SKEW_MS 50 // Allowed difference of clocks between mounts
+
+#define LEASE_SHARED 0x1 // Read lease was taken by more than one mount
+#define LEASE_WRITE 0x2 // Owner changes inode, readers can't take leases
+#define LEASE_WAITING 0x4 // Writer waits for lease to expire, it can't be extended
+
+/**
+ * Lease on metadata and directory entries of one inode, stored
+ * with key <id>#LEASE and expiration time slightly past EXPIRES
+ */
+struct lease_record {
+    int64_t expires; // Milliseconds since epoch
+    uint64_t origin; // Mount which took or last extended lease
+    uint32_t flags;
+};
+
+/**
+ * Function : init_leases
+ * ----------------------------------------
+ * Starts taking leases with given duration
+ * 
+ * mem      : memcache data object 
+ * duration : milliseconds lease lasts, 0 disables leases
+ */
+void init_leases(struct memcache_t* mem, int64_t duration);
+
+/**
+ * Function : lease_acquire
+ * ----------------------------------------
+ * Takes or extends read lease on inode. While this mount holds
+ * lease, no other mount changes metadata or entries of inode,
+ * so they can be served from memory. Lease isn't given while
+ * other mount writes to inode
+ * 
+ * id       : id of inode
+ * 
+ * Returns  : true if lease is held
+ */
+bool lease_acquire(int id);
+
+/**
+ * Function : lease_valid
+ * ----------------------------------------
+ * Checks lease without asking memcached
+ * 
+ * id       : id of inode
+ * 
+ * Returns  : milliseconds since epoch until which cached data of
+ *            inode can be used, 0 if this mount holds no lease
+ */
+int64_t lease_valid(int id);
+
+/**
+ * Function : lease_break
+ * ----------------------------------------
+ * Takes write lease on inode before changing it, waits until
+ * read leases of other mounts expire
+ * 
+ * id       : id of inode
+ */
+void lease_break(int id);
+
+/**
+ * Function : lease_forget
+ * ----------------------------------------
+ * Drops lease of this mount on removed inode
+ * 
+ * id       : id of inode
+ */
+void lease_forget(int id);
+
+/**
+ * Function : lease_taken
+ * ----------------------------------------
+ * Checks whether any mount holds lease on inode, works
+ * without init_leases
+ * 
+ * mem      : memcache data object 
+ * id       : id of inode
+ * taken    : set if lease didn't expire yet
+ * 
+ * Returns  : false on connection error
+ */
+bool lease_taken(struct memcache_t* mem, int id, bool* taken);
+
+#endif
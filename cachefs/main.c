@@ -7,16 +7,27 @@
 
 #define FUSE_USE_VERSION 31
 
+#include "block.h"
+#include "changelog.h"
 #include "directory.h"
 #include "freemap.h"
 #include "inode.h"
+#include "journal.h"
+#include "lease.h"
 #include "memcache.h"
+#include "reaper.h"
+#include "snapshot.h"
+#include "super.h"
+#include "usage.h"
 #include "utils.h"
 #include "xattr.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,11 +44,47 @@
 static struct options {
     const char* filename;
     const char* contents;
+    int dedup;
+    int compress;
+    int checksum_retries;
+    const char* checksum_policy;
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+    int no_writeback;
+    unsigned int max_write;
+    int coherence_interval;
+    int lease_time;
+    const char* snapshot;
+    int snapshot_interval;
+    const char* journal;
     int show_help;
 } options;
 
 struct memcache_t* memcache = NULL;
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/* Renames are serialized, checks of both names must stay valid until entries change */
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Inodes of newly formated file system, free map grows when they are used */
+#define INODE_CNT 8192
+
+/* Entries of readdirplus whose attributes are fetched at once */
+#define READDIR_BATCH 256
+
+/* Read-only attribute of root reporting blocks which failed verification */
+#define CSUM_ERRORS_XATTR "user.cachefs.csum_errors"
+
+/* Largest file offset, ranges ending past it are rejected */
+#define OFF_MAX ((off_t)(~0ULL >> 1))
+
 #define OPTION(t, p)                      \
     {                                     \
         t, offsetof(struct options, p), 1 \
@@ -45,28 +92,301 @@ struct memcache_t* memcache = NULL;
 
 static const struct fuse_opt option_spec[] = {
     OPTION("--name=%s", filename), OPTION("--contents=%s", contents),
+    OPTION("--dedup", dedup), OPTION("--compress", compress),
+    OPTION("--checksum_retries=%d", checksum_retries),
+    OPTION("--checksum_policy=%s", checksum_policy),
+    OPTION("--attr_timeout=%lf", attr_timeout),
+    OPTION("--entry_timeout=%lf", entry_timeout),
+    OPTION("--negative_timeout=%lf", negative_timeout),
+    OPTION("--no_writeback", no_writeback),
+    OPTION("--max_write=%u", max_write),
+    OPTION("--coherence_interval=%d", coherence_interval),
+    OPTION("--lease_time=%d", lease_time),
+    OPTION("--snapshot=%s", snapshot),
+    OPTION("--snapshot_interval=%d", snapshot_interval),
+    OPTION("--journal=%s", journal),
     OPTION("-h", show_help), OPTION("--help", show_help), FUSE_OPT_END
 };
 
+/* Reads stored metadata of inode, false if it isn't stored or has other mode */
+static bool intended_inode(int id, uint32_t mode)
+{
+    struct inode_disk_metadata metadata;
+    bool found = false;
+    return id >= 0 && inode_get_metadata_multi(&id, 1, &metadata, &found) && found
+        && metadata.mode == mode;
+}
+
+static struct dir* open_dir_id(int id)
+{
+    struct inode_disk_metadata metadata;
+    bool found = false;
+    if (id < 0 || !inode_get_metadata_multi(&id, 1, &metadata, &found) || !found || !metadata.is_dir)
+        return NULL;
+    return dir_open(inode_open(id));
+}
+
+/* Id NAME points to in DIR, -1 if there is no such name */
+static int entry_id(struct dir* dir, const char* name)
+{
+    int id;
+    return dir != NULL && dir_lookup_id(dir, name, &id) ? id : -1;
+}
+
+/* Keeps inode whose name was added, otherwise removes it */
+static void replay_create(const struct intent* intent)
+{
+    if (!intended_inode(intent->inode_id, intent->mode))
+        return;
+    struct dir* parent = open_dir_id(intent->dir_id);
+    struct inode* inode = inode_open(intent->inode_id);
+    if (entry_id(parent, intent->name) != intent->inode_id) {
+        dir_discard(inode);
+    } else if (intent->op == INTENT_MKDIR) {
+        struct dir* dir = dir_open(inode_reopen(inode));
+        if (entry_id(dir, ".") < 0)
+            dir_add(dir, ".", intent->inode_id);
+        if (entry_id(dir, "..") < 0)
+            dir_add(dir, "..", intent->dir_id);
+        dir_close(dir);
+    }
+    inode_close(inode);
+    dir_close(parent);
+}
+
+/* Error of name which couldn't be added, it may be taken by other mount */
+static int add_error(struct dir* dir, const char* name)
+{
+    return entry_id(dir, name) >= 0 ? -EEXIST : -EIO;
+}
+
+/* Takes back inode created for name which wasn't added, reaper deletes its
+ * metadata and frees id before record ends */
+static int undo_create(int inode_id, uint64_t seq, int err)
+{
+    struct inode* inode = inode_open(inode_id);
+    if (inode != NULL) {
+        dir_discard(inode);
+        inode_set_intent(inode, seq);
+        inode_close(inode);
+        return err;
+    }
+    /* Metadata could be stored even if its reply was lost */
+    struct inode_disk_metadata metadata = { 0 };
+    inode_reclaim(&inode_id, &metadata, 1);
+    free_inode(inode_id);
+    journal_end(seq);
+    return err;
+}
+
+static void replay_link(const struct intent* intent)
+{
+    if (!intended_inode(intent->inode_id, intent->mode))
+        return;
+    struct dir* dir = open_dir_id(intent->dir_id);
+    struct inode* inode = inode_open(intent->inode_id);
+    if (entry_id(dir, intent->name) == intent->inode_id && inode->metadata.link_cnt < intent->link_cnt) {
+        inode->metadata.link_cnt = intent->link_cnt;
+        inode_flush_metadata(inode);
+    }
+    inode_close(inode);
+    dir_close(dir);
+}
+
+/* Removes name and inode, unlinked file could stay open when mount died */
+static void replay_unlink(const struct intent* intent)
+{
+    struct dir* dir = open_dir_id(intent->dir_id);
+    if (entry_id(dir, intent->name) == intent->inode_id)
+        dir_unlink(dir, intent->name);
+    dir_close(dir);
+    if (!intended_inode(intent->inode_id, intent->mode))
+        return;
+    struct inode* inode = inode_open(intent->inode_id);
+    if (inode->metadata.link_cnt > intent->link_cnt) {
+        inode->metadata.link_cnt = intent->link_cnt;
+        inode_flush_metadata(inode);
+    }
+    dir_discard(inode);
+    inode_close(inode);
+}
+
+static void replay_rename(const struct intent* intent)
+{
+    if (!intended_inode(intent->inode_id, intent->mode))
+        return;
+    bool exchange = intent->flags & RENAME_EXCHANGE;
+    struct inode* src = inode_open(intent->inode_id);
+    struct inode* dst = intended_inode(intent->other_id, intent->other_mode)
+        ? inode_open(intent->other_id)
+        : NULL;
+    struct dir* from_dir = open_dir_id(intent->dir_id);
+    struct dir* to_dir = open_dir_id(intent->to_dir_id);
+    if (from_dir == NULL || to_dir == NULL || (exchange && dst == NULL))
+        goto done;
+
+    int to_id = entry_id(to_dir, intent->to_name);
+    if (to_id < 0 && !dir_add(to_dir, intent->to_name, src->id))
+        goto done;
+    if (to_id >= 0 && to_id != src->id && !dir_set(to_dir, intent->to_name, src->id))
+        goto done;
+    if (exchange) {
+        if (entry_id(from_dir, intent->name) != dst->id)
+            dir_set(from_dir, intent->name, dst->id);
+    } else if (entry_id(from_dir, intent->name) == src->id) {
+        dir_unlink(from_dir, intent->name);
+    }
+
+    if (intent->dir_id != intent->to_dir_id) {
+        struct dir* moved = inode_is_dir(src) ? dir_open(inode_reopen(src)) : NULL;
+        if (moved != NULL && entry_id(moved, "..") != intent->to_dir_id)
+            dir_set(moved, "..", intent->to_dir_id);
+        dir_close(moved);
+        moved = exchange && inode_is_dir(dst) ? dir_open(inode_reopen(dst)) : NULL;
+        if (moved != NULL && entry_id(moved, "..") != intent->dir_id)
+            dir_set(moved, "..", intent->dir_id);
+        dir_close(moved);
+    }
+
+    if (dst != NULL && !exchange) {
+        if (dst->metadata.link_cnt > intent->link_cnt) {
+            dst->metadata.link_cnt = intent->link_cnt;
+            inode_flush_metadata(dst);
+        }
+        if (inode_is_dir(dst) || dst->metadata.link_cnt == 0)
+            dir_discard(dst);
+    }
+
+done:
+    dir_close(to_dir);
+    dir_close(from_dir);
+    inode_close(dst);
+    inode_close(src);
+}
+
+/* Finishes or undoes operation which was cut by crash of previous mount */
+static void replay_intent(const struct intent* intent)
+{
+    switch (intent->op) {
+    case INTENT_CREATE:
+    case INTENT_MKDIR:
+    case INTENT_SYMLINK:
+        replay_create(intent);
+        break;
+    case INTENT_LINK:
+        replay_link(intent);
+        break;
+    case INTENT_UNLINK:
+    case INTENT_RMDIR:
+        replay_unlink(intent);
+        break;
+    case INTENT_RENAME:
+        replay_rename(intent);
+        break;
+    }
+    /* Journal is dropped after replay, removed inodes have to be gone by then */
+    reaper_drain();
+}
+
+/* Starts journal record of operation on NAME in directory DIR_ID */
+static void fill_intent(struct intent* intent, intent_op_t op, int inode_id, uint32_t mode,
+    int dir_id, const char* name)
+{
+    memset(intent, 0, sizeof(struct intent));
+    intent->op = op;
+    intent->inode_id = inode_id;
+    intent->other_id = -1;
+    intent->dir_id = dir_id;
+    intent->to_dir_id = -1;
+    intent->mode = mode;
+    snprintf(intent->name, sizeof(intent->name), "%s", name);
+}
+
+/*
+ * Loads superblock, file system lost by Memcached is brought back from
+ * snapshot first. Returns false if it can't be mounted
+ */
+static bool load_super(struct memcache_t* mem, super_status_t* status)
+{
+    bool locked = false;
+    if (!super_is_locked(mem, &locked)) {
+        fprintf(stderr, "cachefs: can't read superblock\n");
+        return false;
+    }
+    if (locked) {
+        fprintf(stderr, "cachefs: file system is being repaired by cachefs-fsck\n");
+        return false;
+    }
+    *status = super_load(mem);
+    if (*status == SUPER_MISSING && options.snapshot != NULL && access(options.snapshot, F_OK) == 0) {
+        /* Memcached lost file system, last snapshot brings it back */
+        if (!memcache_clear(mem) || !snapshot_restore(mem, options.snapshot)) {
+            fprintf(stderr, "cachefs: can't restore snapshot %s\n", options.snapshot);
+            return false;
+        }
+        *status = super_load(mem);
+    }
+    if (*status == SUPER_INCOMPATIBLE) {
+        /* Stored data is kept, it can be mounted by build which wrote it */
+        fprintf(stderr, "cachefs: stored file system has unsupported format\n");
+        return false;
+    }
+    return true;
+}
+
+/* Mount can't go on, session ends and kernel unmounts file system */
+static void* abort_mount()
+{
+    fuse_exit(fuse_get_context()->fuse);
+    return NULL;
+}
+
 static void* cachefs_init(struct fuse_conn_info* conn,
     struct fuse_config* cfg)
 {
-    (void)conn;
     cfg->kernel_cache = 1;
+    cfg->attr_timeout = options.attr_timeout;
+    cfg->entry_timeout = options.entry_timeout;
+    cfg->negative_timeout = options.negative_timeout;
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+        conn->want |= FUSE_CAP_READDIRPLUS;
+    /* Kernel keeps dirty pages and file size, writes reach us in large batches */
+    if (!options.no_writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    conn->max_write = options.max_write;
+    conn->max_read = options.max_write;
+    conn->max_readahead = options.max_write;
 
     if (memcache != NULL)
         return NULL;
 
     memcache = memcache_init();
-    if (memcache == NULL)
-        return NULL;
+    if (memcache == NULL) {
+        fprintf(stderr, "cachefs: can't connect to memcached at %s:%d\n",
+            MEMCACHED_ADDRESS, MEMCACHED_PORT);
+        return abort_mount();
+    }
 
     init_inodes(memcache, getgid(), getuid());
-
-    if (!memcache_is_consistent(memcache)) {
+    init_leases(memcache, options.lease_time);
+    /* Without leases nothing keeps polling mounts away from directory being compacted */
+    init_directories(memcache, options.coherence_interval == 0 || options.lease_time > 0);
+    block_set_verification(options.checksum_retries,
+        strcmp(options.checksum_policy, "zero") == 0 ? CORRUPTION_ZERO : CORRUPTION_EIO);
+
+    int features = (options.dedup ? FEATURE_DEDUP : 0)
+        | (options.compress ? FEATURE_COMPRESS : 0);
+    /* Main checked store already, it fails here only if it changed since */
+    super_status_t status;
+    if (!load_super(memcache, &status))
+        return abort_mount();
+
+    if (status == SUPER_MISSING) {
         assert(memcache_clear(memcache));
-        memcache_create(memcache);
-        assert(init_freemap(memcache, 1024));
+        assert(super_create(memcache, INODE_CNT, features));
+        inode_set_features(features);
+        assert(init_freemap(memcache, INODE_CNT));
+        assert(init_usage(memcache));
         int root_inode = get_free_inode();
 
         assert(root_inode == 0);
@@ -74,32 +394,84 @@ static void* cachefs_init(struct fuse_conn_info* conn,
         struct dir* root = dir_open_root();
         assert(dir_add(root, ".", root_inode));
         assert(dir_add(root, "..", root_inode));
-        assert(inode_path_register("/", root_inode));
+    } else {
+        struct superblock sb;
+        super_get(&sb);
+        /* Features can be enabled on existing file system, stored data keeps its own flags */
+        if ((sb.features | features) != sb.features)
+            assert(super_set_features(sb.features | features));
+        inode_set_features(sb.features | features);
+        assert(load_freemap(memcache, sb.inode_capacity));
+        load_usage(memcache);
     }
+    init_reaper();
+    if (!init_journal(options.journal, replay_intent)) {
+        fprintf(stderr, "cachefs: can't open journal %s\n", options.journal);
+        return abort_mount();
+    }
+    init_changelog(memcache, fuse_get_context()->fuse, options.coherence_interval);
+    if (options.snapshot != NULL)
+        init_snapshots(memcache, options.snapshot, options.snapshot_interval);
 
     return NULL;
 }
 
+/* Inode kept open by open or create, NULL if FI has none */
+static struct inode* get_file(struct fuse_file_info* fi)
+{
+    if (fi == NULL)
+        return NULL;
+    return (struct inode*)(uintptr_t)fi->fh;
+}
+
+/*
+ * Opens inode of handle FI, permissions were checked when it was opened.
+ * Without handle PATH is resolved and checked for PERMISSION.
+ * Returns 0 or negative error code
+ */
+static int open_file(const char* path, struct fuse_file_info* fi,
+    permission_t permission, struct inode** inode)
+{
+    *inode = inode_reopen(get_file(fi));
+    if (*inode != NULL)
+        return 0;
+
+    *inode = inode_from_path(path);
+    if (*inode == NULL)
+        return -ENOENT;
+    if (!inode_check_permission(*inode, permission)) {
+        inode_close(*inode);
+        return -EACCES;
+    }
+    return 0;
+}
+
+static void fill_stat(struct stat* stbuf, const struct inode_disk_metadata* metadata)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = metadata->mode;
+    stbuf->st_nlink = metadata->link_cnt;
+    stbuf->st_size = metadata->length;
+    stbuf->st_uid = metadata->uid;
+    stbuf->st_gid = metadata->gid;
+}
+
 static int cachefs_getattr(const char* path, struct stat* stbuf,
     struct fuse_file_info* fi)
 {
     //printf("begin getattr\n path: %s\n", path);
-    (void)fi;
     int res = 0;
 
     memset(stbuf, 0, sizeof(struct stat));
 
-    struct inode* inode = inode_get_from_path(path);
+    /* Open file may already be unlinked, its inode is used directly */
+    struct inode* inode = fi != NULL && fi->fh != 0 ? inode_reopen(get_file(fi)) : inode_from_path(path);
 
     if (inode == NULL) {
         return -ENOENT;
     }
 
-    stbuf->st_mode = inode->metadata.mode;
-    stbuf->st_nlink = inode->metadata.link_cnt;
-    stbuf->st_size = inode_length(inode);
-    stbuf->st_uid = inode->metadata.uid;
-    stbuf->st_gid = inode->metadata.gid;
+    fill_stat(stbuf, &inode->metadata);
 
     inode_close(inode);
     //printf("end getattr\n");
@@ -110,47 +482,98 @@ static int cachefs_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
     off_t offset, struct fuse_file_info* fi,
     enum fuse_readdir_flags flags)
 {
-    (void)offset;
-    (void)fi;
-    (void)flags;
     //printf("begin readdir\n");
-
-    struct inode* inode = inode_get_from_path(path);
-    if (inode == NULL) {
-        return -ENOENT;
-    }
-    struct dir* dir = dir_open(inode);
-    char name[30];
-    while (dir_readdir(dir, name)) {
-        filler(buf, name, NULL, 0, 0);
+    struct dir* dir = (struct dir*)(uintptr_t)fi->fh;
+    if (dir == NULL)
+        return -EBADF;
+
+    /* Offset passed to filler is position after the entry, 0 is the start */
+    dir_seek(dir, offset);
+
+    char(*names)[NAME_MAX + 1] = malloc(READDIR_BATCH * (NAME_MAX + 1));
+    int* ids = malloc(READDIR_BATCH * sizeof(int));
+    off_t* offsets = malloc(READDIR_BATCH * sizeof(off_t));
+    struct inode_disk_metadata* metadata = malloc(READDIR_BATCH * sizeof(struct inode_disk_metadata));
+    bool found[READDIR_BATCH];
+    int res = 0;
+    if (names == NULL || ids == NULL || offsets == NULL || metadata == NULL)
+        res = -ENOMEM;
+
+    /* Entries are streamed in batches until kernel buffer is full */
+    bool more = true;
+    bool full = false;
+    while (res == 0 && more && !full) {
+        size_t cnt = 0;
+        while (cnt < READDIR_BATCH && (more = dir_readdir_inode(dir, names[cnt], &ids[cnt])))
+            offsets[cnt++] = dir_tell(dir);
+
+        /* Attributes of readdirplus batch are fetched together */
+        bool plus = flags & FUSE_READDIR_PLUS;
+        if (plus && !inode_get_metadata_multi(ids, cnt, metadata, found)) {
+            res = -EIO;
+            break;
+        }
+        for (size_t i = 0; i < cnt && !full; i++) {
+            struct stat stbuf;
+            if (plus && found[i]) {
+                fill_stat(&stbuf, &metadata[i]);
+                full = filler(buf, names[i], &stbuf, offsets[i], FUSE_FILL_DIR_PLUS) != 0;
+            } else {
+                full = filler(buf, names[i], NULL, offsets[i], 0) != 0;
+            }
+        }
     }
-    dir_close(dir);
+    free(metadata);
+    free(offsets);
+    free(ids);
+    free(names);
     //printf("end readdir\n");
-    return 0;
+    return res;
 }
 
 static int cachefs_open(const char* path, struct fuse_file_info* fi)
 {
     //printf("open\n");
+    struct inode* inode = inode_from_path(path);
+    if (inode == NULL) {
+        return -ENOENT;
+    }
+
+    int res = 0;
+    int mode = fi->flags & O_ACCMODE;
+    if (inode_is_dir(inode)) {
+        res = -EISDIR;
+    } else if ((mode != O_WRONLY && !inode_check_permission(inode, READ))
+        || (mode != O_RDONLY && !inode_check_permission(inode, WRITE))) {
+        res = -EACCES;
+    }
+
+    if (res != 0) {
+        inode_close(inode);
+        return res;
+    }
+    /* Inode stays open until release, reads and writes don't resolve path */
+    fi->fh = (uint64_t)(uintptr_t)inode;
     return 0;
 }
 
 static int cachefs_read(const char* path, char* buf, size_t size, off_t offset,
     struct fuse_file_info* fi)
 {
-    size_t len;
-    (void)fi;
     //printf("read\n");
-
-    struct inode* inode = inode_get_from_path(path);
+    /* Permissions were checked by open, with writeback cache kernel
+       also reads through handles opened for writing only */
+    struct inode* inode = inode_reopen(get_file(fi));
 
     if (inode == NULL) {
-        return -ENOENT;
-    }
-
-    if (!inode_check_permission(inode, READ)) {
-        inode_close(inode);
-        return -EACCES;
+        inode = inode_from_path(path);
+        if (inode == NULL) {
+            return -ENOENT;
+        }
+        if (!inode_check_permission(inode, READ)) {
+            inode_close(inode);
+            return -EACCES;
+        }
     }
 
     if (inode_is_dir(inode)) {
@@ -158,40 +581,145 @@ static int cachefs_read(const char* path, char* buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    return inode_read_at(inode, buf, size, offset, false);
+    ssize_t read = inode_read_at(inode, buf, size, offset, false);
+    inode_close(inode);
+    return read;
 }
 
 static int cachefs_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
 {
-
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_reopen(get_file(fi));
 
     if (inode == NULL) {
-        return -ENOENT;
+        inode = inode_from_path(path);
+        if (inode == NULL) {
+            return -ENOENT;
+        }
+        if (!inode_check_permission(inode, WRITE)) {
+            inode_close(inode);
+            return -EACCES;
+        }
     }
 
-    if (!inode_check_permission(inode, WRITE)) {
+    if (inode_is_dir(inode)) {
         inode_close(inode);
-        return -EACCES;
+        return -EISDIR;
     }
 
+    size_t written = inode_write_at(inode, buf, size, offset, false);
+    inode_close(inode);
+    if (written == 0 && size > 0)
+        return -EIO;
+    return written;
+}
+
+static ssize_t cachefs_copy_file_range(const char* path_in, struct fuse_file_info* fi_in,
+    off_t offset_in, const char* path_out, struct fuse_file_info* fi_out,
+    off_t offset_out, size_t size, int flags)
+{
+    if (flags != 0 || offset_in < 0 || offset_out < 0)
+        return -EINVAL;
+    if (size > (size_t)(OFF_MAX - offset_in) || size > (size_t)(OFF_MAX - offset_out))
+        return -EOVERFLOW;
+
+    struct inode* from;
+    ssize_t res = open_file(path_in, fi_in, READ, &from);
+    if (res != 0)
+        return res;
+
+    struct inode* to;
+    res = open_file(path_out, fi_out, WRITE, &to);
+    if (res != 0) {
+        inode_close(from);
+        return res;
+    }
+
+    if (inode_is_dir(from) || inode_is_dir(to)) {
+        res = -EISDIR;
+    } else if (from == to && offset_in < offset_out + (off_t)size && offset_out < offset_in + (off_t)size) {
+        res = -EINVAL;
+    } else {
+        res = inode_copy_range(from, offset_in, to, offset_out, size);
+    }
+    if (res > 0)
+        changelog_append(path_out, 0);
+
+    inode_close(from);
+    inode_close(to);
+    return res;
+}
+
+static int cachefs_fallocate(const char* path, int mode, off_t offset, off_t length,
+    struct fuse_file_info* fi)
+{
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    if (offset > OFF_MAX - length)
+        return -EFBIG;
+
+    struct inode* inode;
+    int res = open_file(path, fi, WRITE, &inode);
+    if (res != 0)
+        return res;
+
     if (inode_is_dir(inode)) {
-        inode_close(inode);
-        return -EISDIR;
+        res = -EISDIR;
+    } else if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        res = -EOPNOTSUPP;
+    } else {
+        /* Memcached has nothing to reserve, preallocated range is a hole */
+        if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+            && !inode_punch_hole(inode, offset, length))
+            res = -EIO;
+        if (res == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && !inode_extend(inode, offset + length))
+            res = -EIO;
     }
+    if (res == 0)
+        changelog_append(path, 0);
 
-    return inode_write_at(inode, buf, size, offset, false);
+    inode_close(inode);
+    return res;
 }
 
 static int cachefs_statfs(const char* path, struct statvfs* buff)
 {
     //printf("statfs\n");
+    (void)path;
+    struct usage usage;
+    usage_get(&usage);
+    fsblkcnt_t used = usage.blocks > 0 ? usage.blocks : 0;
+    /* Without known server limit file system is reported as full */
+    fsblkcnt_t total = usage_capacity() / INODE_BLOCK_SIZE;
+    if (total < used)
+        total = used;
+    size_t files = freemap_max();
+    size_t used_files = freemap_used();
+
+    memset(buff, 0, sizeof(struct statvfs));
+    buff->f_bsize = INODE_BLOCK_SIZE;
+    buff->f_frsize = INODE_BLOCK_SIZE;
+    buff->f_blocks = total;
+    buff->f_bfree = total - used;
+    buff->f_bavail = total - used;
+    buff->f_files = files;
+    buff->f_ffree = files - used_files;
+    buff->f_favail = files - used_files;
+    buff->f_namemax = NAME_MAX;
+    struct superblock sb;
+    super_get(&sb);
+    memcpy(&buff->f_fsid, sb.uuid, sizeof(buff->f_fsid));
     return 0;
 }
 
 static void cachefs_destroy(void* private_data)
 {
     //printf("destroy\n");
+    close_changelog();
+    reaper_drain();
+    close_journal();
+    close_freemap();
+    close_usage();
+    close_snapshots();
     memcache_close(memcache);
 }
 
@@ -201,10 +729,10 @@ static int cachefs_mkdir(const char* path, mode_t mode)
     char dir_path[strlen(path)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(path, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
 
-    struct inode* parent_inode = inode_get_from_path(dir_path);
+    struct inode* parent_inode = inode_from_path(dir_path);
     if (parent_inode == NULL) {
         return -ENOENT;
     }
@@ -214,7 +742,7 @@ static int cachefs_mkdir(const char* path, mode_t mode)
         return -EACCES;
     }
 
-    struct inode* current = inode_get_from_path(path);
+    struct inode* current = inode_from_path(path);
     if (current != NULL) {
         inode_close(current);
         inode_close(parent_inode);
@@ -229,21 +757,43 @@ static int cachefs_mkdir(const char* path, mode_t mode)
         return -ENOSPC;
     }
 
-    assert(dir_create(inode_id, fuse_context->gid, fuse_context->uid, mode | S_IFDIR));
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_MKDIR, inode_id, mode | S_IFDIR, parent_inode->id, file_name);
+    if (!journal_begin(&intent, &seq)) {
+        free_inode(inode_id);
+        inode_close(parent_inode);
+        return -EIO;
+    }
+
+    if (!dir_create(inode_id, fuse_context->gid, fuse_context->uid, mode | S_IFDIR)) {
+        inode_close(parent_inode);
+        return undo_create(inode_id, seq, -EIO);
+    }
 
     struct dir* parent = dir_open(parent_inode);
     struct dir* child = dir_open(inode_open(inode_id));
+    if (parent == NULL || child == NULL) {
+        dir_close(parent);
+        dir_close(child);
+        return undo_create(inode_id, seq, -ENOMEM);
+    }
 
-    assert(parent != NULL);
-    assert(child != NULL);
-
-    assert(dir_add(parent, file_name, inode_id));
-    assert(dir_add(child, ".", inode_id));
-    assert(dir_add(child, "..", dir_get_inode(parent)->id));
-    inode_path_register(path, inode_id);
+    if (!dir_add(parent, file_name, inode_id)) {
+        int err = add_error(parent, file_name);
+        dir_close(parent);
+        dir_close(child);
+        return undo_create(inode_id, seq, err);
+    }
+    /* Name is visible, replay adds missing entries of new directory */
+    bool added = dir_add(child, ".", inode_id) && dir_add(child, "..", dir_get_inode(parent)->id);
 
     dir_close(parent);
     dir_close(child);
+    if (!added)
+        return -EIO;
+    journal_end(seq);
+    changelog_append(path, CHANGE_ENTRY);
 
     //printf("end mkdir\n");
     return 0;
@@ -256,13 +806,13 @@ static int cachefs_rmdir(const char* path)
     char dir_path[strlen(path)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(path, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
 
     if (!strcmp(path, "/"))
         return -EPERM;
 
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL) {
         return -ENOENT;
     }
@@ -279,17 +829,50 @@ static int cachefs_rmdir(const char* path)
         return -ENOENT;
     }
 
-    struct dir* parent = dir_open(inode_get_from_path(dir_path));
-    dir_remove(parent, file_name);
-    inode_path_delete(path);
+    struct dir* parent = dir_open(inode_from_path(dir_path));
+    if (parent == NULL) {
+        dir_close(child);
+        return -ENOENT;
+    }
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_RMDIR, inode->id, inode->metadata.mode,
+        dir_get_inode(parent)->id, file_name);
+    if (!journal_begin(&intent, &seq)) {
+        dir_close(parent);
+        dir_close(child);
+        return -EIO;
+    }
+    /* Record ends once removed directory is gone */
+    if (dir_remove(parent, file_name))
+        inode_set_intent(inode, seq);
+    else
+        journal_end(seq);
     dir_close(parent);
     dir_close(child);
+    changelog_append(path, CHANGE_ENTRY);
     return 0;
 }
 
 static int cachefs_opendir(const char* path, struct fuse_file_info* fi)
 {
     //printf("begin opendir %s\n", path);
+    struct inode* inode = inode_from_path(path);
+    if (inode == NULL)
+        return -ENOENT;
+    if (!inode_is_dir(inode)) {
+        inode_close(inode);
+        return -ENOTDIR;
+    }
+    if (!inode_check_permission(inode, READ)) {
+        inode_close(inode);
+        return -EACCES;
+    }
+
+    struct dir* dir = dir_open(inode);
+    if (dir == NULL)
+        return -ENOMEM;
+    fi->fh = (uintptr_t)dir;
     //printf("end opendir\n");
     return 0;
 }
@@ -297,6 +880,8 @@ static int cachefs_opendir(const char* path, struct fuse_file_info* fi)
 static int cachefs_releasedir(const char* path, struct fuse_file_info* fi)
 {
     //printf("begin releasedir\n");
+    dir_close((struct dir*)(uintptr_t)fi->fh);
+    fi->fh = 0;
     //printf("end releasedir\n");
     return 0;
 }
@@ -313,27 +898,44 @@ static int cachefs_unlink(const char* path)
     char dir_path[strlen(path)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(path, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
 
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL) {
         return -ENOENT;
     }
 
-    struct dir* dir = dir_open(inode_get_from_path(dir_path));
+    struct dir* dir = dir_open(inode_from_path(dir_path));
+    if (dir == NULL) {
+        inode_close(inode);
+        return -ENOENT;
+    }
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_UNLINK, inode->id, inode->metadata.mode,
+        dir_get_inode(dir)->id, file_name);
+    intent.link_cnt = inode->metadata.link_cnt - 1;
+    if (!journal_begin(&intent, &seq)) {
+        inode_close(inode);
+        dir_close(dir);
+        return -EIO;
+    }
     dir_remove(dir, file_name);
-    inode_path_delete(path);
     inode->metadata.link_cnt--;
     inode_flush_metadata(inode);
     inode_remove(inode);
+    /* Record ends once file is gone, it may stay open for a while */
+    inode_set_intent(inode, seq);
+    inode_close(inode);
     dir_close(dir);
+    changelog_append(path, CHANGE_ENTRY);
     return 0;
 }
 static int cachefs_create(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
     //printf("create\n");
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode != NULL) {
         inode_close(inode);
         return -EEXIST;
@@ -342,10 +944,10 @@ static int cachefs_create(const char* path, mode_t mode, struct fuse_file_info*
     char dir_path[strlen(path)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(path, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
 
-    struct inode* parent_inode = inode_get_from_path(dir_path);
+    struct inode* parent_inode = inode_from_path(dir_path);
     if (parent_inode == NULL) {
         inode_close(inode);
         return -ENOENT;
@@ -360,27 +962,61 @@ static int cachefs_create(const char* path, mode_t mode, struct fuse_file_info*
         return -ENOSPC;
     }
 
-    assert(inode_create(inode_id, false, fuse_context->gid, fuse_context->uid, mode | S_IFREG));
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_CREATE, inode_id, mode | S_IFREG, parent_inode->id, file_name);
+    if (!journal_begin(&intent, &seq)) {
+        free_inode(inode_id);
+        inode_close(parent_inode);
+        return -EIO;
+    }
+
+    if (!inode_create(inode_id, false, fuse_context->gid, fuse_context->uid, mode | S_IFREG)) {
+        inode_close(parent_inode);
+        return undo_create(inode_id, seq, -EIO);
+    }
 
     struct dir* parent = dir_open(parent_inode);
     struct inode* child = inode_open(inode_id);
+    if (parent == NULL || child == NULL) {
+        dir_close(parent);
+        inode_close(child);
+        return undo_create(inode_id, seq, -ENOMEM);
+    }
 
-    assert(parent != NULL);
-    assert(child != NULL);
-
-    assert(dir_add(parent, file_name, inode_id));
+    if (!dir_add(parent, file_name, inode_id)) {
+        int err = add_error(parent, file_name);
+        dir_close(parent);
+        inode_close(child);
+        return undo_create(inode_id, seq, err);
+    }
 
-    inode_path_register(path, inode_id);
     dir_close(parent);
-    inode_close(child);
+    journal_end(seq);
+    if (fi != NULL)
+        fi->fh = (uint64_t)(uintptr_t)child;
+    else
+        inode_close(child);
+    changelog_append(path, CHANGE_ENTRY);
 
     //printf("end create\n");
     return 0;
 }
 
+/* Data written through handle is announced when file is closed or synced */
+static void announce_file(const char* path, struct fuse_file_info* fi)
+{
+    struct inode* inode = get_file(fi);
+    if (inode != NULL && inode_take_changed(inode))
+        changelog_append(path, 0);
+}
+
 static int cachefs_release(const char* path, struct fuse_file_info* fi)
 {
     //printf("start release\n");
+    announce_file(path, fi);
+    inode_close(get_file(fi));
+    fi->fh = 0;
     //printf("end release\n");
     return 0;
 }
@@ -388,18 +1024,20 @@ static int cachefs_release(const char* path, struct fuse_file_info* fi)
 static int cachefs_flush(const char* path, struct fuse_file_info* fi)
 {
     //printf("start flush\n");
+    announce_file(path, fi);
     return 0;
 }
 static int cachefs_fsync(const char* path, int isdatasync, struct fuse_file_info* fi)
 {
     //printf("start fsync\n");
+    announce_file(path, fi);
     return 0;
 }
 
 static int cachefs_access(const char* path, int mask)
 {
     //printf("access\n");
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
     int res = 0;
@@ -424,11 +1062,12 @@ static int cachefs_access(const char* path, int mask)
 static int cachefs_setxattr(const char* path, const char* name, const char* buff, size_t size, int flags)
 {
     //printf("start setxattr\n");
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
     if (xattr_add(inode, name, buff, size)) {
         inode_close(inode);
+        changelog_append(path, 0);
         return 0;
     } else {
         inode_close(inode);
@@ -439,7 +1078,17 @@ static int cachefs_setxattr(const char* path, const char* name, const char* buff
 static int cachefs_getxattr(const char* path, const char* name, char* buff, size_t size)
 {
     //printf("start getxattr %s\n", name);
-    struct inode* inode = inode_get_from_path(path);
+    if (strcmp(path, "/") == 0 && strcmp(name, CSUM_ERRORS_XATTR) == 0) {
+        char value[32];
+        int len = snprintf(value, sizeof(value), "%" PRIu64, block_checksum_failures());
+        if (size == 0)
+            return len;
+        if (size < (size_t)len)
+            return -ERANGE;
+        memcpy(buff, value, len);
+        return len;
+    }
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
     int ans = xattr_get(inode, name, buff, size);
@@ -452,7 +1101,7 @@ static int cachefs_getxattr(const char* path, const char* name, char* buff, size
 static int cachefs_listxattr(const char* path, char* buff, size_t size)
 {
     //printf("start listxattr %zu\n", size);
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -1;
     int ans = xattr_list(inode, buff, size);
@@ -463,11 +1112,12 @@ static int cachefs_listxattr(const char* path, char* buff, size_t size)
 static int cachefs_removexattr(const char* path, const char* name)
 {
     //printf("start removexattr\n");
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -1;
     if (xattr_remove(inode, name)) {
         inode_close(inode);
+        changelog_append(path, 0);
         return 0;
     } else {
         inode_close(inode);
@@ -483,30 +1133,53 @@ static int cachefs_utimens(const char* path, const struct timespec tv[2], struct
 static int cachefs_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
     //printf("chmod %d \n\n", mode);
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
     inode->metadata.mode = mode;
     inode_flush_metadata(inode);
     inode_close(inode);
+    changelog_append(path, 0);
     return 0;
 }
 
 static int cachefs_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi)
 {
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
     inode->metadata.gid = gid;
     inode->metadata.uid = uid;
     inode_flush_metadata(inode);
     inode_close(inode);
+    changelog_append(path, 0);
     return 0;
 }
 
 static int cachefs_truncate(const char* path, off_t size, struct fuse_file_info* fi)
 {
-    return 0;
+    struct inode* inode = inode_reopen(get_file(fi));
+    if (inode == NULL) {
+        inode = inode_from_path(path);
+        if (inode == NULL)
+            return -ENOENT;
+        if (!inode_check_permission(inode, WRITE)) {
+            inode_close(inode);
+            return -EACCES;
+        }
+    }
+
+    int res = 0;
+    if (inode_is_dir(inode))
+        res = -EISDIR;
+    else if (size < 0)
+        res = -EINVAL;
+    else if (!inode_truncate(inode, size))
+        res = -EIO;
+    inode_close(inode);
+    if (res == 0)
+        changelog_append(path, 0);
+    return res;
 }
 
 static int cachefs_link(const char* from, const char* to)
@@ -515,16 +1188,16 @@ static int cachefs_link(const char* from, const char* to)
     char dir_path[strlen(to)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(to, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
 
-    struct dir* to_dir = dir_open(inode_get_from_path(dir_path));
+    struct dir* to_dir = dir_open(inode_from_path(dir_path));
     if (to_dir == NULL) {
         //printf("cant open from dir : %s\n", dir_path);
         return -ENOENT;
     }
 
-    struct inode* from_inode = inode_get_from_path(from);
+    struct inode* from_inode = inode_from_path(from);
     if (from_inode == NULL) {
         //printf("cant open from file : %s\n", from);
         dir_close(to_dir);
@@ -537,21 +1210,198 @@ static int cachefs_link(const char* from, const char* to)
         return -EPERM;
     }
 
-    if (inode_get_from_path(to)) {
+    if (inode_from_path(to)) {
         dir_close(to_dir);
         inode_close(from_inode);
         return -EEXIST;
     }
 
-    assert(dir_add(to_dir, file_name, from_inode->id));
-    inode_path_register(to, from_inode->id);
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_LINK, from_inode->id, from_inode->metadata.mode,
+        dir_get_inode(to_dir)->id, file_name);
+    intent.link_cnt = from_inode->metadata.link_cnt + 1;
+    if (!journal_begin(&intent, &seq)) {
+        dir_close(to_dir);
+        inode_close(from_inode);
+        return -EIO;
+    }
+
+    if (!dir_add(to_dir, file_name, from_inode->id)) {
+        int err = add_error(to_dir, file_name);
+        journal_end(seq);
+        dir_close(to_dir);
+        inode_close(from_inode);
+        return err;
+    }
     from_inode->metadata.link_cnt++;
     inode_flush_metadata(from_inode);
+    journal_end(seq);
     inode_close(from_inode);
     dir_close(to_dir);
+    changelog_append(from, 0);
+    changelog_append(to, CHANGE_ENTRY);
     //printf("end link\n");
     return 0;
 }
+static int rename_locked(const char* from, const char* to, unsigned int flags,
+    const char* from_dir_path, const char* from_name,
+    const char* to_dir_path, const char* to_name)
+{
+    int res = 0;
+    struct dir* from_dir = NULL;
+    struct dir* to_dir = NULL;
+    struct inode* dst = NULL;
+    struct inode* src = inode_from_path(from);
+    if (src == NULL)
+        return -ENOENT;
+
+    from_dir = dir_open(inode_from_path(from_dir_path));
+    to_dir = dir_open(inode_from_path(to_dir_path));
+    if (from_dir == NULL || to_dir == NULL) {
+        res = -ENOENT;
+        goto done;
+    }
+    if (!inode_check_permission(dir_get_inode(from_dir), WRITE)
+        || !inode_check_permission(dir_get_inode(to_dir), WRITE)) {
+        res = -EACCES;
+        goto done;
+    }
+
+    dst = inode_from_path(to);
+    if ((flags & RENAME_EXCHANGE) && dst == NULL) {
+        res = -ENOENT;
+        goto done;
+    }
+    if ((flags & RENAME_NOREPLACE) && dst != NULL) {
+        res = -EEXIST;
+        goto done;
+    }
+    if (dst != NULL && dst->id == src->id)
+        goto done;
+    if (dst != NULL && !(flags & RENAME_EXCHANGE)) {
+        if (inode_is_dir(src) && !inode_is_dir(dst)) {
+            res = -ENOTDIR;
+            goto done;
+        }
+        if (!inode_is_dir(src) && inode_is_dir(dst)) {
+            res = -EISDIR;
+            goto done;
+        }
+        struct dir* dst_dir = inode_is_dir(dst) ? dir_open(inode_reopen(dst)) : NULL;
+        bool empty = dst_dir == NULL || dir_is_empty(dst_dir);
+        dir_close(dst_dir);
+        if (!empty) {
+            res = -ENOTEMPTY;
+            goto done;
+        }
+    }
+
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_RENAME, src->id, src->metadata.mode,
+        dir_get_inode(from_dir)->id, from_name);
+    intent.flags = flags;
+    intent.to_dir_id = dir_get_inode(to_dir)->id;
+    snprintf(intent.to_name, sizeof(intent.to_name), "%s", to_name);
+    if (dst != NULL) {
+        intent.other_id = dst->id;
+        intent.other_mode = dst->metadata.mode;
+        intent.link_cnt = dst->metadata.link_cnt - 1;
+    }
+    if (!journal_begin(&intent, &seq)) {
+        res = -EIO;
+        goto done;
+    }
+
+    bool placed = dst != NULL ? dir_set(to_dir, to_name, src->id) : dir_add(to_dir, to_name, src->id);
+    if (!placed) {
+        res = dst != NULL ? -EIO : add_error(to_dir, to_name);
+        journal_end(seq);
+        goto done;
+    }
+    bool ok = flags & RENAME_EXCHANGE ? dir_set(from_dir, from_name, dst->id)
+                                      : dir_unlink(from_dir, from_name);
+    if (!ok) {
+        /* Record stays for replay to finish rename if new name can't be taken back */
+        bool undone = dst != NULL ? dir_set(to_dir, to_name, dst->id) : dir_unlink(to_dir, to_name);
+        if (undone)
+            journal_end(seq);
+        res = -EIO;
+        goto done;
+    }
+
+    int from_dir_id = dir_get_inode(from_dir)->id;
+    int to_dir_id = dir_get_inode(to_dir)->id;
+    if (from_dir_id != to_dir_id) {
+        struct dir* moved = inode_is_dir(src) ? dir_open(inode_reopen(src)) : NULL;
+        if (moved != NULL)
+            dir_set(moved, "..", to_dir_id);
+        dir_close(moved);
+        moved = (flags & RENAME_EXCHANGE) && inode_is_dir(dst) ? dir_open(inode_reopen(dst)) : NULL;
+        if (moved != NULL)
+            dir_set(moved, "..", from_dir_id);
+        dir_close(moved);
+    }
+
+    bool discarded = false;
+    if (dst != NULL && !(flags & RENAME_EXCHANGE)) {
+        /* Replaced inode lost its name */
+        dst->metadata.link_cnt--;
+        inode_flush_metadata(dst);
+        discarded = inode_is_dir(dst) || dst->metadata.link_cnt == 0;
+        if (discarded)
+            dir_discard(dst);
+    }
+    /* Record of replaced inode ends once it is gone */
+    if (discarded)
+        inode_set_intent(dst, seq);
+    else
+        journal_end(seq);
+
+done:
+    inode_close(dst);
+    dir_close(to_dir);
+    dir_close(from_dir);
+    inode_close(src);
+    return res;
+}
+
+static int cachefs_rename(const char* from, const char* to, unsigned int flags)
+{
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        return -EINVAL;
+    if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))
+        return -EINVAL;
+    if (!strcmp(from, "/") || !strcmp(to, "/"))
+        return -EBUSY;
+
+    char from_dir_path[strlen(from)];
+    char from_name[NAME_MAX + 1];
+    char to_dir_path[strlen(to)];
+    char to_name[NAME_MAX + 1];
+    if (!split_file_path(from, from_dir_path, from_name)
+        || !split_file_path(to, to_dir_path, to_name)) {
+        return -ENAMETOOLONG;
+    }
+
+    /* Directory can't be moved inside itself */
+    size_t from_len = strlen(from);
+    size_t to_len = strlen(to);
+    if ((!strncmp(to, from, from_len) && to[from_len] == '/')
+        || ((flags & RENAME_EXCHANGE) && !strncmp(from, to, to_len) && from[to_len] == '/'))
+        return -EINVAL;
+
+    pthread_mutex_lock(&rename_lock);
+    int res = rename_locked(from, to, flags, from_dir_path, from_name, to_dir_path, to_name);
+    pthread_mutex_unlock(&rename_lock);
+    if (res == 0) {
+        changelog_append(from, CHANGE_ENTRY);
+        changelog_append(to, CHANGE_ENTRY);
+    }
+    return res;
+}
+
 static int cachefs_symlink(const char* to, const char* from)
 {
     //printf("\n\n\n");
@@ -559,7 +1409,7 @@ static int cachefs_symlink(const char* to, const char* from)
 
     //printf("symlink\n");
 
-    struct inode* inode = inode_get_from_path(from);
+    struct inode* inode = inode_from_path(from);
     if (inode != NULL) {
         inode_close(inode);
         return -EEXIST;
@@ -567,9 +1417,9 @@ static int cachefs_symlink(const char* to, const char* from)
     char dir_path[strlen(from)];
     char file_name[NAME_MAX + 1];
     if (!split_file_path(from, dir_path, file_name)) {
-        return -1;
+        return -ENAMETOOLONG;
     }
-    struct inode* parent_inode = inode_get_from_path(dir_path);
+    struct inode* parent_inode = inode_from_path(dir_path);
     if (parent_inode == NULL) {
         return -ENOENT;
     }
@@ -582,32 +1432,58 @@ static int cachefs_symlink(const char* to, const char* from)
         inode_close(parent_inode);
         return -ENOSPC;
     }
-    assert(inode_create(inode_id, false, fuse_context->gid, fuse_context->uid, O_RDONLY | S_IFLNK));
+    struct intent intent;
+    uint64_t seq;
+    fill_intent(&intent, INTENT_SYMLINK, inode_id, O_RDONLY | S_IFLNK, parent_inode->id, file_name);
+    if (!journal_begin(&intent, &seq)) {
+        free_inode(inode_id);
+        inode_close(parent_inode);
+        return -EIO;
+    }
+    if (!inode_create(inode_id, false, fuse_context->gid, fuse_context->uid, O_RDONLY | S_IFLNK)) {
+        inode_close(parent_inode);
+        return undo_create(inode_id, seq, -EIO);
+    }
 
     struct dir* parent = dir_open(parent_inode);
     inode = inode_open(inode_id);
-    assert(parent != NULL);
-    assert(inode != NULL);
+    if (parent == NULL || inode == NULL) {
+        dir_close(parent);
+        inode_close(inode);
+        return undo_create(inode_id, seq, -ENOMEM);
+    }
 
-    inode_write_at(inode, to, strlen(to), 0, false);
+    size_t len = strlen(to);
+    if (inode_write_at(inode, to, len, 0, false) != len) {
+        dir_close(parent);
+        inode_close(inode);
+        return undo_create(inode_id, seq, -EIO);
+    }
 
-    assert(dir_add(parent, file_name, inode_id));
-    inode_path_register(from, inode_id);
+    if (!dir_add(parent, file_name, inode_id)) {
+        int err = add_error(parent, file_name);
+        dir_close(parent);
+        inode_close(inode);
+        return undo_create(inode_id, seq, err);
+    }
 
     dir_close(parent);
     inode_close(inode);
+    journal_end(seq);
+    changelog_append(from, CHANGE_ENTRY);
     printf("end symlink\n");
     return 0;
 }
 static int cachefs_readlink(const char* path, char* buf, size_t size)
 {
     bzero(buf, size);
-    struct inode* inode = inode_get_from_path(path);
+    struct inode* inode = inode_from_path(path);
     if (inode == NULL)
         return -ENOENT;
 
-    int res = inode_read_at(inode, buf, size, 0, false);
-    return 0;
+    ssize_t res = inode_read_at(inode, buf, size, 0, false);
+    inode_close(inode);
+    return res < 0 ? res : 0;
 }
 
 static struct fuse_operations cachefs_oper = {
@@ -624,6 +1500,7 @@ static struct fuse_operations cachefs_oper = {
     .statfs = cachefs_statfs,
     .destroy = cachefs_destroy,
     .unlink = cachefs_unlink,
+    .rename = cachefs_rename,
     .create = cachefs_create,
     .write = cachefs_write,
     .release = cachefs_release,
@@ -640,7 +1517,9 @@ static struct fuse_operations cachefs_oper = {
     .truncate = cachefs_truncate,
     .link = cachefs_link,
     .symlink = cachefs_symlink,
-    .readlink = cachefs_readlink
+    .readlink = cachefs_readlink,
+    .fallocate = cachefs_fallocate,
+    .copy_file_range = cachefs_copy_file_range
 
 };
 
@@ -652,9 +1531,80 @@ static void show_help(const char* progname)
            "                        (default: \"hello\")\n"
            "    --contents=<s>      Contents \"hello\" file\n"
            "                        (default \"Hello, World!\\n\")\n"
+           "    --dedup             Store blocks of new files by content hash,\n"
+           "                        identical blocks are kept only once\n"
+           "    --compress          Compress blocks which are worth compressing\n"
+           "    --checksum_retries=<n>  How many times corrupted block is\n"
+           "                        fetched again (default: 1)\n"
+           "    --checksum_policy=<s>   eio or zero, what reads return for\n"
+           "                        blocks which stay corrupted (default: eio)\n"
+           "    --attr_timeout=<t>  Seconds kernel caches attributes (default: 1)\n"
+           "    --entry_timeout=<t> Seconds kernel caches names (default: 1)\n"
+           "    --negative_timeout=<t>  Seconds kernel remembers missing\n"
+           "                        names (default: 0)\n"
+           "    --no_writeback      Send every write to memcached instead of\n"
+           "                        caching dirty pages in kernel\n"
+           "    --max_write=<n>     Largest read or write request in bytes\n"
+           "                        (default: 1048576)\n"
+           "    --coherence_interval=<s>  Seconds between polls of changes made\n"
+           "                        by other mounts, 0 disables (default: 0)\n"
+           "    --lease_time=<ms>   Serve metadata and names from memory under\n"
+           "                        leases this long, writers wait them out,\n"
+           "                        0 disables (default: 0)\n"
+           "    --snapshot=<file>   Copy file system to local file at unmount,\n"
+           "                        restore it if memcached lost file system\n"
+           "    --snapshot_interval=<s>  Seconds between background snapshots,\n"
+           "                        0 takes only one at unmount (default: 0)\n"
+           "    --journal=<file>    Record operations which change several items\n"
+           "                        in local file, unfinished ones are completed\n"
+           "                        or undone at next mount\n"
            "\n");
 }
 
+/*
+ * Checks before mounting that stored file system and journal can be
+ * used, restores file system from snapshot if it was lost. Daemon started by fuse_main
+ * does the rest of setup, failing there would leave dead mountpoint
+ */
+static bool prepare_mount()
+{
+    struct memcache_t* mem = memcache_init();
+    if (mem == NULL) {
+        fprintf(stderr, "cachefs: can't connect to memcached at %s:%d\n",
+            MEMCACHED_ADDRESS, MEMCACHED_PORT);
+        return false;
+    }
+    super_status_t status;
+    bool res = load_super(mem, &status);
+    memcache_close(mem);
+
+    /* Unfinished intents are replayed by init, here journal is only opened */
+    if (res && options.journal != NULL) {
+        int journal = open(options.journal, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (journal < 0) {
+            fprintf(stderr, "cachefs: can't open journal %s\n", options.journal);
+            res = false;
+        } else {
+            close(journal);
+        }
+    }
+    return res;
+}
+
+static void make_absolute(const char** path)
+{
+    if (*path == NULL || (*path)[0] == '/')
+        return;
+    char* cwd = getcwd(NULL, 0);
+    char* absolute = cwd != NULL ? malloc(strlen(cwd) + strlen(*path) + 2) : NULL;
+    if (absolute != NULL) {
+        sprintf(absolute, "%s/%s", cwd, *path);
+        free((void*)*path);
+        *path = absolute;
+    }
+    free(cwd);
+}
+
 int main(int argc, char* argv[])
 {
     int ret;
@@ -665,10 +1615,25 @@ int main(int argc, char* argv[])
    values are specified */
     options.filename = strdup("hello");
     options.contents = strdup("Hello World!\n");
+    options.checksum_retries = 1;
+    options.checksum_policy = strdup("eio");
+    options.attr_timeout = 1.0;
+    options.entry_timeout = 1.0;
+    options.negative_timeout = 0.0;
+    options.max_write = 1024 * 1024;
 
     /* Parse options */
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
         return 1;
+    if (options.checksum_retries < 0) {
+        fprintf(stderr, "cachefs: --checksum_retries can't be negative\n");
+        return 1;
+    }
+    if (strcmp(options.checksum_policy, "eio") != 0 && strcmp(options.checksum_policy, "zero") != 0) {
+        fprintf(stderr, "cachefs: unknown --checksum_policy %s, expected eio or zero\n",
+            options.checksum_policy);
+        return 1;
+    }
 
     /* When --help is specified, first print our own file-system
    specific help text, then signal fuse_main to show
@@ -681,6 +1646,20 @@ int main(int argc, char* argv[])
         args.argv[0][0] = '\0';
     }
 
+    /* Daemon leaves working directory, relative paths wouldn't be found */
+    make_absolute(&options.snapshot);
+    make_absolute(&options.journal);
+
+    /* Kernel takes read size limit from mount options */
+    char max_read[32];
+    snprintf(max_read, sizeof(max_read), "-omax_read=%u", options.max_write);
+    assert(fuse_opt_add_arg(&args, max_read) == 0);
+
+    if (!options.show_help && !prepare_mount()) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
     ret = fuse_main(args.argc, args.argv, &cachefs_oper, NULL);
     fuse_opt_free_args(&args);
     return ret;
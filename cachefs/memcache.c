@@ -10,33 +10,70 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define MAX_BLOCK_SIZE 4196
+#define MAX_VALUE_SIZE (1024 * 1024)
+#define READ_BUFFER_SIZE 16384
+#define PIPELINE_DEPTH 64
+#define MAX_IOV 1024
 #define CONNECTION_COUNT 5
 
 struct memcache_t {
     int fds[CONNECTION_COUNT];
     bool in_use[CONNECTION_COUNT];
     pthread_mutex_t lock;
+    pthread_cond_t released; // Signaled when connection is returned
 };
 
+/* Opens new connection to server, returns -1 on failure */
+static int connect_server()
+{
+    struct in_addr s_addr;
+    if (!inet_pton(AF_INET, MEMCACHED_ADDRESS, &s_addr.s_addr))
+        return -1;
+    int clientfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (clientfd < 0)
+        return -1;
+
+    struct sockaddr_in addr;
+    addr.sin_addr = s_addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MEMCACHED_PORT);
+    if (connect(clientfd, (const struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * Takes unused connection, waits if all of them are busy.
+ * Returns -1 if dropped connection can't be opened again
+ */
 static int get_fd(struct memcache_t* memcache)
 {
-    int res = -1;
     pthread_mutex_lock(&memcache->lock);
-    for (int i = 0; i < CONNECTION_COUNT; i++) {
-        if (!memcache->in_use[i]) {
-            memcache->in_use[i] = true;
-            res = memcache->fds[i];
-            break;
+    while (true) {
+        for (int i = 0; i < CONNECTION_COUNT; i++) {
+            if (memcache->in_use[i])
+                continue;
+            if (memcache->fds[i] < 0)
+                memcache->fds[i] = connect_server();
+            int res = memcache->fds[i];
+            memcache->in_use[i] = res >= 0;
+            pthread_mutex_unlock(&memcache->lock);
+            return res;
         }
+        pthread_cond_wait(&memcache->released, &memcache->lock);
     }
-    pthread_mutex_unlock(&memcache->lock);
-    return res;
 }
 
-static void release_fd(struct memcache_t* memcache, int fd)
+/*
+ * Returns connection to pool. BROKEN connection may still have unread
+ * replies, so it's closed and opened again by next get_fd
+ */
+static void release_fd(struct memcache_t* memcache, int fd, bool broken)
 {
     if (fd < 0)
         return;
@@ -45,23 +82,155 @@ static void release_fd(struct memcache_t* memcache, int fd)
     for (int i = 0; i < CONNECTION_COUNT; i++) {
         if (memcache->in_use[i] && memcache->fds[i] == fd) {
             memcache->in_use[i] = false;
+            if (broken) {
+                close(fd);
+                memcache->fds[i] = -1;
+            }
             break;
         }
     }
+    pthread_cond_signal(&memcache->released);
     pthread_mutex_unlock(&memcache->lock);
 }
 
-int line_start_index(const char* st, int line)
+enum command {
+    SET,
+    ADD,
+    CAS,
+    DELETE,
+    INCR,
+    DECR
+};
+
+struct reader {
+    int fd;
+    char buff[READ_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+};
+
+static void reader_init(struct reader* reader, int fd)
+{
+    reader->fd = fd;
+    reader->start = reader->end = 0;
+}
+
+static bool reader_fill(struct reader* reader)
+{
+    if (reader->start == reader->end)
+        reader->start = reader->end = 0;
+    ssize_t res = read(reader->fd, reader->buff + reader->end, READ_BUFFER_SIZE - reader->end);
+    if (res <= 0)
+        return false;
+    reader->end += res;
+    return true;
+}
+
+/* Reads one "\r\n" terminated line into LINE, without terminator. */
+static bool read_line(struct reader* reader, char* line, size_t size)
+{
+    while (true) {
+        char* nl = memchr(reader->buff + reader->start, '\n', reader->end - reader->start);
+        if (nl != NULL) {
+            size_t len = nl - (reader->buff + reader->start);
+            if (len > 0 && nl[-1] == '\r')
+                len--;
+            if (len >= size)
+                return false;
+            memcpy(line, reader->buff + reader->start, len);
+            line[len] = '\0';
+            reader->start = nl - reader->buff + 1;
+            return true;
+        }
+        if (reader->start > 0) {
+            memmove(reader->buff, reader->buff + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->end == READ_BUFFER_SIZE || !reader_fill(reader))
+            return false;
+    }
+}
+
+/* Reads exactly SIZE bytes, DST may be NULL to skip them. */
+static bool read_bytes(struct reader* reader, void* dst, size_t size)
 {
+    char* out = dst;
+    while (size > 0) {
+        if (reader->start == reader->end && !reader_fill(reader))
+            return false;
+        size_t chunk = reader->end - reader->start;
+        if (chunk > size)
+            chunk = size;
+        if (out != NULL) {
+            memcpy(out, reader->buff + reader->start, chunk);
+            out += chunk;
+        }
+        reader->start += chunk;
+        size -= chunk;
+    }
+    return true;
+}
 
-    for (int i = 0;; i++) {
-        if (i == 0 || st[i - 1] == '\n') {
-            line--;
-            if (line == 0)
-                return i;
+static bool write_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t res = writev(fd, iov, iovcnt > MAX_IOV ? MAX_IOV : iovcnt);
+        if (res < 0)
+            return false;
+        while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + res;
+            iov->iov_len -= res;
         }
     }
-    return -1;
+    return true;
+}
+
+/*
+ * Reads one VALUE block of get response into ITEM. Returns false on
+ * protocol or connection error. END line terminates whole response and
+ * is reported through END.
+ */
+static bool read_value(struct reader* reader, struct memcache_item* items,
+    size_t cnt, size_t* next, bool* end)
+{
+    char line[MEMCACHE_KEY_MAX + 64];
+    if (!read_line(reader, line, sizeof(line)))
+        return false;
+    if (strcmp(line, "END") == 0) {
+        *end = true;
+        return true;
+    }
+
+    char ret_key[MEMCACHE_KEY_MAX + 1];
+    unsigned int ret_flags;
+    size_t ret_size;
+    unsigned long long ret_cas = 0;
+    if (sscanf(line, "VALUE %250s %u %zu %llu", ret_key, &ret_flags, &ret_size, &ret_cas) < 3)
+        return false;
+
+    /* Server answers in request order and skips missing keys */
+    while (*next < cnt && strcmp(items[*next].key, ret_key) != 0)
+        (*next)++;
+
+    void* dst = NULL;
+    if (*next < cnt && ret_size <= items[*next].size)
+        dst = items[*next].buff;
+    if (!read_bytes(reader, dst, ret_size) || !read_bytes(reader, NULL, 2))
+        return false;
+    if (dst != NULL) {
+        items[*next].size = ret_size;
+        items[*next].cas = ret_cas;
+        items[*next].found = true;
+        (*next)++;
+    }
+    *end = false;
+    return true;
 }
 
 struct memcache_t* memcache_init()
@@ -70,131 +239,296 @@ struct memcache_t* memcache_init()
     if (memcache == NULL)
         return NULL;
     for (int i = 0; i < CONNECTION_COUNT; i++) {
-        int clientfd = socket(AF_INET, SOCK_STREAM, 0);
-        struct in_addr s_addr;
-        if (!inet_pton(AF_INET, MEMCACHED_ADDRESS, &s_addr.s_addr)) {
+        memcache->fds[i] = connect_server();
+        if (memcache->fds[i] < 0) {
             for (int j = 0; j < i; j++)
                 close(memcache->fds[j]);
             free(memcache);
             return NULL;
         }
-
-        struct sockaddr_in addr;
-        addr.sin_addr = s_addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(MEMCACHED_PORT);
-        if (connect(clientfd, (const struct sockaddr*)&addr, sizeof(addr)) == -1) {
-            for (int j = 0; j < i; j++)
-                close(memcache->fds[j]);
-            free(memcache);
-            return NULL;
-        }
-
-        memcache->fds[i] = clientfd;
         memcache->in_use[i] = false;
     }
     pthread_mutex_init(&memcache->lock, NULL);
+    pthread_cond_init(&memcache->released, NULL);
     return memcache;
 }
 
-void memcache_create(struct memcache_t* memcache)
+bool memcache_get(struct memcache_t* memcache, const char* key, void* buff)
 {
-    assert(memcache != NULL);
-    int value = CONSISTENCY_VALUE;
-    memcache_add(memcache, CONSISTENCY_KEY, (void*)&value, sizeof(int));
+    /*     printf("memcache get : %s\n", key); */
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", key);
+    item.buff = buff;
+    item.size = MAX_VALUE_SIZE;
+    return memcache_get_multi(memcache, &item, 1) && item.found;
 }
 
-bool memcache_is_consistent(struct memcache_t* memcache)
+bool memcache_add(struct memcache_t* memcache, const char* key,
+    const void* value, size_t size)
 {
-    assert(memcache != NULL);
-    int value;
-    return (memcache_get(memcache, CONSISTENCY_KEY, (void*)&value) && value == CONSISTENCY_VALUE);
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", key);
+    item.buff = (void*)value;
+    item.size = size;
+    item.exptime = 0;
+    return memcache_set_multi(memcache, &item, 1) && item.found;
 }
 
-bool memcache_get(struct memcache_t* memcache, const char* key, void* buff)
+bool memcache_delete(struct memcache_t* memcache, const char* key)
 {
-    /*     printf("memcache get : %s\n", key); */
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", key);
+    return memcache_delete_multi(memcache, &item, 1) && item.found;
+}
+
+static bool retrieve(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, const char* command)
+{
+    for (size_t i = 0; i < cnt; i++)
+        items[i].found = false;
+    if (cnt == 0)
+        return true;
+
     int fd = get_fd(memcache);
     if (fd < 0)
         return false;
-    char data[MAX_BLOCK_SIZE];
-    int filled = sprintf(data, "get %s\r\n", key);
 
-    if (write(fd, data, filled) < filled) {
-        release_fd(memcache, fd);
-        return false;
-    }
-    if (read(fd, data, MAX_BLOCK_SIZE) >= 0) {
-        char ret_key[64];
-        int ret_exp, ret_size;
-        if (sscanf(data, "VALUE %s %d %d\r\n", ret_key, &ret_exp, &ret_size) < 3) {
-            release_fd(memcache, fd);
-            return false;
+    struct reader* reader = malloc(sizeof(struct reader));
+    char* line = malloc(PIPELINE_DEPTH * (MEMCACHE_KEY_MAX + 1) + 8);
+    bool allocated = reader != NULL && line != NULL;
+    bool res = allocated;
+    if (res)
+        reader_init(reader, fd);
+
+    for (size_t batch = 0; res && batch < cnt; batch += PIPELINE_DEPTH) {
+        size_t batch_end = batch + PIPELINE_DEPTH < cnt ? batch + PIPELINE_DEPTH : cnt;
+        int filled = sprintf(line, "%s", command);
+        for (size_t i = batch; i < batch_end; i++)
+            filled += sprintf(line + filled, " %s", items[i].key);
+        filled += sprintf(line + filled, "\r\n");
+
+        struct iovec iov = { line, filled };
+        if (!write_all(fd, &iov, 1)) {
+            res = false;
+            break;
         }
 
-        memcpy(buff, data + line_start_index(data, 2), ret_size);
-        release_fd(memcache, fd);
-        return true;
-    } else {
-        release_fd(memcache, fd);
-        return false;
+        size_t next = batch;
+        bool end = false;
+        while (res && !end)
+            res = read_value(reader, items, batch_end, &next, &end);
     }
+
+    free(line);
+    free(reader);
+    release_fd(memcache, fd, allocated && !res);
+    return res;
 }
 
-bool memcache_add(struct memcache_t* memcache, const char* key,
-    const void* value, size_t size)
+bool memcache_get_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
 {
+    return retrieve(memcache, items, cnt, "get");
+}
 
-    int fd = get_fd(memcache);
-    if (fd < 0)
-        return false;
+bool memcache_gets_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return retrieve(memcache, items, cnt, "gets");
+}
 
-    char data[MAX_BLOCK_SIZE];
-    int filled = sprintf(data, "set %s 0 0 %zu\r\n", key, size);
-    memcpy(data + filled, value, size);
-    filled += size;
+static int format_command(char* header, enum command command, const struct memcache_item* item)
+{
+    switch (command) {
+    case SET:
+        return sprintf(header, "set %s 0 %u %zu\r\n", item->key, item->exptime, item->size);
+    case ADD:
+        return sprintf(header, "add %s 0 %u %zu\r\n", item->key, item->exptime, item->size);
+    case CAS:
+        /* Uniques are never zero, record without one must not exist yet */
+        if (item->cas == 0)
+            return sprintf(header, "add %s 0 %u %zu\r\n", item->key, item->exptime, item->size);
+        return sprintf(header, "cas %s 0 %u %zu %llu\r\n", item->key, item->exptime, item->size,
+            (unsigned long long)item->cas);
+    case DELETE:
+        return sprintf(header, "delete %s\r\n", item->key);
+    case INCR:
+        return sprintf(header, "incr %s %llu\r\n", item->key, (unsigned long long)item->number);
+    default:
+        return sprintf(header, "decr %s %llu\r\n", item->key, (unsigned long long)item->number);
+    }
+}
 
-    filled += sprintf(data + filled, "\r\n");
+static bool parse_result(const char* result, enum command command, struct memcache_item* item)
+{
+    switch (command) {
+    case SET:
+    case ADD:
+    case CAS:
+        return strcmp(result, "STORED") == 0;
+    case DELETE:
+        return strcmp(result, "DELETED") == 0;
+    default: {
+        /* Counters answer with new value, NOT_FOUND or CLIENT_ERROR */
+        char* end;
+        unsigned long long value = strtoull(result, &end, 10);
+        if (end == result || *end != '\0')
+            return false;
+        item->number = value;
+        return true;
+    }
+    }
+}
 
-    if (write(fd, data, filled) < filled) {
-        release_fd(memcache, fd);
-        return false;
+/*
+ * Reads back stored records of cas pipeline which were asked for with
+ * gets, record keeps new unique only if it still holds the stored value.
+ */
+static bool renew_uniques(struct reader* reader, struct memcache_item* items, size_t cnt)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < cnt; i++)
+        total += items[i].size;
+    struct memcache_item* copies = malloc(cnt * sizeof(struct memcache_item));
+    char* values = malloc(total + 1);
+    bool res = copies != NULL && values != NULL;
+    for (size_t i = 0, pos = 0; res && i < cnt; pos += items[i++].size) {
+        strcpy(copies[i].key, items[i].key);
+        copies[i].buff = values + pos;
+        copies[i].size = items[i].size;
+        copies[i].found = false;
     }
-    char result[64];
-    bool res = (read(fd, result, 64) >= 0 && strncmp(result, "STORED", 6) == 0);
-    release_fd(memcache, fd);
+    size_t next = 0;
+    bool end = false;
+    while (res && !end)
+        res = read_value(reader, copies, cnt, &next, &end);
+    for (size_t i = 0; res && i < cnt; i++) {
+        if (!items[i].found)
+            continue;
+        bool same = copies[i].found && copies[i].size == items[i].size
+            && memcmp(copies[i].buff, items[i].buff, items[i].size) == 0;
+        items[i].cas = same ? copies[i].cas : 0;
+    }
+    free(values);
+    free(copies);
     return res;
 }
 
-bool memcache_delete(struct memcache_t* memcache, const char* key)
+/*
+ * Sends COUNT pipelined commands which answer with a single line and
+ * marks every item found when the command succeeded. With RENEW stored
+ * records are fetched again in the same round trip to learn new uniques.
+ */
+static bool pipeline(struct memcache_t* memcache, struct memcache_item* items,
+    size_t cnt, enum command command, bool renew)
 {
+    for (size_t i = 0; i < cnt; i++)
+        items[i].found = false;
+    if (cnt == 0)
+        return true;
+
     int fd = get_fd(memcache);
     if (fd < 0)
         return false;
 
-    char data[MAX_BLOCK_SIZE];
-    int filled = sprintf(data, "delete %s\r\n", key);
+    bool has_value = command == SET || command == ADD || command == CAS;
+    struct reader* reader = malloc(sizeof(struct reader));
+    struct iovec* iov = malloc((3 * PIPELINE_DEPTH + 1) * sizeof(struct iovec));
+    char(*headers)[MEMCACHE_KEY_MAX + 96] = malloc(PIPELINE_DEPTH * sizeof(*headers));
+    char* line = renew ? malloc(PIPELINE_DEPTH * (MEMCACHE_KEY_MAX + 1) + 8) : NULL;
+    bool allocated = reader != NULL && iov != NULL && headers != NULL && (line != NULL || !renew);
+    bool res = allocated;
+    if (res)
+        reader_init(reader, fd);
 
-    if (write(fd, data, filled) < filled) {
-        release_fd(memcache, fd);
-        return false;
+    for (size_t batch = 0; res && batch < cnt; batch += PIPELINE_DEPTH) {
+        size_t batch_end = batch + PIPELINE_DEPTH < cnt ? batch + PIPELINE_DEPTH : cnt;
+        int iovcnt = 0;
+        for (size_t i = batch; i < batch_end; i++) {
+            char* header = headers[i - batch];
+            iov[iovcnt++] = (struct iovec) { header, format_command(header, command, &items[i]) };
+            if (has_value) {
+                iov[iovcnt++] = (struct iovec) { items[i].buff, items[i].size };
+                iov[iovcnt++] = (struct iovec) { "\r\n", 2 };
+            }
+        }
+        if (renew) {
+            int filled = sprintf(line, "gets");
+            for (size_t i = batch; i < batch_end; i++)
+                filled += sprintf(line + filled, " %s", items[i].key);
+            filled += sprintf(line + filled, "\r\n");
+            iov[iovcnt++] = (struct iovec) { line, filled };
+        }
+        if (!write_all(fd, iov, iovcnt)) {
+            res = false;
+            break;
+        }
+
+        for (size_t i = batch; i < batch_end; i++) {
+            char result[64];
+            if (!read_line(reader, result, sizeof(result))) {
+                res = false;
+                break;
+            }
+            items[i].found = parse_result(result, command, &items[i]);
+        }
+        if (res && renew)
+            res = renew_uniques(reader, items + batch, batch_end - batch);
     }
 
-    char result[64];
-    bool res = (read(fd, result, 64) >= 0 && strncmp(result, "DELETED", 7) == 0);
-    release_fd(memcache, fd);
+    free(line);
+    free(headers);
+    free(iov);
+    free(reader);
+    release_fd(memcache, fd, allocated && !res);
     return res;
 }
 
+bool memcache_set_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, SET, false);
+}
+
+bool memcache_add_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, ADD, false);
+}
+
+bool memcache_cas_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, CAS, false);
+}
+
+bool memcache_cas_gets_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, CAS, true);
+}
+
+bool memcache_delete_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, DELETE, false);
+}
+
+bool memcache_incr_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, INCR, false);
+}
+
+bool memcache_decr_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt)
+{
+    return pipeline(memcache, items, cnt, DECR, false);
+}
+
 void memcache_close(struct memcache_t* memcache)
 {
     if (memcache == NULL)
         return;
     pthread_mutex_lock(&memcache->lock);
-    for (int j = 0; j < CONNECTION_COUNT; j++)
-        close(memcache->fds[j]);
+    for (int j = 0; j < CONNECTION_COUNT; j++) {
+        if (memcache->fds[j] >= 0)
+            close(memcache->fds[j]);
+    }
     pthread_mutex_unlock(&memcache->lock);
     pthread_mutex_destroy(&memcache->lock);
+    pthread_cond_destroy(&memcache->released);
     free(memcache);
 }
 
@@ -203,16 +537,38 @@ bool memcache_clear(struct memcache_t* memcache)
     int fd = get_fd(memcache);
     if (fd < 0)
         return false;
-    char data[MAX_BLOCK_SIZE];
-    int filled = sprintf(data, "flush_all\r\n");
-
-    if (write(fd, data, filled) < filled) {
-        release_fd(memcache, fd);
-        return false;
-    }
 
+    struct iovec iov = { "flush_all\r\n", 11 };
+    struct reader reader;
+    reader_init(&reader, fd);
     char result[64];
-    bool res = (read(fd, result, 64) >= 0 && strncmp(result, "OK", 2) == 0);
-    release_fd(memcache, fd);
+    bool res = write_all(fd, &iov, 1) && read_line(&reader, result, sizeof(result))
+        && strcmp(result, "OK") == 0;
+    release_fd(memcache, fd, !res);
     return res;
-}
\ No newline at end of file
+}
+
+bool memcache_stat(struct memcache_t* memcache, const char* name, uint64_t* value)
+{
+    int fd = get_fd(memcache);
+    if (fd < 0)
+        return false;
+
+    struct iovec iov = { "stats\r\n", 7 };
+    struct reader reader;
+    reader_init(&reader, fd);
+    char line[256];
+    bool found = false;
+    bool res = write_all(fd, &iov, 1);
+    /* Whole response is read so that connection stays usable */
+    while (res && (res = read_line(&reader, line, sizeof(line))) && strcmp(line, "END") != 0) {
+        char stat[128];
+        unsigned long long number;
+        if (sscanf(line, "STAT %127s %llu", stat, &number) == 2 && strcmp(stat, name) == 0) {
+            *value = number;
+            found = true;
+        }
+    }
+    release_fd(memcache, fd, !res);
+    return res && found;
+}
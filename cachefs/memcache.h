@@ -4,13 +4,26 @@
 #define MEMCACHE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define MEMCACHED_PORT 11211
 #define MEMCACHED_ADDRESS "127.0.0.1"
 
-#define CONSISTENCY_KEY "bakurits-xoiquxtt"
-#define CONSISTENCY_VALUE 0xfff123
+#define MEMCACHE_KEY_MAX 250
+
+/**
+ * One record of pipelined request
+ */
+struct memcache_item {
+    char key[MEMCACHE_KEY_MAX + 1];
+    void* buff; // Value buffer
+    size_t size; // Value size, for gets capacity of buff which is replaced by real size
+    unsigned int exptime; // Seconds until stored value expires, 0 for never
+    uint64_t cas; // Unique value returned by gets and checked by cas
+    uint64_t number; // Delta for incr/decr, replaced by new value of counter
+    bool found; // Set if key existed (get, delete, incr/decr) or value was stored
+};
 
 /**
  * Function : memcache_init
@@ -22,28 +35,6 @@
  */
 struct memcache_t* memcache_init();
 
-/**
- * Function : memcache_create
- * ----------------------------------------
- * 
- * Creates Memcached's metadata in memory
- * 
- * memcache : memcache object
- */
-void memcache_create(struct memcache_t* memcache);
-
-/**
- * Function : memcache_is_consistent
- * ----------------------------------------
- * 
- * Chechs if Memcached has valid kay for filesistem
- * 
- * memcache : memcache object
- * 
- * Returns  : true if memcache is consistent and false otherwise 
- */
-bool memcache_is_consistent(struct memcache_t* memcache);
-
 /**
  * Function : memcache_get
  * ----------------------------------------
@@ -87,6 +78,143 @@ bool memcache_add(struct memcache_t* memcache, const char* key,
  */
 bool memcache_delete(struct memcache_t* memcache, const char* key);
 
+/**
+ * Function : memcache_get_multi
+ * ----------------------------------------
+ *  
+ * Gets many records with pipelined requests, missing keys 
+ * are reported with found flag
+ * 
+ * memcache : memcache object
+ * items    : records to get
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_get_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_set_multi
+ * ----------------------------------------
+ *  
+ * Stores many records with pipelined requests, existing keys are replaced, 
+ * stored records are reported with found flag
+ * 
+ * memcache : memcache object
+ * items    : records to store
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_set_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_gets_multi
+ * ----------------------------------------
+ *  
+ * Same as memcache_get_multi but also fills cas unique of 
+ * every found record for later memcache_cas_multi
+ * 
+ * memcache : memcache object
+ * items    : records to get
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_gets_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_add_multi
+ * ----------------------------------------
+ *  
+ * Stores records only if their keys don't exist yet, 
+ * stored records are reported with found flag
+ * 
+ * memcache : memcache object
+ * items    : records to store
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_add_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_cas_multi
+ * ----------------------------------------
+ *  
+ * Stores records only if they weren't modified since gets 
+ * returned their cas unique, stored records are reported with found flag.
+ * Records with zero cas are stored only if their keys don't exist yet
+ * 
+ * memcache : memcache object
+ * items    : records to store
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_cas_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_cas_gets_multi
+ * ----------------------------------------
+ *  
+ * Same as memcache_cas_multi but stored records are read back in 
+ * the same round trip, their cas field is replaced by the new unique
+ * or by zero if somebody else changed them in between
+ * 
+ * memcache : memcache object
+ * items    : records to store
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_cas_gets_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_incr_multi
+ * ----------------------------------------
+ *  
+ * Increments numeric records by their number field, which 
+ * is replaced with new value. Missing keys aren't created
+ * 
+ * memcache : memcache object
+ * items    : counters to increment
+ * cnt      : number of counters
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_incr_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_decr_multi
+ * ----------------------------------------
+ *  
+ * Decrements numeric records by their number field, which 
+ * is replaced with new value. Counters don't go below zero
+ * 
+ * memcache : memcache object
+ * items    : counters to decrement
+ * cnt      : number of counters
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_decr_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
+/**
+ * Function : memcache_delete_multi
+ * ----------------------------------------
+ *  
+ * Deletes many records with pipelined requests, 
+ * deleted records are reported with found flag
+ * 
+ * memcache : memcache object
+ * items    : records to delete, only keys are used
+ * cnt      : number of records
+ * 
+ * Returns  : true if all requests were answered and false on connection error
+ */
+bool memcache_delete_multi(struct memcache_t* memcache, struct memcache_item* items, size_t cnt);
+
 /**
  * Function : memcache_clear
  * ----------------------------------------
@@ -99,6 +227,21 @@ bool memcache_delete(struct memcache_t* memcache, const char* key);
  */
 bool memcache_clear(struct memcache_t* memcache);
 
+/**
+ * Function : memcache_stat
+ * ----------------------------------------
+ *  
+ * Reads one numeric general-purpose statistic of Memcached server,
+ * for example "bytes" or "limit_maxbytes"
+ * 
+ * memcache : memcache object
+ * name     : name of statistic
+ * value    : where value is written
+ * 
+ * Returns  : true if server reported the statistic
+ */
+bool memcache_stat(struct memcache_t* memcache, const char* name, uint64_t* value);
+
 /**
  * Function : memcache_close
  * ----------------------------------------
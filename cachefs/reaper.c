@@ -0,0 +1,105 @@
+#include "reaper.h"
+#include "freemap.h"
+#include "journal.h"
+#include "list.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct reap_job {
+    int inode_id;
+    struct inode_disk_metadata metadata;
+    uint64_t intent;
+    struct list_elem elem;
+};
+
+static struct list queue;
+static size_t busy; // Jobs taken from queue and not finished yet
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained_cond = PTHREAD_COND_INITIALIZER;
+static bool reaper_started;
+
+static void reap(struct reap_job** jobs, size_t cnt)
+{
+    int ids[REAPER_BATCH];
+    struct inode_disk_metadata metadata[REAPER_BATCH];
+    for (size_t i = 0; i < cnt; i++) {
+        ids[i] = jobs[i]->inode_id;
+        metadata[i] = jobs[i]->metadata;
+    }
+    inode_reclaim(ids, metadata, cnt);
+    for (size_t i = 0; i < cnt; i++) {
+        free_inode(jobs[i]->inode_id);
+        journal_end(jobs[i]->intent);
+    }
+}
+
+static void* reap_loop(void* aux)
+{
+    (void)aux;
+    struct reap_job* jobs[REAPER_BATCH];
+    pthread_mutex_lock(&reaper_lock);
+    while (true) {
+        while (list_empty(&queue))
+            pthread_cond_wait(&queued_cond, &reaper_lock);
+        /* Small files removed by rm -rf go in few pipelined requests */
+        size_t cnt = 0;
+        while (cnt < REAPER_BATCH && !list_empty(&queue))
+            jobs[cnt++] = list_entry(list_pop_front(&queue), struct reap_job, elem);
+        busy += cnt;
+        pthread_mutex_unlock(&reaper_lock);
+
+        reap(jobs, cnt);
+        for (size_t i = 0; i < cnt; i++)
+            free(jobs[i]);
+
+        pthread_mutex_lock(&reaper_lock);
+        busy -= cnt;
+        if (busy == 0 && list_empty(&queue))
+            pthread_cond_broadcast(&drained_cond);
+    }
+    return NULL;
+}
+
+void init_reaper()
+{
+    pthread_mutex_lock(&reaper_lock);
+    if (!reaper_started) {
+        list_init(&queue);
+        pthread_t reaper;
+        reaper_started = pthread_create(&reaper, NULL, reap_loop, NULL) == 0;
+        if (reaper_started)
+            pthread_detach(reaper);
+    }
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+void reaper_queue(int inode_id, const struct inode_disk_metadata* metadata, uint64_t intent)
+{
+    struct reap_job* job = malloc(sizeof(struct reap_job));
+    pthread_mutex_lock(&reaper_lock);
+    if (job != NULL && reaper_started) {
+        job->inode_id = inode_id;
+        job->metadata = *metadata;
+        job->intent = intent;
+        list_push_back(&queue, &job->elem);
+        pthread_cond_signal(&queued_cond);
+        pthread_mutex_unlock(&reaper_lock);
+        return;
+    }
+    pthread_mutex_unlock(&reaper_lock);
+    free(job);
+
+    /* Without reaper thread inode is deleted right away */
+    struct reap_job now = { .inode_id = inode_id, .metadata = *metadata, .intent = intent };
+    struct reap_job* jobs[1] = { &now };
+    reap(jobs, 1);
+}
+
+void reaper_drain()
+{
+    pthread_mutex_lock(&reaper_lock);
+    while (busy > 0 || (reaper_started && !list_empty(&queue)))
+        pthread_cond_wait(&drained_cond, &reaper_lock);
+    pthread_mutex_unlock(&reaper_lock);
+}
@@ -0,0 +1,36 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "inode.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define REAPER_BATCH 64 // Removed inodes reclaimed together
+
+/**
+ * Function : init_reaper
+ * ----------------------------------------
+ * Starts thread which deletes stored data of removed inodes
+ */
+void init_reaper();
+
+/**
+ * Function : reaper_queue
+ * ----------------------------------------
+ * Queues removed inode for deletion, its id returns to free map
+ * and journal record ends once everything is deleted
+ * 
+ * inode_id : id of inode
+ * metadata : last metadata of inode
+ * intent   : journal record of removal, 0 if there is none
+ */
+void reaper_queue(int inode_id, const struct inode_disk_metadata* metadata, uint64_t intent);
+
+/**
+ * Function : reaper_drain
+ * ----------------------------------------
+ * Waits until every queued inode is deleted
+ */
+void reaper_drain();
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * Loads snapshot written by cachefs-dump or by --snapshot option into
+ * Memcached. Stored file system is replaced only when -f is given.
+ *
+ * Usage : ./cachefs-restore [-f] <file>
+ */
+
+#include "memcache.h"
+#include "snapshot.h"
+#include "super.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char* argv[])
+{
+    bool force = argc == 3 && strcmp(argv[1], "-f") == 0;
+    if (argc != 2 && !force) {
+        fprintf(stderr, "usage: %s [-f] <file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* path = argv[argc - 1];
+
+    struct memcache_t* memcache = memcache_init();
+    if (memcache == NULL) {
+        fprintf(stderr, "cachefs-restore: can't connect to memcached\n");
+        return EXIT_FAILURE;
+    }
+    if (!force && super_load(memcache) != SUPER_MISSING) {
+        fprintf(stderr, "cachefs-restore: memcached holds file system, -f replaces it\n");
+        memcache_close(memcache);
+        return EXIT_FAILURE;
+    }
+
+    bool res = memcache_clear(memcache) && snapshot_restore(memcache, path);
+    if (!res)
+        fprintf(stderr, "cachefs-restore: can't restore snapshot %s\n", path);
+    memcache_close(memcache);
+    return res ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,431 @@
+#include "snapshot.h"
+#include "block.h"
+#include "directory.h"
+#include "freemap.h"
+#include "hash.h"
+#include "inode.h"
+#include "super.h"
+#include "usage.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BATCH_SIZE 256 // Records fetched or stored with one pipelined request
+#define METADATA_BATCH 1024 // Inode ids whose metadata is fetched at once
+#define VALUE_MAX BLOCK_VALUE_MAX // Blocks are largest stored values, index buckets and maps fit too
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct record_header {
+    uint32_t value_size;
+    uint8_t key_len;
+} __attribute__((packed));
+
+/* Follows record with empty key, checksum covers everything before it */
+struct snapshot_trailer {
+    uint64_t records;
+    uint32_t crc;
+} __attribute__((packed));
+
+struct writer {
+    struct memcache_t* memcache;
+    FILE* file;
+    uint32_t crc;
+    uint64_t records;
+    bool failed;
+    struct memcache_item items[BATCH_SIZE];
+    size_t cnt;
+    char* values;
+    uint64_t* seen; // Hashes of reported shared keys, 0 marks free slot
+    size_t seen_cap;
+    size_t seen_cnt;
+};
+
+static struct memcache_t* memcache;
+static const char* snapshot_path;
+static int snapshot_interval;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool snapshotter_started;
+
+static void write_bytes(struct writer* w, const void* data, size_t size)
+{
+    if (w->failed)
+        return;
+    w->crc = crc32c(w->crc, data, size);
+    w->failed = fwrite(data, 1, size, w->file) != size;
+}
+
+static void write_batch(struct writer* w)
+{
+    if (w->cnt == 0 || w->failed)
+        return;
+    if (!memcache_get_multi(w->memcache, w->items, w->cnt)) {
+        w->failed = true;
+        return;
+    }
+    /* Holes and records removed since they were listed are skipped */
+    for (size_t i = 0; i < w->cnt; i++) {
+        if (!w->items[i].found)
+            continue;
+        struct record_header header = { w->items[i].size, strlen(w->items[i].key) };
+        write_bytes(w, &header, sizeof(header));
+        write_bytes(w, w->items[i].key, header.key_len);
+        write_bytes(w, w->items[i].buff, header.value_size);
+        w->records++;
+    }
+    w->cnt = 0;
+}
+
+/* Returns false if KEY was already reported */
+static bool remember(struct writer* w, const char* key)
+{
+    if (2 * (w->seen_cnt + 1) > w->seen_cap) {
+        size_t cap = w->seen_cap == 0 ? 1024 : 2 * w->seen_cap;
+        uint64_t* seen = calloc(cap, sizeof(uint64_t));
+        if (seen == NULL) {
+            w->failed = true;
+            return false;
+        }
+        for (size_t i = 0; i < w->seen_cap; i++) {
+            size_t slot = w->seen[i] % cap;
+            while (w->seen[i] != 0 && seen[slot] != 0)
+                slot = (slot + 1) % cap;
+            seen[slot] = w->seen[i];
+        }
+        free(w->seen);
+        w->seen = seen;
+        w->seen_cap = cap;
+    }
+
+    struct block_hash hash;
+    hash_block(key, strlen(key), &hash);
+    uint64_t h = hash.h[0] != 0 ? hash.h[0] : 1;
+    size_t slot = h % w->seen_cap;
+    while (w->seen[slot] != 0) {
+        if (w->seen[slot] == h)
+            return false;
+        slot = (slot + 1) % w->seen_cap;
+    }
+    w->seen[slot] = h;
+    w->seen_cnt++;
+    return true;
+}
+
+static void visit_key(const char* key, bool shared, void* aux)
+{
+    struct writer* w = aux;
+    if (w->failed || (shared && !remember(w, key)))
+        return;
+    strcpy(w->items[w->cnt].key, key);
+    w->items[w->cnt].size = VALUE_MAX;
+    w->cnt++;
+    if (w->cnt == BATCH_SIZE)
+        write_batch(w);
+}
+
+static void walk_inodes(struct writer* w, size_t capacity)
+{
+    int* ids = malloc(METADATA_BATCH * sizeof(int));
+    struct inode_disk_metadata* metadata = malloc(METADATA_BATCH * sizeof(struct inode_disk_metadata));
+    bool* found = malloc(METADATA_BATCH * sizeof(bool));
+    if (ids == NULL || metadata == NULL || found == NULL)
+        w->failed = true;
+
+    for (size_t first = 0; first < capacity && !w->failed; first += METADATA_BATCH) {
+        size_t cnt = capacity - first < METADATA_BATCH ? capacity - first : METADATA_BATCH;
+        for (size_t i = 0; i < cnt; i++)
+            ids[i] = first + i;
+        if (!inode_get_metadata_multi(ids, cnt, metadata, found)) {
+            w->failed = true;
+            break;
+        }
+        for (size_t i = 0; i < cnt && !w->failed; i++) {
+            if (!found[i])
+                continue;
+            if (!inode_list_keys(ids[i], &metadata[i], visit_key, w))
+                w->failed = true;
+            if (metadata[i].is_dir && !dir_list_keys(ids[i], visit_key, w))
+                w->failed = true;
+        }
+    }
+    free(ids);
+    free(metadata);
+    free(found);
+}
+
+bool snapshot_dump(struct memcache_t* mem, const char* path)
+{
+    struct superblock sb;
+    struct memcache_item item = { 0 };
+    snprintf(item.key, sizeof(item.key), "%s", SUPERBLOCK_KEY);
+    item.buff = &sb;
+    item.size = sizeof(struct superblock);
+    if (!memcache_get_multi(mem, &item, 1) || !item.found || item.size != sizeof(struct superblock))
+        return false;
+
+    char* tmp_path = malloc(strlen(path) + 5);
+    struct writer* w = calloc(1, sizeof(struct writer));
+    if (tmp_path == NULL || w == NULL || (w->values = malloc(BATCH_SIZE * VALUE_MAX)) == NULL) {
+        free(tmp_path);
+        if (w != NULL)
+            free(w->values);
+        free(w);
+        return false;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+    w->memcache = mem;
+    for (size_t i = 0; i < BATCH_SIZE; i++)
+        w->items[i].buff = w->values + i * VALUE_MAX;
+
+    w->file = fopen(tmp_path, "w");
+    w->failed = w->file == NULL;
+    struct snapshot_header header = { SNAPSHOT_MAGIC, SNAPSHOT_VERSION };
+    write_bytes(w, &header, sizeof(header));
+
+    /*
+     * Namespace keeps changing while records are read. Free map goes
+     * last so that it covers every dumped inode, restore claims ids of
+     * inodes which were freed after they were read
+     */
+    visit_key(SUPERBLOCK_KEY, false, w);
+    visit_key(USAGE_KEY, false, w);
+    walk_inodes(w, sb.inode_capacity);
+    write_batch(w);
+    freemap_list_keys(sb.inode_capacity, visit_key, w);
+    write_batch(w);
+
+    struct record_header end = { 0, 0 };
+    write_bytes(w, &end, sizeof(end));
+    struct snapshot_trailer trailer = { w->records, w->crc };
+    write_bytes(w, &trailer, sizeof(trailer));
+
+    bool res = !w->failed;
+    if (w->file != NULL) {
+        res = fflush(w->file) == 0 && fsync(fileno(w->file)) == 0 && res;
+        res = fclose(w->file) == 0 && res;
+    }
+    /* Old snapshot is replaced only by complete one */
+    if (res)
+        res = rename(tmp_path, path) == 0;
+    if (!res)
+        unlink(tmp_path);
+
+    free(w->seen);
+    free(w->values);
+    free(w);
+    free(tmp_path);
+    return res;
+}
+
+static bool read_bytes(FILE* file, void* data, size_t size, uint32_t* crc)
+{
+    if (fread(data, 1, size, file) != size)
+        return false;
+    *crc = crc32c(*crc, data, size);
+    return true;
+}
+
+/*
+ * Reads next record of FILE into ITEM, false at the end of
+ * records or if file is damaged
+ */
+static bool read_record(FILE* file, struct memcache_item* item, uint32_t* crc, bool* damaged)
+{
+    struct record_header header;
+    *damaged = true;
+    if (!read_bytes(file, &header, sizeof(header), crc))
+        return false;
+    if (header.key_len == 0) {
+        *damaged = header.value_size != 0;
+        return false;
+    }
+    if (header.value_size > VALUE_MAX || !read_bytes(file, item->key, header.key_len, crc)
+        || !read_bytes(file, item->buff, header.value_size, crc))
+        return false;
+    item->key[header.key_len] = '\0';
+    item->size = header.value_size;
+    item->exptime = 0;
+    *damaged = false;
+    return true;
+}
+
+/* Reads whole FILE and checks its layout and checksum */
+static bool verify(FILE* file, char* value)
+{
+    struct snapshot_header header;
+    uint32_t crc = 0;
+    if (!read_bytes(file, &header, sizeof(header), &crc) || header.magic != SNAPSHOT_MAGIC
+        || header.version != SNAPSHOT_VERSION)
+        return false;
+
+    struct memcache_item item;
+    item.buff = value;
+    uint64_t records = 0;
+    bool damaged;
+    while (read_record(file, &item, &crc, &damaged))
+        records++;
+    uint32_t sum = crc;
+    struct snapshot_trailer trailer;
+    return !damaged && read_bytes(file, &trailer, sizeof(trailer), &crc)
+        && trailer.records == records && trailer.crc == sum && fgetc(file) == EOF;
+}
+
+static bool store_batch(struct memcache_t* mem, struct memcache_item* items, size_t cnt)
+{
+    if (!memcache_set_multi(mem, items, cnt))
+        return false;
+    for (size_t i = 0; i < cnt; i++) {
+        if (!items[i].found)
+            return false;
+    }
+    return true;
+}
+
+/* Returns false if KEY isn't metadata record of inode */
+static bool metadata_of(const char* key, int* inode_id)
+{
+    int end = -1;
+    sscanf(key, "%d#METADATA%n", inode_id, &end);
+    return end > 0 && key[end] == '\0';
+}
+
+/* Marks restored inodes used in restored free map */
+static bool claim_inodes(struct memcache_t* mem, const struct superblock* sb,
+    const int* ids, size_t cnt)
+{
+    if (!load_freemap(mem, sb->inode_capacity))
+        return false;
+    for (size_t i = 0; i < cnt; i++)
+        freemap_claim(ids[i]);
+    bool res = freemap_flush();
+    close_freemap();
+    return res;
+}
+
+bool snapshot_restore(struct memcache_t* mem, const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+    struct memcache_item* items = malloc((BATCH_SIZE + 1) * sizeof(struct memcache_item));
+    char* values = malloc((BATCH_SIZE + 1) * VALUE_MAX);
+    bool res = items != NULL && values != NULL && verify(file, values);
+
+    struct snapshot_header header;
+    uint32_t crc = 0;
+    if (res) {
+        rewind(file);
+        res = read_bytes(file, &header, sizeof(header), &crc);
+        for (size_t i = 0; i <= BATCH_SIZE; i++)
+            items[i].buff = values + i * VALUE_MAX;
+    }
+
+    struct memcache_item* sb = res ? &items[BATCH_SIZE] : NULL;
+    bool sb_found = false;
+    size_t cnt = 0;
+    bool damaged = false;
+    int* ids = NULL;
+    size_t id_cnt = 0;
+    size_t id_cap = 0;
+    while (res && read_record(file, &items[cnt], &crc, &damaged)) {
+        int inode_id;
+        if (metadata_of(items[cnt].key, &inode_id)) {
+            if (id_cnt == id_cap) {
+                id_cap = id_cap == 0 ? METADATA_BATCH : 2 * id_cap;
+                int* grown = realloc(ids, id_cap * sizeof(int));
+                res = grown != NULL;
+                if (!res)
+                    break;
+                ids = grown;
+            }
+            ids[id_cnt++] = inode_id;
+        }
+        if (strcmp(items[cnt].key, SUPERBLOCK_KEY) == 0) {
+            memcpy(sb->buff, items[cnt].buff, items[cnt].size);
+            strcpy(sb->key, items[cnt].key);
+            sb->size = items[cnt].size;
+            sb->exptime = 0;
+            sb_found = true;
+            continue;
+        }
+        if (++cnt == BATCH_SIZE) {
+            res = store_batch(mem, items, cnt);
+            cnt = 0;
+        }
+    }
+    res = res && !damaged && store_batch(mem, items, cnt);
+    res = res && sb_found && sb->size == sizeof(struct superblock)
+        && claim_inodes(mem, sb->buff, ids, id_cnt);
+    res = res && store_batch(mem, sb, 1);
+
+    free(ids);
+    fclose(file);
+    free(items);
+    free(values);
+    return res;
+}
+
+static bool take_snapshot()
+{
+    pthread_mutex_lock(&snapshot_lock);
+    bool res = true;
+    if (memcache != NULL) {
+        /* Counters and free map kept in memory go in too */
+        freemap_flush();
+        usage_flush();
+        res = snapshot_dump(memcache, snapshot_path);
+        if (!res)
+            fprintf(stderr, "cachefs: snapshot to %s failed\n", snapshot_path);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return res;
+}
+
+static void* snapshot_loop(void* aux)
+{
+    (void)aux;
+    while (true) {
+        pthread_mutex_lock(&snapshot_lock);
+        int interval = snapshot_interval;
+        if (interval <= 0)
+            snapshotter_started = false;
+        pthread_mutex_unlock(&snapshot_lock);
+        if (interval <= 0)
+            return NULL;
+        sleep(interval);
+        take_snapshot();
+    }
+    return NULL;
+}
+
+bool init_snapshots(struct memcache_t* mem, const char* path, int interval)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    memcache = mem;
+    snapshot_path = path;
+    snapshot_interval = interval;
+    bool res = true;
+    if (interval > 0 && !snapshotter_started) {
+        pthread_t snapshotter;
+        res = pthread_create(&snapshotter, NULL, snapshot_loop, NULL) == 0;
+        if (res) {
+            pthread_detach(snapshotter);
+            snapshotter_started = true;
+        }
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return res;
+}
+
+void close_snapshots()
+{
+    take_snapshot();
+    pthread_mutex_lock(&snapshot_lock);
+    memcache = NULL;
+    pthread_mutex_unlock(&snapshot_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "memcache.h"
+#include <stdbool.h>
+
+#define SNAPSHOT_MAGIC 0x70616e73u
+#define SNAPSHOT_VERSION 1 // Changed when layout of snapshot file changes
+
+/**
+ * Function : snapshot_dump
+ * ----------------------------------------
+ * Copies superblock, usage counters, every inode with its blocks,
+ * extended attributes and directory index, and then free map to local
+ * file. File is written next to PATH and renamed over it when complete
+ *
+ * mem      : memcache data object
+ * path     : snapshot file
+ *
+ * Returns  : true if snapshot was written
+ */
+bool snapshot_dump(struct memcache_t* mem, const char* path);
+
+/**
+ * Function : snapshot_restore
+ * ----------------------------------------
+ * Checks snapshot file and stores all its records in Memcached,
+ * restored inodes are marked used in free map. Superblock is stored
+ * last so that interrupted restore leaves no mountable file system
+ *
+ * mem      : memcache data object
+ * path     : snapshot file
+ *
+ * Returns  : true if every record was stored
+ */
+bool snapshot_restore(struct memcache_t* mem, const char* path);
+
+/**
+ * Function : init_snapshots
+ * ----------------------------------------
+ * Starts taking snapshots of mounted file system in background
+ *
+ * mem      : memcache data object
+ * path     : snapshot file
+ * interval : seconds between snapshots, 0 takes only last one at close
+ *
+ * Returns  : true if snapshots are running
+ */
+bool init_snapshots(struct memcache_t* mem, const char* path, int interval);
+
+/**
+ * Function : close_snapshots
+ * ----------------------------------------
+ * Takes last snapshot and stops background ones
+ */
+void close_snapshots();
+
+#endif
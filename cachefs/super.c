@@ -0,0 +1,170 @@
+#include "super.h"
+
+#include "inode.h"
+#include "utils.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define KNOWN_FEATURES (FEATURE_DEDUP | FEATURE_COMPRESS)
+#define CAS_RETRIES 16
+
+static struct memcache_t* memcache;
+static struct superblock super;
+static pthread_mutex_t super_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Must be called with super_lock held */
+static bool store(const struct superblock* sb)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPERBLOCK_KEY);
+    item.buff = (void*)sb;
+    item.size = sizeof(struct superblock);
+    item.exptime = 0;
+    return memcache != NULL && memcache_set_multi(memcache, &item, 1) && item.found;
+}
+
+/* Random version 4 UUID */
+static void generate_uuid(uint8_t* uuid)
+{
+    random_bytes(uuid, SUPER_UUID_SIZE);
+    uuid[6] = (uuid[6] & 0x0f) | 0x40;
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;
+}
+
+bool super_create(struct memcache_t* mem, uint64_t inode_capacity, uint32_t features)
+{
+    pthread_mutex_lock(&super_lock);
+    memcache = mem;
+    memset(&super, 0, sizeof(struct superblock));
+    super.magic = SUPER_MAGIC;
+    super.version = SUPER_VERSION;
+    super.block_size = INODE_BLOCK_SIZE;
+    super.name_max = NAME_MAX;
+    super.inode_capacity = inode_capacity;
+    super.features = features;
+    generate_uuid(super.uuid);
+    bool success = store(&super);
+    pthread_mutex_unlock(&super_lock);
+    return success;
+}
+
+super_status_t super_load(struct memcache_t* mem)
+{
+    struct superblock sb;
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPERBLOCK_KEY);
+    item.buff = &sb;
+    item.size = sizeof(struct superblock);
+    if (!memcache_get_multi(mem, &item, 1) || !item.found
+        || item.size < 2 * sizeof(uint32_t) || sb.magic != SUPER_MAGIC)
+        return SUPER_MISSING;
+    /* Older versions will be upgraded here when layout changes */
+    if (item.size != sizeof(struct superblock) || sb.version != SUPER_VERSION
+        || sb.block_size != INODE_BLOCK_SIZE || sb.name_max != NAME_MAX
+        || (sb.features & ~KNOWN_FEATURES) != 0)
+        return SUPER_INCOMPATIBLE;
+
+    pthread_mutex_lock(&super_lock);
+    memcache = mem;
+    super = sb;
+    pthread_mutex_unlock(&super_lock);
+    return SUPER_OK;
+}
+
+void super_get(struct superblock* sb)
+{
+    pthread_mutex_lock(&super_lock);
+    *sb = super;
+    pthread_mutex_unlock(&super_lock);
+}
+
+static void raise_capacity(struct superblock* sb, uint64_t inode_capacity)
+{
+    if (sb->inode_capacity < inode_capacity)
+        sb->inode_capacity = inode_capacity;
+}
+
+static void add_features(struct superblock* sb, uint64_t features)
+{
+    sb->features |= features;
+}
+
+/*
+ * Applies CHANGE to superblock stored by other mounts and stores it
+ * with gets/cas, nothing is sent if it's already there
+ */
+static bool update(void (*change)(struct superblock*, uint64_t), uint64_t value)
+{
+    bool success = false;
+    struct superblock sb;
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPERBLOCK_KEY);
+    pthread_mutex_lock(&super_lock);
+    for (int attempt = 0; memcache != NULL && !success && attempt < CAS_RETRIES; attempt++) {
+        item.buff = &sb;
+        item.size = sizeof(struct superblock);
+        if (!memcache_gets_multi(memcache, &item, 1) || !item.found
+            || item.size != sizeof(struct superblock))
+            break;
+        struct superblock changed = sb;
+        change(&changed, value);
+        if (memcmp(&changed, &sb, sizeof(struct superblock)) != 0) {
+            sb = changed;
+            item.exptime = 0;
+            if (!memcache_cas_multi(memcache, &item, 1))
+                break;
+            success = item.found;
+        } else {
+            success = true;
+        }
+        if (success)
+            super = sb;
+    }
+    pthread_mutex_unlock(&super_lock);
+    return success;
+}
+
+bool super_set_inode_capacity(uint64_t inode_capacity)
+{
+    /* Other mounts grow the map too, capacity never goes down */
+    return update(raise_capacity, inode_capacity);
+}
+
+bool super_set_features(uint32_t features)
+{
+    /* Features enabled by other mounts meanwhile are kept */
+    return update(add_features, features);
+}
+
+bool super_take_lock(struct memcache_t* mem, bool renew)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPER_LOCK_KEY);
+    item.buff = "1";
+    item.size = 1;
+    item.exptime = SUPER_LOCK_TTL;
+    bool sent = renew ? memcache_set_multi(mem, &item, 1) : memcache_add_multi(mem, &item, 1);
+    return sent && item.found;
+}
+
+void super_drop_lock(struct memcache_t* mem)
+{
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPER_LOCK_KEY);
+    memcache_delete_multi(mem, &item, 1);
+}
+
+bool super_is_locked(struct memcache_t* mem, bool* locked)
+{
+    char value[2];
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", SUPER_LOCK_KEY);
+    item.buff = value;
+    item.size = sizeof(value);
+    if (!memcache_get_multi(mem, &item, 1))
+        return false;
+    *locked = item.found;
+    return true;
+}
@@ -0,0 +1,127 @@
+#ifndef SUPER_H
+#define SUPER_H
+
+#include "memcache.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SUPERBLOCK_KEY "SUPERBLOCK"
+#define SUPER_MAGIC 0x63616368u
+#define SUPER_VERSION 1 // Changed when stored layout changes
+#define SUPER_UUID_SIZE 16
+#define SUPER_LOCK_KEY "FSCK#LOCK" // Held while file system is repaired, mounts refuse to start
+#define SUPER_LOCK_TTL 60 // Seconds lock lasts unless its holder renews it
+
+/**
+ * Parameters of file system which are stored once for whole mount
+ */
+struct superblock {
+    uint32_t magic;
+    uint32_t version; // Layout version file system was formated with
+    uint32_t block_size; // Size of inode blocks
+    uint32_t name_max; // Longest directory entry name
+    uint64_t inode_capacity; // Number of inode ids covered by free map
+    uint32_t features; // FEATURE_* flags enabled on file system
+    uint8_t uuid[SUPER_UUID_SIZE];
+};
+
+typedef enum {
+    SUPER_OK,
+    SUPER_MISSING, // Nothing recognizable is stored, file system has to be formated
+    SUPER_INCOMPATIBLE // Stored by other version or with other parameters
+} super_status_t;
+
+/**
+ * Function : super_create
+ * ----------------------------------------
+ * Stores superblock of newly formated file system with
+ * new UUID and current version and parameters
+ * 
+ * mem            : memcache data object 
+ * inode_capacity : initial number of inodes
+ * features       : FEATURE_* flags
+ * 
+ * Returns        : true if superblock was stored
+ */
+bool super_create(struct memcache_t* mem, uint64_t inode_capacity, uint32_t features);
+
+/**
+ * Function : super_load
+ * ----------------------------------------
+ * Reads superblock of existing file system into memory and checks
+ * that this build can use it
+ * 
+ * mem      : memcache data object 
+ * 
+ * Returns  : SUPER_OK if superblock was loaded
+ */
+super_status_t super_load(struct memcache_t* mem);
+
+/**
+ * Function : super_get
+ * ----------------------------------------
+ * Copies in-memory superblock
+ * 
+ * sb       : where superblock is copied
+ */
+void super_get(struct superblock* sb);
+
+/**
+ * Function : super_set_inode_capacity
+ * ----------------------------------------
+ * Records new size of inode space, returns after
+ * superblock is stored. Capacity only grows, if other
+ * mount recorded larger one already it is kept
+ * 
+ * inode_capacity : number of inodes
+ * 
+ * Returns        : true if superblock holds at least given capacity
+ */
+bool super_set_inode_capacity(uint64_t inode_capacity);
+
+/**
+ * Function : super_set_features
+ * ----------------------------------------
+ * Records features enabled on file system
+ * 
+ * features : FEATURE_* flags
+ * 
+ * Returns  : true if superblock was stored
+ */
+bool super_set_features(uint32_t features);
+
+/**
+ * Function : super_take_lock
+ * ----------------------------------------
+ * Takes lock which keeps mounts away from file system, it
+ * expires after SUPER_LOCK_TTL seconds unless it is renewed
+ * 
+ * mem      : memcache data object 
+ * renew    : lock is already held by caller and is extended
+ * 
+ * Returns  : true if lock is held
+ */
+bool super_take_lock(struct memcache_t* mem, bool renew);
+
+/**
+ * Function : super_drop_lock
+ * ----------------------------------------
+ * Drops lock taken by super_take_lock
+ * 
+ * mem      : memcache data object 
+ */
+void super_drop_lock(struct memcache_t* mem);
+
+/**
+ * Function : super_is_locked
+ * ----------------------------------------
+ * Checks whether somebody holds lock of file system
+ * 
+ * mem      : memcache data object 
+ * locked   : set if lock is held
+ * 
+ * Returns  : false on connection error
+ */
+bool super_is_locked(struct memcache_t* mem, bool* locked);
+
+#endif
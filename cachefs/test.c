@@ -1,11 +1,26 @@
+#include "changelog.h"
+#include "compress.h"
+#include "dedup.h"
+#include "directory.h"
+#include "freemap.h"
+#include "hash.h"
 #include "inode.h"
+#include "journal.h"
+#include "lease.h"
 #include "memcache.h"
+#include "reaper.h"
+#include "snapshot.h"
+#include "super.h"
+#include "usage.h"
 #include <assert.h>
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 struct memcache_t* memcache;
 void test1()
 {
@@ -152,7 +167,7 @@ void test6()
 
 void test7()
 {
-    init_inodes(memcache);
+    init_inodes(memcache, 0, 0);
     assert(inode_create(3123, 1, 0, 0, 0));
     struct inode* inode = inode_open(3123);
 
@@ -163,17 +178,1277 @@ void test7()
     value[2] = 'd';
     value[3] = 'c';
 
-    size_t ans = inode_write_at(inode, value, 4, 1023);
+    size_t ans = inode_write_at(inode, value, 4, 1023, false);
     printf("%zu\n", ans);
     assert(ans == 4);
     char res[100];
-    ans = inode_read_at(inode, res, 4, 1021);
-    printf("%zu\n", ans);
+    ssize_t read = inode_read_at(inode, res, 4, 1021, false);
+    printf("%zd\n", read);
+    assert(read == 4);
     assert(res[2] == 'b');
     assert(res[3] == 'h');
     printf("test 7 passed\n");
 }
 
+/* Fills block with random bytes, runs and repeated patterns */
+static void fill_random(char* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size) {
+        size_t len = 1 + rand() % 300;
+        if (len > size - pos)
+            len = size - pos;
+        int kind = rand() % 3;
+        for (size_t i = 0; i < len; i++) {
+            if (kind == 0)
+                data[pos + i] = rand();
+            else if (kind == 1)
+                data[pos + i] = 'a';
+            else
+                data[pos + i] = "pattern"[i % 7];
+        }
+        pos += len;
+    }
+}
+
+void test8()
+{
+    char data[4096];
+    char packed[4096];
+    char unpacked[4096];
+    for (int i = 0; i < 1000; i++) {
+        size_t size = 1 + rand() % sizeof(data);
+        fill_random(data, size);
+        size_t packed_size = compress_block(data, size, packed, sizeof(packed));
+        if (packed_size == 0)
+            continue;
+        assert(decompress_block(packed, packed_size, unpacked, size));
+        assert(memcmp(data, unpacked, size) == 0);
+        /* Cut or damaged input must not be read past its end */
+        assert(!decompress_block(packed, packed_size - 1, unpacked, size));
+        packed[rand() % packed_size] ^= 1 << (rand() % 8);
+        decompress_block(packed, packed_size, unpacked, size);
+    }
+    for (int i = 0; i < 1000; i++) {
+        size_t size = 1 + rand() % sizeof(packed);
+        for (size_t j = 0; j < size; j++)
+            packed[j] = rand();
+        decompress_block(packed, size, unpacked, sizeof(unpacked));
+    }
+
+    printf("test 8 passed\n");
+}
+
+static uint32_t crc32c_bitwise(const unsigned char* data, size_t size)
+{
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+void test9()
+{
+    assert(crc32c(0, "123456789", 9) == 0xe3069283);
+    assert(crc32c(crc32c(0, "1234", 4), "56789", 5) == 0xe3069283);
+
+    unsigned char data[4096 + 16];
+    for (int i = 0; i < 1000; i++) {
+        size_t offset = rand() % 16;
+        size_t size = rand() % 4097;
+        for (size_t j = 0; j < size; j++)
+            data[offset + j] = rand();
+        uint32_t crc = crc32c(0, data + offset, size);
+        assert(crc == crc32c_bitwise(data + offset, size));
+        size_t split = size == 0 ? 0 : rand() % size;
+        assert(crc == crc32c(crc32c(0, data + offset, split), data + offset + split, size - split));
+    }
+
+    printf("test 9 passed\n");
+}
+
+static void dedup_key(char* key, const char* prefix, const char* block)
+{
+    struct block_hash hash;
+    hash_block(block, INODE_BLOCK_SIZE, &hash);
+    sprintf(key, "%s#%016llx%016llx", prefix, (unsigned long long)hash.h[0], (unsigned long long)hash.h[1]);
+}
+
+/* Value stored under dedup key of block with given contents, -1 if it's missing */
+static ssize_t stored_value(const char* prefix, const char* block, char* value, size_t size)
+{
+    struct memcache_item item;
+    dedup_key(item.key, prefix, block);
+    item.buff = value;
+    item.size = size - 1;
+    if (!memcache_get_multi(memcache, &item, 1) || !item.found)
+        return -1;
+    value[item.size] = '\0';
+    return item.size;
+}
+
+/* References of stored block with given contents, -1 if it isn't stored */
+static int ref_cnt(const char* block)
+{
+    char value[32];
+    if (stored_value("ref", block, value, sizeof(value)) < 0)
+        return -1;
+    return atoi(value);
+}
+
+void test10()
+{
+    init_inodes(memcache, 0, 0);
+    inode_set_features(FEATURE_DEDUP);
+    assert(inode_create(4001, false, 0, 0, 0644));
+    assert(inode_create(4002, false, 0, 0, 0644));
+    struct inode* a = inode_open(4001);
+    struct inode* b = inode_open(4002);
+
+    char block[INODE_BLOCK_SIZE];
+    char old[INODE_BLOCK_SIZE];
+    char res[INODE_BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(block); i++)
+        block[i] = rand();
+    memcpy(old, block, sizeof(block));
+    assert(inode_write_at(a, block, sizeof(block), 0, false) == sizeof(block));
+    assert(inode_write_at(b, block, sizeof(block), 0, false) == sizeof(block));
+    assert(ref_cnt(block) == 2);
+
+    /* Changed block gets its own reference, the old one loses one */
+    assert(inode_write_at(b, "x", 1, 0, false) == 1);
+    block[0] = 'x';
+    assert(ref_cnt(old) == 1);
+    assert(ref_cnt(block) == 1);
+    assert(inode_read_at(a, res, sizeof(res), 0, false) == sizeof(res));
+    assert(memcmp(res, old, sizeof(res)) == 0);
+
+    /* Last reference is gone, data is deleted and counter with it or left as tombstone */
+    char value[2 * INODE_BLOCK_SIZE];
+    assert(inode_punch_hole(a, 0, sizeof(block)));
+    ssize_t size = stored_value("ref", old, value, sizeof(value));
+    assert(size == -1 || strcmp(value, "-") == 0);
+    assert(stored_value("blk", old, value, sizeof(value)) == -1);
+    assert(stored_value("blk", block, value, sizeof(value)) > 0);
+
+    /* Tombstone of crashed collector fails the write, other block isn't kept */
+    char key[64];
+    char blocks[2 * INODE_BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(blocks); i++)
+        blocks[i] = rand();
+    dedup_key(key, "ref", blocks + INODE_BLOCK_SIZE);
+    assert(memcache_add(memcache, key, "-", 1));
+    assert(inode_write_at(b, blocks, sizeof(blocks), INODE_BLOCK_SIZE, false) == 0);
+    assert(ref_cnt(blocks) == -1);
+    assert(stored_value("blk", blocks, value, sizeof(value)) == -1);
+
+    /* Block whose hash collides with stored block of other contents isn't shared */
+    ssize_t other = stored_value("blk", block, value, sizeof(value));
+    assert(other > 0);
+    dedup_key(key, "blk", blocks);
+    assert(memcache_add(memcache, key, value, other));
+    dedup_key(key, "ref", blocks);
+    assert(memcache_add(memcache, key, "1", 1));
+    assert(inode_write_at(a, blocks, INODE_BLOCK_SIZE, 0, false) == INODE_BLOCK_SIZE);
+    assert(ref_cnt(blocks) == 1);
+    assert(inode_read_at(a, res, sizeof(res), 0, false) == sizeof(res));
+    assert(memcmp(res, blocks, sizeof(res)) == 0);
+    assert(inode_read_at(b, res, sizeof(res), 0, false) == sizeof(res));
+    assert(memcmp(res, block, sizeof(res)) == 0);
+    inode_close(a);
+    inode_close(b);
+    inode_set_features(0);
+
+    printf("test 10 passed\n");
+}
+
+/* Sets bit of inode in stored free map like other mount would */
+static void set_stored_bit(int inode)
+{
+    uint64_t words[1024 / 64];
+    assert(memcache_get(memcache, "FREEMAP#0", words));
+    words[inode / 64] |= 1ULL << (inode % 64);
+    assert(memcache_add(memcache, "FREEMAP#0", words, sizeof(words)));
+}
+
+void test11()
+{
+    assert(init_freemap(memcache, 1024));
+    assert(freemap_claim(600));
+    assert(freemap_claim(700));
+    assert(freemap_flush());
+
+    /* Other mount takes ids while this one takes and frees others */
+    set_stored_bit(500);
+    assert(freemap_claim(601));
+    assert(free_inode(700));
+    assert(freemap_flush());
+
+    assert(load_freemap(memcache, 1024));
+    assert(freemap_is_used(500));
+    assert(freemap_is_used(600));
+    assert(freemap_is_used(601));
+    assert(!freemap_is_used(700));
+    close_freemap();
+
+    printf("test 11 passed\n");
+}
+
+void test12()
+{
+    init_inodes(memcache, 0, 0);
+    assert(inode_create(4003, false, 0, 0, 0644));
+    struct inode* inode = inode_open(4003);
+
+    /* Other mount changes mode and adds a link after metadata was read */
+    struct inode_disk_metadata theirs;
+    assert(memcache_get(memcache, "4003#METADATA", &theirs));
+    theirs.mode = (theirs.mode & ~0777) | 0600;
+    theirs.link_cnt++;
+    assert(memcache_add(memcache, "4003#METADATA", &theirs, sizeof(theirs)));
+
+    inode->metadata.uid = 7;
+    inode->metadata.link_cnt++;
+    assert(inode_flush_metadata(inode));
+    struct inode_disk_metadata stored;
+    assert(memcache_get(memcache, "4003#METADATA", &stored));
+    assert((stored.mode & 0777) == 0600);
+    assert(stored.uid == 7);
+    assert(stored.link_cnt == theirs.link_cnt + 1);
+    inode_close(inode);
+
+    /* Block map slots changed by two mounts in the same chunk are both kept */
+    struct block_hash x = { { 1, 2 } };
+    struct block_hash y = { { 3, 4 } };
+    struct block_map first;
+    struct block_map second;
+    assert(block_map_load(&first, 4004, 0, 8));
+    assert(block_map_load(&second, 4004, 0, 8));
+    *block_map_at(&first, 1) = x;
+    *block_map_at(&second, 2) = y;
+    *block_map_at(&second, 1) = y;
+    assert(block_map_store(&first));
+    assert(block_map_store(&second));
+    assert(memcmp(block_map_replaced(&second, 1), &x, sizeof(x)) == 0);
+    block_map_free(&first);
+    block_map_free(&second);
+    assert(block_map_load(&first, 4004, 0, 8));
+    assert(memcmp(block_map_at(&first, 1), &y, sizeof(y)) == 0);
+    assert(memcmp(block_map_at(&first, 2), &y, sizeof(y)) == 0);
+    block_map_free(&first);
+
+    printf("test 12 passed\n");
+}
+
+#define TEST_JOURNAL "/tmp/cachefs-test.journal"
+
+static struct intent replayed[4];
+static int replayed_cnt;
+
+static void remember_intent(const struct intent* intent)
+{
+    if (replayed_cnt < 4)
+        replayed[replayed_cnt] = *intent;
+    replayed_cnt++;
+}
+
+static void test_intent(struct intent* intent, int inode_id, const char* name)
+{
+    memset(intent, 0, sizeof(struct intent));
+    intent->op = INTENT_CREATE;
+    intent->inode_id = inode_id;
+    intent->other_id = -1;
+    intent->mode = 0644;
+    strcpy(intent->name, name);
+}
+
+void test13()
+{
+    struct intent intent;
+    uint64_t done;
+    uint64_t left;
+    remove(TEST_JOURNAL);
+    assert(init_journal(TEST_JOURNAL, remember_intent));
+    assert(replayed_cnt == 0);
+
+    /* Only intent without end record is replayed */
+    test_intent(&intent, 11, "done");
+    assert(journal_begin(&intent, &done));
+    test_intent(&intent, 12, "left");
+    assert(journal_begin(&intent, &left));
+    journal_end(done);
+    close_journal();
+    assert(init_journal(TEST_JOURNAL, remember_intent));
+    assert(replayed_cnt == 1);
+    assert(replayed[0].inode_id == 12 && strcmp(replayed[0].name, "left") == 0);
+
+    /* Journal is emptied after replay */
+    close_journal();
+    replayed_cnt = 0;
+    assert(init_journal(TEST_JOURNAL, remember_intent));
+    assert(replayed_cnt == 0);
+
+    /* Pending intent survives compaction, torn record at the end is ignored */
+    test_intent(&intent, 13, "kept");
+    assert(journal_begin(&intent, &left));
+    for (int i = 0; i < 2500; i++) {
+        test_intent(&intent, 100 + i, "temp");
+        assert(journal_begin(&intent, &done));
+        journal_end(done);
+    }
+    close_journal();
+    FILE* file = fopen(TEST_JOURNAL, "a");
+    assert(file != NULL);
+    fwrite("torn", 1, 4, file);
+    fclose(file);
+    assert(init_journal(TEST_JOURNAL, remember_intent));
+    assert(replayed_cnt == 1);
+    assert(replayed[0].inode_id == 13 && strcmp(replayed[0].name, "kept") == 0);
+    close_journal();
+    remove(TEST_JOURNAL);
+
+    printf("test 13 passed\n");
+}
+
+/* Directories are set up once, compaction thread keeps running */
+static void use_directories()
+{
+    static bool initialized = false;
+    init_inodes(memcache, 0, 0);
+    if (!initialized)
+        init_directories(memcache, true);
+    initialized = true;
+}
+
+static struct dir* create_dir(int id)
+{
+    assert(dir_create(id, 0, 0, S_IFDIR | 0755));
+    struct dir* dir = dir_open(inode_open(id));
+    assert(dir != NULL);
+    return dir;
+}
+
+static int bucket_cnt;
+
+static void count_bucket(const char* key, bool shared, void* aux)
+{
+    assert(strncmp(key, aux, strlen(aux)) == 0);
+    bucket_cnt++;
+}
+
+/* Creates root like mount of empty memcached does, paths are resolved from it */
+static void use_root()
+{
+    use_directories();
+    struct inode* root = inode_open(ROOT_INODE_ID);
+    if (root != NULL) {
+        inode_close(root);
+        return;
+    }
+    struct dir* dir = create_dir(ROOT_INODE_ID);
+    assert(dir_add(dir, ".", ROOT_INODE_ID));
+    assert(dir_add(dir, "..", ROOT_INODE_ID));
+    dir_close(dir);
+}
+
+/* Adds directory ID named NAME to PARENT */
+static void make_dir(struct dir* parent, const char* name, int id)
+{
+    struct dir* dir = create_dir(id);
+    assert(dir_add(dir, ".", id));
+    assert(dir_add(dir, "..", dir_get_inode(parent)->id));
+    assert(dir_add(parent, name, id));
+    dir_close(dir);
+}
+
+static void make_file(struct dir* parent, const char* name, int id)
+{
+    assert(inode_create(id, false, 0, 0, 0644));
+    assert(dir_add(parent, name, id));
+}
+
+static int path_id(const char* path)
+{
+    struct inode* inode = inode_from_path(path);
+    if (inode == NULL)
+        return -1;
+    int id = inode->id;
+    inode_close(inode);
+    return id;
+}
+
+void test14()
+{
+    use_directories();
+    struct dir* dir = create_dir(5000);
+    char name[NAME_MAX + 1];
+    int id;
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "file%d", i);
+        assert(dir_add(dir, name, 6000 + i));
+    }
+    assert(!dir_add(dir, "file7", 1));
+
+    /* Each name is found in its index bucket, not by scanning entries */
+    bucket_cnt = 0;
+    assert(dir_list_keys(5000, count_bucket, "5000#H"));
+    assert(bucket_cnt == 300);
+    dir_forget_cached();
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "file%d", i);
+        assert(dir_lookup_id(dir, name, &id) && id == 6000 + i);
+    }
+    assert(!dir_lookup_id(dir, "file300", &id));
+
+    for (int i = 0; i < 300; i += 2) {
+        sprintf(name, "file%d", i);
+        assert(dir_unlink(dir, name));
+    }
+    dir_forget_cached();
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "file%d", i);
+        assert(dir_lookup_id(dir, name, &id) == (i % 2 == 1));
+    }
+    assert(dir_add(dir, "file0", 7000));
+    assert(dir_lookup_id(dir, "file0", &id));
+    dir_close(dir);
+
+    printf("test 14 passed\n");
+}
+
+void test15()
+{
+    use_directories();
+    struct dir* dir = create_dir(5001);
+    char name[NAME_MAX + 1];
+    int id;
+
+    /* Entries span more blocks than one scan reads at once */
+    for (int i = 0; i < 3000; i++) {
+        sprintf(name, "a rather long name of entry number %d", i);
+        assert(dir_add(dir, name, 8000 + i));
+    }
+    assert(inode_length(dir_get_inode(dir)) > 16 * INODE_BLOCK_SIZE);
+    static bool seen[3000];
+    int cnt = 0;
+    while (dir_readdir_inode(dir, name, &id)) {
+        int i;
+        assert(sscanf(name, "a rather long name of entry number %d", &i) == 1);
+        assert(id == 8000 + i && !seen[i]);
+        seen[i] = true;
+        cnt++;
+    }
+    assert(cnt == 3000);
+
+    /* Name added after scan reached the end is found by the same scan */
+    struct dir* other = dir_reopen(dir);
+    assert(dir_add(other, "late", 11000));
+    assert(dir_readdir_inode(dir, name, &id));
+    assert(strcmp(name, "late") == 0 && id == 11000);
+    assert(!dir_readdir(dir, name));
+    dir_close(other);
+    dir_close(dir);
+
+    printf("test 15 passed\n");
+}
+
+void test16()
+{
+    use_directories();
+    struct dir* dir = create_dir(5002);
+    char name[NAME_MAX + 2];
+    char read[NAME_MAX + 1];
+    int id;
+
+    /* Longest names fill blocks unevenly, entries move to the next block */
+    for (int i = 0; i < 40; i++) {
+        memset(name, 'a' + i % 26, NAME_MAX);
+        sprintf(name + NAME_MAX - 3, "%03d", i);
+        assert(dir_add(dir, name, 12000 + i));
+    }
+    assert(dir_add(dir, "x", 12040));
+    memset(name, 'z', NAME_MAX + 1);
+    name[NAME_MAX + 1] = '\0';
+    assert(!dir_add(dir, name, 12041));
+    assert(!dir_add(dir, "", 12041));
+
+    int cnt = 0;
+    while (dir_readdir_inode(dir, read, &id)) {
+        if (id == 12040) {
+            assert(strcmp(read, "x") == 0);
+        } else {
+            int i = id - 12000;
+            assert(strlen(read) == NAME_MAX && read[0] == 'a' + i % 26);
+            assert(atoi(read + NAME_MAX - 3) == i);
+        }
+        cnt++;
+    }
+    assert(cnt == 41);
+    dir_forget_cached();
+    memset(name, 'a' + 33 % 26, NAME_MAX);
+    sprintf(name + NAME_MAX - 3, "%03d", 33);
+    assert(dir_lookup_id(dir, name, &id) && id == 12033);
+    name[NAME_MAX - 1] = '4';
+    assert(!dir_lookup_id(dir, name, &id));
+    dir_close(dir);
+
+    printf("test 16 passed\n");
+}
+
+void test17()
+{
+    use_directories();
+    struct dir* dir = create_dir(5003);
+    char name[NAME_MAX + 1];
+    int id;
+
+    /* Names of removed entries are reused before directory grows */
+    for (int i = 0; i < 100; i++) {
+        sprintf(name, "old%03d", i);
+        assert(dir_add(dir, name, 13000 + i));
+    }
+    size_t length = inode_length(dir_get_inode(dir));
+    for (int i = 0; i < 100; i += 2) {
+        sprintf(name, "old%03d", i);
+        assert(dir_unlink(dir, name));
+    }
+    for (int i = 0; i < 50; i++) {
+        sprintf(name, "new%03d", i);
+        assert(dir_add(dir, name, 13100 + i));
+    }
+    assert(inode_length(dir_get_inode(dir)) == length);
+    dir_forget_cached();
+    assert(dir_lookup_id(dir, "new049", &id) && id == 13149);
+    assert(dir_lookup_id(dir, "old099", &id) && id == 13099);
+    dir_close(dir);
+
+    /* Mostly removed directory is compacted once nobody has it open */
+    dir = create_dir(5004);
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "entry%04d", i);
+        assert(dir_add(dir, name, 14000 + i));
+    }
+    length = inode_length(dir_get_inode(dir));
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "entry%04d", i);
+        if (i % 4 != 0)
+            assert(dir_unlink(dir, name));
+    }
+    dir_close(dir);
+    size_t compacted = length;
+    for (int i = 0; i < 20 && compacted == length; i++) {
+        sleep(1);
+        struct inode* inode = inode_open(5004);
+        compacted = inode_length(inode);
+        inode_close(inode);
+    }
+    assert(compacted < length / 2);
+
+    dir = dir_open(inode_open(5004));
+    dir_forget_cached();
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "entry%04d", i);
+        assert(dir_lookup_id(dir, name, &id) == (i % 4 == 0));
+        assert(i % 4 != 0 || id == 14000 + i);
+    }
+    int cnt = 0;
+    while (dir_readdir(dir, name))
+        cnt++;
+    assert(cnt == 500);
+    dir_close(dir);
+
+    printf("test 17 passed\n");
+}
+
+void test18()
+{
+    use_root();
+    struct dir* root = dir_open_root();
+    make_dir(root, "from", 5010);
+    make_dir(root, "to", 5011);
+    struct dir* from = dir_open(inode_open(5010));
+    struct dir* to = dir_open(inode_open(5011));
+    make_file(from, "file", 5012);
+    make_file(to, "file", 5013);
+    make_dir(from, "sub", 5014);
+    make_dir(to, "other", 5015);
+
+    /* RENAME_NOREPLACE fails on existing name and changes nothing */
+    assert(!dir_add(to, "file", 5012));
+    assert(path_id("/to/file") == 5013);
+    assert(path_id("/from/file") == 5012);
+
+    /* RENAME_EXCHANGE swaps both names in place */
+    assert(dir_set(to, "file", 5012));
+    assert(dir_set(from, "file", 5013));
+    dir_forget_cached();
+    assert(path_id("/to/file") == 5012);
+    assert(path_id("/from/file") == 5013);
+
+    /* Exchanged directories get their ".." pointed to new parents */
+    assert(dir_set(to, "other", 5014));
+    assert(dir_set(from, "sub", 5015));
+    struct dir* moved = dir_open(inode_open(5014));
+    assert(dir_set(moved, "..", 5011));
+    dir_close(moved);
+    moved = dir_open(inode_open(5015));
+    assert(dir_set(moved, "..", 5010));
+    dir_close(moved);
+    assert(path_id("/to/other/../file") == 5012);
+    assert(path_id("/from/sub/../file") == 5013);
+
+    /* Plain move of directory takes new name, drops old one and fixes ".." */
+    assert(dir_add(root, "moved", 5014));
+    assert(dir_unlink(to, "other"));
+    moved = dir_open(inode_open(5014));
+    assert(dir_set(moved, "..", ROOT_INODE_ID));
+    dir_close(moved);
+    assert(path_id("/to/other") == -1);
+    assert(path_id("/moved/..") == ROOT_INODE_ID);
+    assert(!dir_set(to, "other", 5015));
+
+    dir_close(to);
+    dir_close(from);
+    dir_close(root);
+
+    printf("test 18 passed\n");
+}
+
+void test19()
+{
+    use_root();
+    struct dir* root = dir_open_root();
+    make_dir(root, "top", 5020);
+    struct dir* top = dir_open(inode_open(5020));
+    make_dir(top, "middle", 5021);
+    struct dir* middle = dir_open(inode_open(5021));
+    make_dir(middle, "bottom", 5022);
+    struct dir* bottom = dir_open(inode_open(5022));
+    make_file(bottom, "leaf", 5023);
+
+    /* Each component is looked up in its parent */
+    assert(path_id("/top/middle/bottom/leaf") == 5023);
+    assert(path_id("//top/middle//bottom/leaf/") == 5023);
+    assert(path_id("/top/middle/bottom") == 5022);
+    assert(path_id("/") == ROOT_INODE_ID);
+    assert(path_id("/top/missing/bottom/leaf") == -1);
+    assert(path_id("/top/middle/bottom/leaf/more") == -1);
+    char path[2 * NAME_MAX];
+    memset(path, 'a', sizeof path);
+    path[0] = '/';
+    path[sizeof path - 1] = '\0';
+    assert(path_id(path) == -1);
+
+    /* Renamed directory moves whole subtree without touching its names */
+    assert(dir_add(root, "renamed", 5020));
+    assert(dir_unlink(root, "top"));
+    assert(path_id("/renamed/middle/bottom/leaf") == 5023);
+    assert(path_id("/top/middle/bottom/leaf") == -1);
+    assert(dir_unlink(bottom, "leaf"));
+    assert(path_id("/renamed/middle/bottom/leaf") == -1);
+
+    dir_close(bottom);
+    dir_close(middle);
+    dir_close(top);
+    dir_close(root);
+
+    printf("test 19 passed\n");
+}
+
+void test20()
+{
+    use_directories();
+    struct dir* dir = create_dir(5030);
+    char name[NAME_MAX + 1];
+    char data[100] = { 0 };
+    for (int i = 0; i < 10; i++) {
+        sprintf(name, "file%d", i);
+        assert(inode_create(5031 + i, false, 0, i, 0600 + i));
+        struct inode* inode = inode_open(5031 + i);
+        assert(inode_write_at(inode, data, i * 10, 0, false) == i * 10);
+        inode_close(inode);
+        assert(dir_add(dir, name, 5031 + i));
+    }
+    assert(dir_add(dir, "dangling", 5099));
+
+    /* Listing comes with ids, attributes of all entries take one request */
+    int ids[11];
+    size_t cnt = 0;
+    while (dir_readdir_inode(dir, name, &ids[cnt]))
+        cnt++;
+    assert(cnt == 11);
+    struct inode* open = inode_open(5033);
+    open->metadata.uid = 77;
+    struct inode_disk_metadata metadata[11];
+    bool found[11];
+    assert(inode_get_metadata_multi(ids, cnt, metadata, found));
+    for (size_t i = 0; i < cnt; i++) {
+        int n = ids[i] - 5031;
+        if (ids[i] == 5099) {
+            assert(!found[i]);
+            continue;
+        }
+        assert(found[i]);
+        assert(metadata[i].mode == (__mode_t)(0600 + n));
+        assert(metadata[i].length == (size_t)n * 10);
+        assert(metadata[i].uid == (ids[i] == 5033 ? 77u : (unsigned)n));
+    }
+    inode_close(open);
+    dir_close(dir);
+
+    printf("test 20 passed\n");
+}
+
+void test21()
+{
+    use_directories();
+    struct dir* dir = create_dir(5040);
+    char name[NAME_MAX + 1];
+    int id;
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "entry%04d", i);
+        assert(dir_add(dir, name, 15000 + i));
+    }
+
+    /* Listing stops after some entries and goes on from returned offset */
+    static int seen[2000];
+    for (int i = 0; i < 700; i++) {
+        assert(dir_readdir_inode(dir, name, &id));
+        seen[id - 15000]++;
+    }
+    size_t offset = dir_tell(dir);
+    assert(dir_readdir_inode(dir, name, &id));
+    int next = id;
+
+    /* Removed entries stay in place while directory is open */
+    for (int i = 0; i < 2000; i++) {
+        sprintf(name, "entry%04d", i);
+        if (i % 4 != 0)
+            assert(dir_unlink(dir, name));
+    }
+    sleep(2);
+    struct dir* other = dir_reopen(dir);
+    dir_seek(other, offset);
+    int cnt = 0;
+    while (dir_readdir_inode(other, name, &id)) {
+        assert(id >= next && (id - 15000) % 4 == 0);
+        seen[id - 15000]++;
+        cnt++;
+    }
+    assert(cnt == 325);
+    for (int i = 0; i < 2000; i++)
+        assert(seen[i] == (i < 700 || i % 4 == 0 ? 1 : 0));
+
+    /* Offset given earlier lists the same entries again */
+    dir_seek(other, 0);
+    cnt = 0;
+    while (dir_readdir(other, name))
+        cnt++;
+    assert(cnt == 500);
+    dir_close(other);
+    dir_close(dir);
+
+    printf("test 21 passed\n");
+}
+
+/* Starts from empty memcached like newly formated file system */
+static void format()
+{
+    assert(memcache_clear(memcache));
+    dir_forget_cached();
+}
+
+void test22()
+{
+    format();
+    assert(super_create(memcache, 100, 0));
+    assert(init_freemap(memcache, 100));
+    static bool taken[100];
+    for (int i = 0; i < 100; i++) {
+        int id = get_free_inode();
+        assert(id >= 0 && id < 100 && !taken[id]);
+        taken[id] = true;
+    }
+
+    /* Full map grows and superblock records new capacity */
+    int id = get_free_inode();
+    assert(id >= 100);
+    struct superblock sb;
+    super_get(&sb);
+    assert(sb.inode_capacity > (uint64_t)id);
+    assert(super_load(memcache) == SUPER_OK);
+    super_get(&sb);
+    assert(sb.inode_capacity > (uint64_t)id);
+    assert(freemap_used() == 101);
+
+    /* Grown map is stored in full and loads with recorded capacity */
+    close_freemap();
+    assert(load_freemap(memcache, sb.inode_capacity));
+    for (int i = 0; i < 100; i++)
+        assert(freemap_is_used(i));
+    assert(freemap_is_used(id));
+    assert(!freemap_is_used(sb.inode_capacity - 1));
+    assert(freemap_used() == 101);
+    close_freemap();
+
+    printf("test 22 passed\n");
+}
+
+void test23()
+{
+    format();
+    assert(init_usage(memcache));
+    init_inodes(memcache, 0, 0);
+    assert(inode_create(5050, false, 0, 0, 0644));
+    struct inode* inode = inode_open(5050);
+    char data[3 * INODE_BLOCK_SIZE];
+    fill_random(data, sizeof data);
+    struct usage usage;
+
+    /* Holes take no blocks, length counts them */
+    assert(inode_write_at(inode, data, sizeof data, 0, false) == sizeof data);
+    assert(inode_write_at(inode, data, INODE_BLOCK_SIZE, 10 * INODE_BLOCK_SIZE, false)
+        == INODE_BLOCK_SIZE);
+    usage_get(&usage);
+    assert(usage.blocks == 4 && usage.bytes == 11 * INODE_BLOCK_SIZE);
+    size_t blocks;
+    assert(inode_count_blocks(&inode->id, &inode->metadata, 1, &blocks) && blocks == 4);
+    assert(inode_punch_hole(inode, INODE_BLOCK_SIZE, INODE_BLOCK_SIZE));
+    usage_get(&usage);
+    assert(usage.blocks == 3 && usage.bytes == 11 * INODE_BLOCK_SIZE);
+    assert(inode_truncate(inode, 0));
+    usage_get(&usage);
+    assert(usage.blocks == 0 && usage.bytes == 0);
+    inode_close(inode);
+
+    /* Changes of other mounts are merged into stored counters */
+    assert(usage_flush());
+    struct usage stored;
+    assert(memcache_get(memcache, USAGE_KEY, &stored));
+    stored.blocks += 5;
+    stored.bytes += 5 * INODE_BLOCK_SIZE;
+    assert(memcache_add(memcache, USAGE_KEY, &stored, sizeof(stored)));
+    usage_add(1, 100);
+    assert(usage_flush());
+    usage_get(&usage);
+    assert(usage.blocks == 6 && usage.bytes == 5 * INODE_BLOCK_SIZE + 100);
+    assert(load_usage(memcache));
+    usage_get(&usage);
+    assert(usage.blocks == 6 && usage.bytes == 5 * INODE_BLOCK_SIZE + 100);
+
+    printf("test 23 passed\n");
+}
+
+void test24()
+{
+    format();
+    struct superblock sb;
+    assert(super_load(memcache) == SUPER_MISSING);
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, "garbage", 7));
+    assert(super_load(memcache) == SUPER_MISSING);
+
+    assert(super_create(memcache, 1000, FEATURE_DEDUP));
+    assert(super_load(memcache) == SUPER_OK);
+    super_get(&sb);
+    assert(sb.version == SUPER_VERSION && sb.inode_capacity == 1000);
+    assert(sb.features == FEATURE_DEDUP);
+    const struct superblock ours = sb;
+
+    /* Layout this build doesn't know is refused */
+    sb.version++;
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &sb, sizeof(sb)));
+    assert(super_load(memcache) == SUPER_INCOMPATIBLE);
+    sb = ours;
+    sb.block_size *= 2;
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &sb, sizeof(sb)));
+    assert(super_load(memcache) == SUPER_INCOMPATIBLE);
+    sb = ours;
+    sb.features |= 1u << 31;
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &sb, sizeof(sb)));
+    assert(super_load(memcache) == SUPER_INCOMPATIBLE);
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &ours, sizeof(ours) - 4));
+    assert(super_load(memcache) == SUPER_INCOMPATIBLE);
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &ours, sizeof(ours)));
+    assert(super_load(memcache) == SUPER_OK);
+
+    /* Changes keep what other mounts stored meanwhile */
+    sb = ours;
+    sb.inode_capacity = 20000;
+    assert(memcache_add(memcache, SUPERBLOCK_KEY, &sb, sizeof(sb)));
+    assert(super_set_features(FEATURE_COMPRESS));
+    assert(super_set_inode_capacity(500));
+    assert(super_load(memcache) == SUPER_OK);
+    super_get(&sb);
+    assert(sb.inode_capacity == 20000);
+    assert(sb.features == (FEATURE_DEDUP | FEATURE_COMPRESS));
+    assert(memcmp(sb.uuid, ours.uuid, SUPER_UUID_SIZE) == 0);
+
+    printf("test 24 passed\n");
+}
+
+void test25()
+{
+    format();
+    assert(init_freemap(memcache, 1024));
+    assert(freemap_claim(ROOT_INODE_ID));
+    use_root();
+    struct dir* root = dir_open_root();
+    int id = get_free_inode();
+    make_file(root, "open", id);
+
+    /* File handle keeps inode after its name is gone */
+    struct inode* handle = inode_from_path("/open");
+    assert(handle != NULL);
+    assert(inode_write_at(handle, "written", 7, 0, false) == 7);
+    assert(dir_remove(root, "open"));
+    assert(path_id("/open") == -1);
+    char data[10];
+    assert(inode_read_at(handle, data, 7, 0, false) == 7 && memcmp(data, "written", 7) == 0);
+    assert(inode_write_at(handle, "more", 4, 7, false) == 4);
+    assert(inode_truncate(handle, 9));
+    assert(inode_length(handle) == 9);
+    assert(inode_read_at(handle, data, 10, 0, false) == 9 && memcmp(data, "writtenmo", 9) == 0);
+    char key[MEMCACHE_KEY_MAX + 1];
+    sprintf(key, "%d#METADATA", id);
+    struct inode_disk_metadata stored;
+    assert(memcache_get(memcache, key, &stored) && stored.length == 9);
+    assert(freemap_is_used(id));
+
+    /* Stored inode goes when the last handle is closed */
+    inode_close(handle);
+    assert(!memcache_get(memcache, key, &stored));
+    assert(!freemap_is_used(id));
+    dir_close(root);
+    close_freemap();
+
+    printf("test 25 passed\n");
+}
+
+/* Takes number of change like other mount does, returns it */
+static uint64_t take_change_seq(uint64_t cnt)
+{
+    struct memcache_item item = { 0 };
+    strcpy(item.key, CHANGELOG_SEQ_KEY);
+    item.number = cnt;
+    assert(memcache_incr_multi(memcache, &item, 1) && item.found);
+    return item.number;
+}
+
+/* Stores change of other mount under number it took */
+static void store_change(uint64_t seq, const char* path, uint32_t flags)
+{
+    struct change change = { 0 };
+    change.seq = seq;
+    change.origin = ~0ULL;
+    change.flags = flags;
+    strcpy(change.path, path);
+    struct memcache_item item = { 0 };
+    sprintf(item.key, "CHANGES#%lu", (unsigned long)(seq % CHANGELOG_SIZE));
+    item.buff = &change;
+    item.size = offsetof(struct change, path) + strlen(path) + 1;
+    assert(memcache_set_multi(memcache, &item, 1) && item.found);
+}
+
+void test26()
+{
+    format();
+    use_root();
+    struct dir* root = dir_open_root();
+    make_file(root, "watched", 5060);
+    dir_close(root);
+    assert(init_changelog(memcache, NULL, 3600));
+
+    /* Own changes are skipped, changes of others refresh open inodes */
+    changelog_append("/watched", 0);
+    assert(changelog_poll() == 0);
+    struct inode* inode = inode_from_path("/watched");
+    struct inode_disk_metadata theirs;
+    assert(memcache_get(memcache, "5060#METADATA", &theirs));
+    theirs.mode = 0600;
+    assert(memcache_add(memcache, "5060#METADATA", &theirs, sizeof(theirs)));
+    store_change(take_change_seq(1), "/watched", 0);
+    assert(changelog_poll() == 1);
+    assert(inode->metadata.mode == 0600);
+    inode_close(inode);
+
+    /* Change stored late is still applied */
+    uint64_t seq = take_change_seq(1);
+    assert(changelog_poll() == 0);
+    store_change(seq, "/watched", CHANGE_ENTRY);
+    assert(changelog_poll() == 1);
+
+    /* Number which is never stored stalls polls only for a while */
+    take_change_seq(1);
+    store_change(take_change_seq(1), "/watched", 0);
+    for (int i = 0; i < 4; i++)
+        assert(changelog_poll() == 0);
+    assert(changelog_poll() == 1);
+
+    /* Overwritten changes and lost counter drop everything cached */
+    take_change_seq(2 * CHANGELOG_SIZE);
+    assert(changelog_poll() == 0);
+    store_change(take_change_seq(1), "/watched", 0);
+    assert(changelog_poll() == 1);
+    struct memcache_item item = { 0 };
+    strcpy(item.key, CHANGELOG_SEQ_KEY);
+    assert(memcache_delete_multi(memcache, &item, 1) && item.found);
+    assert(changelog_poll() == 0);
+    store_change(take_change_seq(1), "/watched", CHANGE_ALL);
+    assert(changelog_poll() == 1);
+    close_changelog();
+
+    printf("test 26 passed\n");
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Stores lease record like other mount does */
+static void store_lease(int id, int64_t expires, uint32_t flags)
+{
+    struct lease_record record = { expires, ~0ULL, flags };
+    char key[MEMCACHE_KEY_MAX + 1];
+    sprintf(key, "%d#LEASE", id);
+    assert(memcache_add(memcache, key, &record, sizeof(record)));
+}
+
+static struct lease_record load_lease(int id)
+{
+    struct lease_record record;
+    char key[MEMCACHE_KEY_MAX + 1];
+    sprintf(key, "%d#LEASE", id);
+    assert(memcache_get(memcache, key, &record));
+    return record;
+}
+
+void test27()
+{
+    format();
+    init_leases(memcache, 500);
+    bool taken;
+
+    assert(lease_taken(memcache, 5070, &taken) && !taken);
+    assert(lease_acquire(5070));
+    assert(lease_valid(5070) > now_ms());
+    assert(lease_taken(memcache, 5070, &taken) && taken);
+    lease_forget(5070);
+    assert(lease_valid(5070) == 0);
+
+    /* Read leases are shared, writer waits until they expire */
+    store_lease(5071, now_ms() + 400, 0);
+    assert(lease_acquire(5071));
+    assert(load_lease(5071).flags == LEASE_SHARED);
+    int64_t start = now_ms();
+    lease_break(5071);
+    assert(now_ms() - start >= 400);
+    assert(load_lease(5071).flags == LEASE_WRITE);
+
+    /* Nobody reads from cache while other mount writes or waits to */
+    store_lease(5072, now_ms() + 400, LEASE_WRITE);
+    assert(!lease_acquire(5072));
+    store_lease(5072, now_ms() + 400, LEASE_SHARED | LEASE_WAITING);
+    assert(!lease_acquire(5072));
+
+    /* Own write lease serves reads and repeated writes at once */
+    lease_break(5073);
+    start = now_ms();
+    lease_break(5073);
+    assert(lease_acquire(5073));
+    assert(now_ms() - start < 100);
+    assert(load_lease(5073).flags == LEASE_WRITE);
+
+    init_leases(memcache, 0);
+    assert(!lease_acquire(5070));
+    assert(lease_taken(memcache, 5073, &taken) && taken);
+
+    printf("test 27 passed\n");
+}
+
+#define TEST_SNAPSHOT "/tmp/cachefs-test.snapshot"
+
+void test28()
+{
+    format();
+    assert(super_create(memcache, 1024, 0));
+    assert(init_freemap(memcache, 1024));
+    assert(freemap_claim(ROOT_INODE_ID));
+    assert(init_usage(memcache));
+    use_root();
+    struct dir* root = dir_open_root();
+    int dir_id = get_free_inode();
+    make_dir(root, "docs", dir_id);
+    struct dir* docs = dir_open(inode_open(dir_id));
+    int file_id = get_free_inode();
+    make_file(docs, "file", file_id);
+    dir_close(docs);
+    char data[2 * INODE_BLOCK_SIZE];
+    fill_random(data, sizeof data);
+    struct inode* inode = inode_open(file_id);
+    assert(inode_write_at(inode, data, sizeof data, 0, false) == sizeof data);
+    inode_close(inode);
+
+    /* Inode freed in map while it still exists, restore claims it again */
+    int lost_id = get_free_inode();
+    make_file(root, "lost", lost_id);
+    assert(free_inode(lost_id));
+    dir_close(root);
+    close_freemap();
+    assert(usage_flush());
+    struct usage dumped;
+    usage_get(&dumped);
+    assert(snapshot_dump(memcache, TEST_SNAPSHOT));
+
+    /* Damaged snapshot is refused before anything is stored */
+    FILE* file = fopen(TEST_SNAPSHOT, "r");
+    static char copy[1 << 20];
+    size_t size = fread(copy, 1, sizeof copy, file);
+    fclose(file);
+    file = fopen(TEST_SNAPSHOT ".bad", "w");
+    fwrite(copy, 1, size - 3, file);
+    fclose(file);
+    format();
+    assert(!snapshot_restore(memcache, TEST_SNAPSHOT ".bad"));
+    assert(super_load(memcache) == SUPER_MISSING);
+    remove(TEST_SNAPSHOT ".bad");
+
+    assert(snapshot_restore(memcache, TEST_SNAPSHOT));
+    assert(super_load(memcache) == SUPER_OK);
+    assert(path_id("/docs/file") == file_id);
+    assert(path_id("/lost") == lost_id);
+    inode = inode_from_path("/docs/file");
+    char read[sizeof data];
+    assert(inode_read_at(inode, read, sizeof read, 0, false) == sizeof read);
+    assert(memcmp(read, data, sizeof data) == 0);
+    inode_close(inode);
+    assert(load_freemap(memcache, 1024));
+    assert(freemap_is_used(ROOT_INODE_ID) && freemap_is_used(dir_id));
+    assert(freemap_is_used(file_id) && freemap_is_used(lost_id));
+    close_freemap();
+    assert(load_usage(memcache));
+    struct usage restored;
+    usage_get(&restored);
+    assert(restored.blocks == dumped.blocks && restored.bytes == dumped.bytes);
+    remove(TEST_SNAPSHOT);
+
+    printf("test 28 passed\n");
+}
+
+void test29()
+{
+    format();
+    assert(init_freemap(memcache, 1024));
+    assert(init_usage(memcache));
+    init_inodes(memcache, 0, 0);
+    init_reaper();
+    int ids[200];
+    char data[INODE_BLOCK_SIZE];
+    for (int i = 0; i < 200; i++) {
+        ids[i] = get_free_inode();
+        assert(inode_create(ids[i], false, 0, 0, 0644));
+        struct inode* inode = inode_open(ids[i]);
+        fill_random(data, sizeof data);
+        assert(inode_write_at(inode, data, sizeof data, 0, false) == sizeof data);
+        inode_close(inode);
+    }
+    struct usage usage;
+    usage_get(&usage);
+    assert(usage.blocks == 200);
+
+    /* Removed inodes are deleted in background, drain waits for all of them */
+    for (int i = 0; i < 200; i++) {
+        struct inode* inode = inode_open(ids[i]);
+        inode_remove(inode);
+        inode_close(inode);
+    }
+    reaper_drain();
+    for (int i = 0; i < 200; i++) {
+        char key[MEMCACHE_KEY_MAX + 1];
+        sprintf(key, "%d#METADATA", ids[i]);
+        assert(!memcache_get(memcache, key, data));
+        sprintf(key, "%d#0", ids[i]);
+        assert(!memcache_get(memcache, key, data));
+        assert(!freemap_is_used(ids[i]));
+    }
+    usage_get(&usage);
+    assert(usage.blocks == 0 && usage.bytes == 0);
+    assert(freemap_used() == 0);
+    close_freemap();
+
+    printf("test 29 passed\n");
+}
+
+static void bucket_key(char* key, int dir_id, const char* name)
+{
+    struct block_hash hash;
+    hash_block(name, strlen(name), &hash);
+    sprintf(key, "%d#H%016llx", dir_id, (unsigned long long)hash.h[0]);
+}
+
+static int visited_cnt;
+
+static void count_entry(const char* name, int inode_id, void* aux)
+{
+    visited_cnt++;
+}
+
+void test30()
+{
+    format();
+    init_inodes(memcache, 0, 0);
+    bool locked;
+    assert(super_take_lock(memcache, false));
+    assert(!super_take_lock(memcache, false));
+    assert(super_take_lock(memcache, true));
+    assert(super_is_locked(memcache, &locked) && locked);
+
+    /* Index records lost or emptied are found and rebuilt from entries */
+    use_root();
+    struct dir* root = dir_open_root();
+    make_file(root, "a", 5080);
+    make_file(root, "b", 5081);
+    make_file(root, "c", 5082);
+    struct memcache_item item = { 0 };
+    bucket_key(item.key, ROOT_INODE_ID, "b");
+    assert(memcache_delete_multi(memcache, &item, 1) && item.found);
+    char key[MEMCACHE_KEY_MAX + 1];
+    bucket_key(key, ROOT_INODE_ID, "c");
+    assert(memcache_add(memcache, key, "", 0));
+    dir_forget_cached();
+    size_t problems;
+    visited_cnt = 0;
+    assert(dir_check(root, false, &problems, count_entry, NULL));
+    assert(problems == 2 && visited_cnt == 5);
+    assert(path_id("/b") == -1 && path_id("/c") == -1);
+    assert(dir_check(root, true, &problems, count_entry, NULL) && problems == 2);
+    assert(dir_check(root, false, &problems, count_entry, NULL) && problems == 0);
+    assert(path_id("/a") == 5080 && path_id("/b") == 5081 && path_id("/c") == 5082);
+    dir_close(root);
+
+    /* Blocks past length left by cut write are found and removed */
+    struct inode* inode = inode_open(5080);
+    char data[INODE_BLOCK_SIZE];
+    fill_random(data, sizeof data);
+    assert(inode_write_at(inode, data, sizeof data, 0, false) == sizeof data);
+    assert(memcache_add(memcache, "5080#3", data, sizeof data));
+    assert(inode_find_stray(&inode->id, &inode->metadata, 1, false) == 1);
+    assert(inode_find_stray(&inode->id, &inode->metadata, 1, true) == 1);
+    assert(inode_find_stray(&inode->id, &inode->metadata, 1, false) == 0);
+    assert(inode_read_at(inode, data, sizeof data, 0, false) == sizeof data);
+    inode_close(inode);
+
+    super_drop_lock(memcache);
+    assert(super_is_locked(memcache, &locked) && !locked);
+
+    printf("test 30 passed\n");
+}
+
 int main(int argc, char* argv[])
 {
     memcache = memcache_init();
@@ -186,4 +1461,27 @@ int main(int argc, char* argv[])
     test5();
     test6(); */
     test7();
+    test8();
+    test9();
+    test10();
+    test11();
+    test12();
+    test13();
+    test14();
+    test15();
+    test16();
+    test17();
+    test18();
+    test19();
+    test20();
+    test21();
+    test22();
+    test23();
+    test24();
+    test25();
+    test26();
+    test27();
+    test28();
+    test29();
+    test30();
 }
\ No newline at end of file
@@ -0,0 +1,191 @@
+#include "usage.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLUSH_INTERVAL 5 // Seconds between stores of counters
+#define CAS_RETRIES 16 // Attempts to merge changes with those of other mounts
+
+static struct memcache_t* memcache;
+static struct usage usage; // Stored counters with changes of this mount
+static struct usage delta; // Changes which weren't stored yet
+static uint64_t capacity;
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool flusher_started;
+
+static void refresh_capacity()
+{
+    uint64_t limit;
+    if (!memcache_stat(memcache, "limit_maxbytes", &limit))
+        limit = 0;
+    pthread_mutex_lock(&usage_lock);
+    capacity = limit;
+    pthread_mutex_unlock(&usage_lock);
+}
+
+static void* flush_loop(void* aux)
+{
+    (void)aux;
+    while (true) {
+        sleep(FLUSH_INTERVAL);
+        pthread_mutex_lock(&flush_lock);
+        if (memcache != NULL)
+            refresh_capacity();
+        pthread_mutex_unlock(&flush_lock);
+        usage_flush();
+    }
+    return NULL;
+}
+
+static void setup(struct memcache_t* mem, const struct usage* stored)
+{
+    pthread_mutex_lock(&flush_lock);
+    memcache = mem;
+    pthread_mutex_lock(&usage_lock);
+    usage = *stored;
+    memset(&delta, 0, sizeof(struct usage));
+    pthread_mutex_unlock(&usage_lock);
+    refresh_capacity();
+    pthread_mutex_unlock(&flush_lock);
+
+    if (!flusher_started) {
+        pthread_t flusher;
+        if (pthread_create(&flusher, NULL, flush_loop, NULL) == 0) {
+            pthread_detach(flusher);
+            flusher_started = true;
+        }
+    }
+}
+
+bool init_usage(struct memcache_t* mem)
+{
+    struct usage zero;
+    memset(&zero, 0, sizeof(struct usage));
+    setup(mem, &zero);
+
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", USAGE_KEY);
+    item.buff = &zero;
+    item.size = sizeof(struct usage);
+    item.exptime = 0;
+    return memcache_set_multi(mem, &item, 1) && item.found;
+}
+
+bool load_usage(struct memcache_t* mem)
+{
+    struct usage stored;
+    struct memcache_item item;
+    snprintf(item.key, sizeof(item.key), "%s", USAGE_KEY);
+    item.buff = &stored;
+    item.size = sizeof(struct usage);
+    bool found = memcache_get_multi(mem, &item, 1) && item.found
+        && item.size == sizeof(struct usage);
+    if (!found)
+        memset(&stored, 0, sizeof(struct usage));
+    setup(mem, &stored);
+    return found;
+}
+
+void usage_add(int64_t blocks, int64_t bytes)
+{
+    if (blocks == 0 && bytes == 0)
+        return;
+    pthread_mutex_lock(&usage_lock);
+    usage.blocks += blocks;
+    usage.bytes += bytes;
+    delta.blocks += blocks;
+    delta.bytes += bytes;
+    pthread_mutex_unlock(&usage_lock);
+}
+
+void usage_get(struct usage* dst)
+{
+    pthread_mutex_lock(&usage_lock);
+    *dst = usage;
+    pthread_mutex_unlock(&usage_lock);
+}
+
+uint64_t usage_capacity()
+{
+    pthread_mutex_lock(&usage_lock);
+    uint64_t res = capacity;
+    pthread_mutex_unlock(&usage_lock);
+    return res;
+}
+
+/*
+ * Adds CHANGES to stored counters, other mounts change them too so they
+ * are merged with gets/cas. Stored result is written to MERGED
+ */
+static bool merge(const struct usage* changes, struct usage* merged)
+{
+    for (int attempt = 0; attempt < CAS_RETRIES; attempt++) {
+        struct memcache_item item;
+        snprintf(item.key, sizeof(item.key), "%s", USAGE_KEY);
+        item.buff = merged;
+        item.size = sizeof(struct usage);
+        if (!memcache_gets_multi(memcache, &item, 1))
+            return false;
+        if (item.found && item.size == sizeof(struct usage)) {
+            merged->blocks += changes->blocks;
+            merged->bytes += changes->bytes;
+        } else {
+            /* Lost counters are recreated from what this mount knows */
+            pthread_mutex_lock(&usage_lock);
+            merged->blocks = usage.blocks - delta.blocks;
+            merged->bytes = usage.bytes - delta.bytes;
+            pthread_mutex_unlock(&usage_lock);
+            item.cas = 0;
+        }
+
+        item.buff = merged;
+        item.size = sizeof(struct usage);
+        item.exptime = 0;
+        if (!memcache_cas_multi(memcache, &item, 1))
+            return false;
+        if (item.found)
+            return true;
+    }
+    return false;
+}
+
+bool usage_flush()
+{
+    /* Flushes are serialized so changes are never merged twice */
+    pthread_mutex_lock(&flush_lock);
+    pthread_mutex_lock(&usage_lock);
+    struct usage changes = delta;
+    bool store = memcache != NULL && (changes.blocks != 0 || changes.bytes != 0);
+    memset(&delta, 0, sizeof(struct usage));
+    pthread_mutex_unlock(&usage_lock);
+    if (!store) {
+        pthread_mutex_unlock(&flush_lock);
+        return true;
+    }
+
+    struct usage merged;
+    bool success = merge(&changes, &merged);
+    pthread_mutex_lock(&usage_lock);
+    if (success) {
+        /* Changes of other mounts become visible, newer local ones stay on top */
+        usage.blocks = merged.blocks + delta.blocks;
+        usage.bytes = merged.bytes + delta.bytes;
+    } else {
+        delta.blocks += changes.blocks;
+        delta.bytes += changes.bytes;
+    }
+    pthread_mutex_unlock(&usage_lock);
+    pthread_mutex_unlock(&flush_lock);
+    return success;
+}
+
+void close_usage()
+{
+    usage_flush();
+    pthread_mutex_lock(&flush_lock);
+    memcache = NULL;
+    pthread_mutex_unlock(&flush_lock);
+}
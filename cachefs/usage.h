@@ -0,0 +1,87 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include "memcache.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define USAGE_KEY "USAGE"
+
+/**
+ * Space used by file system, data and extended attributes of
+ * every inode are counted
+ */
+struct usage {
+    int64_t blocks; // Stored blocks, holes aren't counted and shared blocks are counted once
+    int64_t bytes; // Sum of lengths of inodes
+};
+
+/**
+ * Function : init_usage
+ * ----------------------------------------
+ * Starts counting from zero for newly formated file system
+ * 
+ * mem      : memcache data object 
+ * 
+ * Returns  : true if counters were stored
+ */
+bool init_usage(struct memcache_t* mem);
+
+/**
+ * Function : load_usage
+ * ----------------------------------------
+ * Reads counters of existing file system, counters which
+ * weren't stored before crash start from zero
+ * 
+ * mem      : memcache data object 
+ * 
+ * Returns  : true if stored counters were found
+ */
+bool load_usage(struct memcache_t* mem);
+
+/**
+ * Function : usage_add
+ * ----------------------------------------
+ * Changes counters in memory, they are stored in background
+ * every few seconds
+ * 
+ * blocks   : change of used blocks
+ * bytes    : change of used bytes
+ */
+void usage_add(int64_t blocks, int64_t bytes);
+
+/**
+ * Function : usage_get
+ * ----------------------------------------
+ * Copies current counters
+ * 
+ * usage    : where counters are copied
+ */
+void usage_get(struct usage* usage);
+
+/**
+ * Function : usage_capacity
+ * ----------------------------------------
+ * Returns memory limit of Memcached server in bytes, it's
+ * refreshed together with background stores, 0 if unknown
+ */
+uint64_t usage_capacity();
+
+/**
+ * Function : usage_flush
+ * ----------------------------------------
+ * Adds changes made since last flush to stored counters, they are
+ * merged with changes of other mounts
+ * 
+ * Returns  : true if counters are stored
+ */
+bool usage_flush();
+
+/**
+ * Function : close_usage
+ * ----------------------------------------
+ * Stores counters and stops background flushes
+ */
+void close_usage();
+
+#endif
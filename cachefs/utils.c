@@ -1,5 +1,9 @@
 #include "utils.h"
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 int get_next_part(char part[NAME_MAX + 1], const char** srcp)
 {
     const char* src = *srcp;
@@ -32,6 +36,8 @@ int split_file_path(const char* whole_path, char* dir, char* file)
     int i;
     for (i = n - 1; i >= 0; i--) {
         if (whole_path[i] == '/') {
+            if (n - i - 1 > NAME_MAX)
+                return false;
             memcpy(dir, whole_path, i + 1);
             if (i == 0)
                 dir[i + 1] = '\0';
@@ -76,4 +82,18 @@ void DumpHex(const void* data, size_t size)
             }
         }
     }
-}
\ No newline at end of file
+}
+
+/* Fills BUFF from /dev/urandom, falls back to random() seeded by time and pid */
+void random_bytes(void* buff, size_t size)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+    bool filled = fd >= 0 && read(fd, buff, size) == (ssize_t)size;
+    if (fd >= 0)
+        close(fd);
+    if (!filled) {
+        srandom(time(NULL) ^ getpid());
+        for (size_t i = 0; i < size; i++)
+            ((unsigned char*)buff)[i] = random();
+    }
+}
@@ -9,4 +9,6 @@ int split_file_path(const char* whole_path, char* dir, char* file);
 
 void DumpHex(const void* data, size_t size);
 
+void random_bytes(void* buff, size_t size);
+
 #endif
\ No newline at end of file